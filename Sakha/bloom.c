@@ -0,0 +1,100 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "bloom.h"
+
+#include <string.h>
+#include <cpl/cpl_allocator.h>
+
+#include "btree.h"
+
+/***************************** Private Interface ******************************/
+
+static inline uint64_t bloomHash(const unsigned char* key)
+{
+    // FNV-1a with final mixing, ObjectIds differ mostly in the last bytes
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(int i = 0; i < SAKHADB_BTREE_OID_SIZE; ++i)
+    {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/******************************************************************************/
+
+/***************************** Public Interface *******************************/
+uint64_t* sakhadb_bloom_create(uint64_t count, int bits, uint32_t* pNbits)
+{
+    uint64_t nbits = (count ? count : 1) * bits;
+    nbits = (nbits + 63) & ~63ULL;
+    if(nbits > UINT32_MAX - 63)
+    {
+        nbits = (UINT32_MAX - 63) & ~63ULL;
+    }
+    
+    size_t sz = nbits / 8;
+    uint64_t* bloom = cpl_allocator_allocate(cpl_allocator_get_default(), sz);
+    if(bloom)
+    {
+        memset(bloom, 0, sz);
+        *pNbits = (uint32_t)nbits;
+    }
+    return bloom;
+}
+
+void sakhadb_bloom_add(uint64_t* bloom, uint32_t nbits, int probes, const void* key)
+{
+    uint64_t h = bloomHash(key);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for(int i = 0; i < probes; ++i)
+    {
+        uint32_t bit = (h1 + i * h2) % nbits;
+        bloom[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+uint32_t sakhadb_bloom_block(uint32_t nblocks, const void* key)
+{
+    // Bits other than the ones probes use
+    uint64_t h = bloomHash(key) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(((h >> 32) * nblocks) >> 32);
+}
+
+int sakhadb_bloom_may_contain(const uint64_t* bloom, uint32_t nbits, int probes, const void* key)
+{
+    uint64_t h = bloomHash(key);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for(int i = 0; i < probes; ++i)
+    {
+        uint32_t bit = (h1 + i * h2) % nbits;
+        if(!(bloom[bit / 64] & (1ULL << (bit % 64))))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
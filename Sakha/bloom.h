@@ -0,0 +1,52 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/**
+ * Bloom filters of ObjectId keys. A filter is an array of 64-bit words; a key
+ * sets 'probes' bits chosen by double hashing, so a key without any of its
+ * bits set is certainly not in the set.
+ */
+
+#ifndef _SAKHADB_BLOOM_H_
+#define _SAKHADB_BLOOM_H_
+
+#include <stdint.h>
+
+/**
+ * Number of probes, optimal for 'bits' per key.
+ */
+#define SAKHADB_BLOOM_PROBES(bits)  (((bits) * 69 + 99) / 100)
+
+/**
+ * Allocates zeroed filter of 'bits' per key for 'count' keys. Its size in
+ * bits is returned in 'pNbits'.
+ */
+uint64_t* sakhadb_bloom_create(uint64_t count, int bits, uint32_t* pNbits);
+
+void sakhadb_bloom_add(uint64_t* bloom, uint32_t nbits, int probes, const void* key);
+int sakhadb_bloom_may_contain(const uint64_t* bloom, uint32_t nbits, int probes, const void* key);
+
+/**
+ * Block of the key in the filter split into 'nblocks' blocks, a key sets all
+ * its bits in its block. Blocks are filters of their own.
+ */
+uint32_t sakhadb_bloom_block(uint32_t nblocks, const void* key);
+
+#endif // _SAKHADB_BLOOM_H_
@@ -22,6 +22,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cpl/cpl_allocator.h>
 #include <cpl/cpl_array.h>
 #include <cpl/cpl_error.h>
@@ -30,8 +31,35 @@
 #include "logger.h"
 #include "cursor.h"
 
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
+
 #define SAKHADB_BTREE_LEAF      0x1
 
+/**
+ * Node is underfull when less than 1/SAKHADB_BTREE_UNDERFLOW of it is used.
+ * Siblings are merged only if 1/SAKHADB_BTREE_UNDERFLOW of the page stays free,
+ * so the merged node doesn't split on the next insert.
+ */
+#define SAKHADB_BTREE_UNDERFLOW 4
+
+/**
+ * Bound for the height of the tree in concurrent inserts and bulk builds.
+ */
+#define SAKHADB_BTREE_MAX_HEIGHT 32
+
+/**
+ * Node cache is kept in single-threaded builds only, SAKHADB_THREADSAFE
+ * lookups search validated copies of nodes.
+ */
+#define SAKHADB_BTREE_CACHE (SAKHADB_BTREE_CACHE_NODES > 0 && !SAKHADB_THREADSAFE)
+
+/**
+ * Misses of other nodes a cached node survives for each of its hits.
+ */
+#define SAKHADB_BTREE_CACHE_MAX_HITS 8
+
 /**
  * Turn on/off logging for btree routines
  */
@@ -58,8 +86,47 @@ struct BtreeSlot
     Pgno        no;
 };
 
+/**
+ * Slot of internal node is followed by the count of entries in the subtree of
+ * 'no', so the slots of leaves are smaller. -1 is the slot below the first one.
+ */
 #define btreeNodeOffset(n, off) ((char*)(n) + (off))
-#define btreeGetSlots(n) (sakhadb_btree_slot_t*)btreeNodeOffset((n), (n)->slots_off)
+#define btreeSlotSize(n) (sizeof(sakhadb_btree_slot_t) + (btreeIsLeaf(n) ? 0 : sizeof(uint32_t)))
+#define btreeGetSlot(n, i) \
+    ((sakhadb_btree_slot_t*)btreeNodeOffset((n), (n)->slots_off + (int)(i) * (int)btreeSlotSize(n)))
+#define btreeSlotCount(s) ((uint32_t*)((s) + 1))
+
+#define btreeIsLeaf(n) ((n)->flags & SAKHADB_BTREE_LEAF)
+#define btreeIsOid(n) ((n)->flags & SAKHADB_BTREE_OIDKEYS)
+#define btreeHasOidKeys(n) ((n)->flags & (SAKHADB_BTREE_OIDKEYS | SAKHADB_BTREE_INLINE))
+#define btreeIsBuffered(n) ((n)->flags & SAKHADB_BTREE_BUFFERED)
+
+/**
+ * Clustered leaf (SAKHADB_BTREE_INLINE). Slot holds the ObjectId key followed
+ * by the payload, 'sz' is the size of both. Entry with a zero page number
+ * keeps its payload inline, otherwise there is no payload.
+ */
+#define btreeIsInline(n) (((n)->flags & (SAKHADB_BTREE_INLINE | SAKHADB_BTREE_LEAF)) == \
+                          (SAKHADB_BTREE_INLINE | SAKHADB_BTREE_LEAF))
+
+/**
+ * Fixed-width node layout (SAKHADB_BTREE_OIDKEYS).
+ *
+ * Keys are stored in ascending order as a dense array right after the header,
+ * Pgno's are stored in a parallel array at 'slots_off'. Logical index of the
+ * entry is the same as in slotted node (0 is the greatest key), so the code
+ * above node level does not care about layout. Internal nodes keep counts of
+ * the children in one more parallel array right after the Pgno's.
+ */
+#define SAKHADB_BTREE_OID_ENTRY (SAKHADB_BTREE_OID_SIZE + sizeof(Pgno))
+#define btreeOidEntrySize(flags) \
+    (SAKHADB_BTREE_OID_ENTRY + (((flags) & SAKHADB_BTREE_LEAF) ? 0 : sizeof(uint32_t)))
+#define btreeOidEntry(n) btreeOidEntrySize((n)->flags)
+#define btreeOidCapacity(n) (((n)->slots_off - sizeof(struct BtreePageHeader)) / SAKHADB_BTREE_OID_SIZE)
+#define btreeOidKeys(n) btreeNodeOffset((n), sizeof(struct BtreePageHeader))
+#define btreeOidPgnos(n) ((Pgno*)btreeNodeOffset((n), (n)->slots_off))
+#define btreeOidCounts(n) ((uint32_t*)(btreeOidPgnos(n) + btreeOidCapacity(n)))
+#define btreeOidPos(n, i) ((n)->nslots - 1 - (i))
 
 struct BtreePageHeader
 {
@@ -70,6 +137,8 @@ struct BtreePageHeader
     uint16_t        slots_off;          /* Offset to slots array */
     uint16_t        nslots;             /* No of slots. */
     Pgno            right;              /* Right-most leaf */
+    uint32_t        right_count;        /* Entries in the subtree of 'right', internal nodes only */
+    Pgno            buffer;             /* First page of the insert buffer, 0 if none */
 };
 
 typedef struct BtreePage* sakhadb_btree_page_t;
@@ -79,11 +148,34 @@ struct BtreePage
     struct BtreePageHeader* header;     /* Page Header */
 };
 
+/**
+ * Decoded internal node. Keys are reduced to 16-byte prefixes compared as
+ * two big-endian words and laid out in Eytzinger (BFS) order, so the search
+ * walks the array down without branches and prefetches the levels below.
+ */
+struct BtreeCacheEntry
+{
+    sakhadb_btree_page_t    page;       /* Cached node, 0 if the entry is free */
+    uint16_t                nkeys;      /* Number of keys */
+    uint16_t                hits;       /* Hits not yet spent on misses of other nodes */
+    uint64_t*               prefixes;   /* Key prefixes at Eytzinger positions from 1 */
+    uint16_t*               ranks;      /* Ascending position of the key at Eytzinger position */
+};
+
 struct BtreeContext
 {
     sakhadb_pager_t         pager;      /* Pager is a low-level interface for per-page access */
+    struct BtreeStats       stats;      /* Counters */
+    struct BtreeCacheEntry* cache;      /* Decoded nodes by page number, 0 if there is no cache */
+    uint16_t                cache_keys; /* Most keys a cached node may have */
 };
 
+#if SAKHADB_THREADSAFE
+#   define btreeStatInc(ctx, counter) __atomic_fetch_add(&(ctx)->stats.counter, 1, __ATOMIC_RELAXED)
+#else
+#   define btreeStatInc(ctx, counter) ((ctx)->stats.counter++)
+#endif
+
 struct Btree
 {
     sakhadb_btree_ctx_t     ctx;        /* Context */
@@ -92,8 +184,8 @@ struct Btree
 
 struct BtreeSplitResult
 {
-    void*                   data;       /* pointer to key data */
-    size_t                  size;       /* size of key */
+    char                    data[SAKHADB_BTREE_MAX_KEY_SIZE]; /* copy of key data */
+    uint16_t                size;       /* size of key */
     sakhadb_btree_page_t    new_page;
 };
 
@@ -101,6 +193,8 @@ struct BtreeCursorPointer
 {
     sakhadb_btree_page_t    page;
     int                     index;
+    const char*             fence;      /* Upper fence of the subtree, 0 if none */
+    uint16_t                nfence;     /* Size of the fence */
 };
 
 /****************************** B-tree Section ********************************/
@@ -139,6 +233,105 @@ static inline void btreeDestroy(struct Btree* tree)
 
 /****************************** Node Section **********************************/
 
+static inline void btreeInitNode(
+    sakhadb_btree_node_t node,          /* Node to initialize */
+    size_t page_size,                   /* Usable size of the page */
+    char flags
+)
+{
+    node->nslots = 0;
+    node->right_count = 0;
+    node->buffer = 0;
+    node->free_off = sizeof(struct BtreePageHeader);
+    node->flags = flags;
+    if(flags & SAKHADB_BTREE_OIDKEYS)
+    {
+        uint16_t capacity = (page_size - sizeof(struct BtreePageHeader)) / btreeOidEntrySize(flags);
+        node->slots_off = sizeof(struct BtreePageHeader) + capacity * SAKHADB_BTREE_OID_SIZE;
+        node->free_sz = capacity * btreeOidEntrySize(flags);
+    }
+    else
+    {
+        node->slots_off = page_size;
+        node->free_sz = node->slots_off - sizeof(struct BtreePageHeader);
+    }
+}
+
+static inline int btreeNodeHasRoom(sakhadb_btree_node_t node, uint16_t nkey)
+{
+    if(btreeIsOid(node))
+    {
+        return node->free_sz >= btreeOidEntry(node);
+    }
+    return node->free_sz >= nkey + btreeSlotSize(node);
+}
+
+static inline const char* btreeGetKey(
+    sakhadb_btree_node_t node,          /* The node contains the key */
+    int islot,                          /* Index of the key */
+    uint16_t* pSize                     /* Out: size of the key */
+)
+{
+    if(btreeIsOid(node))
+    {
+        *pSize = SAKHADB_BTREE_OID_SIZE;
+        return btreeOidKeys(node) + btreeOidPos(node, islot) * SAKHADB_BTREE_OID_SIZE;
+    }
+    
+    register sakhadb_btree_slot_t* slot = btreeGetSlot(node, islot);
+    *pSize = btreeIsInline(node) ? SAKHADB_BTREE_OID_SIZE : slot->sz;
+    return btreeNodeOffset(node, slot->off);
+}
+
+/**
+ * Raw entry of the node: the key along with the inline payload.
+ */
+static inline const char* btreeGetEntry(
+    sakhadb_btree_node_t node,          /* The node contains the entry */
+    int islot,                          /* Index of the entry */
+    uint16_t* pSize                     /* Out: size of the entry */
+)
+{
+    if(btreeIsOid(node))
+    {
+        return btreeGetKey(node, islot, pSize);
+    }
+    
+    register sakhadb_btree_slot_t* slot = btreeGetSlot(node, islot);
+    *pSize = slot->sz;
+    return btreeNodeOffset(node, slot->off);
+}
+
+static inline Pgno btreeGetDataPgno(struct BtreePageHeader* node, int islot)
+{
+    if(btreeIsOid(node))
+    {
+        return btreeOidPgnos(node)[btreeOidPos(node, islot)];
+    }
+    
+    return btreeGetSlot(node, islot)->no;
+}
+
+/**
+ * Count of entries in the subtree of the child of internal node, -1 is the
+ * right-most child.
+ */
+static inline uint32_t* btreeChildCount(sakhadb_btree_node_t node, int islot)
+{
+    assert(!btreeIsLeaf(node));
+    if(islot == -1)
+    {
+        return &node->right_count;
+    }
+    
+    if(btreeIsOid(node))
+    {
+        return btreeOidCounts(node) + btreeOidPos(node, islot);
+    }
+    
+    return btreeSlotCount(btreeGetSlot(node, islot));
+}
+
 /*************************** Load/Save Section ********************************/
 static inline int btreeLoadNode(
     struct BtreeContext * ctx,          /* Context */
@@ -160,15 +353,51 @@ static inline int btreeLoadNode(
     return rc;
 }
 
+#if SAKHADB_BTREE_CACHE
+static inline void btreeCacheInvalidate(struct BtreeContext * ctx, Pgno no)
+{
+    struct BtreeCacheEntry* entry = ctx->cache + no % SAKHADB_BTREE_CACHE_NODES;
+    if(entry->page && entry->page->no == no)
+    {
+        entry->page = 0;
+        entry->hits = 0;
+    }
+}
+#else // SAKHADB_BTREE_CACHE
+#   define btreeCacheInvalidate(ctx, no)
+#endif // SAKHADB_BTREE_CACHE
+
 static inline void btreeSaveNode(
     struct BtreeContext * ctx,          /* Context */
     sakhadb_btree_page_t page           /* Page to save */
 )
 {
     SLOG_BTREE_INFO("btreeSaveNode: save page [%x][%d]", page->no);
+    btreeCacheInvalidate(ctx, page->no);
+    sakhadb_pager_save_page(ctx->pager, (sakhadb_page_t)page);
+}
+
+/**
+ * Saves the node whose entry counts or insert buffer alone have changed.
+ * Neither is part of the node cache, so the decoded node stays valid.
+ */
+static inline void btreeSaveCount(
+    struct BtreeContext * ctx,          /* Context */
+    sakhadb_btree_page_t page           /* Page to save */
+)
+{
     sakhadb_pager_save_page(ctx->pager, (sakhadb_page_t)page);
 }
 
+static inline void btreeFreeNode(
+    struct BtreeContext * ctx,          /* Context */
+    sakhadb_btree_page_t page           /* Page to return to the freelist */
+)
+{
+    btreeCacheInvalidate(ctx, page->no);
+    sakhadb_pager_add_freelist(ctx->pager, (sakhadb_page_t)page);
+}
+
 static inline int btreeLoadNewNode(
     struct BtreeContext * ctx,          /* Context */
     char flags,
@@ -184,12 +413,7 @@ static inline int btreeLoadNewNode(
         return rc;
     }
     
-    register sakhadb_btree_node_t node = page->data;
-    node->nslots = 0;
-    node->slots_off = sakhadb_pager_page_size(ctx->pager, 0);
-    node->free_off = sizeof(struct BtreePageHeader);
-    node->free_sz = node->slots_off - sizeof(struct BtreePageHeader);
-    node->flags = flags;
+    btreeInitNode(page->data, sakhadb_pager_page_size(ctx->pager, 0), flags);
     
     *pPage = (sakhadb_btree_page_t)page;
     
@@ -197,10 +421,64 @@ static inline int btreeLoadNewNode(
 }
 
 /****************************** Find Section **********************************/
-static inline Pgno btreeGetDataPgno(struct BtreePageHeader* node, int islot)
+
+/**
+ * Compares two ObjectId keys as memcmp() does. Both pointers must be readable
+ * for 16 bytes.
+ */
+static inline int btreeCompareOid(const void* a, const void* b)
+{
+#ifdef __SSE2__
+    __m128i va = _mm_loadu_si128((const __m128i*)a);
+    __m128i vb = _mm_loadu_si128((const __m128i*)b);
+    unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & ((1u << SAKHADB_BTREE_OID_SIZE) - 1);
+    if(!mask)
+    {
+        return 0;
+    }
+    int i = __builtin_ctz(mask);
+    return (int)((const unsigned char*)a)[i] - (int)((const unsigned char*)b)[i];
+#else
+    return memcmp(a, b, SAKHADB_BTREE_OID_SIZE);
+#endif
+}
+
+static int btreeFindOidKey(
+    sakhadb_btree_node_t node,              /* The node contains keys */
+    const void* key,                        /* Key to find */
+    int* pIndex                             /* Out: index */
+)
 {
-    register sakhadb_btree_slot_t* slots = btreeGetSlots(node);
-    return slots[islot].no;
+    SLOG_BTREE_INFO("btreeFindOidKey: find key in node [%hu]", node->nslots);
+    char search[16];
+    memcpy(search, key, SAKHADB_BTREE_OID_SIZE);
+    
+    // Lower bound over ascending dense array.
+    const char* keys = btreeOidKeys(node);
+    register int lo = 0;
+    register int lim = node->nslots;
+    while(lim > 0)
+    {
+        register int half = lim >> 1;
+        if(btreeCompareOid(keys + (lo + half) * SAKHADB_BTREE_OID_SIZE, search) < 0)
+        {
+            lo += half + 1;
+            lim -= half + 1;
+        }
+        else
+        {
+            lim = half;
+        }
+    }
+    
+    if(lo == node->nslots)
+    {
+        *pIndex = -1;
+        return 1;
+    }
+    
+    *pIndex = btreeOidPos(node, lo);
+    return btreeCompareOid(search, keys + lo * SAKHADB_BTREE_OID_SIZE);
 }
 
 static int btreeFindKey(
@@ -211,620 +489,3527 @@ static int btreeFindKey(
 )
 {
     SLOG_BTREE_INFO("btreeFindKey: find key in node [%hu][%hu]", key_sz, node->nslots);
-    sakhadb_btree_slot_t* slots = btreeGetSlots(node);
-    sakhadb_btree_slot_t* base = slots;
+    if(btreeIsOid(node))
+    {
+        assert(key_sz == SAKHADB_BTREE_OID_SIZE);
+        return btreeFindOidKey(node, key, pIndex);
+    }
+    
+    char* slots = (char*)btreeGetSlot(node, 0);
+    size_t stride = btreeSlotSize(node);
+    int is_inline = btreeIsInline(node);
+    register int base = 0;
     register int lim;
     register int cmp = 1;
-    register sakhadb_btree_slot_t* slot = slots;
+    register int idx = 0;
     for(lim = node->nslots; lim != 0; lim>>=1)
     {
-        slot = slots + (lim>>1);
+        idx = base + (lim>>1);
+        sakhadb_btree_slot_t* slot = (sakhadb_btree_slot_t*)(slots + idx * stride);
         char* stored_key = (char*)node + slot->off;
-        cmp = memcmp(key, stored_key, (slot->sz < key_sz)?slot->sz:key_sz);
-        if(cmp == 0 && (cmp = key_sz - slot->sz) == 0)
+        uint16_t stored_sz = is_inline ? SAKHADB_BTREE_OID_SIZE : slot->sz;
+        cmp = memcmp(key, stored_key, (stored_sz < key_sz)?stored_sz:key_sz);
+        if(cmp == 0 && (cmp = key_sz - stored_sz) == 0)
         {
             break;
         }
         if(cmp < 0)
         {
-            slots = slot+1;
+            base = idx + 1;
             lim--;
         }
     }
     
     if(cmp > 0)
     {
-        slot--;
+        idx--;
     }
  
-    *pIndex = (int)(slot - base);
+    *pIndex = idx;
     return cmp;
 }
 
-static int btreeFirst(
-    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+static inline int btreeCompareKeys(
+    const void* key, uint16_t key_sz,       /* First key */
+    const void* other, uint16_t other_sz    /* Second key */
 )
 {
-    int rc = SAKHADB_OK;
-    SLOG_BTREE_INFO("btreeFirst: fetch first entry of tree [%d]", tree->root->no);
-    sakhadb_btree_t tree = stack->tree;
-    sakhadb_btree_page_t page = tree->root;
-    while(rc == SAKHADB_OK)
+    int cmp = memcmp(key, other, (key_sz < other_sz) ? key_sz : other_sz);
+    return cmp ? cmp : (int)key_sz - (int)other_sz;
+}
+
+/**************************** Node Cache Section ******************************/
+
+#if SAKHADB_BTREE_CACHE
+static int btreeCacheCreate(struct BtreeContext* ctx)
+{
+    // Smallest entry of a slotted node is a slot with one byte key
+    size_t page_size = sakhadb_pager_page_size(ctx->pager, 0);
+    size_t nkeys = (page_size - sizeof(struct BtreePageHeader)) / (sizeof(sakhadb_btree_slot_t) + 1);
+    size_t nprefixes = ((nkeys + 1) * 2 + 7) & ~(size_t)7;
+    size_t size = SAKHADB_BTREE_CACHE_NODES * (sizeof(struct BtreeCacheEntry) +
+                                               nprefixes * sizeof(uint64_t) + (nkeys + 1) * sizeof(uint16_t));
+    
+    char* data = cpl_allocator_allocate(cpl_allocator_get_default(), size + 64);
+    if(!data)
     {
-        register sakhadb_btree_node_t node = page->header;
-        int cur = (node->nslots > 0) ? 0 : -1;
-        struct BtreeCursorPointer cursor = { page, cur };
-        cpl_array_push_back(&stack->st, cursor);
-        
-        if(node->flags)
-        {
-            if(cur == -1)
-            {
-                rc = SAKHADB_NOTFOUND;
-            }
-            break;
-        }
-        
-        Pgno no;
-        if(cur == -1)
-        {
-            no = node->right;
-        }
-        else
-        {
-            no  = btreeGetDataPgno(node, cur);
-        }
-        rc = btreeLoadNode(tree->ctx, no, &page);
+        SLOG_BTREE_ERROR("btreeCacheCreate: failed to allocate memory for node cache");
+        return SAKHADB_NOMEM;
     }
     
-    return rc;
+    // Prefixes of each node start at a cache line
+    struct BtreeCacheEntry* cache = (struct BtreeCacheEntry*)data;
+    uint64_t* prefixes = (uint64_t*)(((uintptr_t)(cache + SAKHADB_BTREE_CACHE_NODES) + 63) & ~(uintptr_t)63);
+    uint16_t* ranks = (uint16_t*)(prefixes + SAKHADB_BTREE_CACHE_NODES * nprefixes);
+    for(int i = 0; i < SAKHADB_BTREE_CACHE_NODES; ++i)
+    {
+        cache[i].page = 0;
+        cache[i].nkeys = 0;
+        cache[i].hits = 0;
+        cache[i].prefixes = prefixes + i * nprefixes;
+        cache[i].ranks = ranks + i * (nkeys + 1);
+    }
+    
+    ctx->cache = cache;
+    ctx->cache_keys = (uint16_t)nkeys;
+    return SAKHADB_OK;
 }
 
-static int btreeFind(
-    sakhadb_btree_t tree,                   /* Tree to seek in */
-    const void* key,                        /* Key to find */
-    uint16_t key_sz,                        /* Size of the key to find */
-    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
-)
+static void btreeCacheClear(struct BtreeContext* ctx)
 {
-    SLOG_BTREE_INFO("btreeFind: find key in tree [%d][%hu]", tree->root->no, key_sz);
-    sakhadb_btree_page_t page = tree->root;
-    int cmp;
-    while (1) {
-        int cur;
-        register sakhadb_btree_node_t node = page->header;
-        cmp = btreeFindKey(node, key, key_sz, &cur);
-        struct BtreeCursorPointer cursor = { page, cur };
-        cpl_array_push_back(&stack->st, cursor);
-        
-        SLOG_BTREE_INFO("btreeFind: finding key in node [%d][%d]", cmp, cur);
-        
-        if(node->flags)
-        {
-            break;
-        }
-        
-        Pgno no;
-        if(cur == -1)
-        {
-            no = node->right;
-        }
-        else
-        {
-            no  = btreeGetDataPgno(node, cur);
-        }
-        btreeLoadNode(tree->ctx, no, &page);
+    for(int i = 0; i < SAKHADB_BTREE_CACHE_NODES; ++i)
+    {
+        ctx->cache[i].page = 0;
+        ctx->cache[i].hits = 0;
     }
-    return cmp;
 }
 
-static inline int btreeNext(
-    sakhadb_btree_t tree,                   /* A target */
-    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+/**
+ * Key prefix as two big-endian words, shorter keys are padded with zeroes.
+ */
+static inline void btreeCachePrefix(const void* key, uint16_t nkey, uint64_t* prefix)
+{
+    unsigned char bytes[16] = { 0 };
+    memcpy(bytes, key, (nkey < sizeof(bytes)) ? nkey : sizeof(bytes));
+    prefix[0] = prefix[1] = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+        prefix[0] = (prefix[0] << 8) | bytes[i];
+        prefix[1] = (prefix[1] << 8) | bytes[i + 8];
+    }
+}
+
+/**
+ * Fills the subtree of Eytzinger position 'k' with keys from ascending
+ * position 'pos'. Returns position of the next key.
+ */
+static uint16_t btreeCacheFill(
+    struct BtreeCacheEntry* entry,          /* Entry to fill */
+    sakhadb_btree_node_t node,              /* Node to decode */
+    uint16_t pos,                           /* Ascending position of the first key */
+    size_t k                                /* Eytzinger position */
 )
 {
-    int rc = SAKHADB_OK;
-    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
-    sakhadb_btree_node_t node = cur->page->header;
-    if(++cur->index >= node->nslots)
+    if(k <= entry->nkeys)
     {
-        Pgno no = node->right;
-        if(!no)
-        {
-            rc = SAKHADB_NOTFOUND;
-            goto Lexit;
-        }
+        pos = btreeCacheFill(entry, node, pos, 2 * k);
         
-        rc = btreeLoadNode(tree->ctx, node->right, &cur->page);
-        if(rc)
-        {
-            SLOG_BTREE_ERROR("btreeNext: failed to fetch page [%d]", node->right);
-            goto Lexit;
-        }
+        uint16_t nkey;
+        const char* key = btreeGetKey(node, entry->nkeys - 1 - pos, &nkey);
+        btreeCachePrefix(key, nkey, entry->prefixes + 2 * k);
+        entry->ranks[k] = pos++;
         
-        cur->index = 0;
+        pos = btreeCacheFill(entry, node, pos, 2 * k + 1);
     }
-    
-Lexit:
-    return rc;
+    return pos;
 }
 
-static inline int btreeDumpPage(
-    sakhadb_btree_page_t page,      /* A page to dump */
-    sakhadb_btree_ctx_t  ctx,       /* Context */
-    cpl_region_ref prefix,          /* Offset level prefix */
-    cpl_region_ref region           /* Output: dumped data */
+/**
+ * Returns cache entry of the internal node at 'depth' of the tree, decoding
+ * the node if its entry is free or spent. Returns 0 if the node is not cached.
+ */
+static struct BtreeCacheEntry* btreeCacheGet(
+    struct BtreeContext* ctx,               /* Context */
+    sakhadb_btree_page_t page,              /* Node */
+    int depth                               /* Level of the node, 0 for root */
 )
 {
-    int rc = SAKHADB_OK;
-    char templ[] = " (%d)\n";
-    char buffer[64];
     sakhadb_btree_node_t node = page->header;
-    sakhadb_btree_slot_t* slots = btreeGetSlots(node);
+    if(depth >= SAKHADB_BTREE_CACHE_DEPTH || btreeIsLeaf(node))
+    {
+        return 0;
+    }
     
-    if(node->nslots == 0)
+    struct BtreeCacheEntry* entry = ctx->cache + page->no % SAKHADB_BTREE_CACHE_NODES;
+    if(entry->page == page)
     {
-        goto Lexit;
+        entry->hits += (entry->hits < SAKHADB_BTREE_CACHE_MAX_HITS);
+        return entry;
     }
     
-    for(int i = node->nslots-1; i >= 0; --i)
+    // Hot node keeps its entry until it runs out of hits
+    if(entry->hits)
     {
-        if(!node->flags)
-        {
-            sakhadb_btree_page_t new_page;
-            rc = btreeLoadNode(ctx, slots[i].no, &new_page);
-            if(rc)
-            {
-                goto Lexit;
-            }
-            
-            cpl_region_append_data(prefix, "|    ", 5);
-            btreeDumpPage(new_page, ctx, prefix, region);
-            prefix->offset -= 5;
-        }
-        
-        if(prefix->offset > 0)
-        {
-            cpl_region_append_region(region, prefix);
+        entry->hits--;
+        return 0;
+    }
+    
+    if(node->nslots > ctx->cache_keys)
+    {
+        return 0;
+    }
+    
+    entry->page = page;
+    entry->nkeys = node->nslots;
+    btreeCacheFill(entry, node, 0, 1);
+    return entry;
+}
+
+/**
+ * Same as btreeFindKey() for the node at 'depth' of the tree, searches cached
+ * nodes by prefixes. Keys with the prefix equal to the one of the key to
+ * find are resolved on the page.
+ */
+static int btreeCacheFindKey(
+    struct BtreeContext* ctx,               /* Context */
+    sakhadb_btree_page_t page,              /* The node contains slots */
+    int depth,                              /* Level of the node, 0 for root */
+    const void* key,                        /* Key to find */
+    uint16_t key_sz,                        /* Size of the key to find */
+    int* pIndex                             /* Out: index */
+)
+{
+    struct BtreeCacheEntry* entry = btreeCacheGet(ctx, page, depth);
+    if(!entry)
+    {
+        return btreeFindKey(page->header, key, key_sz, pIndex);
+    }
+    
+    uint64_t search[2];
+    btreeCachePrefix(key, key_sz, search);
+    
+    // Lower bound: go right past lesser prefixes, then undo right turns
+    const uint64_t* prefixes = entry->prefixes;
+    size_t n = entry->nkeys;
+    size_t k = 1;
+    while(k <= n)
+    {
+        __builtin_prefetch(prefixes + 32 * k);
+        const uint64_t* p = prefixes + 2 * k;
+        k = 2 * k + ((p[0] < search[0]) | ((p[0] == search[0]) & (p[1] < search[1])));
+    }
+    k >>= __builtin_ffsl(~(long)k);
+    
+    if(k == 0)
+    {
+        *pIndex = -1;
+        return 1;
+    }
+    
+    if(prefixes[2 * k] == search[0] && prefixes[2 * k + 1] == search[1])
+    {
+        return btreeFindKey(page->header, key, key_sz, pIndex);
+    }
+    
+    *pIndex = (int)(n - 1 - entry->ranks[k]);
+#ifdef DEBUG
+    int index;
+    btreeFindKey(page->header, key, key_sz, &index);
+    assert(index == *pIndex);
+#endif
+    return -1;
+}
+
+/**
+ * Loads the child node, cached nodes skip the pager.
+ */
+static inline int btreeCacheLoadNode(
+    struct BtreeContext * ctx,          /* Context */
+    Pgno no,                            /* Page number */
+    sakhadb_btree_page_t* pPage
+)
+{
+    struct BtreeCacheEntry* entry = ctx->cache + no % SAKHADB_BTREE_CACHE_NODES;
+    if(entry->page && entry->page->no == no)
+    {
+        *pPage = entry->page;
+        return SAKHADB_OK;
+    }
+    return btreeLoadNode(ctx, no, pPage);
+}
+#else // SAKHADB_BTREE_CACHE
+#   define btreeCacheFindKey(ctx, page, depth, key, key_sz, pIndex) \
+        btreeFindKey((page)->header, (key), (key_sz), (pIndex))
+#   define btreeCacheLoadNode(ctx, no, pPage) btreeLoadNode((ctx), (no), (pPage))
+#endif // SAKHADB_BTREE_CACHE
+
+/******************************************************************************/
+
+static inline void btreeResetCursor(struct BtreeCursorStack* stack)
+{
+    while(cpl_array_count(&stack->st) > 0)
+    {
+        cpl_array_pop_back(&stack->st);
+    }
+}
+
+/**
+ * Checks whether the leaf cursor at the top of the stack is beyond the upper
+ * bound of the cursor.
+ */
+static inline int btreeAboveUpper(struct BtreeCursorStack* stack)
+{
+    if(!(stack->flags & SAKHADB_BTREE_CURSOR_UPPER))
+    {
+        return 0;
+    }
+    
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    uint16_t sz;
+    const char* key = btreeGetKey(cur->page->header, cur->index, &sz);
+    int cmp = btreeCompareKeys(key, sz, stack->upper, stack->nupper);
+    return (stack->flags & SAKHADB_BTREE_CURSOR_UPPER_EXCL) ? cmp >= 0 : cmp > 0;
+}
+
+/**
+ * Checks whether the leaf cursor at the top of the stack is beyond the lower
+ * bound of the cursor.
+ */
+static inline int btreeBelowLower(struct BtreeCursorStack* stack)
+{
+    if(!(stack->flags & SAKHADB_BTREE_CURSOR_LOWER))
+    {
+        return 0;
+    }
+    
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    uint16_t sz;
+    const char* key = btreeGetKey(cur->page->header, cur->index, &sz);
+    int cmp = btreeCompareKeys(key, sz, stack->lower, stack->nlower);
+    return (stack->flags & SAKHADB_BTREE_CURSOR_LOWER_EXCL) ? cmp <= 0 : cmp < 0;
+}
+
+/**
+ * Descends from the page to the leaf with the smallest keys.
+ * Leaf cursor at the top of the stack is -1 if the leaf is empty.
+ */
+static int btreeDescendFirst(
+    sakhadb_btree_t tree,                   /* Tree to seek in */
+    sakhadb_btree_page_t page,              /* Root of subtree */
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    int rc = SAKHADB_OK;
+    while(rc == SAKHADB_OK)
+    {
+        register sakhadb_btree_node_t node = page->header;
+        int cur = node->nslots - 1;
+        struct BtreeCursorPointer cursor = { page, cur };
+        cpl_array_push_back(&stack->st, cursor);
+        
+        if(btreeIsLeaf(node))
+        {
+            break;
+        }
+        
+        Pgno no;
+        if(cur == -1)
+        {
+            no = node->right;
+        }
+        else
+        {
+            no  = btreeGetDataPgno(node, cur);
+        }
+        rc = btreeLoadNode(tree->ctx, no, &page);
+    }
+    
+    return rc;
+}
+
+/**
+ * Moves the cursor to the next leaf, climbing up the stack as far as needed.
+ * Separator of the parent is a lower fence of the next subtree, so the upper
+ * bound is checked before the subtree is touched.
+ */
+static int btreeNextLeaf(
+    sakhadb_btree_t tree,                   /* A target */
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    int rc = SAKHADB_OK;
+    cpl_array_pop_back(&stack->st);
+    while(cpl_array_count(&stack->st) > 0)
+    {
+        struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+        sakhadb_btree_node_t node = cur->page->header;
+        if(cur->index == -1)
+        {
+            cpl_array_pop_back(&stack->st);
+            continue;
+        }
+        
+        if(stack->flags & SAKHADB_BTREE_CURSOR_UPPER)
+        {
+            uint16_t sz;
+            const char* fence = btreeGetKey(node, cur->index, &sz);
+            if(btreeCompareKeys(fence, sz, stack->upper, stack->nupper) >= 0)
+            {
+                break;
+            }
+        }
+        
+        Pgno no = (--cur->index == -1) ? node->right : btreeGetDataPgno(node, cur->index);
+        sakhadb_btree_page_t page;
+        rc = btreeLoadNode(tree->ctx, no, &page);
+        if(rc)
+        {
+            SLOG_BTREE_ERROR("btreeNextLeaf: failed to fetch page [%d]", no);
+            return rc;
+        }
+        
+        rc = btreeDescendFirst(tree, page, stack);
+        if(rc)
+        {
+            return rc;
+        }
+        
+        cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+        if(cur->index != -1)
+        {
+            return btreeAboveUpper(stack) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+        }
+        
+        // Empty leaf
+        cpl_array_pop_back(&stack->st);
+    }
+    
+    btreeResetCursor(stack);
+    return SAKHADB_NOTFOUND;
+}
+
+/**
+ * Descends from the page to the leaf with the greatest keys.
+ * Leaf cursor at the top of the stack is -1 if the leaf is empty.
+ */
+static int btreeDescendLast(
+    sakhadb_btree_t tree,                   /* Tree to seek in */
+    sakhadb_btree_page_t page,              /* Root of subtree */
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    int rc = SAKHADB_OK;
+    while(rc == SAKHADB_OK)
+    {
+        register sakhadb_btree_node_t node = page->header;
+        if(btreeIsLeaf(node))
+        {
+            struct BtreeCursorPointer cursor = { page, node->nslots ? 0 : -1 };
+            cpl_array_push_back(&stack->st, cursor);
+            break;
+        }
+        
+        struct BtreeCursorPointer cursor = { page, -1 };
+        cpl_array_push_back(&stack->st, cursor);
+        rc = btreeLoadNode(tree->ctx, node->right, &page);
+    }
+    
+    return rc;
+}
+
+/**
+ * Moves the cursor to the previous leaf. Mirror of btreeNextLeaf(): separator
+ * of the previous subtree is its upper fence.
+ */
+static int btreePrevLeaf(
+    sakhadb_btree_t tree,                   /* A target */
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    int rc = SAKHADB_OK;
+    cpl_array_pop_back(&stack->st);
+    while(cpl_array_count(&stack->st) > 0)
+    {
+        struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+        sakhadb_btree_node_t node = cur->page->header;
+        if(cur->index + 1 >= node->nslots)
+        {
+            cpl_array_pop_back(&stack->st);
+            continue;
+        }
+        
+        ++cur->index;
+        if(stack->flags & SAKHADB_BTREE_CURSOR_LOWER)
+        {
+            uint16_t sz;
+            const char* fence = btreeGetKey(node, cur->index, &sz);
+            int cmp = btreeCompareKeys(fence, sz, stack->lower, stack->nlower);
+            if((stack->flags & SAKHADB_BTREE_CURSOR_LOWER_EXCL) ? cmp <= 0 : cmp < 0)
+            {
+                break;
+            }
+        }
+        
+        Pgno no = btreeGetDataPgno(node, cur->index);
+        sakhadb_btree_page_t page;
+        rc = btreeLoadNode(tree->ctx, no, &page);
+        if(rc)
+        {
+            SLOG_BTREE_ERROR("btreePrevLeaf: failed to fetch page [%d]", no);
+            return rc;
+        }
+        
+        rc = btreeDescendLast(tree, page, stack);
+        if(rc)
+        {
+            return rc;
+        }
+        
+        cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+        if(cur->index != -1)
+        {
+            return btreeBelowLower(stack) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+        }
+        
+        // Empty leaf
+        cpl_array_pop_back(&stack->st);
+    }
+    
+    btreeResetCursor(stack);
+    return SAKHADB_NOTFOUND;
+}
+
+static int btreeLast(
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    SLOG_BTREE_INFO("btreeLast: fetch last entry of tree [%d]", stack->tree->root->no);
+    sakhadb_btree_t tree = stack->tree;
+    btreeResetCursor(stack);
+    int rc = btreeDescendLast(tree, tree->root, stack);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    if(cur->index == -1)
+    {
+        return btreePrevLeaf(tree, stack);
+    }
+    
+    return btreeBelowLower(stack) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+}
+
+static int btreeFirst(
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    SLOG_BTREE_INFO("btreeFirst: fetch first entry of tree [%d]", stack->tree->root->no);
+    sakhadb_btree_t tree = stack->tree;
+    btreeResetCursor(stack);
+    int rc = btreeDescendFirst(tree, tree->root, stack);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    if(cur->index == -1)
+    {
+        return btreeNextLeaf(tree, stack);
+    }
+    
+    return btreeAboveUpper(stack) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+}
+
+/**
+ * Descends from the page to the leaf, which may contain the key.
+ * Every level remembers the upper fence of its subtree. The fence points to
+ * a separator in one of the ancestors, which stay intact while the level is
+ * in the stack.
+ */
+static int btreeDescend(
+    sakhadb_btree_t tree,                   /* Tree to seek in */
+    sakhadb_btree_page_t page,              /* Root of subtree */
+    const char* fence, uint16_t nfence,     /* Upper fence of the subtree */
+    const void* key,                        /* Key to find */
+    uint16_t key_sz,                        /* Size of the key to find */
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    int cmp;
+    while (1) {
+        int cur;
+        register sakhadb_btree_node_t node = page->header;
+        cmp = btreeCacheFindKey(tree->ctx, page, (int)cpl_array_count(&stack->st), key, key_sz, &cur);
+        struct BtreeCursorPointer cursor = { page, cur, fence, nfence };
+        cpl_array_push_back(&stack->st, cursor);
+        
+        SLOG_BTREE_INFO("btreeDescend: finding key in node [%d][%d]", cmp, cur);
+        
+        if(btreeIsLeaf(node))
+        {
+            break;
+        }
+        
+        Pgno no;
+        if(cur == -1)
+        {
+            no = node->right;
+        }
+        else
+        {
+            no  = btreeGetDataPgno(node, cur);
+            fence = btreeGetKey(node, cur, &nfence);
+        }
+        btreeCacheLoadNode(tree->ctx, no, &page);
+    }
+    return cmp;
+}
+
+static int btreeFind(
+    sakhadb_btree_t tree,                   /* Tree to seek in */
+    const void* key,                        /* Key to find */
+    uint16_t key_sz,                        /* Size of the key to find */
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    SLOG_BTREE_INFO("btreeFind: find key in tree [%d][%hu]", tree->root->no, key_sz);
+    btreeResetCursor(stack);
+    return btreeDescend(tree, tree->root, 0, 0, key, key_sz, stack);
+}
+
+/**
+ * Same as btreeFind(), but reuses the path in the stack. Key must be greater
+ * than the key the stack was positioned to, so only upper fences are checked.
+ */
+static int btreeRefind(
+    sakhadb_btree_t tree,                   /* Tree to seek in */
+    const void* key,                        /* Key to find */
+    uint16_t key_sz,                        /* Size of the key to find */
+    struct BtreeCursorStack* stack          /* In/Out param: stack that contains cursors */
+)
+{
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    while(cur->fence && btreeCompareKeys(key, key_sz, cur->fence, cur->nfence) > 0)
+    {
+        cpl_array_pop_back(&stack->st);
+        cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    }
+    
+    struct BtreeCursorPointer top = *cur;
+    cpl_array_pop_back(&stack->st);
+    return btreeDescend(tree, top.page, top.fence, top.nfence, key, key_sz, stack);
+}
+
+/**
+ * Keys are ordered in descending order inside node, so the next key has
+ * lesser index.
+ */
+static inline int btreeNext(
+    sakhadb_btree_t tree,                   /* A target */
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    if(!cur)
+    {
+        return SAKHADB_NOTFOUND;
+    }
+    
+    if(--cur->index < 0)
+    {
+        return btreeNextLeaf(tree, stack);
+    }
+    
+    return btreeAboveUpper(stack) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+}
+
+static inline int btreePrev(
+    sakhadb_btree_t tree,                   /* A target */
+    struct BtreeCursorStack* stack          /* Out param: stack that contains cursors */
+)
+{
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    if(!cur)
+    {
+        return SAKHADB_NOTFOUND;
+    }
+    
+    if(++cur->index >= cur->page->header->nslots)
+    {
+        return btreePrevLeaf(tree, stack);
+    }
+    
+    return btreeBelowLower(stack) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+}
+
+/**
+ * Positions the cursor at the first key, which is greater or equal
+ * (or just greater if 'exclusive' is set) than the key.
+ */
+static int btreeSeek(
+    struct BtreeCursorStack* stack,         /* Cursor to position */
+    const void* key,                        /* Lower bound */
+    uint16_t key_sz,                        /* Size of the lower bound */
+    int exclusive
+)
+{
+    sakhadb_btree_t tree = stack->tree;
+    int cmp = btreeFind(tree, key, key_sz, stack);
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    if(cur->index == -1)
+    {
+        // All keys in the leaf are less than the bound
+        return btreeNextLeaf(tree, stack);
+    }
+    
+    if(cmp == 0 && exclusive)
+    {
+        return btreeNext(tree, stack);
+    }
+    
+    return btreeAboveUpper(stack) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+}
+
+/**
+ * Positions the cursor at the last key, which is less or equal
+ * (or just less if 'exclusive' is set) than the key.
+ */
+static int btreeSeekLast(
+    struct BtreeCursorStack* stack,         /* Cursor to position */
+    const void* key,                        /* Upper bound */
+    uint16_t key_sz,                        /* Size of the upper bound */
+    int exclusive
+)
+{
+    sakhadb_btree_t tree = stack->tree;
+    int cmp = btreeFind(tree, key, key_sz, stack);
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    if(cur->index == -1)
+    {
+        // All keys in the leaf are less than the bound
+        if(cur->page->header->nslots == 0)
+        {
+            return btreePrevLeaf(tree, stack);
+        }
+        cur->index = 0;
+    }
+    else if(cmp != 0 || exclusive)
+    {
+        return btreePrev(tree, stack);
+    }
+    
+    return btreeBelowLower(stack) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+}
+
+static inline int btreeDumpPage(
+    sakhadb_btree_page_t page,      /* A page to dump */
+    sakhadb_btree_ctx_t  ctx,       /* Context */
+    cpl_region_ref prefix,          /* Offset level prefix */
+    cpl_region_ref region           /* Output: dumped data */
+)
+{
+    int rc = SAKHADB_OK;
+    char templ[] = " (%d)\n";
+    char buffer[64];
+    sakhadb_btree_node_t node = page->header;
+    
+    if(node->nslots == 0)
+    {
+        goto Lexit;
+    }
+    
+    for(int i = node->nslots-1; i >= 0; --i)
+    {
+        if(!btreeIsLeaf(node))
+        {
+            sakhadb_btree_page_t new_page;
+            rc = btreeLoadNode(ctx, btreeGetDataPgno(node, i), &new_page);
+            if(rc)
+            {
+                goto Lexit;
+            }
+            
+            cpl_region_append_data(prefix, "|    ", 5);
+            btreeDumpPage(new_page, ctx, prefix, region);
+            prefix->offset -= 5;
+        }
+        
+        if(prefix->offset > 0)
+        {
+            cpl_region_append_region(region, prefix);
+        }
+        
+        if(i == 0)
+        {
+            cpl_region_append_data(region, "+-- ", 4);
+        }
+        else
+        {
+            cpl_region_append_data(region, "|-- ", 4);
+        }
+        
+        uint16_t sz;
+        const char* key = btreeGetKey(node, i, &sz);
+        if(btreeHasOidKeys(node))
+        {
+            for(uint16_t j = 0; j < sz; ++j)
+            {
+                sprintf(buffer + 2*j, "%02x", (unsigned char)key[j]);
+            }
+            cpl_region_append_data(region, buffer, 2*sz);
+        }
+        else
+        {
+            cpl_region_append_data(region, key, sz);
+        }
+        sprintf(buffer, templ, btreeGetDataPgno(node, i));
+        cpl_region_append_data(region, buffer, strlen(buffer));
+    }
+    
+    if(!btreeIsLeaf(node))
+    {
+        sakhadb_btree_page_t new_page;
+        rc = btreeLoadNode(ctx, node->right, &new_page);
+        if(rc)
+        {
+            goto Lexit;
+        }
+        
+        cpl_region_append_data(prefix, "     ", 5);
+        btreeDumpPage(new_page, ctx, prefix, region);
+        prefix->offset -= 5;
+    }
+    
+Lexit:
+    return rc;
+}
+
+static inline int btreeDump(
+    sakhadb_btree_t tree,   /* A tree to dump */
+    cpl_region_ref region   /* Output: dumped data */
+)
+{
+    int rc = SAKHADB_OK;
+    region->offset = 0;
+    char root[] = "root (%d)\n";
+    char buffer[64];
+    cpl_region_t prefix;
+    cpl_region_init(cpl_allocator_get_default(), &prefix, 64);
+    
+    sprintf(buffer, root, tree->root->no);
+    cpl_region_append_data(region, buffer, strlen(buffer));
+    rc = btreeDumpPage(tree->root, tree->ctx, &prefix, region);
+    
+    cpl_region_deinit(&prefix);
+    
+    cpl_region_append_data(region, "\0", 1);
+    
+    return rc;
+}
+
+/****************************** Count Section *********************************/
+
+/**
+ * Number of entries in the subtree rooted at the node. Internal node keeps
+ * the counts of its children, so none of them is loaded.
+ */
+static inline uint32_t btreeNodeCount(sakhadb_btree_node_t node)
+{
+    if(btreeIsLeaf(node))
+    {
+        return node->nslots;
+    }
+    
+    uint32_t count = node->right_count;
+    for(int i = 0; i < node->nslots; ++i)
+    {
+        count += *btreeChildCount(node, i);
+    }
+    return count;
+}
+
+/**
+ * Sets counts of the halves of the split child, whose separator was just
+ * inserted at the cursor. Separator points to the lesser half.
+ */
+static inline void btreeSetSplitCounts(
+    struct BtreeCursorPointer* cursor,  /* Position of the separator before insertion */
+    sakhadb_btree_page_t child,         /* Lesser half */
+    sakhadb_btree_page_t new_child      /* Greater half */
+)
+{
+    sakhadb_btree_node_t node = cursor->page->header;
+    *btreeChildCount(node, cursor->index + 1) = btreeNodeCount(child->header);
+    *btreeChildCount(node, cursor->index) = btreeNodeCount(new_child->header);
+}
+
+/**
+ * Adds 'delta' to the counts of the children on the cursor path.
+ */
+static inline void btreeAdjustCounts(struct BtreeCursorStack* stack, int delta)
+{
+    struct BtreeCursorPointer* top = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    for(size_t i = 1; i < cpl_array_count(&stack->st); ++i)
+    {
+        struct BtreeCursorPointer* cur = top - i;
+        *btreeChildCount(cur->page->header, cur->index) += delta;
+        btreeSaveCount(stack->tree->ctx, cur->page);
+    }
+}
+
+/**
+ * Number of keys less than the key (or not greater, if 'inclusive').
+ * Counts of the children on the left of the path are summed up in the nodes
+ * of the path, so the cost is the height of the tree.
+ */
+static int btreeRank(
+    sakhadb_btree_t tree,
+    const void* key, uint16_t nkey,
+    int inclusive,
+    uint64_t* pRank
+)
+{
+    int rc = SAKHADB_OK;
+    uint64_t rank = 0;
+    sakhadb_btree_page_t page = tree->root;
+    while(1)
+    {
+        sakhadb_btree_node_t node = page->header;
+        int idx;
+        int cmp = btreeFindKey(node, key, nkey, &idx);
+        if(btreeIsLeaf(node))
+        {
+            // Entries below 'idx' are less than the key
+            rank += (idx == -1) ? node->nslots : node->nslots - 1 - idx;
+            if(idx != -1 && cmp == 0 && inclusive)
+            {
+                rank += 1;
+            }
+            break;
+        }
+        
+        // Children below 'idx' hold lesser keys only
+        for(int i = idx + 1; i < node->nslots; ++i)
+        {
+            rank += *btreeChildCount(node, i);
+        }
+        
+        rc = btreeLoadNode(tree->ctx, (idx == -1) ? node->right : btreeGetDataPgno(node, idx), &page);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    *pRank = rank;
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Number of keys less than the key under the cursor.
+ */
+static uint64_t btreeCursorRank(struct BtreeCursorStack* stack)
+{
+    uint64_t rank = 0;
+    struct BtreeCursorPointer* top = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    for(size_t i = 0; i < cpl_array_count(&stack->st); ++i)
+    {
+        struct BtreeCursorPointer* cur = top - i;
+        sakhadb_btree_node_t node = cur->page->header;
+        if(btreeIsLeaf(node))
+        {
+            rank += node->nslots - 1 - cur->index;
+            continue;
+        }
+        
+        for(int j = cur->index + 1; j < node->nslots; ++j)
+        {
+            rank += *btreeChildCount(node, j);
+        }
+    }
+    
+    return rank;
+}
+
+/**
+ * Positions the cursor at the n-th (counting from 0) key in ascending order.
+ */
+static int btreeNth(struct BtreeCursorStack* stack, uint64_t n)
+{
+    int rc = SAKHADB_OK;
+    sakhadb_btree_t tree = stack->tree;
+    btreeResetCursor(stack);
+    if(n >= btreeNodeCount(tree->root->header))
+    {
+        return SAKHADB_NOTFOUND;
+    }
+    
+    sakhadb_btree_page_t page = tree->root;
+    const char* fence = 0;
+    uint16_t nfence = 0;
+    while(1)
+    {
+        sakhadb_btree_node_t node = page->header;
+        if(btreeIsLeaf(node))
+        {
+            struct BtreeCursorPointer cursor = { page, node->nslots - 1 - (int)n, fence, nfence };
+            cpl_array_push_back(&stack->st, cursor);
+            break;
+        }
+        
+        int idx = node->nslots - 1;
+        for(; idx >= 0; --idx)
+        {
+            uint32_t c = *btreeChildCount(node, idx);
+            if(n < c)
+            {
+                break;
+            }
+            n -= c;
+        }
+        
+        struct BtreeCursorPointer cursor = { page, idx, fence, nfence };
+        cpl_array_push_back(&stack->st, cursor);
+        
+        Pgno no = node->right;
+        if(idx != -1)
+        {
+            no = btreeGetDataPgno(node, idx);
+            fence = btreeGetKey(node, idx, &nfence);
+        }
+        rc = btreeLoadNode(tree->ctx, no, &page);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    if(btreeAboveUpper(stack) || btreeBelowLower(stack))
+    {
+        rc = SAKHADB_NOTFOUND;
+    }
+    
+Lexit:
+    return rc;
+}
+
+/******************************************************************************/
+
+/****************************** Buffer Section ********************************/
+
+/**
+ * Insert buffer of an internal node (SAKHADB_BTREE_BUFFERED). 'buffer' of the
+ * node is the first of SAKHADB_BTREE_BUFFER_PAGES consecutive pages, which are
+ * filled in turn. A page holds whole messages, each one is an entry waiting
+ * for the subtree of the node. Along the path of a key older messages are
+ * deeper, and in one buffer they come first.
+ *
+ * Leaves take entries only from flushes, which take out the messages of the
+ * nodes above the leaves first, so a node splits with an empty buffer.
+ */
+struct BtreeBufferPage
+{
+    uint16_t        used;               /* Bytes used, the header included */
+    uint16_t        count;              /* Number of messages */
+    uint16_t        npages;             /* Pages in use, first page only */
+    uint16_t        reserved;
+};
+
+struct BtreeMessage
+{
+    Pgno            no;                 /* Data page of the entry */
+    uint16_t        nkey;               /* Size of the key the entry starts with */
+    uint16_t        nentry;             /* Size of the entry following the message */
+};
+
+#define btreeMessageSize(nentry) ((sizeof(struct BtreeMessage) + (nentry) + 3) & ~(size_t)3)
+#define btreeMessageEntry(m) ((const char*)((m) + 1))
+#define btreeFirstMessage(p) ((const struct BtreeMessage*)((const struct BtreeBufferPage*)(p) + 1))
+#define btreeNextMessage(m) \
+    ((const struct BtreeMessage*)((const char*)(m) + btreeMessageSize((m)->nentry)))
+
+/**
+ * Message taken out of a buffer. 'seq' keeps messages of the same key in the
+ * order they came in.
+ */
+struct BtreeBufferedEntry
+{
+    const struct BtreeMessage*  msg;
+    size_t                      seq;
+};
+
+static inline void btreeBufferInitPage(struct BtreeBufferPage* bp)
+{
+    bp->used = sizeof(struct BtreeBufferPage);
+    bp->count = 0;
+    bp->npages = 1;
+    bp->reserved = 0;
+}
+
+static int btreeBufferCreate(
+    struct BtreeContext* ctx,           /* Context */
+    sakhadb_btree_page_t page           /* Internal node to get a buffer */
+)
+{
+    Pgno no;
+    int rc = sakhadb_pager_request_extent(ctx->pager, SAKHADB_BTREE_BUFFER_PAGES, &no);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeBufferCreate: failed to allocate buffer [%d][%d]", rc, page->no);
+        return rc;
+    }
+    
+    sakhadb_page_t first;
+    rc = sakhadb_pager_request_page(ctx->pager, no, &first);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeBufferCreate: failed to load buffer [%d][%d]", rc, no);
+        return rc;
+    }
+    
+    btreeBufferInitPage(first->data);
+    sakhadb_pager_save_page(ctx->pager, first);
+    
+    page->header->buffer = no;
+    btreeSaveCount(ctx, page);
+    return rc;
+}
+
+/**
+ * Returns the pages of the buffer to the freelist. The node is saved by the
+ * caller.
+ */
+static int btreeBufferFree(struct BtreeContext* ctx, sakhadb_btree_node_t node)
+{
+    int rc = SAKHADB_OK;
+    for(Pgno i = SAKHADB_BTREE_BUFFER_PAGES; i-- > 0 && rc == SAKHADB_OK; )
+    {
+        // In reverse, so the extent heads the freelist in ascending order
+        sakhadb_page_t page;
+        rc = sakhadb_pager_request_page(ctx->pager, node->buffer + i, &page);
+        if(rc == SAKHADB_OK)
+        {
+            sakhadb_pager_add_freelist(ctx->pager, page);
+        }
+    }
+    
+    node->buffer = 0;
+    return rc;
+}
+
+/**
+ * Appends the message to the buffer of the node, creating the buffer first if
+ * there is none. Sets 'pFull' if the buffer has no room for the message.
+ */
+static int btreeBufferAppend(
+    struct BtreeContext* ctx,           /* Context */
+    sakhadb_btree_page_t page,          /* Internal node */
+    Pgno no,                            /* Data page of the entry */
+    uint16_t nkey,                      /* Size of the key */
+    const void* entry, uint16_t nentry, /* Entry starting with the key */
+    int* pFull
+)
+{
+    int rc = SAKHADB_OK;
+    sakhadb_btree_node_t node = page->header;
+    size_t page_size = sakhadb_pager_page_size(ctx->pager, 0);
+    size_t sz = btreeMessageSize(nentry);
+    *pFull = 0;
+    
+    if(!node->buffer)
+    {
+        rc = btreeBufferCreate(ctx, page);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    sakhadb_page_t first, last;
+    rc = sakhadb_pager_request_page(ctx->pager, node->buffer, &first);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    struct BtreeBufferPage* head = first->data;
+    last = first;
+    if(head->npages > 1)
+    {
+        rc = sakhadb_pager_request_page(ctx->pager, node->buffer + head->npages - 1, &last);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    struct BtreeBufferPage* bp = last->data;
+    if(bp->used + sz > page_size)
+    {
+        if(head->npages == SAKHADB_BTREE_BUFFER_PAGES)
+        {
+            *pFull = 1;
+            goto Lexit;
+        }
+        
+        rc = sakhadb_pager_request_page(ctx->pager, node->buffer + head->npages, &last);
+        if(rc)
+        {
+            goto Lexit;
+        }
+        
+        bp = last->data;
+        btreeBufferInitPage(bp);
+        head->npages++;
+        sakhadb_pager_save_page(ctx->pager, first);
+    }
+    
+    struct BtreeMessage* msg = (struct BtreeMessage*)((char*)bp + bp->used);
+    msg->no = no;
+    msg->nkey = nkey;
+    msg->nentry = nentry;
+    memcpy(msg + 1, entry, nentry);
+    bp->used += sz;
+    bp->count++;
+    sakhadb_pager_save_page(ctx->pager, last);
+    
+Lexit:
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeBufferAppend: failed to append message [%d][%d]", rc, page->no);
+    }
+    return rc;
+}
+
+/**
+ * Moves the messages of the buffer of the node to the end of the memory block,
+ * which grows as needed. The buffer is left empty. The block is a sequence of
+ * buffer pages cut to their 'used' size.
+ */
+static int btreeBufferTake(
+    struct BtreeContext* ctx,           /* Context */
+    sakhadb_btree_page_t page,          /* Internal node with a buffer */
+    char** pBlock,                      /* In/Out: memory block */
+    size_t* pSize                       /* In/Out: size of the block */
+)
+{
+    sakhadb_btree_node_t node = page->header;
+    sakhadb_page_t first;
+    int rc = sakhadb_pager_request_page(ctx->pager, node->buffer, &first);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    struct BtreeBufferPage* head = first->data;
+    char* block = cpl_allocator_realloc(cpl_allocator_get_default(), *pBlock,
+                                        *pSize + head->npages * sakhadb_pager_page_size(ctx->pager, 0));
+    if(!block)
+    {
+        SLOG_BTREE_FATAL("btreeBufferTake: failed to allocate memory for messages");
+        rc = SAKHADB_NOMEM;
+        goto Lexit;
+    }
+    *pBlock = block;
+    
+    for(Pgno i = 0; i < head->npages; ++i)
+    {
+        sakhadb_page_t p = first;
+        if(i)
+        {
+            rc = sakhadb_pager_request_page(ctx->pager, node->buffer + i, &p);
+            if(rc)
+            {
+                goto Lexit;
+            }
+        }
+        
+        struct BtreeBufferPage* bp = p->data;
+        memcpy(block + *pSize, bp, bp->used);
+        *pSize += bp->used;
+    }
+    
+    btreeBufferInitPage(head);
+    sakhadb_pager_save_page(ctx->pager, first);
+    
+Lexit:
+    return rc;
+}
+
+static int btreeCompareBuffered(const void* a, const void* b)
+{
+    const struct BtreeBufferedEntry* x = a;
+    const struct BtreeBufferedEntry* y = b;
+    int cmp = btreeCompareKeys(btreeMessageEntry(x->msg), x->msg->nkey,
+                               btreeMessageEntry(y->msg), y->msg->nkey);
+    return cmp ? cmp : (x->seq < y->seq ? -1 : 1);
+}
+
+/**
+ * Lists the messages of the block taken by btreeBufferTake() in ascending
+ * order of keys, messages of the same key in the order of the block.
+ */
+static int btreeBufferSort(
+    const char* block, size_t size,     /* Messages */
+    struct BtreeBufferedEntry** pEntries,
+    size_t* pCount
+)
+{
+    size_t count = 0;
+    for(size_t off = 0; off < size; off += ((const struct BtreeBufferPage*)(block + off))->used)
+    {
+        count += ((const struct BtreeBufferPage*)(block + off))->count;
+    }
+    
+    struct BtreeBufferedEntry* entries = cpl_allocator_allocate(cpl_allocator_get_default(),
+                                                                (count + 1) * sizeof(struct BtreeBufferedEntry));
+    if(!entries)
+    {
+        SLOG_BTREE_FATAL("btreeBufferSort: failed to allocate memory for messages [%d]", count);
+        return SAKHADB_NOMEM;
+    }
+    
+    size_t n = 0;
+    for(size_t off = 0; off < size; off += ((const struct BtreeBufferPage*)(block + off))->used)
+    {
+        const struct BtreeBufferPage* bp = (const struct BtreeBufferPage*)(block + off);
+        const struct BtreeMessage* msg = btreeFirstMessage(bp);
+        for(uint16_t i = 0; i < bp->count; ++i, msg = btreeNextMessage(msg))
+        {
+            entries[n].msg = msg;
+            entries[n].seq = n;
+            ++n;
+        }
+    }
+    
+    qsort(entries, count, sizeof(struct BtreeBufferedEntry), btreeCompareBuffered);
+    
+    *pEntries = entries;
+    *pCount = count;
+    return SAKHADB_OK;
+}
+
+/**
+ * Checks that the buffer of the node holds no messages.
+ */
+static inline int btreeBufferIsEmpty(struct BtreeContext* ctx, sakhadb_btree_node_t node)
+{
+    sakhadb_page_t page;
+    if(!node->buffer || sakhadb_pager_request_page(ctx->pager, node->buffer, &page))
+    {
+        return 1;
+    }
+    
+    const struct BtreeBufferPage* bp = page->data;
+    return bp->npages == 1 && bp->count == 0;
+}
+
+/**
+ * Finds the oldest message of the key in the buffer of the node.
+ */
+static const struct BtreeMessage* btreeBufferFind(
+    struct BtreeContext* ctx,           /* Context */
+    sakhadb_btree_node_t node,          /* Internal node with a buffer */
+    const void* key, uint16_t nkey      /* Key to find */
+)
+{
+    sakhadb_page_t page;
+    if(sakhadb_pager_request_page(ctx->pager, node->buffer, &page))
+    {
+        return 0;
+    }
+    
+    uint16_t npages = ((struct BtreeBufferPage*)page->data)->npages;
+    for(Pgno i = 0; i < npages; ++i)
+    {
+        if(i && sakhadb_pager_request_page(ctx->pager, node->buffer + i, &page))
+        {
+            return 0;
+        }
+        
+        const struct BtreeBufferPage* bp = page->data;
+        const struct BtreeMessage* msg = btreeFirstMessage(bp);
+        for(uint16_t j = 0; j < bp->count; ++j, msg = btreeNextMessage(msg))
+        {
+            if(msg->nkey == nkey && memcmp(btreeMessageEntry(msg), key, nkey) == 0)
+            {
+                return msg;
+            }
+        }
+    }
+    return 0;
+}
+
+/******************************************************************************/
+
+/****************************** Split Section *********************************/
+static inline void btreeRemoveLastSlot(
+    sakhadb_btree_node_t __restrict node
+)
+{
+    assert(node->nslots > 0);
+    
+    if(btreeIsOid(node))
+    {
+        node->nslots -= 1;
+        node->free_off -= SAKHADB_BTREE_OID_SIZE;
+        node->free_sz += btreeOidEntry(node);
+        return;
+    }
+ 
+    register sakhadb_btree_slot_t* slot = btreeGetSlot(node, 0);
+    node->nslots -= 1;
+    node->slots_off += btreeSlotSize(node);
+    node->free_off = slot->off;
+    node->free_sz += slot->sz + btreeSlotSize(node);
+}
+
+static inline void btreeTruncateSlots(
+    sakhadb_btree_node_t __restrict node,
+    size_t k
+)
+{
+    assert(node->nslots >= k);
+    
+    if(btreeIsOid(node))
+    {
+        node->nslots -= k;
+        node->free_off -= k * SAKHADB_BTREE_OID_SIZE;
+        node->free_sz += k * btreeOidEntry(node);
+        return;
+    }
+
+    register sakhadb_btree_slot_t* slot = btreeGetSlot(node, k - 1);
+    node->nslots -= k;
+    node->slots_off += k * btreeSlotSize(node);
+    node->free_off = slot->off;
+    node->free_sz = node->slots_off - node->free_off;
+}
+
+/**
+ * Appends key to the node as the greatest one.
+ */
+static inline void btreeAppendKey(
+    sakhadb_btree_node_t __restrict node,
+    const void* key, uint16_t nkey,
+    Pgno no,
+    uint32_t count                      /* Entries in the subtree of 'no', internal nodes only */
+)
+{
+    assert(btreeNodeHasRoom(node, nkey));
+    
+    if(btreeIsOid(node))
+    {
+        memcpy(btreeNodeOffset(node, node->free_off), key, SAKHADB_BTREE_OID_SIZE);
+        btreeOidPgnos(node)[node->nslots] = no;
+        if(!btreeIsLeaf(node))
+        {
+            btreeOidCounts(node)[node->nslots] = count;
+        }
+        node->nslots += 1;
+        node->free_off += SAKHADB_BTREE_OID_SIZE;
+        node->free_sz -= btreeOidEntry(node);
+        return;
+    }
+    
+    register sakhadb_btree_slot_t* new_slot = btreeGetSlot(node, -1);
+    new_slot->off = node->free_off;
+    new_slot->sz = nkey;
+    new_slot->no = no;
+    if(!btreeIsLeaf(node))
+    {
+        *btreeSlotCount(new_slot) = count;
+    }
+    memcpy(btreeNodeOffset(node, new_slot->off), key, nkey);
+    
+    node->nslots += 1;
+    node->free_off += nkey;
+    node->slots_off -= btreeSlotSize(node);
+    node->free_sz -= nkey + btreeSlotSize(node);
+    
+#ifdef DEBUG
+    memset(btreeNodeOffset(node, node->free_off), 0xCC, node->free_sz);
+#endif
+}
+
+static inline void btreeCopyOnSplit(
+    sakhadb_btree_node_t __restrict node,
+    sakhadb_btree_node_t __restrict new_node,
+    uint16_t k
+)
+{
+    assert(new_node->nslots == 0);
+    
+    if(k == 0)
+    {
+        return;
+    }
+    
+    if(btreeIsOid(node))
+    {
+        register uint16_t start = node->nslots - k;
+        memcpy(btreeOidKeys(new_node),
+               btreeOidKeys(node) + start * SAKHADB_BTREE_OID_SIZE,
+               k * SAKHADB_BTREE_OID_SIZE);
+        memcpy(btreeOidPgnos(new_node), btreeOidPgnos(node) + start, k * sizeof(Pgno));
+        if(!btreeIsLeaf(node))
+        {
+            memcpy(btreeOidCounts(new_node), btreeOidCounts(node) + start, k * sizeof(uint32_t));
+        }
+        new_node->nslots = k;
+        new_node->free_off += k * SAKHADB_BTREE_OID_SIZE;
+        new_node->free_sz -= k * btreeOidEntry(new_node);
+        btreeTruncateSlots(node, k);
+        return;
+    }
+    
+    size_t stride = btreeSlotSize(node);
+    assert(stride == btreeSlotSize(new_node));
+    register uint16_t start_off = btreeGetSlot(node, k - 1)->off;
+    register uint16_t len = btreeGetSlot(node, 0)->off + btreeGetSlot(node, 0)->sz - start_off;
+    memcpy(btreeGetSlot(new_node, -(int)k), btreeGetSlot(node, 0), k * stride);
+    memcpy(btreeNodeOffset(new_node, new_node->free_off), btreeNodeOffset(node, start_off), len);
+    new_node->free_off += len;
+    new_node->slots_off -= k * stride;
+    new_node->free_sz -= len + k * stride;
+    start_off -= sizeof(struct BtreePageHeader);
+    for (uint16_t i = 0; i < k; ++i)
+    {
+        btreeGetSlot(new_node, i)->off -= start_off;
+    }
+    new_node->nslots = k;
+    btreeTruncateSlots(node, k);
+}
+
+/**
+ * Number of the greatest entries to move to the new page on split, so both
+ * halves get about the same number of bytes.
+ */
+static inline uint16_t btreeSplitPoint(sakhadb_btree_node_t node)
+{
+    assert(node->nslots > 1);
+    
+    if(btreeIsOid(node))
+    {
+        return node->nslots >> 1;
+    }
+    
+    size_t stride = btreeSlotSize(node);
+    size_t total = 0;
+    for(uint16_t i = 0; i < node->nslots; ++i)
+    {
+        total += btreeGetSlot(node, i)->sz + stride;
+    }
+    
+    size_t moved = 0;
+    uint16_t k = 0;
+    while(k < node->nslots - 1 && 2 * moved < total)
+    {
+        moved += btreeGetSlot(node, k++)->sz + stride;
+    }
+    
+    return k ? k : 1;
+}
+
+/**
+ * Rewrites keys of the slotted node contiguously, so space lost between keys
+ * becomes usable again. Returns 1 if the node has room for the key then.
+ */
+static int btreeDefragmentNode(
+    struct BtreeContext* ctx,
+    sakhadb_btree_page_t page,
+    uint16_t nkey                       /* Size of the key to insert */
+)
+{
+    sakhadb_btree_node_t node = page->header;
+    if(btreeIsOid(node))
+    {
+        // Dense array is never fragmented
+        return 0;
+    }
+    
+    uint16_t used = 0;
+    for(uint16_t i = 0; i < node->nslots; ++i)
+    {
+        used += btreeGetSlot(node, i)->sz;
+    }
+    
+    uint16_t free_sz = node->slots_off - sizeof(struct BtreePageHeader) - used;
+    if(free_sz <= node->free_sz || free_sz < nkey + btreeSlotSize(node))
+    {
+        return 0;
+    }
+    
+    char* buffer = cpl_allocator_allocate(cpl_allocator_get_default(), used);
+    if(!buffer)
+    {
+        SLOG_BTREE_WARN("btreeDefragmentNode: failed to allocate memory [%d]", used);
+        return 0;
+    }
+    
+    // Greatest key goes on top, as btreeAppendKey() does
+    uint16_t off = 0;
+    for(int i = node->nslots - 1; i >= 0; --i)
+    {
+        sakhadb_btree_slot_t* slot = btreeGetSlot(node, i);
+        memcpy(buffer + off, btreeNodeOffset(node, slot->off), slot->sz);
+        slot->off = sizeof(struct BtreePageHeader) + off;
+        off += slot->sz;
+    }
+    memcpy(btreeNodeOffset(node, sizeof(struct BtreePageHeader)), buffer, used);
+    cpl_allocator_free(cpl_allocator_get_default(), buffer);
+    
+    node->free_off = sizeof(struct BtreePageHeader) + used;
+    node->free_sz = free_sz;
+    btreeSaveNode(ctx, page);
+    
+    SLOG_BTREE_INFO("btreeDefragmentNode: compacted node [%d][%d]", page->no, free_sz);
+    btreeStatInc(ctx, avoided_splits);
+    return 1;
+}
+
+/**
+ * Moves cursor to the half of the split node, which holds its entry.
+ * 'k' is the number of entries moved to the right ("greater") page.
+ */
+static inline void btreeAdjustCursorOnSplit(
+    struct BtreeCursorPointer* cursor,
+    int is_leaf,
+    uint16_t k,
+    sakhadb_btree_page_t left_page,
+    sakhadb_btree_page_t right_page
+)
+{
+    if(cursor->index < k)
+    {
+        cursor->page = right_page;
+        return;
+    }
+    
+    cursor->page = left_page;
+    if(is_leaf)
+    {
+        cursor->index -= k;
+    }
+    else
+    {
+        // Separator was moved to parent, its child is 'right' of the left page
+        cursor->index = (cursor->index == k) ? -1 : cursor->index - k - 1;
+    }
+}
+
+static inline int btreeSplitNode(
+    sakhadb_btree_t tree,
+    sakhadb_btree_page_t page,
+    uint16_t k,                         /* Number of entries to move to new page */
+    struct BtreeSplitResult* res
+)
+{
+    SLOG_BTREE_INFO("btreeSplitNode: split node [%d]", page->no);
+    sakhadb_btree_page_t new_page;
+    sakhadb_btree_node_t node = page->header;
+    int rc = btreeLoadNewNode(tree->ctx, node->flags, &new_page);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeSplitNode: failed to load new node [%d]", rc);
+        goto Lexit;
+    }
+    
+    sakhadb_btree_node_t new_node = new_page->header;
+    btreeStatInc(tree->ctx, splits);
+    
+    // Buffer is empty (see Buffer Section), the new node starts without one
+    assert(btreeBufferIsEmpty(tree->ctx, node));
+    
+    btreeCopyOnSplit(node, new_node, k);
+    new_node->right = node->right;
+    new_node->right_count = node->right_count;
+    
+    uint16_t sz;
+    const char* key = btreeGetKey(node, 0, &sz);
+    memcpy(res->data, key, sz);
+    res->size = sz;
+    res->new_page = new_page;
+    
+    // If node is leaf
+    if(btreeIsLeaf(node))
+    {
+        node->right = new_page->no;
+    }
+    else
+    {
+        Pgno no = btreeGetDataPgno(node, 0);
+        uint32_t count = *btreeChildCount(node, 0);
+        btreeRemoveLastSlot(node);
+        node->right = no;
+        node->right_count = count;
+    }
+    
+#ifdef DEBUG
+    if(!btreeIsOid(node))
+    {
+        memset(btreeNodeOffset(node, node->free_off), 0, node->free_sz);
+    }
+#endif
+    
+    btreeSaveNode(tree->ctx, page);
+    btreeSaveNode(tree->ctx, new_page);
+    
+Lexit:
+    return rc;
+}
+
+static inline int btreeSplitRoot(
+    sakhadb_btree_t tree,
+    sakhadb_btree_page_t* pLeftPage,
+    sakhadb_btree_page_t* pRightPage
+)
+{
+    SLOG_BTREE_INFO("btreeSplitRoot: split root [%d]", tree->root->no);
+    sakhadb_btree_page_t left_page;
+    sakhadb_btree_page_t right_page;
+    sakhadb_btree_node_t root_node = tree->root->header;
+    int rc = btreeLoadNewNode(tree->ctx, root_node->flags, &left_page);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeSplitRoot: failed to load new node [%d]", rc);
+        goto Lexit;
+    }
+    
+    rc = btreeLoadNewNode(tree->ctx, root_node->flags, &right_page);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeSplitRoot: failed to load new node [%d]", rc);
+        goto Lexit;
+    }
+    
+    int is_leaf = btreeIsLeaf(root_node);
+    sakhadb_btree_node_t left_node = left_page->header;
+    sakhadb_btree_node_t right_node = right_page->header;
+    
+    btreeStatInc(tree->ctx, splits);
+    uint16_t k = btreeSplitPoint(root_node);
+    char sep[SAKHADB_BTREE_MAX_KEY_SIZE];
+    uint16_t nsep;
+    const char* key = btreeGetKey(root_node, k, &nsep);
+    memcpy(sep, key, nsep);
+    Pgno sep_no = btreeGetDataPgno(root_node, k);
+    
+    btreeCopyOnSplit(root_node, right_node, k);
+    if(!is_leaf)
+    {
+        left_node->right_count = *btreeChildCount(root_node, 0);
+        btreeRemoveLastSlot(root_node);
+        left_node->right = sep_no;
+    }
+    else
+    {
+        left_node->right = right_page->no;
+    }
+    btreeCopyOnSplit(root_node, left_node, root_node->nslots);
+    
+    assert(root_node->nslots == 0);
+    assert(root_node->free_off == sizeof(struct BtreePageHeader));
+    
+    right_node->right = root_node->right;
+    right_node->right_count = root_node->right_count;
+    
+    // Root is not leaf anymore, internal OID node has a wider layout.
+    // Buffer of the root stays with it, its messages still belong to the root.
+    Pgno buffer = root_node->buffer;
+    btreeInitNode(root_node, sakhadb_pager_page_size(tree->ctx->pager, tree->root->no == 1),
+                  root_node->flags & ~SAKHADB_BTREE_LEAF);
+    root_node->buffer = buffer;
+    btreeAppendKey(root_node, sep, nsep, left_page->no, btreeNodeCount(left_node));
+    root_node->right = right_page->no;
+    root_node->right_count = btreeNodeCount(right_node);
+    
+    btreeSaveNode(tree->ctx, tree->root);
+    btreeSaveNode(tree->ctx, left_page);
+    btreeSaveNode(tree->ctx, right_page);
+    
+    *pLeftPage = left_page;
+    *pRightPage = right_page;
+    
+Lexit:
+    return rc;
+}
+
+/******************************************************************************/
+
+/***************************** Insert Section *********************************/
+
+static inline void btreeInsertInOidNode(
+    struct BtreeCursorPointer * cursor,
+    const void* key,
+    Pgno no
+)
+{
+    register int idx = cursor->index;
+    sakhadb_btree_node_t node = cursor->page->header;
+    char* keys = btreeOidKeys(node);
+    Pgno* pgnos = btreeOidPgnos(node);
+    
+    // Physical position of the new entry: just below the entry at 'idx'
+    uint16_t pos = (idx == -1) ? node->nslots : btreeOidPos(node, idx);
+    uint16_t ntail = node->nslots - pos;
+    memmove(keys + (pos + 1) * SAKHADB_BTREE_OID_SIZE,
+            keys + pos * SAKHADB_BTREE_OID_SIZE,
+            ntail * SAKHADB_BTREE_OID_SIZE);
+    memmove(pgnos + pos + 1, pgnos + pos, ntail * sizeof(Pgno));
+    memcpy(keys + pos * SAKHADB_BTREE_OID_SIZE, key, SAKHADB_BTREE_OID_SIZE);
+    
+    if(btreeIsLeaf(node))
+    {
+        pgnos[pos] = no;
+    }
+    else
+    {
+        // Counts of the new child and its neighbour are set by the caller
+        uint32_t* counts = btreeOidCounts(node);
+        memmove(counts + pos + 1, counts + pos, ntail * sizeof(uint32_t));
+        if(idx == -1)
+        {
+            pgnos[pos] = node->right;
+            node->right = no;
+        }
+        else
+        {
+            pgnos[pos + 1] = no;
+        }
+    }
+    
+    node->nslots += 1;
+    node->free_off += SAKHADB_BTREE_OID_SIZE;
+    node->free_sz -= btreeOidEntry(node);
+}
+
+static inline void btreeInsertInNode(
+    struct BtreeCursorPointer * cursor,
+    const void* key, uint16_t nkey,
+    Pgno no
+)
+{
+    SLOG_BTREE_INFO("btreeInsertInNode: insert in node [%d][%d][%d]",
+                    cursor->page->no, cursor->index, no);
+    assert(btreeNodeHasRoom(cursor->page->header, nkey));
+    
+    register int idx = cursor->index;
+    sakhadb_btree_node_t node = cursor->page->header;
+    if(btreeIsOid(node))
+    {
+        btreeInsertInOidNode(cursor, key, no);
+        return;
+    }
+    
+    int is_leaf = btreeIsLeaf(node);
+    size_t stride = btreeSlotSize(node);
+    
+    // Slots are addressed as they are before the insert, the new one is 'idx'
+    uint16_t off;
+    register char* ptr;
+    sakhadb_btree_slot_t* new_slot = btreeGetSlot(node, idx);
+    if(idx == -1)
+    {
+        off = node->free_off;
+        ptr = btreeNodeOffset(node, off);
+        if(is_leaf)
+        {
+            new_slot->no = no;
+        }
+        else
+        {
+            new_slot->no = node->right;
+            node->right = no;
+        }
+    }
+    else
+    {
+        off = new_slot->off;
+        ptr = btreeNodeOffset(node, off);
+        memmove(ptr + nkey, ptr, node->free_off - off);
+        memmove(btreeGetSlot(node, -1), btreeGetSlot(node, 0), (idx + 1) * stride);
+        for(int i = -1; i < idx; ++i)
+        {
+            btreeGetSlot(node, i)->off += nkey;
+        }
+        
+        if(is_leaf)
+        {
+            new_slot->no = no;
+        }
+        else
+        {
+            sakhadb_btree_slot_t* old_slot = btreeGetSlot(node, idx - 1);
+            new_slot->no = old_slot->no;
+            old_slot->no = no;
+        }
+    }
+    if(!is_leaf)
+    {
+        *btreeSlotCount(new_slot) = 0;
+    }
+    memcpy(ptr, key, nkey);
+    new_slot->off = off;
+    new_slot->sz = nkey;
+    node->free_off += nkey;
+    node->nslots += 1;
+    node->slots_off -= stride;
+    node->free_sz -= stride + nkey;
+}
+
+static inline int btreeInsertCursor(
+    struct BtreeCursorStack* stack,
+    const void* key, uint16_t nkey,
+    Pgno no
+)
+{
+    int rc = SAKHADB_OK;
+    struct Btree* tree = stack->tree;
+    struct BtreeCursorPointer* cur;
+    struct BtreeSplitResult res[2];
+    int ires = 0;
+    sakhadb_btree_page_t child = 0;     /* Halves of the split child, 0 at leaf level */
+    sakhadb_btree_page_t new_child = 0;
+    
+    // Key is appended to the end of the tree: keep split nodes full and
+    // move only the new key to the new page.
+    cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    int append = (cur->index == -1) && (cur->page->header->right == 0);
+    
+    while (cpl_array_count(&stack->st) > 1)
+    {
+        cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+        
+        register sakhadb_btree_node_t node = cur->page->header;
+        if(!btreeNodeHasRoom(node, nkey) && !btreeDefragmentNode(tree->ctx, cur->page, nkey))
+        {
+            // 'key' may point to the previous split result, so use another one
+            struct BtreeSplitResult* r = &res[ires ^= 1];
+            int is_leaf = btreeIsLeaf(node);
+            sakhadb_btree_page_t page = cur->page;
+            rc = btreeSplitNode(tree, page, append ? 0 : btreeSplitPoint(node), r);
+            
+            if(rc)
+            {
+                SLOG_BTREE_ERROR("btreeInsert: failed to split node [%d][%d]", rc, cur->page->no);
+                goto Ldexit;
+            }
+            
+            register sakhadb_btree_page_t new_page = r->new_page;
+            btreeAdjustCursorOnSplit(cur, is_leaf, new_page->header->nslots, page, new_page);
+            
+            btreeInsertInNode(cur, key, nkey, no);
+            if(child)
+            {
+                btreeSetSplitCounts(cur, child, new_child);
+            }
+            btreeSaveNode(tree->ctx, cur->page);
+            
+            key = r->data;
+            nkey = r->size;
+            no = new_page->no;
+            child = page;
+            new_child = new_page;
+        }
+        else
+        {
+            goto Linsertexit;
+        }
+        cpl_array_pop_back(&stack->st);
+    }
+    
+    SLOG_BTREE_INFO("btreeInsert: inserting in root...");
+    
+    cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+    register sakhadb_btree_node_t node = cur->page->header;
+    if(!btreeNodeHasRoom(node, nkey) && !btreeDefragmentNode(tree->ctx, cur->page, nkey))
+    {
+        int is_leaf = btreeIsLeaf(node);
+        sakhadb_btree_page_t left_page, right_page;
+        rc = btreeSplitRoot(tree, &left_page, &right_page);
+        
+        if(rc)
+        {
+            SLOG_BTREE_ERROR("btreeInsert: failed to split root [%d][%d]", rc, tree->root->no);
+            goto Ldexit;
+        }
+        
+        btreeAdjustCursorOnSplit(cur, is_leaf, right_page->header->nslots, left_page, right_page);
+        btreeInsertInNode(cur, key, nkey, no);
+        if(child)
+        {
+            btreeSetSplitCounts(cur, child, new_child);
+        }
+        btreeSaveNode(tree->ctx, cur->page);
+        
+        struct BtreeCursorPointer root = { tree->root, -1 };
+        btreeSetSplitCounts(&root, left_page, right_page);
+        btreeSaveCount(tree->ctx, tree->root);
+        goto Ldexit;
+    }
+    
+Linsertexit:
+    btreeInsertInNode(cur, key, nkey, no);
+    if(child)
+    {
+        btreeSetSplitCounts(cur, child, new_child);
+    }
+    btreeSaveNode(tree->ctx, cur->page);
+    
+    // Counts change only once the entry is in: nodes below 'cur' were
+    // counted from their contents
+    btreeAdjustCounts(stack, 1);
+    
+Ldexit:
+    return rc;
+}
+
+/**
+ * Inserts the entry under the key. Entry is the key itself, or the key
+ * followed by the inline payload.
+ */
+static inline int btreeInsert(
+    sakhadb_btree_t tree,
+    const void* key, uint16_t nkey,
+    const void* entry, uint16_t nentry,
+    Pgno no
+)
+{
+    SLOG_BTREE_INFO("btreeInsert: insert in tree [%d][%d]", tree->root->no, no);
+    assert(nentry < sakhadb_pager_page_size(tree->ctx->pager, 0) / 5);
+    assert(nkey <= SAKHADB_BTREE_MAX_KEY_SIZE);
+    int rc = SAKHADB_OK;
+    struct BtreeCursorStack stack;
+    stack.tree = tree;
+    stack.flags = 0;
+    rc = cpl_array_init(&stack.st, sizeof(struct BtreeCursorPointer), 16);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeInsert: failed to init cursors stack [%d]", rc);
+        goto Lexit;
+    }
+    
+    int cmp = btreeFind(tree, key, nkey, &stack);
+    if(cmp == 0)
+    {
+        SLOG_BTREE_WARN("btreeInsert: keys duplicated");
+        goto Ldexit;
+    }
+    
+    rc = btreeInsertCursor(&stack, entry, nentry, no);
+    
+Ldexit:
+    cpl_array_deinit(&stack.st);
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Inserts keys sorted in ascending order. The cursor path is kept between
+ * keys, so consecutive keys landing in the same leaf cost a single search in
+ * the leaf. After a split only the levels below the split point are
+ * re-descended.
+ */
+static inline int btreeInsertSorted(
+    sakhadb_btree_t tree,
+    size_t count,
+    const void* const* keys, const size_t* nkeys,
+    const Pgno* nos
+)
+{
+    SLOG_BTREE_INFO("btreeInsertSorted: insert in tree [%d][%d]", tree->root->no, count);
+    int rc = SAKHADB_OK;
+    struct BtreeCursorStack stack;
+    stack.tree = tree;
+    stack.flags = 0;
+    rc = cpl_array_init(&stack.st, sizeof(struct BtreeCursorPointer), 16);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeInsertSorted: failed to init cursors stack [%d]", rc);
+        goto Lexit;
+    }
+    
+    const void* prev = 0;
+    uint16_t nprev = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        const void* key = keys[i];
+        uint16_t nkey = nkeys[i];
+        assert(nkey <= SAKHADB_BTREE_MAX_KEY_SIZE);
+        
+        int cmp;
+        if(cpl_array_count(&stack.st) == 0 || !prev ||
+           btreeCompareKeys(key, nkey, prev, nprev) < 0)
+        {
+            cmp = btreeFind(tree, key, nkey, &stack);
+        }
+        else
+        {
+            cmp = btreeRefind(tree, key, nkey, &stack);
+        }
+        
+        if(cmp == 0)
+        {
+            SLOG_BTREE_WARN("btreeInsertSorted: keys duplicated");
+            continue;
+        }
+        
+        rc = btreeInsertCursor(&stack, key, nkey, nos[i]);
+        if(rc)
+        {
+            break;
+        }
+        
+        // Root split moves the root cursor to one of the new pages
+        struct BtreeCursorPointer* top = (struct BtreeCursorPointer *)cpl_array_back_p(&stack.st);
+        if(cpl_array_count(&stack.st) == 1 && top->page != tree->root)
+        {
+            btreeResetCursor(&stack);
+        }
+        
+        prev = key;
+        nprev = nkey;
+    }
+    
+    cpl_array_deinit(&stack.st);
+    
+Lexit:
+    return rc;
+}
+
+/******************************************************************************/
+
+/************************** Buffered Insert Section ***************************/
+
+/**
+ * Number of levels below the root.
+ */
+static int btreeHeight(sakhadb_btree_t tree, int* pHeight)
+{
+    int rc = SAKHADB_OK;
+    int height = 0;
+    sakhadb_btree_page_t page = tree->root;
+    while(!btreeIsLeaf(page->header))
+    {
+        rc = btreeLoadNode(tree->ctx, page->header->right, &page);
+        if(rc)
+        {
+            return rc;
+        }
+        ++height;
+    }
+    
+    *pHeight = height;
+    return rc;
+}
+
+/**
+ * Inserts sorted messages into the leaves. Of the messages of one key the
+ * oldest one goes first, the rest are duplicates.
+ */
+static int btreeBufferApply(
+    sakhadb_btree_t tree,
+    const struct BtreeBufferedEntry* entries,
+    size_t count
+)
+{
+    int rc = SAKHADB_OK;
+    for(size_t i = 0; i < count && rc == SAKHADB_OK; ++i)
+    {
+        const struct BtreeMessage* msg = entries[i].msg;
+        const char* entry = btreeMessageEntry(msg);
+        rc = btreeInsert(tree, entry, msg->nkey, entry, msg->nentry, msg->no);
+    }
+    return rc;
+}
+
+static int btreeBufferFlush(sakhadb_btree_t tree, sakhadb_btree_page_t page, int level);
+
+/**
+ * Appends sorted messages to the buffers of the nodes at 'level', which
+ * cover their keys. A full buffer is flushed and the path searched again,
+ * as the flush may split nodes.
+ */
+static int btreeBufferRoute(
+    sakhadb_btree_t tree,
+    const struct BtreeBufferedEntry* entries,
+    size_t count,
+    int level                           /* Level of the nodes to take messages, leaves are 0 */
+)
+{
+    struct BtreeCursorStack stack;
+    stack.tree = tree;
+    stack.flags = 0;
+    int rc = cpl_array_init(&stack.st, sizeof(struct BtreeCursorPointer), 16);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeBufferRoute: failed to init cursors stack [%d]", rc);
+        return rc;
+    }
+    
+    size_t i = 0;
+    while(i < count && rc == SAKHADB_OK)
+    {
+        const struct BtreeMessage* msg = entries[i].msg;
+        btreeFind(tree, btreeMessageEntry(msg), msg->nkey, &stack);
+        struct BtreeCursorPointer* target = (struct BtreeCursorPointer *)cpl_array_back_p(&stack.st) - level;
+        
+        // Messages up to the fence of the node go to its buffer
+        for(; i < count; ++i)
+        {
+            msg = entries[i].msg;
+            const char* entry = btreeMessageEntry(msg);
+            if(target->fence && btreeCompareKeys(entry, msg->nkey, target->fence, target->nfence) > 0)
+            {
+                break;
+            }
+            
+            int full;
+            rc = btreeBufferAppend(tree->ctx, target->page, msg->no, msg->nkey, entry, msg->nentry, &full);
+            if(rc == SAKHADB_OK && full)
+            {
+                rc = btreeBufferFlush(tree, target->page, level);
+                break;
+            }
+            if(rc)
+            {
+                break;
+            }
+        }
+    }
+    
+    cpl_array_deinit(&stack.st);
+    return rc;
+}
+
+/**
+ * Empties the buffer of the node: messages go to the buffers of the children,
+ * or to the leaves if the node is at level 1.
+ */
+static int btreeBufferFlush(
+    sakhadb_btree_t tree,
+    sakhadb_btree_page_t page,          /* Internal node with a buffer */
+    int level                           /* Level of the node, leaves are 0 */
+)
+{
+    SLOG_BTREE_INFO("btreeBufferFlush: flush buffer [%d][%d]", page->no, level);
+    btreeStatInc(tree->ctx, flushes);
+    char* block = 0;
+    size_t size = 0;
+    struct BtreeBufferedEntry* entries = 0;
+    size_t count;
+    
+    int rc = btreeBufferTake(tree->ctx, page, &block, &size);
+    if(rc == SAKHADB_OK)
+    {
+        rc = btreeBufferSort(block, size, &entries, &count);
+    }
+    
+    if(rc == SAKHADB_OK)
+    {
+        rc = (level == 1) ? btreeBufferApply(tree, entries, count) :
+                            btreeBufferRoute(tree, entries, count, level - 1);
+    }
+    
+    cpl_allocator_free(cpl_allocator_get_default(), entries);
+    cpl_allocator_free(cpl_allocator_get_default(), block);
+    return rc;
+}
+
+/**
+ * Takes the messages of the buffers in the subtree and frees the buffers.
+ * Children are taken before their parent, as their messages are older.
+ */
+static int btreeBufferCollect(
+    struct BtreeContext* ctx,           /* Context */
+    sakhadb_btree_page_t page,          /* Internal node */
+    char** pBlock,                      /* In/Out: memory block */
+    size_t* pSize                       /* In/Out: size of the block */
+)
+{
+    int rc = SAKHADB_OK;
+    sakhadb_btree_node_t node = page->header;
+    sakhadb_btree_page_t child;
+    rc = btreeLoadNode(ctx, node->right, &child);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    if(!btreeIsLeaf(child->header))
+    {
+        for(int i = -1; i < node->nslots && rc == SAKHADB_OK; ++i)
+        {
+            rc = btreeLoadNode(ctx, (i == -1) ? node->right : btreeGetDataPgno(node, i), &child);
+            if(rc == SAKHADB_OK)
+            {
+                rc = btreeBufferCollect(ctx, child, pBlock, pSize);
+            }
+        }
+    }
+    
+    if(rc == SAKHADB_OK && node->buffer)
+    {
+        rc = btreeBufferTake(ctx, page, pBlock, pSize);
+        if(rc == SAKHADB_OK)
+        {
+            rc = btreeBufferFree(ctx, node);
+            btreeSaveCount(ctx, page);
+        }
+    }
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Moves all buffered entries to the leaves and frees the buffers. Only this
+ * frees the buffer of the root, so a tree without one has nothing buffered.
+ */
+static int btreeBufferFlushAll(sakhadb_btree_t tree)
+{
+    if(!tree->root->header->buffer)
+    {
+        return SAKHADB_OK;
+    }
+    
+    SLOG_BTREE_INFO("btreeBufferFlushAll: flush buffers of tree [%d]", tree->root->no);
+    char* block = 0;
+    size_t size = 0;
+    struct BtreeBufferedEntry* entries = 0;
+    size_t count;
+    
+    int rc = btreeBufferCollect(tree->ctx, tree->root, &block, &size);
+    if(rc == SAKHADB_OK)
+    {
+        rc = btreeBufferSort(block, size, &entries, &count);
+    }
+    
+    if(rc == SAKHADB_OK)
+    {
+        rc = btreeBufferApply(tree, entries, count);
+    }
+    
+    cpl_allocator_free(cpl_allocator_get_default(), entries);
+    cpl_allocator_free(cpl_allocator_get_default(), block);
+    return rc;
+}
+
+/**
+ * Inserts the entry into the buffer of the root. A tree of a single leaf
+ * takes it right away.
+ */
+static int btreeBufferInsert(
+    sakhadb_btree_t tree,
+    const void* key, uint16_t nkey,
+    const void* entry, uint16_t nentry,
+    Pgno no
+)
+{
+    sakhadb_btree_page_t root = tree->root;
+    if(btreeIsLeaf(root->header))
+    {
+        return btreeInsert(tree, key, nkey, entry, nentry, no);
+    }
+    
+    int full;
+    int rc = btreeBufferAppend(tree->ctx, root, no, nkey, entry, nentry, &full);
+    if(rc == SAKHADB_OK && full)
+    {
+        int height;
+        rc = btreeHeight(tree, &height);
+        if(rc == SAKHADB_OK)
+        {
+            rc = btreeBufferFlush(tree, root, height);
+        }
+        if(rc == SAKHADB_OK)
+        {
+            rc = btreeBufferAppend(tree->ctx, root, no, nkey, entry, nentry, &full);
+            assert(!full);
+        }
+    }
+    return rc;
+}
+
+/******************************************************************************/
+
+/***************************** Delete Section *********************************/
+
+static inline uint16_t btreeEntrySize(sakhadb_btree_node_t node, uint16_t nkey)
+{
+    return btreeIsOid(node) ? btreeOidEntry(node) : nkey + btreeSlotSize(node);
+}
+
+/**
+ * Number of bytes available for entries in the node.
+ */
+static inline uint16_t btreeNodeCapacity(struct BtreeContext* ctx, sakhadb_btree_page_t page)
+{
+    sakhadb_btree_node_t node = page->header;
+    if(btreeIsOid(node))
+    {
+        return btreeOidCapacity(node) * btreeOidEntry(node);
+    }
+    return sakhadb_pager_page_size(ctx->pager, page->no == 1) - sizeof(struct BtreePageHeader);
+}
+
+/**
+ * Number of bytes taken by entries of the node. Unlike the capacity less
+ * 'free_sz', holes left by removed keys are not counted.
+ */
+static inline uint16_t btreeNodeUsed(sakhadb_btree_node_t node)
+{
+    if(btreeIsOid(node))
+    {
+        return node->nslots * btreeOidEntry(node);
+    }
+    
+    uint16_t used = node->nslots * btreeSlotSize(node);
+    for(uint16_t i = 0; i < node->nslots; ++i)
+    {
+        used += btreeGetSlot(node, i)->sz;
+    }
+    return used;
+}
+
+static inline void btreeSetDataPgno(sakhadb_btree_node_t node, int islot, Pgno no)
+{
+    if(btreeIsOid(node))
+    {
+        btreeOidPgnos(node)[btreeOidPos(node, islot)] = no;
+        return;
+    }
+    
+    btreeGetSlot(node, islot)->no = no;
+}
+
+/**
+ * Removes the entry from the node. Bytes of the key stay as a hole, unless the
+ * key is on top of the key area; btreeDefragmentNode() reclaims holes once the
+ * node runs out of room.
+ */
+static inline void btreeRemoveSlot(
+    sakhadb_btree_node_t __restrict node,
+    int islot
+)
+{
+    assert(islot >= 0 && islot < node->nslots);
+    
+    if(btreeIsOid(node))
+    {
+        char* keys = btreeOidKeys(node);
+        Pgno* pgnos = btreeOidPgnos(node);
+        uint16_t pos = btreeOidPos(node, islot);
+        uint16_t ntail = node->nslots - pos - 1;
+        memmove(keys + pos * SAKHADB_BTREE_OID_SIZE,
+                keys + (pos + 1) * SAKHADB_BTREE_OID_SIZE,
+                ntail * SAKHADB_BTREE_OID_SIZE);
+        memmove(pgnos + pos, pgnos + pos + 1, ntail * sizeof(Pgno));
+        if(!btreeIsLeaf(node))
+        {
+            uint32_t* counts = btreeOidCounts(node);
+            memmove(counts + pos, counts + pos + 1, ntail * sizeof(uint32_t));
+        }
+        node->nslots -= 1;
+        node->free_off -= SAKHADB_BTREE_OID_SIZE;
+        node->free_sz += btreeOidEntry(node);
+        return;
+    }
+    
+    uint16_t off = btreeGetSlot(node, islot)->off;
+    uint16_t sz = btreeGetSlot(node, islot)->sz;
+    memmove(btreeGetSlot(node, 1), btreeGetSlot(node, 0), islot * btreeSlotSize(node));
+    
+    node->nslots -= 1;
+    node->slots_off += btreeSlotSize(node);
+    if(off + sz == node->free_off)
+    {
+        node->free_off = off;
+    }
+    node->free_sz = node->slots_off - node->free_off;
+}
+
+/**
+ * Replaces the key of the entry. Caller checks that the node has room for it.
+ */
+static inline void btreeReplaceKey(
+    sakhadb_btree_node_t __restrict node,
+    int islot,
+    const void* key, uint16_t nkey
+)
+{
+    if(btreeIsOid(node))
+    {
+        memcpy(btreeOidKeys(node) + btreeOidPos(node, islot) * SAKHADB_BTREE_OID_SIZE, key, SAKHADB_BTREE_OID_SIZE);
+        return;
+    }
+    
+    sakhadb_btree_slot_t* slot = btreeGetSlot(node, islot);
+    uint16_t off = slot->off;
+    int delta = (int)nkey - (int)slot->sz;
+    assert(delta <= (int)node->free_sz);
+    
+    uint16_t tail = off + slot->sz;
+    memmove(btreeNodeOffset(node, tail + delta), btreeNodeOffset(node, tail), node->free_off - tail);
+    for(int i = 0; i < islot; ++i)
+    {
+        btreeGetSlot(node, i)->off += delta;
+    }
+    memcpy(btreeNodeOffset(node, off), key, nkey);
+    
+    slot->sz = nkey;
+    node->free_off += delta;
+    node->free_sz -= delta;
+}
+
+/**
+ * Entries of two sibling nodes and (for internal nodes) their separator
+ * taken in ascending order.
+ */
+struct BtreeMergeSource
+{
+    sakhadb_btree_node_t    left;       /* Copy of the lesser node */
+    sakhadb_btree_node_t    right;      /* Copy of the greater node, 0 if none */
+    const char*             sep;        /* Separator, 0 for leaves */
+    uint16_t                nsep;       /* Size of the separator */
+    uint16_t                count;      /* Total number of entries */
+};
+
+static inline const char* btreeMergedEntry(
+    struct BtreeMergeSource* src,
+    uint16_t i,                         /* Position in ascending order */
+    uint16_t* pSize,                    /* Out: size of the entry */
+    Pgno* pNo                           /* Out: page number of the entry */
+)
+{
+    sakhadb_btree_node_t node = src->left;
+    if(i >= node->nslots)
+    {
+        i -= node->nslots;
+        if(src->sep)
+        {
+            if(i == 0)
+            {
+                // Separator takes the right-most child of the lesser node
+                *pSize = src->nsep;
+                *pNo = node->right;
+                return src->sep;
+            }
+            i -= 1;
+        }
+        node = src->right;
+    }
+    
+    int islot = node->nslots - 1 - i;
+    *pNo = btreeGetDataPgno(node, islot);
+    return btreeGetEntry(node, islot, pSize);
+}
+
+/**
+ * Entries in the subtree of the merged entry, 0 for leaves.
+ */
+static inline uint32_t btreeMergedCount(struct BtreeMergeSource* src, uint16_t i)
+{
+    sakhadb_btree_node_t node = src->left;
+    if(btreeIsLeaf(node))
+    {
+        return 0;
+    }
+    
+    if(i >= node->nslots)
+    {
+        i -= node->nslots;
+        if(i == 0)
+        {
+            return node->right_count;
         }
+        i -= 1;
+        node = src->right;
+    }
+    
+    return *btreeChildCount(node, node->nslots - 1 - i);
+}
+
+static inline void btreeFillNode(
+    sakhadb_btree_node_t __restrict node,
+    struct BtreeMergeSource* src,
+    uint16_t from, uint16_t to          /* Range of entries to append */
+)
+{
+    for(uint16_t i = from; i < to; ++i)
+    {
+        uint16_t sz;
+        Pgno no;
+        const char* key = btreeMergedEntry(src, i, &sz, &no);
+        btreeAppendKey(node, key, sz, no, btreeMergedCount(src, i));
+    }
+}
+
+/**
+ * Merges the underfull node with its sibling, or moves entries from the
+ * sibling if they do not fit into one node. Nothing is done if the parent has
+ * no room for the new separator: the node stays underfull but valid.
+ */
+static int btreeRebalance(
+    sakhadb_btree_t tree,
+    struct BtreeCursorPointer* parent,  /* Parent pointing to the underfull node */
+    sakhadb_btree_page_t page,          /* Underfull node */
+    int* pMerged                        /* Out: 1 if the parent lost an entry */
+)
+{
+    int rc = SAKHADB_OK;
+    struct BtreeContext* ctx = tree->ctx;
+    sakhadb_btree_node_t pnode = parent->page->header;
+    *pMerged = 0;
+    
+    if(pnode->nslots == 0)
+    {
+        // No siblings
+        goto Lexit;
+    }
+    
+    // Pair the node with its greater sibling, the right-most child with the lesser one.
+    // Left node is always kept, so the leaf chain stays intact.
+    int l = (parent->index == -1) ? 0 : parent->index;
+    sakhadb_btree_page_t left = page;
+    sakhadb_btree_page_t right = page;
+    if(parent->index == -1)
+    {
+        rc = btreeLoadNode(ctx, btreeGetDataPgno(pnode, 0), &left);
+    }
+    else
+    {
+        rc = btreeLoadNode(ctx, (l == 0) ? pnode->right : btreeGetDataPgno(pnode, l - 1), &right);
+    }
+    
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeRebalance: failed to load sibling [%d]", rc);
+        goto Lexit;
+    }
+    
+    assert(left->no != 1 && right->no != 1);
+    size_t page_size = sakhadb_pager_page_size(ctx->pager, 0);
+    char* buffer = cpl_allocator_allocate(cpl_allocator_get_default(), 2 * page_size);
+    if(!buffer)
+    {
+        SLOG_BTREE_FATAL("btreeRebalance: failed to allocate memory for nodes");
+        rc = SAKHADB_NOMEM;
+        goto Lexit;
+    }
+    
+    memcpy(buffer, left->header, page_size);
+    memcpy(buffer + page_size, right->header, page_size);
+    
+    char sep[SAKHADB_BTREE_MAX_KEY_SIZE];
+    uint16_t nsep;
+    const char* key = btreeGetKey(pnode, l, &nsep);
+    memcpy(sep, key, nsep);
+    
+    struct BtreeMergeSource src;
+    src.left = (sakhadb_btree_node_t)buffer;
+    src.right = (sakhadb_btree_node_t)(buffer + page_size);
+    src.sep = btreeIsLeaf(src.left) ? 0 : sep;
+    src.nsep = nsep;
+    src.count = src.left->nslots + src.right->nslots + (src.sep ? 1 : 0);
+    
+    size_t total = 0;
+    for(uint16_t i = 0; i < src.count; ++i)
+    {
+        uint16_t sz;
+        Pgno no;
+        btreeMergedEntry(&src, i, &sz, &no);
+        total += btreeEntrySize(src.left, sz);
+    }
+    
+    uint16_t capacity = btreeNodeCapacity(ctx, left);
+    char flags = src.left->flags;
+    if(total <= capacity - capacity / SAKHADB_BTREE_UNDERFLOW)
+    {
+        SLOG_BTREE_INFO("btreeRebalance: merge nodes [%d][%d]", left->no, right->no);
+        btreeInitNode(left->header, page_size, flags);
+        btreeFillNode(left->header, &src, 0, src.count);
+        left->header->right = src.right->right;
+        left->header->right_count = src.right->right_count;
         
-        if(i == 0)
+        // Entry which pointed to the right node now points to the merged one
+        if(l == 0)
         {
-            cpl_region_append_data(region, "+-- ", 4);
+            pnode->right = left->no;
         }
         else
         {
-            cpl_region_append_data(region, "|-- ", 4);
+            btreeSetDataPgno(pnode, l - 1, left->no);
         }
-        cpl_region_append_data(region, btreeNodeOffset(node, slots[i].off), slots[i].sz);
-        sprintf(buffer, templ, slots[i].no);
-        cpl_region_append_data(region, buffer, strlen(buffer));
+        *btreeChildCount(pnode, l - 1) = btreeNodeCount(left->header);
+        btreeRemoveSlot(pnode, l);
+        
+        btreeFreeNode(ctx, right);
+        btreeSaveNode(ctx, left);
+        btreeSaveNode(ctx, parent->page);
+        *pMerged = 1;
+        goto Lfree;
     }
     
-    if(!node->flags)
+    // Split entries by size, 'k' entries go to the left node
+    uint16_t k = 0;
+    size_t used = 0;
+    while(k < src.count)
     {
-        sakhadb_btree_page_t new_page;
-        rc = btreeLoadNode(ctx, node->right, &new_page);
+        uint16_t sz;
+        Pgno no;
+        btreeMergedEntry(&src, k, &sz, &no);
+        uint16_t esz = btreeEntrySize(src.left, sz);
+        if(k > 0 && used + esz > total / 2)
+        {
+            break;
+        }
+        used += esz;
+        ++k;
+    }
+    
+    // Leaf separator is the greatest key of the left node, internal one moves up
+    uint16_t isep = src.sep ? k : k - 1;
+    if(k == src.count || (src.sep && k + 1 == src.count))
+    {
+        goto Lfree;
+    }
+    
+    uint16_t nnew;
+    Pgno sep_no;
+    const char* new_sep = btreeMergedEntry(&src, isep, &nnew, &sep_no);
+    if(btreeIsInline(src.left))
+    {
+        // Payload stays in the leaf
+        nnew = SAKHADB_BTREE_OID_SIZE;
+    }
+    if(total - used > capacity ||
+       (!btreeIsOid(pnode) && nnew > nsep && pnode->free_sz < nnew - nsep))
+    {
+        SLOG_BTREE_WARN("btreeRebalance: no room for separator [%d]", parent->page->no);
+        goto Lfree;
+    }
+    
+    SLOG_BTREE_INFO("btreeRebalance: redistribute nodes [%d][%d][%d]", left->no, right->no, k);
+    btreeInitNode(left->header, page_size, flags);
+    btreeFillNode(left->header, &src, 0, k);
+    left->header->right = src.sep ? sep_no : right->no;
+    left->header->right_count = btreeMergedCount(&src, isep);
+    
+    btreeInitNode(right->header, page_size, flags);
+    btreeFillNode(right->header, &src, isep + 1, src.count);
+    right->header->right = src.right->right;
+    right->header->right_count = src.right->right_count;
+    
+    btreeReplaceKey(pnode, l, new_sep, nnew);
+    *btreeChildCount(pnode, l) = btreeNodeCount(left->header);
+    *btreeChildCount(pnode, l - 1) = btreeNodeCount(right->header);
+    
+    btreeSaveNode(ctx, left);
+    btreeSaveNode(ctx, right);
+    btreeSaveNode(ctx, parent->page);
+    
+Lfree:
+    cpl_allocator_free(cpl_allocator_get_default(), buffer);
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Root page can't be changed, so the only child of the root is copied into
+ * it. Page 1 is smaller than the others, the child may not fit there.
+ */
+static int btreeCollapseRoot(sakhadb_btree_t tree)
+{
+    int rc = SAKHADB_OK;
+    struct BtreeContext* ctx = tree->ctx;
+    sakhadb_btree_node_t root = tree->root->header;
+    while(!btreeIsLeaf(root) && root->nslots == 0)
+    {
+        sakhadb_btree_page_t child;
+        rc = btreeLoadNode(ctx, root->right, &child);
         if(rc)
         {
-            goto Lexit;
+            SLOG_BTREE_ERROR("btreeCollapseRoot: failed to load child [%d]", rc);
+            break;
         }
         
-        cpl_region_append_data(prefix, "     ", 5);
-        btreeDumpPage(new_page, ctx, prefix, region);
-        prefix->offset -= 5;
+        uint16_t capacity = btreeNodeCapacity(ctx, tree->root);
+        if(btreeNodeUsed(child->header) > capacity)
+        {
+            break;
+        }
+        
+        size_t page_size = sakhadb_pager_page_size(ctx->pager, 0);
+        char* buffer = cpl_allocator_allocate(cpl_allocator_get_default(), page_size);
+        if(!buffer)
+        {
+            SLOG_BTREE_FATAL("btreeCollapseRoot: failed to allocate memory for node");
+            rc = SAKHADB_NOMEM;
+            break;
+        }
+        memcpy(buffer, child->header, page_size);
+        
+        struct BtreeMergeSource src;
+        src.left = (sakhadb_btree_node_t)buffer;
+        src.right = 0;
+        src.sep = 0;
+        src.count = src.left->nslots;
+        
+        SLOG_BTREE_INFO("btreeCollapseRoot: collapse root [%d][%d]", tree->root->no, child->no);
+        btreeInitNode(root, sakhadb_pager_page_size(ctx->pager, tree->root->no == 1), src.left->flags);
+        btreeFillNode(root, &src, 0, src.count);
+        root->right = src.left->right;
+        root->right_count = src.left->right_count;
+        
+        btreeFreeNode(ctx, child);
+        btreeSaveNode(ctx, tree->root);
+        cpl_allocator_free(cpl_allocator_get_default(), buffer);
     }
     
-Lexit:
     return rc;
 }
 
-static inline int btreeDump(
-    sakhadb_btree_t tree,   /* A tree to dump */
-    cpl_region_ref region   /* Output: dumped data */
-)
+/**
+ * Deletes the entry under the cursor. Nodes are rebalanced lazily: only when
+ * they become underfull, so insert/delete churn around a node boundary does
+ * not cause merges and splits.
+ */
+static inline int btreeDeleteCursor(struct BtreeCursorStack* stack)
 {
     int rc = SAKHADB_OK;
-    region->offset = 0;
-    char root[] = "root (%d)\n";
-    char buffer[64];
-    cpl_region_t prefix;
-    cpl_region_init(cpl_allocator_get_default(), &prefix, 64);
+    struct Btree* tree = stack->tree;
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
     
-    sprintf(buffer, root, tree->root->no);
-    cpl_region_append_data(region, buffer, strlen(buffer));
-    rc = btreeDumpPage(tree->root, tree->ctx, &prefix, region);
+    btreeAdjustCounts(stack, -1);
+    btreeRemoveSlot(cur->page->header, cur->index);
+    btreeSaveNode(tree->ctx, cur->page);
     
-    cpl_region_deinit(&prefix);
+    while(cpl_array_count(&stack->st) > 1)
+    {
+        cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+        sakhadb_btree_page_t page = cur->page;
+        uint16_t capacity = btreeNodeCapacity(tree->ctx, page);
+        if(btreeNodeUsed(page->header) >= capacity / SAKHADB_BTREE_UNDERFLOW)
+        {
+            break;
+        }
+        
+        cpl_array_pop_back(&stack->st);
+        cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
+        
+        int merged;
+        rc = btreeRebalance(tree, cur, page, &merged);
+        if(rc || !merged)
+        {
+            break;
+        }
+    }
     
-    cpl_region_append_data(region, "\0", 1);
+    if(rc == SAKHADB_OK)
+    {
+        rc = btreeCollapseRoot(tree);
+    }
     
+    btreeResetCursor(stack);
     return rc;
 }
 
-/****************************** Split Section *********************************/
-static inline void btreeRemoveLastSlot(
-    sakhadb_btree_node_t __restrict node
+static inline int btreeDelete(
+    sakhadb_btree_t tree,
+    const void* key, uint16_t nkey,
+    Pgno* pNo
 )
 {
-    assert(node->nslots > 0);
- 
-    register sakhadb_btree_slot_t* slot = btreeGetSlots(node);
-    node->nslots -= 1;
-    node->slots_off += sizeof(sakhadb_btree_slot_t);
-    node->free_off = slot->off;
-    node->free_sz += slot->sz + sizeof(sakhadb_btree_slot_t);
+    SLOG_BTREE_INFO("btreeDelete: delete from tree [%d]", tree->root->no);
+    int rc = SAKHADB_OK;
+    struct BtreeCursorStack stack;
+    stack.tree = tree;
+    stack.flags = 0;
+    rc = cpl_array_init(&stack.st, sizeof(struct BtreeCursorPointer), 16);
+    if(rc)
+    {
+        SLOG_BTREE_ERROR("btreeDelete: failed to init cursors stack [%d]", rc);
+        goto Lexit;
+    }
+    
+    int cmp = btreeFind(tree, key, nkey, &stack);
+    if(cmp != 0)
+    {
+        rc = SAKHADB_NOTFOUND;
+        goto Ldexit;
+    }
+    
+    struct BtreeCursorPointer* cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack.st);
+    if(pNo)
+    {
+        *pNo = btreeGetDataPgno(cur->page->header, cur->index);
+    }
+    
+    rc = btreeDeleteCursor(&stack);
+    
+Ldexit:
+    cpl_array_deinit(&stack.st);
+    
+Lexit:
+    return rc;
 }
 
-static inline void btreeTruncateSlots(
-    sakhadb_btree_node_t __restrict node,
-    size_t k
-)
+/******************************************************************************/
+
+/*************************** Concurrent Section *******************************/
+
+#if SAKHADB_THREADSAFE
+
+/**
+ * Optimistic version latches. The latch is write-locked while its bit is set,
+ * every release bumps the version. Readers never write the latch: they copy
+ * the node and check that the version did not change meanwhile.
+ *
+ * High bits of the latch count pins. Pinned node keeps its layout, only
+ * counts of its children change, so it can't be write-locked, but readers
+ * ignore pins.
+ */
+#define SAKHADB_BTREE_LATCH_LOCKED 0x2
+#define SAKHADB_BTREE_LATCH_PIN (1ull << 48)
+#define SAKHADB_BTREE_LATCH_PINS (~0ull << 48)
+
+#define btreeLatch(page) sakhadb_pager_page_latch((sakhadb_page_t)(page))
+
+static inline uint64_t btreeLatchRead(sakhadb_btree_page_t page, int* pRestart)
 {
-    assert(node->nslots >= k);
+    uint64_t v = __atomic_load_n(btreeLatch(page), __ATOMIC_ACQUIRE) & ~SAKHADB_BTREE_LATCH_PINS;
+    if(v & SAKHADB_BTREE_LATCH_LOCKED)
+    {
+        sakhadb_yield();
+        *pRestart = 1;
+    }
+    return v;
+}
 
-    register sakhadb_btree_slot_t* slot = btreeGetSlots(node) + k - 1;
-    node->nslots -= k;
-    node->slots_off += k * sizeof(sakhadb_btree_slot_t);
-    node->free_off = slot->off;
-    node->free_sz = node->slots_off - node->free_off;
+static inline void btreeLatchCheck(sakhadb_btree_page_t page, uint64_t v, int* pRestart)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if((__atomic_load_n(btreeLatch(page), __ATOMIC_RELAXED) & ~SAKHADB_BTREE_LATCH_PINS) != v)
+    {
+        *pRestart = 1;
+    }
 }
 
-static inline sakhadb_btree_slot_t* btreeAppendSlot(
-    sakhadb_btree_node_t __restrict node,
-    sakhadb_btree_slot_t* __restrict slot
+static inline void btreeLatchUpgrade(sakhadb_btree_page_t page, uint64_t v, int* pRestart)
+{
+    if(!__atomic_compare_exchange_n(btreeLatch(page), &v, v + SAKHADB_BTREE_LATCH_LOCKED, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        if(v & SAKHADB_BTREE_LATCH_PINS)
+        {
+            // Let the inserts below the node finish
+            sakhadb_yield();
+        }
+        *pRestart = 1;
+    }
+}
+
+static inline void btreeLatchRelease(sakhadb_btree_page_t page)
+{
+    __atomic_fetch_add(btreeLatch(page), SAKHADB_BTREE_LATCH_LOCKED, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pins the node if it is still at version 'v'. Any number of inserts may pin
+ * the node at once.
+ */
+static inline void btreeLatchPin(sakhadb_btree_page_t page, uint64_t v, int* pRestart)
+{
+    uint64_t old = __atomic_fetch_add(btreeLatch(page), SAKHADB_BTREE_LATCH_PIN, __ATOMIC_ACQUIRE);
+    if((old & ~SAKHADB_BTREE_LATCH_PINS) != v)
+    {
+        __atomic_fetch_sub(btreeLatch(page), SAKHADB_BTREE_LATCH_PIN, __ATOMIC_RELAXED);
+        *pRestart = 1;
+    }
+}
+
+static inline void btreeLatchUnpin(sakhadb_btree_page_t page)
+{
+    __atomic_fetch_sub(btreeLatch(page), SAKHADB_BTREE_LATCH_PIN, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies the node, so it is searched without being torn by writers.
+ * The copy may be used only after btreeLatchCheck() passed.
+ */
+static inline sakhadb_btree_node_t btreeSnapshot(
+    struct BtreeContext* ctx,
+    sakhadb_btree_page_t page,
+    uint64_t* buffer
 )
 {
-    register sakhadb_btree_slot_t* new_slot = btreeGetSlots(node) - 1;
-    *new_slot = *slot;
-    new_slot->off = node->free_off;
-    memmove(btreeNodeOffset(node, new_slot->off),
-            btreeNodeOffset(node, slot->off),
-            slot->sz);
+    memcpy(buffer, page->header, sakhadb_pager_page_size(ctx->pager, page->no == 1));
+    return (sakhadb_btree_node_t)buffer;
+}
+
+/**
+ * Splits the node under write latches of the node and its parent. The parent
+ * always has room for the separator, since inner nodes which may not take one
+ * are split on the way down. Sets 'pRestart' if latches can't be upgraded.
+ */
+static int btreeOptimisticSplit(
+    sakhadb_btree_t tree,
+    sakhadb_btree_page_t parent, uint64_t pv,   /* Parent and its version, 0 for root */
+    sakhadb_btree_page_t page, uint64_t v,      /* Node to split and its version */
+    uint16_t nkey,                              /* Size of the key the node must take */
+    int* pRestart
+)
+{
+    int rc = SAKHADB_OK;
+    if(parent)
+    {
+        btreeLatchUpgrade(parent, pv, pRestart);
+        if(*pRestart)
+        {
+            return rc;
+        }
+    }
     
-    node->nslots += 1;
-    node->free_off += slot->sz;
-    node->slots_off -= sizeof(sakhadb_btree_slot_t);
-    node->free_sz -= new_slot->sz + sizeof(sakhadb_btree_slot_t);
+    btreeLatchUpgrade(page, v, pRestart);
+    if(*pRestart)
+    {
+        goto Lparent;
+    }
     
-#ifdef DEBUG
-    memset(btreeNodeOffset(node, node->free_off), 0xCC, node->free_sz);
-#endif
+    if(btreeDefragmentNode(tree->ctx, page, nkey))
+    {
+        // Nothing to split
+    }
+    else if(!parent)
+    {
+        sakhadb_btree_page_t left_page, right_page;
+        rc = btreeSplitRoot(tree, &left_page, &right_page);
+    }
+    else
+    {
+        // Counts in the node are stable: inserts pin the whole path
+        struct BtreeSplitResult res;
+        rc = btreeSplitNode(tree, page, btreeSplitPoint(page->header), &res);
+        if(rc == SAKHADB_OK)
+        {
+            struct BtreeCursorPointer cursor = { parent, -1 };
+            btreeFindKey(parent->header, res.data, res.size, &cursor.index);
+            btreeInsertInNode(&cursor, res.data, res.size, res.new_page->no);
+            btreeSetSplitCounts(&cursor, page, res.new_page);
+            btreeSaveNode(tree->ctx, parent);
+        }
+    }
+    
+    btreeLatchRelease(page);
+    
+Lparent:
+    if(parent)
+    {
+        btreeLatchRelease(parent);
+    }
+    return rc;
+}
+
+/**
+ * Optimistic lock coupling. Child latch is read before the parent version is
+ * validated, so a concurrent split of the parent is noticed and the descent
+ * restarts from the root. Only the leaf is write-latched. Ancestors are
+ * pinned, so inserts into different leaves run side by side and bump counts
+ * of the path atomically, while splits of the path wait for them.
+ */
+static int btreeOptimisticInsert(
+    sakhadb_btree_t tree,
+    const void* key, uint16_t nkey,
+    const void* entry, uint16_t nentry,
+    Pgno no
+)
+{
+    int rc = SAKHADB_OK;
+    struct BtreeContext* ctx = tree->ctx;
+    size_t page_size = sakhadb_pager_page_size(ctx->pager, 0);
+    uint64_t buffer[(page_size + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+    sakhadb_btree_page_t path[SAKHADB_BTREE_MAX_HEIGHT];
+    uint64_t versions[SAKHADB_BTREE_MAX_HEIGHT];
+    int indexes[SAKHADB_BTREE_MAX_HEIGHT];
+    int restart;
+    
+Lrestart:
+    restart = 0;
+    int depth = 0;
+    sakhadb_btree_page_t parent = 0;
+    uint64_t pv = 0;
+    sakhadb_btree_page_t page = tree->root;
+    uint64_t v = btreeLatchRead(page, &restart);
+    if(restart)
+    {
+        goto Lrestart;
+    }
     
-    return new_slot;
+    while(1)
+    {
+        sakhadb_btree_node_t node = btreeSnapshot(ctx, page, buffer);
+        btreeLatchCheck(page, v, &restart);
+        if(restart)
+        {
+            goto Lrestart;
+        }
+        
+        int is_leaf = btreeIsLeaf(node);
+        uint16_t nroom = is_leaf ? nentry : SAKHADB_BTREE_MAX_KEY_SIZE;
+        if(!btreeNodeHasRoom(node, nroom))
+        {
+            rc = btreeOptimisticSplit(tree, parent, pv, page, v, nroom, &restart);
+            if(rc)
+            {
+                SLOG_BTREE_ERROR("btreeOptimisticInsert: failed to split node [%d][%d]", rc, page->no);
+                return rc;
+            }
+            goto Lrestart;
+        }
+        
+        if(is_leaf)
+        {
+            int npinned = 0;
+            while(npinned < depth && !restart)
+            {
+                btreeLatchPin(path[npinned], versions[npinned], &restart);
+                npinned += !restart;
+            }
+            
+            if(!restart)
+            {
+                btreeLatchUpgrade(page, v, &restart);
+            }
+            
+            if(restart)
+            {
+                while(npinned > 0)
+                {
+                    btreeLatchUnpin(path[--npinned]);
+                }
+                goto Lrestart;
+            }
+            
+            struct BtreeCursorPointer cursor = { page, -1 };
+            if(btreeFindKey(page->header, key, nkey, &cursor.index) != 0)
+            {
+                btreeInsertInNode(&cursor, entry, nentry, no);
+                btreeSaveNode(ctx, page);
+                for(int i = 0; i < depth; ++i)
+                {
+                    __atomic_fetch_add(btreeChildCount(path[i]->header, indexes[i]), 1, __ATOMIC_RELAXED);
+                    btreeSaveCount(ctx, path[i]);
+                }
+            }
+            else
+            {
+                SLOG_BTREE_WARN("btreeOptimisticInsert: keys duplicated");
+            }
+            
+            btreeLatchRelease(page);
+            while(depth > 0)
+            {
+                btreeLatchUnpin(path[--depth]);
+            }
+            return rc;
+        }
+        
+        int idx;
+        btreeFindKey(node, key, nkey, &idx);
+        sakhadb_btree_page_t child;
+        rc = btreeLoadNode(ctx, (idx == -1) ? node->right : btreeGetDataPgno(node, idx), &child);
+        if(rc)
+        {
+            return rc;
+        }
+        
+        uint64_t cv = btreeLatchRead(child, &restart);
+        btreeLatchCheck(page, v, &restart);
+        if(restart)
+        {
+            goto Lrestart;
+        }
+        
+        assert(depth < SAKHADB_BTREE_MAX_HEIGHT);
+        path[depth] = page;
+        indexes[depth] = idx;
+        versions[depth++] = v;
+        parent = page;
+        pv = v;
+        page = child;
+        v = cv;
+    }
 }
 
-static inline void btreeCopyOnSplit(
-    sakhadb_btree_node_t __restrict node,
-    sakhadb_btree_node_t __restrict new_node,
-    uint16_t k
+#endif // SAKHADB_THREADSAFE
+
+/**
+ * Point lookup without cursor. With SAKHADB_THREADSAFE nodes are searched in
+ * validated copies, so lookups run concurrently with inserts. Entries waiting
+ * in the insert buffers on the path are found too.
+ */
+static int btreeLookup(
+    sakhadb_btree_t tree,
+    const void* key, uint16_t nkey,
+    Pgno* pNo
 )
 {
-    sakhadb_btree_slot_t* slots = btreeGetSlots(node);
-    sakhadb_btree_slot_t* new_slots = btreeGetSlots(new_node) - k;
+    int rc = SAKHADB_OK;
+    struct BtreeContext* ctx = tree->ctx;
+#if SAKHADB_THREADSAFE
+    size_t page_size = sakhadb_pager_page_size(ctx->pager, 0);
+    uint64_t buffer[(page_size + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+    int restart;
     
-    register uint16_t start_off = slots[k-1].off;
-    register uint16_t len = slots[0].off + slots[0].sz - start_off;
-    memcpy(new_slots, slots, k * sizeof(sakhadb_btree_slot_t));
-    memcpy(btreeNodeOffset(new_node, new_node->free_off), btreeNodeOffset(node, start_off), len);
-    start_off -= sizeof(struct BtreePageHeader);
-    for (uint16_t i = 0; i < k; ++i)
+Lrestart:
+    restart = 0;
+    sakhadb_btree_page_t page = tree->root;
+    uint64_t v = btreeLatchRead(page, &restart);
+    if(restart)
     {
-        new_slots[i].off -= start_off;
+        goto Lrestart;
+    }
+#else // SAKHADB_THREADSAFE
+    sakhadb_btree_page_t page = tree->root;
+    int depth = 0;
+#endif // SAKHADB_THREADSAFE
+    const struct BtreeMessage* buffered = 0;
+    
+    while(1)
+    {
+#if SAKHADB_THREADSAFE
+        sakhadb_btree_node_t node = btreeSnapshot(ctx, page, buffer);
+        btreeLatchCheck(page, v, &restart);
+        if(restart)
+        {
+            goto Lrestart;
+        }
+        int idx;
+        int cmp = btreeFindKey(node, key, nkey, &idx);
+#else // SAKHADB_THREADSAFE
+        sakhadb_btree_node_t node = page->header;
+        int idx;
+        int cmp = btreeCacheFindKey(ctx, page, depth++, key, nkey, &idx);
+#endif // SAKHADB_THREADSAFE
+        
+        if(btreeIsLeaf(node))
+        {
+            if(cmp != 0)
+            {
+                if(buffered)
+                {
+                    *pNo = buffered->no;
+                    return SAKHADB_OK;
+                }
+                return SAKHADB_NOTFOUND;
+            }
+            
+            *pNo = btreeGetDataPgno(node, idx);
+            return SAKHADB_OK;
+        }
+        
+        if(node->buffer)
+        {
+            // Deeper messages of the key are older, the oldest one is kept
+            const struct BtreeMessage* msg = btreeBufferFind(ctx, node, key, nkey);
+            buffered = msg ? msg : buffered;
+        }
+        
+        sakhadb_btree_page_t child;
+        rc = btreeCacheLoadNode(ctx, (idx == -1) ? node->right : btreeGetDataPgno(node, idx), &child);
+        if(rc)
+        {
+            return rc;
+        }
+        
+#if SAKHADB_THREADSAFE
+        uint64_t cv = btreeLatchRead(child, &restart);
+        btreeLatchCheck(page, v, &restart);
+        if(restart)
+        {
+            goto Lrestart;
+        }
+        v = cv;
+#endif // SAKHADB_THREADSAFE
+        page = child;
     }
-    new_node->free_off += len;
-    new_node->slots_off -= k * sizeof(sakhadb_btree_slot_t);
-    new_node->free_sz -= len + k * sizeof(sakhadb_btree_slot_t);
-    new_node->nslots = k;
-    btreeTruncateSlots(node, k);
 }
 
-static inline int btreeSplitNode(
+/******************************************************************************/
+
+/**
+ * Inserts the entry, under optimistic latches if trees are shared by threads,
+ * into the buffer of the root if the tree is buffered.
+ */
+static inline int btreeInsertEntry(
     sakhadb_btree_t tree,
-    sakhadb_btree_page_t page,
-    struct BtreeSplitResult* res
+    const void* key, uint16_t nkey,
+    const void* entry, uint16_t nentry,
+    Pgno no
 )
 {
-    SLOG_BTREE_INFO("btreeSplitNode: split node [%d]", page->no);
-    sakhadb_btree_page_t new_page;
-    sakhadb_btree_node_t node = page->header;
-    int rc = btreeLoadNewNode(tree->ctx, node->flags, &new_page);
-    if(rc)
-    {
-        SLOG_BTREE_ERROR("btreeSplitNode: failed to load new node [%d]", rc);
-        goto Lexit;
-    }
-    
-    sakhadb_btree_node_t new_node = new_page->header;
-    uint16_t k = node->nslots >> 1;
-    
-    btreeCopyOnSplit(node, new_node, k);
-    new_node->right = node->right;
-    
-    register sakhadb_btree_slot_t* slot = btreeGetSlots(node);
-    res->data = btreeNodeOffset(node, slot->off);
-    res->size = slot->sz;
-    res->new_page = new_page;
-    
-    // If node is leaf
-    if(node->flags == SAKHADB_BTREE_LEAF)
-    {
-        node->right = new_page->no;
-    }
-    else
+#if SAKHADB_THREADSAFE
+    return btreeOptimisticInsert(tree, key, nkey, entry, nentry, no);
+#else
+    if(btreeIsBuffered(tree->root->header))
     {
-        btreeRemoveLastSlot(node);
-        node->right = slot->no;
+        return btreeBufferInsert(tree, key, nkey, entry, nentry, no);
     }
-    
-#ifdef DEBUG
-    memset(btreeNodeOffset(node, node->free_off), 0, node->free_sz);
+    return btreeInsert(tree, key, nkey, entry, nentry, no);
 #endif
-    
-    btreeSaveNode(tree->ctx, page);
-    btreeSaveNode(tree->ctx, new_page);
-    
-Lexit:
-    return rc;
 }
 
-static inline int btreeSplitRoot(
-    sakhadb_btree_t tree,
-    sakhadb_btree_page_t* pLeftPage,
-    sakhadb_btree_page_t* pRightPage
+/******************************************************************************/
+
+/****************************** Build Section *********************************/
+
+/**
+ * Open node of one level of the tree being built. The last child added to an
+ * internal node is held back: it becomes 'right' of the node when the node is
+ * closed, or goes to the node as an ordinary entry when the next child comes.
+ */
+struct BtreeBuildLevel
+{
+    sakhadb_btree_page_t    page;       /* Node being filled, 0 if none */
+    uint32_t                count;      /* Entries in the subtree of the node */
+    Pgno                    child;      /* Pending child, 0 if none */
+    uint32_t                nchild;     /* Entries in the subtree of the pending child */
+    uint16_t                nkey;       /* Size of the key of the pending child */
+    char                    key[SAKHADB_BTREE_MAX_KEY_SIZE]; /* Greatest key of the pending child */
+};
+
+/**
+ * Builds a tree bottom-up from entries coming in key order. Every node is
+ * filled up completely and saved once, new pages are taken from the pager one
+ * after another.
+ */
+struct BtreeBuilder
+{
+    struct BtreeContext*    ctx;        /* Context */
+    char                    flags;      /* Node format, SAKHADB_BTREE_INLINE or 0 */
+    int                     height;     /* Number of levels with open nodes */
+    sakhadb_btree_page_t    leaf;       /* Leaf being filled, 0 if none */
+    struct BtreeBuildLevel  levels[SAKHADB_BTREE_MAX_HEIGHT];  /* Internal levels, 0 is above leaves */
+};
+
+static int btreeBuildChild(
+    struct BtreeBuilder* builder,
+    int level,                          /* Level receiving the child */
+    Pgno no,                            /* Child page */
+    const char* key, uint16_t nkey,     /* Greatest key of the child subtree */
+    uint32_t count                      /* Entries in the child subtree */
 )
 {
-    SLOG_BTREE_INFO("btreeSplitRoot: split root [%d]", tree->root->no);
-    sakhadb_btree_page_t left_page;
-    sakhadb_btree_page_t right_page;
-    sakhadb_btree_node_t root_node = tree->root->header;
-    int rc = btreeLoadNewNode(tree->ctx, root_node->flags, &left_page);
-    if(rc)
+    int rc = SAKHADB_OK;
+    if(level == SAKHADB_BTREE_MAX_HEIGHT)
     {
-        SLOG_BTREE_ERROR("btreeSplitRoot: failed to load new node [%d]", rc);
-        goto Lexit;
+        SLOG_BTREE_ERROR("btreeBuildChild: tree is too high");
+        return SAKHADB_FULL;
     }
     
-    rc = btreeLoadNewNode(tree->ctx, root_node->flags, &right_page);
-    if(rc)
+    struct BtreeBuildLevel* l = builder->levels + level;
+    if(!l->page)
     {
-        SLOG_BTREE_ERROR("btreeSplitRoot: failed to load new node [%d]", rc);
-        goto Lexit;
+        rc = btreeLoadNewNode(builder->ctx, builder->flags, &l->page);
+        if(rc)
+        {
+            goto Lexit;
+        }
+        
+        l->count = 0;
+        l->child = 0;
+        builder->height = level + 1;
     }
-    
-    int is_leaf = root_node->flags == SAKHADB_BTREE_LEAF;
-    sakhadb_btree_node_t left_node = left_page->header;
-    sakhadb_btree_node_t right_node = right_page->header;
-    
-    uint16_t k = root_node->nslots >> 1;
-    sakhadb_btree_slot_t* base_slot = btreeGetSlots(root_node) + k;
-    if(is_leaf)
+    else if(!btreeNodeHasRoom(l->page->header, l->nkey))
     {
-        btreeCopyOnSplit(root_node, right_node, k);
-        btreeCopyOnSplit(root_node, left_node, root_node->nslots);
-        
-        assert(root_node->nslots == 0);
-        assert(root_node->free_off == sizeof(struct BtreePageHeader));
-        assert(root_node->slots_off == sakhadb_pager_page_size(tree->ctx->pager, 1));
-        assert(root_node->free_sz == root_node->slots_off - root_node->free_off);
+        // Pending child closes the node
+        sakhadb_btree_node_t node = l->page->header;
+        node->right = l->child;
+        node->right_count = l->nchild;
+        btreeSaveNode(builder->ctx, l->page);
         
-        btreeAppendSlot(root_node, base_slot)->no = left_page->no;
+        rc = btreeBuildChild(builder, level + 1, l->page->no, l->key, l->nkey, l->count + l->nchild);
+        if(rc)
+        {
+            goto Lexit;
+        }
         
-        left_node->right = right_page->no;
-        right_node->right = root_node->right;
-        root_node->right = right_page->no;
+        rc = btreeLoadNewNode(builder->ctx, builder->flags, &l->page);
+        if(rc)
+        {
+            goto Lexit;
+        }
         
-        // Root is not leaf anymore
-        root_node->flags = 0;
+        l->count = 0;
+        l->child = 0;
     }
-    else
+    else if(l->child)
     {
-        btreeCopyOnSplit(root_node, right_node, k);
-        btreeRemoveLastSlot(root_node);
-        btreeCopyOnSplit(root_node, left_node, root_node->nslots);
-        
-        assert(root_node->nslots == 0);
-        assert(root_node->free_off == sizeof(struct BtreePageHeader));
-        assert(root_node->slots_off == sakhadb_pager_page_size(tree->ctx->pager, 1));
-        assert(root_node->free_sz == root_node->slots_off - root_node->free_off);
-        
-        register sakhadb_btree_slot_t* new_slot = btreeAppendSlot(root_node, base_slot);
-        left_node->right = new_slot->no;
-        new_slot->no = left_page->no;
-        
-        right_node->right = root_node->right;
-        root_node->right = right_page->no;
+        btreeAppendKey(l->page->header, l->key, l->nkey, l->child, l->nchild);
+        l->count += l->nchild;
     }
     
-    btreeSaveNode(tree->ctx, tree->root);
-    btreeSaveNode(tree->ctx, left_page);
-    btreeSaveNode(tree->ctx, right_page);
-    
-    *pLeftPage = left_page;
-    *pRightPage = right_page;
+    l->child = no;
+    l->nchild = count;
+    l->nkey = nkey;
+    memcpy(l->key, key, nkey);
     
 Lexit:
     return rc;
 }
 
-/******************************************************************************/
-
-/***************************** Insert Section *********************************/
+/**
+ * Closes the leaf being filled and passes it to the level above.
+ */
+static int btreeBuildCloseLeaf(struct BtreeBuilder* builder)
+{
+    sakhadb_btree_node_t leaf = builder->leaf->header;
+    uint16_t nkey;
+    const char* key = btreeGetKey(leaf, 0, &nkey);
+    btreeSaveNode(builder->ctx, builder->leaf);
+    return btreeBuildChild(builder, 0, builder->leaf->no, key, nkey, leaf->nslots);
+}
 
-static inline void btreeInsertInNode(
-    struct BtreeCursorPointer * cursor,
-    const void* key, uint16_t nkey,
+static int btreeBuildAdd(
+    struct BtreeBuilder* builder,
+    const void* entry, uint16_t nentry,
     Pgno no
 )
 {
-    SLOG_BTREE_INFO("btreeInsertInNode: insert in node [%d][%d][%d]",
-                    cursor->page->no, cursor->index, no);
-    assert(cursor->page->header->free_sz >= nkey + sizeof(sakhadb_btree_node_t));
-    
-    register int idx = cursor->index;
-    sakhadb_btree_node_t node = cursor->page->header;
-    sakhadb_btree_slot_t* slots = btreeGetSlots(node);
-    int is_leaf = node->flags;
+    int rc = SAKHADB_OK;
+    sakhadb_btree_page_t leaf = builder->leaf;
+    if(leaf && btreeNodeHasRoom(leaf->header, nentry))
+    {
+        btreeAppendKey(leaf->header, entry, nentry, no, 0);
+        goto Lexit;
+    }
     
-    uint16_t off;
-    register char* ptr;
-    sakhadb_btree_slot_t* new_slot = slots + idx;
-    if(idx == -1)
+    sakhadb_btree_page_t new_leaf;
+    rc = btreeLoadNewNode(builder->ctx, builder->flags | SAKHADB_BTREE_LEAF, &new_leaf);
+    if(rc)
     {
-        off = node->free_off;
-        ptr = btreeNodeOffset(node, off);
-        if(is_leaf)
-        {
-            new_slot->no = no;
-        }
-        else
-        {
-            new_slot->no = node->right;
-            node->right = no;
-        }
+        goto Lexit;
     }
-    else
+    
+    new_leaf->header->right = 0;
+    if(leaf)
     {
-        off = slots[idx].off;
-        ptr = btreeNodeOffset(node, off);
-        memmove(ptr + nkey, ptr, node->free_off - off);
-        memmove(slots - 1, slots, (idx + 1) * sizeof(sakhadb_btree_slot_t));
-        for(sakhadb_btree_slot_t *s = slots - 1; s != new_slot; ++s)
-        {
-            s->off += nkey;
-        }
-        
-        if(is_leaf)
-        {
-            new_slot->no = no;
-        }
-        else
+        leaf->header->right = new_leaf->no;
+        rc = btreeBuildCloseLeaf(builder);
+        if(rc)
         {
-            sakhadb_btree_slot_t* old_slot = new_slot - 1;
-            new_slot->no = old_slot->no;
-            old_slot->no = no;
+            goto Lexit;
         }
     }
-    memcpy(ptr, key, nkey);
-    new_slot->off = off;
-    new_slot->sz = nkey;
-    node->free_off += nkey;
-    node->nslots += 1;
-    node->slots_off -= sizeof(sakhadb_btree_slot_t);
-    node->free_sz -= sizeof(sakhadb_btree_slot_t) + nkey;
+    
+    builder->leaf = new_leaf;
+    btreeAppendKey(new_leaf->header, entry, nentry, no, 0);
+    
+Lexit:
+    return rc;
 }
 
-static inline int btreeInsertCursor(
-    struct BtreeCursorStack* stack,
-    const void* key, uint16_t nkey,
-    Pgno no
-)
+static int btreeBuildFinish(struct BtreeBuilder* builder, Pgno* pNo)
 {
     int rc = SAKHADB_OK;
-    struct Btree* tree = stack->tree;
-    struct BtreeCursorPointer* cur;
-    while (cpl_array_count(&stack->st) > 1)
+    if(!builder->leaf)
     {
-        cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
-        
-        register sakhadb_btree_node_t node = cur->page->header;
-        struct BtreeSplitResult res;
-        if(node->free_sz < nkey + sizeof(sakhadb_btree_node_t))
-        {
-            rc = btreeSplitNode(tree, cur->page, &res);
-            
-            if(rc)
-            {
-                SLOG_BTREE_ERROR("btreeInsert: failed to split node [%d][%d]", rc, cur->page->no);
-                goto Ldexit;
-            }
-            
-            register sakhadb_btree_page_t new_page = res.new_page;
-            if(cur->index < new_page->header->nslots)
-            {
-                cur->page = new_page;
-            }
-            else
-            {
-                cur->index -= new_page->header->nslots;
-            }
-            
-            btreeInsertInNode(cur, key, nkey, no);
-            
-            key = res.data;
-            nkey = res.size;
-            no = new_page->no;
-        }
-        else
+        // Empty tree
+        rc = btreeLoadNewNode(builder->ctx, builder->flags | SAKHADB_BTREE_LEAF, &builder->leaf);
+        if(rc)
         {
-            goto Linsertexit;
+            goto Lexit;
         }
-        cpl_array_pop_back(&stack->st);
+        
+        builder->leaf->header->right = 0;
     }
     
-    SLOG_BTREE_INFO("btreeInsert: inserting in root...");
+    if(builder->height == 0)
+    {
+        btreeSaveNode(builder->ctx, builder->leaf);
+        *pNo = builder->leaf->no;
+        goto Lexit;
+    }
     
-    cur = (struct BtreeCursorPointer *)cpl_array_back_p(&stack->st);
-    register sakhadb_btree_node_t node = cur->page->header;
-    if(node->free_sz < nkey + sizeof(sakhadb_btree_node_t))
+    rc = btreeBuildCloseLeaf(builder);
+    if(rc)
     {
-        sakhadb_btree_page_t left_page, right_page;
-        rc = btreeSplitRoot(tree, &left_page, &right_page);
-        
-        if(rc)
+        goto Lexit;
+    }
+    
+    for(int i = 0; i < builder->height; ++i)
+    {
+        struct BtreeBuildLevel* l = builder->levels + i;
+        sakhadb_btree_node_t node = l->page->header;
+        if(i == builder->height - 1 && node->nslots == 0)
         {
-            SLOG_BTREE_ERROR("btreeInsert: failed to split root [%d][%d]", rc, tree->root->no);
-            goto Ldexit;
+            // Single child of the top node is the root
+            btreeFreeNode(builder->ctx, l->page);
+            *pNo = l->child;
+            break;
         }
         
-        if(cur->index < right_page->header->nslots)
+        node->right = l->child;
+        node->right_count = l->nchild;
+        btreeSaveNode(builder->ctx, l->page);
+        if(i == builder->height - 1)
         {
-            cur->page = right_page;
+            *pNo = l->page->no;
+            break;
         }
-        else
+        
+        rc = btreeBuildChild(builder, i + 1, l->page->no, l->key, l->nkey, l->count + l->nchild);
+        if(rc)
         {
-            cur->page = left_page;
-            cur->index -= right_page->header->nslots;
+            goto Lexit;
         }
     }
     
-Linsertexit:
-    btreeInsertInNode(cur, key, nkey, no);
-    btreeSaveNode(tree->ctx, cur->page);
-    
-Ldexit:
+Lexit:
     return rc;
 }
 
-static inline int btreeInsert(
-    sakhadb_btree_t tree,
-    const void* key, uint16_t nkey,
-    Pgno no
-)
+/**
+ * Returns all pages of the subtree to the pager freelist.
+ */
+static int btreeDropNode(struct BtreeContext * ctx, Pgno no)
 {
-    SLOG_BTREE_INFO("btreeInsert: insert in tree [%d][%d]", tree->root->no, no);
-    assert(nkey < sakhadb_pager_page_size(tree->ctx->pager, 0) / 5);
-    int rc = SAKHADB_OK;
-    struct BtreeCursorStack stack;
-    stack.tree = tree;
-    rc = cpl_array_init(&stack.st, sizeof(struct BtreeCursorPointer), 16);
+    sakhadb_btree_page_t page;
+    int rc = btreeLoadNode(ctx, no, &page);
     if(rc)
     {
-        SLOG_BTREE_ERROR("btreeInsert: failed to init cursors stack [%d]", rc);
         goto Lexit;
     }
     
-    int cmp = btreeFind(tree, key, nkey, &stack);
-    if(cmp == 0)
+    sakhadb_btree_node_t node = page->header;
+    if(!btreeIsLeaf(node))
     {
-        SLOG_BTREE_WARN("btreeInsert: keys duplicated");
-        goto Ldexit;
+        for(int i = 0; i < node->nslots && rc == SAKHADB_OK; ++i)
+        {
+            rc = btreeDropNode(ctx, btreeGetDataPgno(node, i));
+        }
+        
+        if(rc == SAKHADB_OK)
+        {
+            rc = btreeDropNode(ctx, node->right);
+        }
+        
+        if(rc == SAKHADB_OK && node->buffer)
+        {
+            rc = btreeBufferFree(ctx, node);
+        }
     }
     
-    rc = btreeInsertCursor(&stack, key, nkey, no);
-    
-Ldexit:
-    cpl_array_deinit(&stack.st);
+    btreeFreeNode(ctx, page);
     
 Lexit:
     return rc;
@@ -852,6 +4037,9 @@ static inline int btreeCreateCursor(sakhadb_btree_t tree, sakhadb_btree_cursor_t
     if(rc == SAKHADB_OK)
     {
         cursor->tree = tree;
+        cursor->flags = 0;
+        cursor->nupper = 0;
+        cursor->nlower = 0;
         *pCursor = cursor;
         return SAKHADB_OK;
     }
@@ -885,6 +4073,18 @@ int sakhadb_btree_ctx_create(sakhadb_pager_t pager, sakhadb_btree_ctx_t* ctx)
     }
     
     env->pager = pager;
+    env->cache = 0;
+    env->cache_keys = 0;
+    memset(&env->stats, 0, sizeof(env->stats));
+    
+#if SAKHADB_BTREE_CACHE
+    int rc = btreeCacheCreate(env);
+    if(rc)
+    {
+        cpl_allocator_free(default_allocator, env);
+        return rc;
+    }
+#endif // SAKHADB_BTREE_CACHE
     
     *ctx = env;
     return SAKHADB_OK;
@@ -895,6 +4095,10 @@ void sakhadb_btree_ctx_destroy(sakhadb_btree_ctx_t ctx)
     assert(ctx);
     
     SLOG_BTREE_INFO("sakhadb_btree_ctx_destroy: destroying btree representation");
+    if(ctx->cache)
+    {
+        cpl_allocator_free(cpl_allocator_get_default(), ctx->cache);
+    }
     cpl_allocator_free(cpl_allocator_get_default(), ctx);
 }
 
@@ -914,17 +4118,14 @@ int sakhadb_btree_create(sakhadb_btree_ctx_t ctx, Pgno no, sakhadb_btree_t* tree
     
     if(node->slots_off == 0)
     {
-        node->nslots = 0;
-        node->slots_off = sakhadb_pager_page_size(ctx->pager, 1);
-        node->free_off = sizeof(struct BtreePageHeader);
-        node->free_sz = node->slots_off - sizeof(struct BtreePageHeader);
-        node->flags = SAKHADB_BTREE_LEAF;
+        btreeInitNode(node, sakhadb_pager_page_size(ctx->pager, no == 1), SAKHADB_BTREE_LEAF);
     }
     
     rc = btreeCreate(ctx, root, tree);
     if(rc)
     {
         SLOG_FATAL("sakhadb_btree_create: failed to create B-tree. [%d]", rc);
+        goto Lexit;
     }
     
 Lexit:
@@ -937,15 +4138,16 @@ void sakhadb_btree_destroy(sakhadb_btree_t tree)
     btreeDestroy(tree);
 }
 
-void sakhadb_btree_init_new_root(sakhadb_btree_ctx_t ctx, sakhadb_page_t page)
+void sakhadb_btree_init_new_root(sakhadb_btree_ctx_t ctx, sakhadb_page_t page, int flags)
 {
     assert(page->no > 1);
+    assert((flags & ~(SAKHADB_BTREE_OIDKEYS | SAKHADB_BTREE_INLINE | SAKHADB_BTREE_BUFFERED)) == 0);
+    assert((flags & SAKHADB_BTREE_OIDKEYS) == 0 || (flags & SAKHADB_BTREE_INLINE) == 0);
+#if SAKHADB_THREADSAFE
+    flags &= ~SAKHADB_BTREE_BUFFERED;
+#endif
     sakhadb_btree_node_t node = page->data;
-    node->nslots = 0;
-    node->slots_off = sakhadb_pager_page_size(ctx->pager, 0);
-    node->free_off = sizeof(struct BtreePageHeader);
-    node->free_sz = node->slots_off - sizeof(struct BtreePageHeader);
-    node->flags = SAKHADB_BTREE_LEAF;
+    btreeInitNode(node, sakhadb_pager_page_size(ctx->pager, 0), SAKHADB_BTREE_LEAF | flags);
     node->right = 0;
 }
 
@@ -958,12 +4160,21 @@ int sakhadb_btree_ctx_commit(sakhadb_btree_ctx_t ctx)
     return sakhadb_pager_sync(ctx->pager);
 }
 
+void sakhadb_btree_ctx_stats(sakhadb_btree_ctx_t ctx, struct BtreeStats* stats)
+{
+    assert(ctx && stats);
+    *stats = ctx->stats;
+}
+
 int sakhadb_btree_ctx_rollback(sakhadb_btree_ctx_t ctx)
 {
     assert(ctx);
     
     SLOG_BTREE_INFO("sakhadb_btree_ctx_rollback: rollback changes");
     
+#if SAKHADB_BTREE_CACHE
+    btreeCacheClear(ctx);
+#endif // SAKHADB_BTREE_CACHE
     return sakhadb_pager_update(ctx->pager);
 }
 
@@ -972,7 +4183,107 @@ int sakhadb_btree_insert(sakhadb_btree_t tree, const void* key, size_t nkey, Pgn
     assert(tree && key && nkey && no);
     SLOG_BTREE_INFO("sakhadb_btree_insert: insert new element [%d][%d][%d]", tree->root->no, nkey, no);
     
-    return btreeInsert(tree, key, nkey, no);
+    if(btreeHasOidKeys(tree->root->header) && nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        SLOG_BTREE_ERROR("sakhadb_btree_insert: key is not an ObjectId [%d]", nkey);
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    return btreeInsertEntry(tree, key, nkey, key, nkey, no);
+}
+
+size_t sakhadb_btree_max_payload(sakhadb_btree_t tree)
+{
+    if(!(tree->root->header->flags & SAKHADB_BTREE_INLINE))
+    {
+        return 0;
+    }
+    
+    // Same bound as for keys, so a split always leaves room for the entry
+    return sakhadb_pager_page_size(tree->ctx->pager, 0) / 5 - 1 - SAKHADB_BTREE_OID_SIZE;
+}
+
+int sakhadb_btree_insert_payload(sakhadb_btree_t tree, const void* key, size_t nkey,
+                                 const void* payload, size_t npayload)
+{
+    assert(tree && key && nkey && payload);
+    SLOG_BTREE_INFO("sakhadb_btree_insert_payload: insert new element [%d][%d][%d]", tree->root->no, nkey, npayload);
+    
+    if(nkey != SAKHADB_BTREE_OID_SIZE || npayload > sakhadb_btree_max_payload(tree))
+    {
+        SLOG_BTREE_ERROR("sakhadb_btree_insert_payload: can't store payload inline [%d][%d]", nkey, npayload);
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    uint16_t nentry = SAKHADB_BTREE_OID_SIZE + npayload;
+    char entry[nentry];
+    memcpy(entry, key, SAKHADB_BTREE_OID_SIZE);
+    memcpy(entry + SAKHADB_BTREE_OID_SIZE, payload, npayload);
+    
+    return btreeInsertEntry(tree, key, nkey, entry, nentry, 0);
+}
+
+int sakhadb_btree_insert_sorted(sakhadb_btree_t tree, size_t count,
+                                const void* const* keys, const size_t* nkeys, const Pgno* nos)
+{
+    assert(tree && keys && nkeys && nos);
+    SLOG_BTREE_INFO("sakhadb_btree_insert_sorted: insert elements [%d][%d]", tree->root->no, count);
+    
+    if(btreeHasOidKeys(tree->root->header))
+    {
+        for(size_t i = 0; i < count; ++i)
+        {
+            if(nkeys[i] != SAKHADB_BTREE_OID_SIZE)
+            {
+                SLOG_BTREE_ERROR("sakhadb_btree_insert_sorted: key is not an ObjectId [%d]", nkeys[i]);
+                return SAKHADB_INVALID_ARG;
+            }
+        }
+    }
+    
+    if(btreeIsBuffered(tree->root->header))
+    {
+        int rc = SAKHADB_OK;
+        for(size_t i = 0; i < count && rc == SAKHADB_OK; ++i)
+        {
+            rc = btreeBufferInsert(tree, keys[i], nkeys[i], keys[i], nkeys[i], nos[i]);
+        }
+        return rc;
+    }
+    
+    return btreeInsertSorted(tree, count, keys, nkeys, nos);
+}
+
+int sakhadb_btree_delete(sakhadb_btree_t tree, const void* key, size_t nkey, Pgno* pNo)
+{
+    assert(tree && key && nkey);
+    SLOG_BTREE_INFO("sakhadb_btree_delete: delete element [%d][%d]", tree->root->no, nkey);
+    
+    if(btreeHasOidKeys(tree->root->header) && nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        return SAKHADB_NOTFOUND;
+    }
+    
+    int rc = btreeBufferFlushAll(tree);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    return btreeDelete(tree, key, nkey, pNo);
+}
+
+int sakhadb_btree_lookup(sakhadb_btree_t tree, const void* key, size_t nkey, Pgno* pNo)
+{
+    assert(tree && key && nkey && pNo);
+    SLOG_BTREE_INFO("sakhadb_btree_lookup: find key in tree [%d][%d]", tree->root->no, nkey);
+    
+    if(btreeHasOidKeys(tree->root->header) && nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        return SAKHADB_NOTFOUND;
+    }
+    
+    return btreeLookup(tree, key, nkey, pNo);
 }
 
 int sakhadb_btree_cursor_find(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey)
@@ -980,13 +4291,140 @@ int sakhadb_btree_cursor_find(sakhadb_btree_cursor_t cursor, const void* key, si
     assert(cursor->tree && key && nkey);
     SLOG_BTREE_INFO("sakhadb_btree_find: find key in tree [%d][%d]", tree->root->no, nkey);
     
+    if(btreeHasOidKeys(cursor->tree->root->header) && nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        return SAKHADB_NOTFOUND;
+    }
+    
+    if(btreeBufferFlushAll(cursor->tree))
+    {
+        SLOG_BTREE_ERROR("sakhadb_btree_cursor_find: failed to flush buffers [%d]", cursor->tree->root->no);
+    }
+    
     int cmp = btreeFind(cursor->tree, key, nkey, cursor);
     
     return cmp;
 }
 
+uint64_t sakhadb_btree_count(sakhadb_btree_t tree)
+{
+    // Buffered entries may be duplicates, they are counted in the leaves
+    if(btreeBufferFlushAll(tree))
+    {
+        SLOG_BTREE_ERROR("sakhadb_btree_count: failed to flush buffers [%d]", tree->root->no);
+    }
+    return btreeNodeCount(tree->root->header);
+}
+
+int sakhadb_btree_rank(sakhadb_btree_t tree, const void* key, size_t nkey, int inclusive, uint64_t* pRank)
+{
+    assert(tree && key && nkey && pRank);
+    SLOG_BTREE_INFO("sakhadb_btree_rank: rank key in tree [%d][%d]", tree->root->no, nkey);
+    
+    if(btreeHasOidKeys(tree->root->header) && nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    int rc = btreeBufferFlushAll(tree);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    return btreeRank(tree, key, nkey, inclusive, pRank);
+}
+
+int sakhadb_btree_cursor_nth(sakhadb_btree_cursor_t cursor, uint64_t n)
+{
+    int rc = btreeBufferFlushAll(cursor->tree);
+    if(rc)
+    {
+        return rc;
+    }
+    return btreeNth(cursor, n);
+}
+
+int sakhadb_btree_cursor_rank(sakhadb_btree_cursor_t cursor, uint64_t* pRank)
+{
+    *pRank = btreeCursorRank(cursor);
+    return SAKHADB_OK;
+}
+
+int sakhadb_btree_builder_create(sakhadb_btree_ctx_t ctx, int flags, sakhadb_btree_builder_t* pBuilder)
+{
+    assert(ctx && pBuilder && (flags & ~SAKHADB_BTREE_INLINE) == 0);
+    struct BtreeBuilder* builder = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct BtreeBuilder));
+    if(!builder)
+    {
+        SLOG_BTREE_FATAL("sakhadb_btree_builder_create: failed to allocate memory for builder");
+        return SAKHADB_NOMEM;
+    }
+    
+    memset(builder, 0, sizeof(struct BtreeBuilder));
+    builder->ctx = ctx;
+    builder->flags = flags;
+    
+    *pBuilder = builder;
+    return SAKHADB_OK;
+}
+
+size_t sakhadb_btree_builder_max_payload(sakhadb_btree_ctx_t ctx)
+{
+    // At least two entries per leaf
+    size_t area = sakhadb_pager_page_size(ctx->pager, 0) - sizeof(struct BtreePageHeader);
+    return area / 2 - sizeof(sakhadb_btree_slot_t) - SAKHADB_BTREE_OID_SIZE;
+}
+
+int sakhadb_btree_builder_add(sakhadb_btree_builder_t builder, const void* key, size_t nkey,
+                              const void* payload, size_t npayload, Pgno no)
+{
+    assert(builder && key);
+    
+    if(!(builder->flags & SAKHADB_BTREE_INLINE))
+    {
+        assert(no && npayload == 0 && nkey <= SAKHADB_BTREE_MAX_KEY_SIZE);
+        return btreeBuildAdd(builder, key, nkey, no);
+    }
+    
+    assert(nkey == SAKHADB_BTREE_OID_SIZE);
+    assert(npayload <= sakhadb_btree_builder_max_payload(builder->ctx));
+    
+    uint16_t nentry = SAKHADB_BTREE_OID_SIZE + npayload;
+    char entry[nentry];
+    memcpy(entry, key, SAKHADB_BTREE_OID_SIZE);
+    if(npayload)
+    {
+        memcpy(entry + SAKHADB_BTREE_OID_SIZE, payload, npayload);
+    }
+    
+    return btreeBuildAdd(builder, entry, nentry, no);
+}
+
+int sakhadb_btree_builder_finish(sakhadb_btree_builder_t builder, Pgno* pNo)
+{
+    assert(builder && pNo);
+    int rc = btreeBuildFinish(builder, pNo);
+    cpl_allocator_free(cpl_allocator_get_default(), builder);
+    return rc;
+}
+
+int sakhadb_btree_drop(sakhadb_btree_t tree)
+{
+    assert(tree);
+    SLOG_BTREE_INFO("sakhadb_btree_drop: drop tree [%d]", tree->root->no);
+    int rc = btreeDropNode(tree->ctx, tree->root->no);
+    btreeDestroy(tree);
+    return rc;
+}
+
 int sakhadb_btree_dump(sakhadb_btree_t tree, cpl_region_ref region)
 {
+    int rc = btreeBufferFlushAll(tree);
+    if(rc)
+    {
+        return rc;
+    }
     return btreeDump(tree, region);
 }
 
@@ -1005,6 +4443,17 @@ int sakhadb_btree_cursor_insert(sakhadb_btree_cursor_t cursor, const void* key,
     assert(cursor && key && nkey && no);
     SLOG_BTREE_INFO("sakhadb_btree_cursor_insert: insert new element [%d][%d][%d]", cursor->tree->root->no, nkey, no);
     
+    if(btreeHasOidKeys(cursor->tree->root->header) && nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    // Buffered tree fills leaves in flushes only
+    if(btreeIsBuffered(cursor->tree->root->header))
+    {
+        return btreeBufferInsert(cursor->tree, key, nkey, key, nkey, no);
+    }
+    
     return btreeInsertCursor(cursor, key, nkey, no);
 }
 
@@ -1014,8 +4463,78 @@ Pgno sakhadb_btree_cursor_pgno(sakhadb_btree_cursor_t cursor)
     return btreeGetDataPgno(ptr->page->header, ptr->index);
 }
 
+const void* sakhadb_btree_cursor_key(sakhadb_btree_cursor_t cursor, size_t* nkey)
+{
+    struct BtreeCursorPointer* ptr = (struct BtreeCursorPointer*)cpl_array_back_p(&cursor->st);
+    uint16_t sz;
+    const char* key = btreeGetKey(ptr->page->header, ptr->index, &sz);
+    *nkey = sz;
+    return key;
+}
+
+const void* sakhadb_btree_cursor_payload(sakhadb_btree_cursor_t cursor, size_t* npayload)
+{
+    struct BtreeCursorPointer* ptr = (struct BtreeCursorPointer*)cpl_array_back_p(&cursor->st);
+    sakhadb_btree_node_t node = ptr->page->header;
+    if(!btreeIsInline(node) || btreeGetDataPgno(node, ptr->index) != 0)
+    {
+        return 0;
+    }
+    
+    uint16_t sz;
+    const char* entry = btreeGetEntry(node, ptr->index, &sz);
+    *npayload = sz - SAKHADB_BTREE_OID_SIZE;
+    return entry + SAKHADB_BTREE_OID_SIZE;
+}
+
+int sakhadb_btree_cursor_seek(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, int exclusive)
+{
+    assert(cursor->tree && key && nkey);
+    SLOG_BTREE_INFO("sakhadb_btree_cursor_seek: seek key in tree [%d][%d]", cursor->tree->root->no, nkey);
+    
+    if(btreeHasOidKeys(cursor->tree->root->header) && nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    int rc = btreeBufferFlushAll(cursor->tree);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    return btreeSeek(cursor, key, nkey, exclusive);
+}
+
+void sakhadb_btree_cursor_set_upper(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, int exclusive)
+{
+    assert(nkey <= SAKHADB_BTREE_MAX_KEY_SIZE);
+    if(!key)
+    {
+        cursor->flags &= ~(SAKHADB_BTREE_CURSOR_UPPER | SAKHADB_BTREE_CURSOR_UPPER_EXCL);
+        return;
+    }
+    
+    memcpy(cursor->upper, key, nkey);
+    cursor->nupper = nkey;
+    cursor->flags |= SAKHADB_BTREE_CURSOR_UPPER;
+    if(exclusive)
+    {
+        cursor->flags |= SAKHADB_BTREE_CURSOR_UPPER_EXCL;
+    }
+    else
+    {
+        cursor->flags &= ~SAKHADB_BTREE_CURSOR_UPPER_EXCL;
+    }
+}
+
 int sakhadb_btree_cursor_first(sakhadb_btree_cursor_t cursor)
 {
+    int rc = btreeBufferFlushAll(cursor->tree);
+    if(rc)
+    {
+        return rc;
+    }
     return btreeFirst(cursor);
 }
 
@@ -1024,3 +4543,59 @@ int sakhadb_btree_cursor_next(sakhadb_btree_cursor_t cursor)
     return btreeNext(cursor->tree, cursor);
 }
 
+int sakhadb_btree_cursor_last(sakhadb_btree_cursor_t cursor)
+{
+    int rc = btreeBufferFlushAll(cursor->tree);
+    if(rc)
+    {
+        return rc;
+    }
+    return btreeLast(cursor);
+}
+
+int sakhadb_btree_cursor_prev(sakhadb_btree_cursor_t cursor)
+{
+    return btreePrev(cursor->tree, cursor);
+}
+
+int sakhadb_btree_cursor_seek_last(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, int exclusive)
+{
+    assert(cursor->tree && key && nkey);
+    SLOG_BTREE_INFO("sakhadb_btree_cursor_seek_last: seek key in tree [%d][%d]", cursor->tree->root->no, nkey);
+    
+    if(btreeHasOidKeys(cursor->tree->root->header) && nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    int rc = btreeBufferFlushAll(cursor->tree);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    return btreeSeekLast(cursor, key, nkey, exclusive);
+}
+
+void sakhadb_btree_cursor_set_lower(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, int exclusive)
+{
+    assert(nkey <= SAKHADB_BTREE_MAX_KEY_SIZE);
+    if(!key)
+    {
+        cursor->flags &= ~(SAKHADB_BTREE_CURSOR_LOWER | SAKHADB_BTREE_CURSOR_LOWER_EXCL);
+        return;
+    }
+    
+    memcpy(cursor->lower, key, nkey);
+    cursor->nlower = nkey;
+    cursor->flags |= SAKHADB_BTREE_CURSOR_LOWER;
+    if(exclusive)
+    {
+        cursor->flags |= SAKHADB_BTREE_CURSOR_LOWER_EXCL;
+    }
+    else
+    {
+        cursor->flags &= ~SAKHADB_BTREE_CURSOR_LOWER_EXCL;
+    }
+}
+
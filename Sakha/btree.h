@@ -26,21 +26,171 @@
 
 #include "paging.h"
 
+/**
+ * Size of the BSON ObjectId used as a key of collection trees.
+ */
+#define SAKHADB_BTREE_OID_SIZE      12
+
+/**
+ * Upper bound for the size of a key stored in B-tree. Keys are compared as
+ * byte strings, typed values are encoded with key.h.
+ */
+#define SAKHADB_BTREE_MAX_KEY_SIZE  192
+
+/**
+ * Node format flags for sakhadb_btree_init_new_root().
+ *
+ * SAKHADB_BTREE_OIDKEYS selects fixed-width nodes: keys are stored as a dense
+ * array of SAKHADB_BTREE_OID_SIZE-byte values without per-slot offsets.
+ */
+#define SAKHADB_BTREE_OIDKEYS       0x2
+
+/**
+ * SAKHADB_BTREE_INLINE selects clustered leaves: an ObjectId key may carry a
+ * small payload (document) stored right after it in the leaf, so reading it
+ * does not touch another page. Nodes are slotted.
+ */
+#define SAKHADB_BTREE_INLINE        0x4
+
+/**
+ * SAKHADB_BTREE_BUFFERED gives internal nodes insert buffers (B-epsilon tree).
+ * An insert is appended to the buffer of the root; a full buffer is flushed
+ * to the buffers of the children, and the buffers one level above the leaves
+ * to the leaves, so a leaf takes many entries at once. Lookups check the
+ * buffers on their path; deletes, counts and cursors apply all buffers first.
+ * Not used with SAKHADB_THREADSAFE.
+ */
+#define SAKHADB_BTREE_BUFFERED      0x8
+
+/**
+ * Number of pages of the insert buffer of an internal node.
+ */
+#ifndef SAKHADB_BTREE_BUFFER_PAGES
+#   define SAKHADB_BTREE_BUFFER_PAGES   16
+#endif
+
+/**
+ * Number of internal nodes a context keeps decoded for searches, 0 turns the
+ * cache off. Only nodes of the top SAKHADB_BTREE_CACHE_DEPTH levels of trees
+ * are cached. Not used with SAKHADB_THREADSAFE.
+ */
+#ifndef SAKHADB_BTREE_CACHE_NODES
+#   define SAKHADB_BTREE_CACHE_NODES    256
+#endif
+
+#ifndef SAKHADB_BTREE_CACHE_DEPTH
+#   define SAKHADB_BTREE_CACHE_DEPTH    3
+#endif
+
+/**
+ * Counters of B-tree operations in a context.
+ */
+struct BtreeStats
+{
+    uint64_t    splits;             /* Nodes split */
+    uint64_t    avoided_splits;     /* Splits avoided by node compaction */
+    uint64_t    flushes;            /* Insert buffers flushed */
+};
+
 typedef struct Btree* sakhadb_btree_t;
 typedef struct BtreeContext* sakhadb_btree_ctx_t;
 typedef struct BtreePageHeader* sakhadb_btree_node_t;
+typedef struct BtreeBuilder* sakhadb_btree_builder_t;
 
 int sakhadb_btree_ctx_create(sakhadb_pager_t pager, sakhadb_btree_ctx_t* ctx);
 void sakhadb_btree_ctx_destroy(sakhadb_btree_ctx_t ctx);
 
 int sakhadb_btree_ctx_commit(sakhadb_btree_ctx_t ctx);
 int sakhadb_btree_ctx_rollback(sakhadb_btree_ctx_t ctx);
+void sakhadb_btree_ctx_stats(sakhadb_btree_ctx_t ctx, struct BtreeStats* stats);
 
 int sakhadb_btree_create(sakhadb_btree_ctx_t ctx, Pgno no, sakhadb_btree_t* tree);
 void sakhadb_btree_destroy(sakhadb_btree_t tree);
-void sakhadb_btree_init_new_root(sakhadb_btree_ctx_t ctx, sakhadb_page_t page);
+void sakhadb_btree_init_new_root(sakhadb_btree_ctx_t ctx, sakhadb_page_t page, int flags);
 
+/**
+ * Inserts the key. With SAKHADB_THREADSAFE inserts and lookups may run from
+ * several threads at once; other operations need exclusive access to the tree.
+ */
 int sakhadb_btree_insert(sakhadb_btree_t tree, const void* key, size_t nkey, Pgno no);
+
+/**
+ * Largest payload sakhadb_btree_insert_payload() takes, 0 if the tree does not
+ * store payloads in leaves.
+ */
+size_t sakhadb_btree_max_payload(sakhadb_btree_t tree);
+
+/**
+ * Inserts the key with payload stored inline in the leaf. Data page of such
+ * key is 0.
+ */
+int sakhadb_btree_insert_payload(sakhadb_btree_t tree, const void* key, size_t nkey,
+                                 const void* payload, size_t npayload);
+
+/**
+ * Finds the key and returns its data page in 'pNo' (0 for inline payload).
+ * Returns SAKHADB_NOTFOUND if there is no such key.
+ */
+int sakhadb_btree_lookup(sakhadb_btree_t tree, const void* key, size_t nkey, Pgno* pNo);
+
+/**
+ * Inserts a batch of keys. Keys are expected to be sorted in ascending order,
+ * an out-of-order key only costs a descent from the root. A buffered tree
+ * takes them into the buffer of the root.
+ */
+int sakhadb_btree_insert_sorted(sakhadb_btree_t tree, size_t count,
+                                const void* const* keys, const size_t* nkeys, const Pgno* nos);
+
+/**
+ * Deletes the key from the tree. Underfull nodes are merged with or refilled
+ * from a sibling, freed pages are returned to the pager freelist.
+ * Data page of the deleted key is returned in 'pNo' (may be NULL).
+ * Invalidates all cursors of the tree.
+ */
+int sakhadb_btree_delete(sakhadb_btree_t tree, const void* key, size_t nkey, Pgno* pNo);
+
+/**
+ * Number of keys in the tree. Internal nodes keep entry counts of their
+ * subtrees, so it takes no scan.
+ */
+uint64_t sakhadb_btree_count(sakhadb_btree_t tree);
+
+/**
+ * Number of keys less than the key (not greater than, if 'inclusive').
+ */
+int sakhadb_btree_rank(sakhadb_btree_t tree, const void* key, size_t nkey, int inclusive, uint64_t* pRank);
+
+/**
+ * Bulk build of a new tree, SAKHADB_BTREE_INLINE or generic (flags 0).
+ * Entries are added in ascending order of their keys; nodes are filled up
+ * completely and written once, so the first inserts into the tree split them.
+ */
+int sakhadb_btree_builder_create(sakhadb_btree_ctx_t ctx, int flags, sakhadb_btree_builder_t* builder);
+
+/**
+ * Largest payload sakhadb_btree_builder_add() takes.
+ */
+size_t sakhadb_btree_builder_max_payload(sakhadb_btree_ctx_t ctx);
+
+/**
+ * Appends the key with inline payload (data page 'no' is 0), or the key
+ * referring to data page 'no' (payload is empty). Keys of SAKHADB_BTREE_INLINE
+ * trees are ObjectId's, generic trees take no payload.
+ */
+int sakhadb_btree_builder_add(sakhadb_btree_builder_t builder, const void* key, size_t nkey,
+                              const void* payload, size_t npayload, Pgno no);
+
+/**
+ * Completes the tree and returns its root page in 'pNo'. Destroys the builder.
+ */
+int sakhadb_btree_builder_finish(sakhadb_btree_builder_t builder, Pgno* pNo);
+
+/**
+ * Returns all pages of the tree to the pager freelist and destroys the tree.
+ * Data pages referred by the keys are left intact.
+ */
+int sakhadb_btree_drop(sakhadb_btree_t tree);
+
 int sakhadb_btree_dump(sakhadb_btree_t tree, cpl_region_ref region);
 
 #endif // _SAKHADB_BTREE_H_
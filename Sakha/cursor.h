@@ -25,11 +25,24 @@
 
 #include "btree.h"
 
+/**
+ * Cursor flags
+ */
+#define SAKHADB_BTREE_CURSOR_UPPER          0x1 /* Cursor has upper bound */
+#define SAKHADB_BTREE_CURSOR_UPPER_EXCL     0x2 /* Upper bound is exclusive */
+#define SAKHADB_BTREE_CURSOR_LOWER          0x4 /* Cursor has lower bound */
+#define SAKHADB_BTREE_CURSOR_LOWER_EXCL     0x8 /* Lower bound is exclusive */
+
 typedef struct BtreeCursorStack* sakhadb_btree_cursor_t;
 struct BtreeCursorStack
 {
     sakhadb_btree_t         tree;
     cpl_array_t             st;         /* stack of cursors */
+    int                     flags;      /* SAKHADB_BTREE_CURSOR_* flags */
+    uint16_t                nupper;     /* size of upper bound */
+    uint16_t                nlower;     /* size of lower bound */
+    char                    upper[SAKHADB_BTREE_MAX_KEY_SIZE]; /* upper bound */
+    char                    lower[SAKHADB_BTREE_MAX_KEY_SIZE]; /* lower bound */
 };
 
 int sakhadb_btree_cursor_create(sakhadb_btree_t tree, sakhadb_btree_cursor_t* cursor);
@@ -45,4 +58,51 @@ Pgno sakhadb_btree_cursor_pgno(sakhadb_btree_cursor_t cursor);
 int sakhadb_btree_cursor_find(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey);
 int sakhadb_btree_cursor_insert(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, Pgno no);
 
+/**
+ * Positions cursor at the first key not less than (greater than, if 'exclusive'
+ * is set) the given one. Returns SAKHADB_NOTFOUND if there is no such key
+ * within the upper bound.
+ */
+int sakhadb_btree_cursor_seek(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, int exclusive);
+
+/**
+ * Sets the upper bound for cursor movement. Cursor stops with SAKHADB_NOTFOUND
+ * as soon as it passes the bound, without loading leaves beyond it.
+ */
+void sakhadb_btree_cursor_set_upper(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, int exclusive);
+
+/**
+ * Positions cursor at the last key not greater than (less than, if 'exclusive'
+ * is set) the given one. Returns SAKHADB_NOTFOUND if there is no such key
+ * within the lower bound.
+ */
+int sakhadb_btree_cursor_seek_last(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, int exclusive);
+
+/**
+ * Sets the lower bound for backward cursor movement.
+ */
+void sakhadb_btree_cursor_set_lower(sakhadb_btree_cursor_t cursor, const void* key, size_t nkey, int exclusive);
+
+/**
+ * Positions cursor at the n-th (counting from 0) key in ascending order.
+ * Returns SAKHADB_NOTFOUND if there is no such key or it is out of bounds.
+ */
+int sakhadb_btree_cursor_nth(sakhadb_btree_cursor_t cursor, uint64_t n);
+
+/**
+ * Returns in 'pRank' the number of keys less than the key under cursor.
+ */
+int sakhadb_btree_cursor_rank(sakhadb_btree_cursor_t cursor, uint64_t* pRank);
+
+/**
+ * Returns pointer to the key of the current entry.
+ */
+const void* sakhadb_btree_cursor_key(sakhadb_btree_cursor_t cursor, size_t* nkey);
+
+/**
+ * Returns pointer to the inline payload of the current entry, or NULL if the
+ * entry refers to a data page. Valid until the tree is modified.
+ */
+const void* sakhadb_btree_cursor_payload(sakhadb_btree_cursor_t cursor, size_t* npayload);
+
 #endif // _SAKHADB_CURSOR_H_
@@ -20,6 +20,7 @@
 
 #include "dbdata.h"
 
+#include <assert.h>
 #include <string.h>
 #include <cpl/cpl_allocator.h>
 
@@ -43,12 +44,581 @@
 #   define SLOG_DBDATA_FATAL(...)
 #endif // SLOG_DBDATA_ENABLE
 
+/**
+ * Records up to 1/SAKHADB_DBDATA_PACK_FRACTION of the page are packed into
+ * slotted pages, larger ones take extents of consecutive pages.
+ */
+#define SAKHADB_DBDATA_PACK_FRACTION    4
+
+/**
+ * Most pages in an extent. Each extent is read from file at once.
+ */
+#ifndef SAKHADB_DBDATA_EXTENT_PAGES
+#   define SAKHADB_DBDATA_EXTENT_PAGES  1024
+#endif
+
 /***************************** Private Interface ******************************/
 struct DBData
 {
     sakhadb_pager_t     pager;      /* middle interface for file representation */
+    Pgno                fill;       /* Slotted page new records go to, 0 if none */
+#if SAKHADB_THREADSAFE
+    sakhadb_mutex_t     mutex;      /* Guards slotted pages */
+#endif
+};
+
+#if SAKHADB_THREADSAFE
+#   define dbdataEnter(d)   sakhadb_mutex_enter((d)->mutex)
+#   define dbdataLeave(d)   sakhadb_mutex_leave((d)->mutex)
+#else // SAKHADB_THREADSAFE
+#   define dbdataEnter(d)
+#   define dbdataLeave(d)
+#endif // SAKHADB_THREADSAFE
+
+/**
+ * Slotted data page. Records are packed right after the header and never
+ * move while the page is written to, so readers need no locks; a freed
+ * record is squeezed out at once. Slots grow down from the end of the page.
+ */
+struct DataPageHeader
+{
+    uint16_t    nslots;             /* Number of slots */
+    uint16_t    nrecords;           /* Number of records */
+    uint16_t    used;               /* End of records */
+    uint16_t    reserved;
 };
 
+struct DataSlot
+{
+    uint16_t    off;                /* Offset of the record */
+    uint16_t    size;               /* Size of the record, 0 if the slot is free */
+};
+
+#define dbdataSlot(h, page_size, i) ((struct DataSlot*)((char*)(h) + (page_size)) - 1 - (i))
+#define dbdataAlign(n) (((n) + 3) & ~(size_t)3)
+
+/**
+ * Large record. Its first page starts with the header and the list of
+ * extents, the data follows them and runs through all pages of the extents.
+ */
+struct DataExtentHeader
+{
+    uint32_t    length;             /* Size of the data */
+    uint32_t    nextents;           /* Number of extents */
+};
+
+struct DataExtent
+{
+    Pgno        no;                 /* First page of the extent */
+    Pgno        count;              /* Number of pages */
+};
+
+#define dbdataExtents(h) ((struct DataExtent*)((struct DataExtentHeader*)(h) + 1))
+#define dbdataExtentHeaderSize(nextents) \
+    (sizeof(struct DataExtentHeader) + (nextents) * sizeof(struct DataExtent))
+
+struct DBDataBlob
+{
+    struct DBData*  dbdata;
+    Pgno            no;                 /* Record id */
+    size_t          size;               /* Size of the record */
+    size_t          tail;               /* Offset of the next append */
+};
+
+static inline size_t dbdataFreeSpace(struct DataPageHeader* h, size_t page_size)
+{
+    return page_size - h->used - h->nslots * sizeof(struct DataSlot);
+}
+
+/**
+ * Checks whether the slotted page takes a record of 'size' bytes.
+ */
+static inline int dbdataHasRoom(struct DataPageHeader* h, size_t page_size, size_t size)
+{
+    if(h->nrecords < h->nslots)
+    {
+        return dbdataFreeSpace(h, page_size) >= size;
+    }
+    
+    return h->nslots < SAKHADB_DBDATA_MAX_SLOTS &&
+           dbdataFreeSpace(h, page_size) >= size + sizeof(struct DataSlot);
+}
+
+/**
+ * Requests free page whose number fits in a record id.
+ */
+static int dbdataRequestPage(struct DBData* dbdata, sakhadb_page_t* pPage)
+{
+    int rc = sakhadb_pager_request_free_page(dbdata->pager, pPage);
+    if(rc == SAKHADB_OK && (*pPage)->no > sakhadb_dbdata_rid_page(~(Pgno)0))
+    {
+        SLOG_DBDATA_ERROR("dbdataRequestPage: page number is out of record ids [%d]", (*pPage)->no);
+        sakhadb_pager_add_freelist(dbdata->pager, *pPage);
+        rc = SAKHADB_FULL;
+    }
+    return rc;
+}
+
+static int dbdataWriteRecord(struct DBData* dbdata, const void* data, size_t ndata, Pgno* pNo)
+{
+    int rc = SAKHADB_OK;
+    size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    size_t size = dbdataAlign(ndata);
+    sakhadb_page_t page = 0;
+    struct DataPageHeader* h;
+    
+    dbdataEnter(dbdata);
+    if(dbdata->fill)
+    {
+        rc = sakhadb_pager_request_page(dbdata->pager, dbdata->fill, &page);
+        if(rc)
+        {
+            SLOG_DBDATA_ERROR("dbdataWriteRecord: failed to fetch page [%d]", rc);
+            goto Lexit;
+        }
+        
+        if(!dbdataHasRoom(page->data, page_size, size))
+        {
+            page = 0;
+        }
+    }
+    
+    if(!page)
+    {
+        rc = dbdataRequestPage(dbdata, &page);
+        if(rc)
+        {
+            SLOG_DBDATA_ERROR("dbdataWriteRecord: failed to fetch free page [%d]", rc);
+            goto Lexit;
+        }
+        
+        h = page->data;
+        h->nslots = 0;
+        h->nrecords = 0;
+        h->used = sizeof(struct DataPageHeader);
+        h->reserved = 0;
+        dbdata->fill = page->no;
+    }
+    
+    // Slot of a freed record is taken first
+    h = page->data;
+    uint16_t i = 0;
+    if(h->nrecords < h->nslots)
+    {
+        while(dbdataSlot(h, page_size, i)->size)
+        {
+            ++i;
+        }
+    }
+    else
+    {
+        i = h->nslots++;
+    }
+    
+    struct DataSlot* slot = dbdataSlot(h, page_size, i);
+    if(data)
+    {
+        memcpy((char*)h + h->used, data, ndata);
+    }
+    else
+    {
+        memset((char*)h + h->used, 0, ndata);
+    }
+    slot->off = h->used;
+    slot->size = (uint16_t)ndata;
+    h->used += size;
+    h->nrecords += 1;
+    sakhadb_pager_save_page(dbdata->pager, page);
+    
+    *pNo = sakhadb_dbdata_rid(page->no, i + 1);
+    
+Lexit:
+    dbdataLeave(dbdata);
+    return rc;
+}
+
+static int dbdataFreeRecord(struct DBData* dbdata, Pgno no)
+{
+    size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    sakhadb_page_t page;
+    
+    dbdataEnter(dbdata);
+    int rc = sakhadb_pager_request_page(dbdata->pager, sakhadb_dbdata_rid_page(no), &page);
+    if(rc)
+    {
+        SLOG_DBDATA_ERROR("dbdataFreeRecord: failed to fetch page [%d]", rc);
+        goto Lexit;
+    }
+    
+    struct DataPageHeader* h = page->data;
+    struct DataSlot* slot = dbdataSlot(h, page_size, sakhadb_dbdata_rid_slot(no) - 1);
+    assert(slot->size);
+    
+    // Records above the freed one move down
+    uint16_t off = slot->off;
+    uint16_t size = (uint16_t)dbdataAlign(slot->size);
+    memmove((char*)h + off, (char*)h + off + size, h->used - off - size);
+    h->used -= size;
+    for(uint16_t i = 0; i < h->nslots; ++i)
+    {
+        struct DataSlot* s = dbdataSlot(h, page_size, i);
+        if(s->size && s->off > off)
+        {
+            s->off -= size;
+        }
+    }
+    
+    slot->off = 0;
+    slot->size = 0;
+    h->nrecords -= 1;
+    while(h->nslots && dbdataSlot(h, page_size, h->nslots - 1)->size == 0)
+    {
+        h->nslots--;
+    }
+    
+    if(h->nrecords == 0)
+    {
+        if(dbdata->fill == page->no)
+        {
+            dbdata->fill = 0;
+        }
+        sakhadb_pager_add_freelist(dbdata->pager, page);
+        goto Lexit;
+    }
+    
+    sakhadb_pager_save_page(dbdata->pager, page);
+    
+    // New records go to the page with the most room
+    if(dbdata->fill != page->no)
+    {
+        sakhadb_page_t fill = 0;
+        if(dbdata->fill)
+        {
+            rc = sakhadb_pager_request_page(dbdata->pager, dbdata->fill, &fill);
+            if(rc)
+            {
+                goto Lexit;
+            }
+        }
+        
+        if(!fill || dbdataFreeSpace(fill->data, page_size) < dbdataFreeSpace(h, page_size))
+        {
+            dbdata->fill = page->no;
+        }
+    }
+    
+Lexit:
+    dbdataLeave(dbdata);
+    return rc;
+}
+
+/**
+ * Returns pages of the first 'nextents' extents to freelist after a failed
+ * write.
+ */
+static void dbdataReleaseExtents(struct DBData* dbdata, const struct DataExtent* extents, size_t nextents)
+{
+    // Reverse order, as dbdataFreeExtents() does
+    for(size_t i = nextents; i-- > 0;)
+    {
+        for(Pgno j = extents[i].count; j-- > 0;)
+        {
+            sakhadb_page_t page;
+            int rc = sakhadb_pager_request_page(dbdata->pager, extents[i].no + j, &page);
+            if(rc)
+            {
+                SLOG_DBDATA_ERROR("dbdataReleaseExtents: failed to fetch page [%d]", rc);
+                continue;
+            }
+            sakhadb_pager_add_freelist(dbdata->pager, page);
+        }
+    }
+}
+
+static int dbdataWriteExtents(struct DBData* dbdata, const void* data, size_t ndata, Pgno* pNo)
+{
+    int rc = SAKHADB_OK;
+    size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    
+    // Header grows with the number of extents it lists
+    size_t nextents = 1;
+    size_t npages;
+    while(1)
+    {
+        npages = (dbdataExtentHeaderSize(nextents) + ndata + page_size - 1) / page_size;
+        size_t n = (npages + SAKHADB_DBDATA_EXTENT_PAGES - 1) / SAKHADB_DBDATA_EXTENT_PAGES;
+        if(n <= nextents)
+        {
+            break;
+        }
+        nextents = n;
+    }
+    
+    size_t nheader = dbdataExtentHeaderSize(nextents);
+    if(nheader >= page_size)
+    {
+        SLOG_DBDATA_ERROR("dbdataWriteExtents: too many extents [%d]", nextents);
+        return SAKHADB_TOOBIG;
+    }
+    
+    struct DataExtent* extents = cpl_allocator_allocate(cpl_allocator_get_default(),
+                                                        nextents * sizeof(struct DataExtent));
+    if(!extents)
+    {
+        return SAKHADB_NOMEM;
+    }
+    
+    size_t nrequested;
+    for(nrequested = 0; nrequested < nextents; ++nrequested)
+    {
+        size_t count = npages - nrequested * SAKHADB_DBDATA_EXTENT_PAGES;
+        extents[nrequested].count = (Pgno)((count < SAKHADB_DBDATA_EXTENT_PAGES) ? count : SAKHADB_DBDATA_EXTENT_PAGES);
+        rc = sakhadb_pager_request_extent(dbdata->pager, extents[nrequested].count, &extents[nrequested].no);
+        if(rc)
+        {
+            break;
+        }
+    }
+    
+    if(rc == SAKHADB_OK && extents[0].no > sakhadb_dbdata_rid_page(~(Pgno)0))
+    {
+        SLOG_DBDATA_ERROR("dbdataWriteExtents: page number is out of record ids [%d]", extents[0].no);
+        rc = SAKHADB_FULL;
+    }
+    
+    const char* in = data;
+    size_t left = ndata;
+    for(size_t i = 0; i < nextents && rc == SAKHADB_OK; ++i)
+    {
+        for(Pgno j = 0; j < extents[i].count; ++j)
+        {
+            sakhadb_page_t page;
+            rc = sakhadb_pager_request_page(dbdata->pager, extents[i].no + j, &page);
+            if(rc)
+            {
+                SLOG_DBDATA_ERROR("dbdataWriteExtents: failed to fetch page [%d]", rc);
+                break;
+            }
+            
+            char* out = page->data;
+            size_t room = page_size;
+            if(i == 0 && j == 0)
+            {
+                struct DataExtentHeader* h = page->data;
+                h->length = (uint32_t)ndata;
+                h->nextents = (uint32_t)nextents;
+                memcpy(dbdataExtents(h), extents, nextents * sizeof(struct DataExtent));
+                out += nheader;
+                room -= nheader;
+            }
+            
+            size_t n = (left < room) ? left : room;
+            if(in)
+            {
+                memcpy(out, in, n);
+                in += n;
+            }
+            else
+            {
+                memset(out, 0, n);
+            }
+            left -= n;
+            sakhadb_pager_save_page(dbdata->pager, page);
+        }
+    }
+    
+    if(rc == SAKHADB_OK)
+    {
+        *pNo = sakhadb_dbdata_rid(extents[0].no, 0);
+    }
+    else
+    {
+        dbdataReleaseExtents(dbdata, extents, nrequested);
+    }
+    
+    cpl_allocator_free(cpl_allocator_get_default(), extents);
+    return rc;
+}
+
+static int dbdataReadExtents(struct DBData* dbdata, Pgno no, cpl_region_ref reg)
+{
+    size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_page(dbdata->pager, no, &page);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    struct DataExtentHeader* h = page->data;
+    size_t nheader = dbdataExtentHeaderSize(h->nextents);
+    size_t left = h->length;
+    for(uint32_t i = 0; i < h->nextents && rc == SAKHADB_OK; ++i)
+    {
+        struct DataExtent* e = dbdataExtents(h) + i;
+        rc = sakhadb_pager_load_pages(dbdata->pager, e->no, e->count);
+        for(Pgno j = 0; j < e->count && rc == SAKHADB_OK; ++j)
+        {
+            sakhadb_page_t p;
+            rc = sakhadb_pager_request_page(dbdata->pager, e->no + j, &p);
+            if(rc)
+            {
+                break;
+            }
+            
+            size_t skip = (i == 0 && j == 0) ? nheader : 0;
+            size_t n = (left < page_size - skip) ? left : page_size - skip;
+            cpl_region_append_data(reg, (char*)p->data + skip, n);
+            left -= n;
+        }
+    }
+    
+    return rc;
+}
+
+static int dbdataFreeExtents(struct DBData* dbdata, Pgno no)
+{
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_page(dbdata->pager, no, &page);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    // Page with the header goes last, so pages of each extent head the
+    // freelist in ascending order for sakhadb_pager_request_extent()
+    struct DataExtentHeader* h = page->data;
+    for(uint32_t i = h->nextents; i-- > 0 && rc == SAKHADB_OK;)
+    {
+        struct DataExtent e = dbdataExtents(h)[i];
+        rc = sakhadb_pager_load_pages(dbdata->pager, e.no, e.count);
+        for(Pgno j = e.count; j-- > 0 && rc == SAKHADB_OK;)
+        {
+            sakhadb_page_t p;
+            rc = sakhadb_pager_request_page(dbdata->pager, e.no + j, &p);
+            if(rc == SAKHADB_OK)
+            {
+                sakhadb_pager_add_freelist(dbdata->pager, p);
+            }
+        }
+    }
+    
+    if(rc)
+    {
+        SLOG_DBDATA_ERROR("dbdataFreeExtents: failed to fetch page [%d]", rc);
+    }
+    return rc;
+}
+
+/**
+ * Copies 'ndata' bytes at 'offset' of the data of extent record to 'data'
+ * or, if 'write' is set, from it. Only pages of the range are loaded.
+ */
+static int dbdataCopyExtents(struct DBData* dbdata, Pgno no, size_t offset, void* data, size_t ndata, int write)
+{
+    size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_page(dbdata->pager, no, &page);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    // Seek to the extent and its page holding the offset
+    struct DataExtentHeader* h = page->data;
+    struct DataExtent* extents = dbdataExtents(h);
+    size_t pos = dbdataExtentHeaderSize(h->nextents) + offset;
+    size_t off = pos % page_size;
+    Pgno k = (Pgno)(pos / page_size);
+    uint32_t i = 0;
+    while(i < h->nextents && k >= extents[i].count)
+    {
+        k -= extents[i].count;
+        ++i;
+    }
+    
+    char* p = data;
+    while(ndata && rc == SAKHADB_OK)
+    {
+        assert(i < h->nextents);
+        Pgno count = (Pgno)((off + ndata + page_size - 1) / page_size);
+        if(count > extents[i].count - k)
+        {
+            count = extents[i].count - k;
+        }
+        
+        rc = sakhadb_pager_load_pages(dbdata->pager, extents[i].no + k, count);
+        for(Pgno j = 0; j < count && rc == SAKHADB_OK; ++j)
+        {
+            sakhadb_page_t pg;
+            rc = sakhadb_pager_request_page(dbdata->pager, extents[i].no + k + j, &pg);
+            if(rc)
+            {
+                break;
+            }
+            
+            size_t n = (ndata < page_size - off) ? ndata : page_size - off;
+            if(write)
+            {
+                memcpy((char*)pg->data + off, p, n);
+                sakhadb_pager_save_page(dbdata->pager, pg);
+            }
+            else
+            {
+                memcpy(p, (char*)pg->data + off, n);
+            }
+            p += n;
+            ndata -= n;
+            off = 0;
+        }
+        
+        ++i;
+        k = 0;
+    }
+    
+    return rc;
+}
+
+/**
+ * Copies the range of the record of 'size' bytes to or from 'data'.
+ */
+static int dbdataCopy(struct DBData* dbdata, Pgno no, size_t size, size_t offset, void* data, size_t ndata, int write)
+{
+    if(offset > size || ndata > size - offset)
+    {
+        SLOG_DBDATA_ERROR("dbdataCopy: range is out of the record [%d][%d]", offset, ndata);
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    if(!sakhadb_dbdata_rid_slot(no))
+    {
+        return dbdataCopyExtents(dbdata, sakhadb_dbdata_rid_page(no), offset, data, ndata, write);
+    }
+    
+    // Slotted record may move within its page, it is found anew every time
+    size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_page(dbdata->pager, sakhadb_dbdata_rid_page(no), &page);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    struct DataSlot* slot = dbdataSlot(page->data, page_size, sakhadb_dbdata_rid_slot(no) - 1);
+    char* record = (char*)page->data + slot->off + offset;
+    if(write)
+    {
+        memcpy(record, data, ndata);
+        sakhadb_pager_save_page(dbdata->pager, page);
+    }
+    else
+    {
+        memcpy(data, record, ndata);
+    }
+    
+    return SAKHADB_OK;
+}
+
 /******************************************************************************/
 
 /***************************** Public Interface *******************************/
@@ -63,6 +633,16 @@ int sakhadb_dbdata_create(sakhadb_pager_t pager, sakhadb_dbdata_t* dbdata)
     }
     
     pDbData->pager = pager;
+    pDbData->fill = 0;
+    
+#if SAKHADB_THREADSAFE
+    int rc = sakhadb_mutex_create(&pDbData->mutex);
+    if(rc)
+    {
+        cpl_allocator_free(cpl_allocator_get_default(), pDbData);
+        return rc;
+    }
+#endif
     
     *dbdata = pDbData;
     return SAKHADB_OK;
@@ -70,89 +650,201 @@ int sakhadb_dbdata_create(sakhadb_pager_t pager, sakhadb_dbdata_t* dbdata)
 
 void sakhadb_dbdata_destroy(sakhadb_dbdata_t dbdata)
 {
+#if SAKHADB_THREADSAFE
+    sakhadb_mutex_destroy(dbdata->mutex);
+#endif
     cpl_allocator_free(cpl_allocator_get_default(), dbdata);
 }
 
+void sakhadb_dbdata_rollback(sakhadb_dbdata_t dbdata)
+{
+    SLOG_DBDATA_INFO("sakhadb_dbdata_rollback: forget fill page [%d]", dbdata->fill);
+    dbdataEnter(dbdata);
+    dbdata->fill = 0;
+    dbdataLeave(dbdata);
+}
+
 int sakhadb_dbdata_write(sakhadb_dbdata_t dbdata, const void* data, size_t ndata, Pgno* pNo)
 {
     SLOG_DBDATA_INFO("sakhadb_dbdata_write: save data to page [0x%x][len: %d]", dbdata, ndata);
-    int rc;
-    Pgno* pData;
-    const char* inData = data;
-    size_t area_size = sakhadb_pager_page_size(dbdata->pager, 0) - sizeof(Pgno);
+    size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    if(ndata && ndata <= (page_size - sizeof(struct DataPageHeader)) / SAKHADB_DBDATA_PACK_FRACTION)
+    {
+        return dbdataWriteRecord(dbdata, data, ndata, pNo);
+    }
     
-    sakhadb_page_t page;
-    rc = sakhadb_pager_request_free_page(dbdata->pager, &page);
-    if(rc)
+    return dbdataWriteExtents(dbdata, data, ndata, pNo);
+}
+
+int sakhadb_dbdata_read(sakhadb_dbdata_t dbdata, Pgno no, cpl_region_ref reg)
+{
+    int rc = SAKHADB_OK;
+    size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    
+    if(sakhadb_dbdata_rid_slot(no))
     {
-        SLOG_DBDATA_ERROR("sakhadb_dbdata_write: failed to fetch free page [%d]", rc);
+        sakhadb_page_t page;
+        rc = sakhadb_pager_request_page(dbdata->pager, sakhadb_dbdata_rid_page(no), &page);
+        if(rc) goto Lexit;
+        struct DataSlot* slot = dbdataSlot(page->data, page_size, sakhadb_dbdata_rid_slot(no) - 1);
+        cpl_region_append_data(reg, (char*)page->data + slot->off, slot->size);
         goto Lexit;
     }
     
-    SLOG_DBDATA_INFO("sakhadb_dbdata_write: fetched free page [%d]", page->no);
-    *pNo = page->no;
+    rc = dbdataReadExtents(dbdata, sakhadb_dbdata_rid_page(no), reg);
     
-    while (ndata > area_size)
+Lexit:
+    return rc;
+}
+
+int sakhadb_dbdata_free(sakhadb_dbdata_t dbdata, Pgno no)
+{
+    SLOG_DBDATA_INFO("sakhadb_dbdata_free: free data [0x%x][%d]", dbdata, no);
+    if(sakhadb_dbdata_rid_slot(no))
     {
-        pData = page->data;
-        sakhadb_pager_save_page(dbdata->pager, page);
-        rc = sakhadb_pager_request_free_page(dbdata->pager, &page);
-        if(rc)
-        {
-            SLOG_DBDATA_ERROR("sakhadb_dbdata_write: failed to fetch free page [%d]", rc);
-            goto Lexit;
-        }
-        
-        SLOG_DBDATA_INFO("sakhadb_dbdata_write: fetched free page [%d]", page->no);
-        
-        *pData++ = page->no;
-        
-        memcpy(pData, inData, area_size);
-        ndata -= area_size;
-        inData += area_size;
+        return dbdataFreeRecord(dbdata, no);
     }
     
-    pData = page->data;
-    *pData++ = 0;
-    memcpy(pData, inData, ndata);
+    return dbdataFreeExtents(dbdata, sakhadb_dbdata_rid_page(no));
+}
+
+int sakhadb_dbdata_preload(sakhadb_dbdata_t dbdata, Pgno no, void** ppData)
+{
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_page(dbdata->pager, sakhadb_dbdata_rid_page(no), &page);
     
-    sakhadb_pager_save_page(dbdata->pager, page);
+    if(!rc && sakhadb_dbdata_rid_slot(no))
+    {
+        size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+        struct DataSlot* slot = dbdataSlot(page->data, page_size, sakhadb_dbdata_rid_slot(no) - 1);
+        *ppData = (char*)page->data + slot->off;
+    }
+    else if(!rc)
+    {
+        struct DataExtentHeader* h = page->data;
+        *ppData = (char*)h + dbdataExtentHeaderSize(h->nextents);
+    }
     
-Lexit:
     return rc;
 }
 
-int sakhadb_dbdata_read(sakhadb_dbdata_t dbdata, Pgno no, cpl_region_ref reg)
+int sakhadb_dbdata_view(sakhadb_dbdata_t dbdata, Pgno no, const void** ppData, size_t* pSize)
 {
-    int rc = SAKHADB_OK;
     size_t page_size = sakhadb_pager_page_size(dbdata->pager, 0);
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_page(dbdata->pager, sakhadb_dbdata_rid_page(no), &page);
+    if(rc)
+    {
+        return rc;
+    }
     
-    do
+    if(sakhadb_dbdata_rid_slot(no))
     {
-        sakhadb_page_t page;
-        rc = sakhadb_pager_request_page(dbdata->pager, no, &page);
-        if(rc) goto Lexit;
-        Pgno* pNo = (Pgno*)page->data;
-        cpl_region_append_data(reg, pNo + 1, page_size - sizeof(Pgno));
-        
-        no = *pNo;
-    } while(no);
+        struct DataSlot* slot = dbdataSlot(page->data, page_size, sakhadb_dbdata_rid_slot(no) - 1);
+        *ppData = (char*)page->data + slot->off;
+        *pSize = slot->size;
+        return SAKHADB_OK;
+    }
     
-Lexit:
-    return rc;
+    struct DataExtentHeader* h = page->data;
+    size_t nheader = dbdataExtentHeaderSize(h->nextents);
+    *ppData = (nheader + h->length <= page_size) ? (char*)h + nheader : 0;
+    *pSize = h->length;
+    return SAKHADB_OK;
 }
 
-int sakhadb_dbdata_preload(sakhadb_dbdata_t dbdata, Pgno no, void** ppData)
+int sakhadb_dbdata_read_range(sakhadb_dbdata_t dbdata, Pgno no, size_t offset, void* data, size_t ndata)
 {
-    sakhadb_page_t page;
-    int rc = sakhadb_pager_request_page(dbdata->pager, no, &page);
+    const void* view;
+    size_t size;
+    int rc = sakhadb_dbdata_view(dbdata, no, &view, &size);
+    return rc ? rc : dbdataCopy(dbdata, no, size, offset, data, ndata, 0);
+}
+
+int sakhadb_dbdata_blob_create(sakhadb_dbdata_t dbdata, size_t size, sakhadb_dbdata_blob_t* pBlob)
+{
+    SLOG_DBDATA_INFO("sakhadb_dbdata_blob_create: create record [len: %d]", size);
+    if(!size)
+    {
+        return SAKHADB_INVALID_ARG;
+    }
     
-    if(!rc)
+    struct DBDataBlob* blob = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct DBDataBlob));
+    if(!blob)
     {
-        Pgno* pNo = (Pgno*)page->data;
-        *ppData = pNo + 1;
+        return SAKHADB_NOMEM;
+    }
+    
+    int rc = sakhadb_dbdata_write(dbdata, 0, size, &blob->no);
+    if(rc)
+    {
+        cpl_allocator_free(cpl_allocator_get_default(), blob);
+        return rc;
+    }
+    
+    blob->dbdata = dbdata;
+    blob->size = size;
+    blob->tail = 0;
+    *pBlob = blob;
+    return SAKHADB_OK;
+}
+
+int sakhadb_dbdata_blob_open(sakhadb_dbdata_t dbdata, Pgno no, sakhadb_dbdata_blob_t* pBlob)
+{
+    const void* data;
+    size_t size;
+    int rc = sakhadb_dbdata_view(dbdata, no, &data, &size);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    struct DBDataBlob* blob = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct DBDataBlob));
+    if(!blob)
+    {
+        return SAKHADB_NOMEM;
     }
     
+    blob->dbdata = dbdata;
+    blob->no = no;
+    blob->size = size;
+    blob->tail = size;
+    *pBlob = blob;
+    return SAKHADB_OK;
+}
+
+void sakhadb_dbdata_blob_close(sakhadb_dbdata_blob_t blob)
+{
+    cpl_allocator_free(cpl_allocator_get_default(), blob);
+}
+
+Pgno sakhadb_dbdata_blob_rid(sakhadb_dbdata_blob_t blob)
+{
+    return blob->no;
+}
+
+size_t sakhadb_dbdata_blob_size(sakhadb_dbdata_blob_t blob)
+{
+    return blob->size;
+}
+
+int sakhadb_dbdata_blob_read(sakhadb_dbdata_blob_t blob, size_t offset, void* data, size_t ndata)
+{
+    return dbdataCopy(blob->dbdata, blob->no, blob->size, offset, data, ndata, 0);
+}
+
+int sakhadb_dbdata_blob_write(sakhadb_dbdata_blob_t blob, size_t offset, const void* data, size_t ndata)
+{
+    return dbdataCopy(blob->dbdata, blob->no, blob->size, offset, (void*)data, ndata, 1);
+}
+
+int sakhadb_dbdata_blob_append(sakhadb_dbdata_blob_t blob, const void* data, size_t ndata)
+{
+    int rc = dbdataCopy(blob->dbdata, blob->no, blob->size, blob->tail, (void*)data, ndata, 1);
+    if(rc == SAKHADB_OK)
+    {
+        blob->tail += ndata;
+    }
     return rc;
 }
-/******************************************************************************/
\ No newline at end of file
+/******************************************************************************/
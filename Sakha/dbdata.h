@@ -29,13 +29,95 @@
 #include <cpl/cpl_region.h>
 
 typedef struct DBData* sakhadb_dbdata_t;
+struct sakhadb;
+
+/**
+ * Data is referred by record id: number of the page holding it and the slot
+ * of the record on the page. Small records share slotted pages, slot 0 is
+ * data stored in extents of consecutive pages.
+ */
+#define SAKHADB_DBDATA_SLOT_BITS    7
+#define SAKHADB_DBDATA_MAX_SLOTS    ((1 << SAKHADB_DBDATA_SLOT_BITS) - 1)
+
+#define sakhadb_dbdata_rid(no, slot)    (((Pgno)(no) << SAKHADB_DBDATA_SLOT_BITS) | (slot))
+#define sakhadb_dbdata_rid_page(rid)    ((Pgno)(rid) >> SAKHADB_DBDATA_SLOT_BITS)
+#define sakhadb_dbdata_rid_slot(rid)    ((rid) & SAKHADB_DBDATA_MAX_SLOTS)
 
 int sakhadb_dbdata_create(sakhadb_pager_t pager, sakhadb_dbdata_t* data);
 void sakhadb_dbdata_destroy(sakhadb_dbdata_t);
 
+/**
+ * Returns data store of the opened database, for code working below
+ * collections. Defined in sakhadb.c.
+ */
+sakhadb_dbdata_t sakhadb_dbdata_of(struct sakhadb* db);
+
+/**
+ * Forgets the slotted page new records go to, it may be gone with rolled back
+ * changes. Called by sakhadb_rollback().
+ */
+void sakhadb_dbdata_rollback(sakhadb_dbdata_t dbdata);
+
+/**
+ * Writes the data and returns its record id in 'pNo'. Data up to a quarter
+ * of the page goes into a slotted page along with other records. NULL data
+ * writes zeros.
+ */
 int sakhadb_dbdata_write(sakhadb_dbdata_t dbdata, const void* data, size_t ndata, Pgno* pNo);
 int sakhadb_dbdata_read(sakhadb_dbdata_t dbdata, Pgno no, cpl_region_ref reg);
 
+/**
+ * Frees the record. Slotted page is compacted, record ids of other records
+ * stay the same; pages left empty are returned to the freelist.
+ */
+int sakhadb_dbdata_free(sakhadb_dbdata_t dbdata, Pgno no);
+
 int sakhadb_dbdata_preload(sakhadb_dbdata_t dbdata, Pgno no, void** ppData);
 
+/**
+ * Returns in 'ppData' pointer to the record in its page, or NULL if the
+ * record spans several pages and has to be read. The pointer stays valid
+ * until the record or another record of its page is freed.
+ */
+int sakhadb_dbdata_view(sakhadb_dbdata_t dbdata, Pgno no, const void** ppData, size_t* pSize);
+
+/**
+ * Reads 'ndata' bytes at 'offset' of the record. Only pages of the range are
+ * loaded. Returns SAKHADB_INVALID_ARG if the range is out of the record.
+ */
+int sakhadb_dbdata_read_range(sakhadb_dbdata_t dbdata, Pgno no, size_t offset, void* data, size_t ndata);
+
+/**
+ * Handle of a record for partial reads and writes, so a large record is
+ * written without building it in memory first.
+ */
+typedef struct DBDataBlob* sakhadb_dbdata_blob_t;
+
+/**
+ * Creates a zero-filled record of 'size' bytes to be written in parts.
+ * Size is fixed, extents of the record are allocated at once.
+ */
+int sakhadb_dbdata_blob_create(sakhadb_dbdata_t dbdata, size_t size, sakhadb_dbdata_blob_t* pBlob);
+
+/**
+ * Opens the record. Appends of opened record start past its end.
+ */
+int sakhadb_dbdata_blob_open(sakhadb_dbdata_t dbdata, Pgno no, sakhadb_dbdata_blob_t* pBlob);
+void sakhadb_dbdata_blob_close(sakhadb_dbdata_blob_t blob);
+
+Pgno sakhadb_dbdata_blob_rid(sakhadb_dbdata_blob_t blob);
+size_t sakhadb_dbdata_blob_size(sakhadb_dbdata_blob_t blob);
+
+/**
+ * Reads or writes 'ndata' bytes at 'offset'. Returns SAKHADB_INVALID_ARG if
+ * the range is out of the record.
+ */
+int sakhadb_dbdata_blob_read(sakhadb_dbdata_blob_t blob, size_t offset, void* data, size_t ndata);
+int sakhadb_dbdata_blob_write(sakhadb_dbdata_blob_t blob, size_t offset, const void* data, size_t ndata);
+
+/**
+ * Writes the data right after the data appended before.
+ */
+int sakhadb_dbdata_blob_append(sakhadb_dbdata_blob_t blob, const void* data, size_t ndata);
+
 #endif // _SAKHADB_DBDATA_H_
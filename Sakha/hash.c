@@ -0,0 +1,488 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "hash.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <cpl/cpl_allocator.h>
+
+#include "sakhadb.h"
+#include "logger.h"
+#include "btree.h"
+
+/**
+ * Turn on/off logging for hash routines
+ */
+//#define SLOG_HASH_ENABLE    1
+
+#if SLOG_HASH_ENABLE
+#   define SLOG_HASH_INFO  SLOG_INFO
+#   define SLOG_HASH_WARN  SLOG_WARN
+#   define SLOG_HASH_ERROR SLOG_ERROR
+#   define SLOG_HASH_FATAL SLOG_FATAL
+#else // SLOG_HASH_ENABLE
+#   define SLOG_HASH_INFO(...)
+#   define SLOG_HASH_WARN(...)
+#   define SLOG_HASH_ERROR(...)
+#   define SLOG_HASH_FATAL(...)
+#endif // SLOG_HASH_ENABLE
+
+/***************************** Private Interface ******************************/
+
+/**
+ * "SHSH" at the start of the root page, B-tree node flags and LSM root never
+ * take this value.
+ */
+#define SAKHADB_HASH_MAGIC      0x48534853
+
+/**
+ * Root page, followed by the list of directory pages.
+ */
+struct HashRoot
+{
+    uint32_t                magic;      /* SAKHADB_HASH_MAGIC */
+    Pgno                    tree;       /* Root of the _id tree */
+    uint32_t                depth;      /* Global depth, directory has 2^depth entries */
+    uint32_t                ndir;       /* Number of directory pages */
+};
+
+#define hashRootDir(root) ((Pgno*)((char*)(root) + sizeof(struct HashRoot)))
+
+struct HashEntry
+{
+    char                    key[SAKHADB_BTREE_OID_SIZE];
+    Pgno                    no;         /* Data page */
+};
+
+/**
+ * Bucket page, followed by its entries in no particular order.
+ */
+struct HashBucket
+{
+    uint16_t                depth;      /* Local depth, all keys share this many low hash bits */
+    uint16_t                count;      /* Number of entries */
+    Pgno                    next;       /* Overflow bucket, only buckets of the deepest directory have them */
+};
+
+#define hashBucketEntries(b) ((struct HashEntry*)((char*)(b) + sizeof(struct HashBucket)))
+
+struct Hash
+{
+    sakhadb_pager_t         pager;      /* Pager */
+    sakhadb_page_t          page;       /* Root page */
+    struct HashRoot*        root;       /* Content of the root page */
+    Pgno*                   dir;        /* Directory: bucket page of each hash suffix */
+    uint32_t                per_dir;    /* Directory entries per directory page */
+    uint32_t                per_bucket; /* Entries per bucket page */
+    uint32_t                max_depth;  /* Depth the directory pages on the root page allow */
+};
+
+static inline uint64_t hashKey(const void* key)
+{
+    const unsigned char* p = key;
+    uint64_t h = 14695981039346656037ULL;
+    for(int i = 0; i < SAKHADB_BTREE_OID_SIZE; ++i)
+    {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    
+    // Low bits select the bucket, mix the high ones into them
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline struct HashBucket* hashBucket(sakhadb_page_t page)
+{
+    return page->data;
+}
+
+/**
+ * Points directory entry 'i' to bucket page 'no' and writes it out.
+ */
+static int hashSetDir(struct Hash* hash, uint32_t i, Pgno no)
+{
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_page(hash->pager, hashRootDir(hash->root)[i / hash->per_dir], &page);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    hash->dir[i] = no;
+    ((Pgno*)page->data)[i % hash->per_dir] = no;
+    sakhadb_pager_save_page(hash->pager, page);
+    return SAKHADB_OK;
+}
+
+static int hashNewBucket(struct Hash* hash, uint16_t depth, sakhadb_page_t* pPage)
+{
+    int rc = sakhadb_pager_request_free_page(hash->pager, pPage);
+    if(rc == SAKHADB_OK)
+    {
+        struct HashBucket* b = hashBucket(*pPage);
+        b->depth = depth;
+        b->count = 0;
+        b->next = 0;
+        sakhadb_pager_save_page(hash->pager, *pPage);
+    }
+    return rc;
+}
+
+/**
+ * Doubles the directory, new half refers to the same buckets as the old one.
+ */
+static int hashGrowDir(struct Hash* hash)
+{
+    struct HashRoot* root = hash->root;
+    uint32_t n = (uint32_t)1 << root->depth;
+    Pgno* dir = cpl_allocator_realloc(cpl_allocator_get_default(), hash->dir, 2 * n * sizeof(Pgno));
+    if(!dir)
+    {
+        return SAKHADB_NOMEM;
+    }
+    hash->dir = dir;
+    
+    int rc = SAKHADB_OK;
+    uint32_t ndir = (2 * n + hash->per_dir - 1) / hash->per_dir;
+    for(; root->ndir < ndir && rc == SAKHADB_OK; root->ndir += 1)
+    {
+        sakhadb_page_t page;
+        rc = sakhadb_pager_request_free_page(hash->pager, &page);
+        if(rc)
+        {
+            break;
+        }
+        hashRootDir(root)[root->ndir] = page->no;
+    }
+    
+    for(uint32_t i = 0; i < n && rc == SAKHADB_OK; ++i)
+    {
+        rc = hashSetDir(hash, n + i, dir[i]);
+    }
+    
+    if(rc == SAKHADB_OK)
+    {
+        root->depth += 1;
+    }
+    sakhadb_pager_save_page(hash->pager, hash->page);
+    return rc;
+}
+
+/**
+ * Splits bucket at directory entry 'i' by the next hash bit, or chains an
+ * overflow bucket to it if the directory can not grow.
+ */
+static int hashSplit(struct Hash* hash, uint32_t i, sakhadb_page_t page)
+{
+    struct HashBucket* b = hashBucket(page);
+    if(b->depth == hash->root->depth)
+    {
+        if(hash->root->depth == hash->max_depth)
+        {
+            sakhadb_page_t next;
+            int rc = hashNewBucket(hash, b->depth, &next);
+            if(rc == SAKHADB_OK)
+            {
+                hashBucket(next)->next = b->next;
+                b->next = next->no;
+                sakhadb_pager_save_page(hash->pager, page);
+            }
+            return rc;
+        }
+        
+        int rc = hashGrowDir(hash);
+        if(rc)
+        {
+            return rc;
+        }
+    }
+    
+    uint32_t depth = b->depth;
+    sakhadb_page_t split;
+    int rc = hashNewBucket(hash, depth + 1, &split);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    // Keys with the next bit set go to the new bucket
+    struct HashBucket* s = hashBucket(split);
+    struct HashEntry* from = hashBucketEntries(b);
+    struct HashEntry* to = hashBucketEntries(s);
+    uint16_t count = 0;
+    for(uint16_t k = 0; k < b->count; ++k)
+    {
+        if(hashKey(from[k].key) & ((uint64_t)1 << depth))
+        {
+            to[s->count++] = from[k];
+        }
+        else
+        {
+            from[count++] = from[k];
+        }
+    }
+    b->count = count;
+    b->depth = depth + 1;
+    sakhadb_pager_save_page(hash->pager, page);
+    
+    uint32_t n = (uint32_t)1 << hash->root->depth;
+    uint32_t low = (i & (((uint32_t)1 << depth) - 1)) | ((uint32_t)1 << depth);
+    for(uint32_t j = low; j < n && rc == SAKHADB_OK; j += (uint32_t)2 << depth)
+    {
+        rc = hashSetDir(hash, j, split->no);
+    }
+    return rc;
+}
+
+/**
+ * Finds the entry of the key. Returns its bucket page in 'pPage' and index in
+ * 'pPos', or SAKHADB_NOTFOUND.
+ */
+static int hashFind(struct Hash* hash, const void* key, sakhadb_page_t* pPage, uint16_t* pPos)
+{
+    uint32_t i = (uint32_t)hashKey(key) & (((uint32_t)1 << hash->root->depth) - 1);
+    for(Pgno no = hash->dir[i]; no; )
+    {
+        sakhadb_page_t page;
+        int rc = sakhadb_pager_request_page(hash->pager, no, &page);
+        if(rc)
+        {
+            return rc;
+        }
+        
+        struct HashBucket* b = hashBucket(page);
+        struct HashEntry* e = hashBucketEntries(b);
+        for(uint16_t k = 0; k < b->count; ++k)
+        {
+            if(memcmp(e[k].key, key, SAKHADB_BTREE_OID_SIZE) == 0)
+            {
+                *pPage = page;
+                *pPos = k;
+                return SAKHADB_OK;
+            }
+        }
+        no = b->next;
+    }
+    return SAKHADB_NOTFOUND;
+}
+
+/******************************************************************************/
+
+/***************************** Public Interface *******************************/
+int sakhadb_hash_is_root(sakhadb_page_t page)
+{
+    return ((struct HashRoot*)page->data)->magic == SAKHADB_HASH_MAGIC;
+}
+
+void sakhadb_hash_init_new_root(sakhadb_pager_t pager, sakhadb_page_t page, Pgno tree)
+{
+    assert(page->no > 1);
+    struct HashRoot* root = page->data;
+    root->magic = SAKHADB_HASH_MAGIC;
+    root->tree = tree;
+    root->depth = 0;
+    root->ndir = 0;
+    sakhadb_pager_save_page(pager, page);
+}
+
+int sakhadb_hash_create(sakhadb_pager_t pager, Pgno no, sakhadb_hash_t* pHash)
+{
+    SLOG_HASH_INFO("sakhadb_hash_create: open hash [%d]", no);
+    cpl_allocator_ref allocator = cpl_allocator_get_default();
+    struct Hash* hash = cpl_allocator_allocate(allocator, sizeof(struct Hash));
+    if(!hash)
+    {
+        SLOG_HASH_FATAL("sakhadb_hash_create: failed to allocate memory for Hash");
+        return SAKHADB_NOMEM;
+    }
+    
+    size_t page_size = sakhadb_pager_page_size(pager, 0);
+    hash->pager = pager;
+    hash->dir = 0;
+    hash->per_dir = (uint32_t)(page_size / sizeof(Pgno));
+    hash->per_bucket = (uint32_t)((page_size - sizeof(struct HashBucket)) / sizeof(struct HashEntry));
+    
+    uint64_t capacity = (uint64_t)hash->per_dir * ((page_size - sizeof(struct HashRoot)) / sizeof(Pgno));
+    for(hash->max_depth = 0; ((uint64_t)2 << hash->max_depth) <= capacity && hash->max_depth < 31; )
+    {
+        hash->max_depth += 1;
+    }
+    
+    int rc = sakhadb_pager_request_page(pager, no, &hash->page);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    struct HashRoot* root = hash->root = hash->page->data;
+    assert(root->magic == SAKHADB_HASH_MAGIC);
+    
+    hash->dir = cpl_allocator_allocate(allocator, ((size_t)1 << root->depth) * sizeof(Pgno));
+    if(!hash->dir)
+    {
+        rc = SAKHADB_NOMEM;
+        goto Lfail;
+    }
+    
+    if(root->ndir == 0)
+    {
+        // New hash: a single bucket
+        sakhadb_page_t page, bucket;
+        rc = sakhadb_pager_request_free_page(pager, &page);
+        if(rc)
+        {
+            goto Lfail;
+        }
+        
+        hashRootDir(root)[0] = page->no;
+        root->ndir = 1;
+        sakhadb_pager_save_page(pager, hash->page);
+        
+        rc = hashNewBucket(hash, 0, &bucket);
+        rc = rc ? rc : hashSetDir(hash, 0, bucket->no);
+        if(rc)
+        {
+            goto Lfail;
+        }
+    }
+    
+    uint32_t n = (uint32_t)1 << root->depth;
+    for(uint32_t d = 0; d * hash->per_dir < n; ++d)
+    {
+        sakhadb_page_t page;
+        rc = sakhadb_pager_request_page(pager, hashRootDir(root)[d], &page);
+        if(rc)
+        {
+            goto Lfail;
+        }
+        
+        uint32_t count = (n - d * hash->per_dir < hash->per_dir) ? n - d * hash->per_dir : hash->per_dir;
+        memcpy(hash->dir + d * hash->per_dir, page->data, count * sizeof(Pgno));
+    }
+    
+    *pHash = hash;
+    return SAKHADB_OK;
+    
+Lfail:
+    SLOG_HASH_ERROR("sakhadb_hash_create: failed to open hash [%d][%d]", no, rc);
+    if(hash->dir)
+    {
+        cpl_allocator_free(allocator, hash->dir);
+    }
+    cpl_allocator_free(allocator, hash);
+    return rc;
+}
+
+void sakhadb_hash_destroy(sakhadb_hash_t hash)
+{
+    cpl_allocator_free(cpl_allocator_get_default(), hash->dir);
+    cpl_allocator_free(cpl_allocator_get_default(), hash);
+}
+
+Pgno sakhadb_hash_tree(sakhadb_hash_t hash)
+{
+    return hash->root->tree;
+}
+
+int sakhadb_hash_insert(sakhadb_hash_t hash, const void* key, Pgno no)
+{
+    sakhadb_page_t page;
+    uint16_t pos;
+    int rc = hashFind(hash, key, &page, &pos);
+    if(rc != SAKHADB_NOTFOUND)
+    {
+        return rc;
+    }
+    
+    uint64_t h = hashKey(key);
+    for(;;)
+    {
+        uint32_t i = (uint32_t)h & (((uint32_t)1 << hash->root->depth) - 1);
+        rc = sakhadb_pager_request_page(hash->pager, hash->dir[i], &page);
+        while(rc == SAKHADB_OK && hashBucket(page)->count == hash->per_bucket && hashBucket(page)->next)
+        {
+            rc = sakhadb_pager_request_page(hash->pager, hashBucket(page)->next, &page);
+        }
+        
+        if(rc)
+        {
+            return rc;
+        }
+        
+        struct HashBucket* b = hashBucket(page);
+        if(b->count < hash->per_bucket)
+        {
+            struct HashEntry* e = hashBucketEntries(b) + b->count;
+            memcpy(e->key, key, SAKHADB_BTREE_OID_SIZE);
+            e->no = no;
+            b->count += 1;
+            sakhadb_pager_save_page(hash->pager, page);
+            return SAKHADB_OK;
+        }
+        
+        // Overflow buckets are chained to the first one
+        rc = sakhadb_pager_request_page(hash->pager, hash->dir[i], &page);
+        rc = rc ? rc : hashSplit(hash, i, page);
+        if(rc)
+        {
+            SLOG_HASH_ERROR("sakhadb_hash_insert: failed to split bucket [%d][%d]", hash->dir[i], rc);
+            return rc;
+        }
+    }
+}
+
+int sakhadb_hash_lookup(sakhadb_hash_t hash, const void* key, Pgno* pNo)
+{
+    sakhadb_page_t page;
+    uint16_t pos;
+    int rc = hashFind(hash, key, &page, &pos);
+    if(rc == SAKHADB_OK)
+    {
+        *pNo = hashBucketEntries(hashBucket(page))[pos].no;
+    }
+    return rc;
+}
+
+int sakhadb_hash_delete(sakhadb_hash_t hash, const void* key, Pgno* pNo)
+{
+    sakhadb_page_t page;
+    uint16_t pos;
+    int rc = hashFind(hash, key, &page, &pos);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    struct HashBucket* b = hashBucket(page);
+    struct HashEntry* e = hashBucketEntries(b);
+    if(pNo)
+    {
+        *pNo = e[pos].no;
+    }
+    
+    e[pos] = e[b->count - 1];
+    b->count -= 1;
+    sakhadb_pager_save_page(hash->pager, page);
+    return SAKHADB_OK;
+}
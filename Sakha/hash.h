@@ -0,0 +1,73 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/**
+ * Extendible hash of _id's. Maps ObjectId of a document to its data page, so
+ * a point lookup reads a single bucket page: the directory of 2^depth bucket
+ * pages is kept in memory and mirrored to directory pages listed on the root
+ * page. A full bucket is split in two and only the directory entries of that
+ * bucket are updated; the directory doubles when a bucket as deep as the
+ * directory splits. Buckets are never merged.
+ */
+
+#ifndef _SAKHADB_HASH_H_
+#define _SAKHADB_HASH_H_
+
+#include "paging.h"
+
+typedef struct Hash* sakhadb_hash_t;
+
+/**
+ * Checks whether the page is the root page of a hash.
+ */
+int sakhadb_hash_is_root(sakhadb_page_t page);
+
+/**
+ * Initializes new root page of a hash of the collection with _id tree at
+ * page 'tree'.
+ */
+void sakhadb_hash_init_new_root(sakhadb_pager_t pager, sakhadb_page_t page, Pgno tree);
+
+int sakhadb_hash_create(sakhadb_pager_t pager, Pgno no, sakhadb_hash_t* pHash);
+void sakhadb_hash_destroy(sakhadb_hash_t hash);
+
+/**
+ * Root page of the _id tree of the collection.
+ */
+Pgno sakhadb_hash_tree(sakhadb_hash_t hash);
+
+/**
+ * Adds ObjectId 'key' with data page 'no'. Insert of an existing key is
+ * ignored, as it is with B-tree.
+ */
+int sakhadb_hash_insert(sakhadb_hash_t hash, const void* key, Pgno no);
+
+/**
+ * Finds data page of the key. Returns SAKHADB_NOTFOUND if there is no such key.
+ */
+int sakhadb_hash_lookup(sakhadb_hash_t hash, const void* key, Pgno* pNo);
+
+/**
+ * Removes the key, its data page is returned in 'pNo' (may be NULL).
+ * Returns SAKHADB_NOTFOUND if there is no such key.
+ */
+int sakhadb_hash_delete(sakhadb_hash_t hash, const void* key, Pgno* pNo);
+
+#endif // _SAKHADB_HASH_H_
@@ -0,0 +1,941 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "index.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cpl/cpl_allocator.h>
+
+#include "sakhadb.h"
+#include "logger.h"
+
+/**
+ * Turn on/off logging for index routines
+ */
+//#define SLOG_INDEX_ENABLE    1
+
+#if SLOG_INDEX_ENABLE
+#   define SLOG_INDEX_INFO  SLOG_INFO
+#   define SLOG_INDEX_WARN  SLOG_WARN
+#   define SLOG_INDEX_ERROR SLOG_ERROR
+#   define SLOG_INDEX_FATAL SLOG_FATAL
+#else // SLOG_INDEX_ENABLE
+#   define SLOG_INDEX_INFO(...)
+#   define SLOG_INDEX_WARN(...)
+#   define SLOG_INDEX_ERROR(...)
+#   define SLOG_INDEX_FATAL(...)
+#endif // SLOG_INDEX_ENABLE
+
+/***************************** Private Interface ******************************/
+
+/**
+ * Byte appended to a value to get a key greater than any entry with this
+ * value: tags of encoded _id are less than it.
+ */
+#define SAKHADB_INDEX_PAST      0xFF
+
+static inline int indexKeyFlags(sakhadb_index_t index)
+{
+    return (index->flags & SAKHADB_INDEX_DESCENDING) ? SAKHADB_KEY_DESCENDING : 0;
+}
+
+/**
+ * Encoded value of the first element of the document.
+ */
+static int indexFirstValue(sakhadb_index_t index, const char* doc, sakhadb_key_t* key)
+{
+    const char* name = doc + sizeof(uint32_t) + 1;
+    return sakhadb_key_append(key, name[-1], name + strlen(name) + 1, indexKeyFlags(index));
+}
+
+/**
+ * Key bounding entries with the value of 'doc': before all of them, or past
+ * all of them if 'past' is set.
+ */
+static int indexBound(sakhadb_index_t index, const char* doc, int past, sakhadb_key_t* key)
+{
+    sakhadb_key_init(key);
+    int rc = indexFirstValue(index, doc, key);
+    if(rc == SAKHADB_OK && past)
+    {
+        if(key->size == SAKHADB_BTREE_MAX_KEY_SIZE)
+        {
+            return SAKHADB_TOOBIG;
+        }
+        key->data[key->size++] = (char)SAKHADB_INDEX_PAST;
+    }
+    return rc;
+}
+
+/**
+ * Walk over values of a document in the index.
+ */
+struct IndexVisit
+{
+    sakhadb_index_t     index;
+    const char*         id;         /* Element _id of the document */
+    Pgno                no;         /* Data page of the document */
+    int                 count;      /* Values visited */
+    int                 (*op)(struct IndexVisit* visit, const sakhadb_key_t* key);
+    sakhadb_index_build_t build;    /* Build receiving the keys, if any */
+    size_t              nfields;    /* Size of included fields */
+    char                fields[SAKHADB_BTREE_MAX_KEY_SIZE]; /* Included fields of the document */
+};
+
+/**
+ * Collects included fields of the document as BSON elements named by their
+ * paths. Missing fields are left out.
+ */
+static int indexVisitFields(struct IndexVisit* visit, const char* doc)
+{
+    visit->nfields = 0;
+    for(const char* path = visit->index->include; path && *path; path += strlen(path) + 1)
+    {
+        char type;
+        const void* value;
+        if(sakhadb_key_find(doc, path, &type, &value) != SAKHADB_OK)
+        {
+            continue;
+        }
+        
+        size_t npath = strlen(path) + 1;
+        size_t nvalue = sakhadb_key_value_size(type, value);
+        if(visit->nfields + 1 + npath + nvalue > sizeof(visit->fields))
+        {
+            return SAKHADB_TOOBIG;
+        }
+        
+        char* field = visit->fields + visit->nfields;
+        field[0] = type;
+        memcpy(field + 1, path, npath);
+        memcpy(field + 1 + npath, value, nvalue);
+        visit->nfields += 1 + npath + nvalue;
+    }
+    return SAKHADB_OK;
+}
+
+static int indexVisitInsert(struct IndexVisit* visit, const sakhadb_key_t* key)
+{
+    return sakhadb_btree_insert(visit->index->tree, key->data, key->size, visit->no);
+}
+
+static int indexVisitDelete(struct IndexVisit* visit, const sakhadb_key_t* key)
+{
+    // Same value may be met twice in an array
+    int rc = sakhadb_btree_delete(visit->index->tree, key->data, key->size, 0);
+    return (rc == SAKHADB_NOTFOUND) ? SAKHADB_OK : rc;
+}
+
+static int indexVisitValue(void* arg, char type, const void* value)
+{
+    struct IndexVisit* visit = arg;
+    visit->count += 1;
+    
+    sakhadb_key_t key;
+    sakhadb_key_init(&key);
+    int rc = sakhadb_key_append(&key, type, value, indexKeyFlags(visit->index));
+    if(rc == SAKHADB_OK)
+    {
+        const char* name = visit->id + 1;
+        rc = sakhadb_key_append(&key, *visit->id, name + strlen(name) + 1, 0);
+    }
+    
+    if(rc == SAKHADB_OK && visit->index->include)
+    {
+        // Fields and their size follow the _id
+        if(key.size + visit->nfields + 1 > SAKHADB_BTREE_MAX_KEY_SIZE)
+        {
+            rc = SAKHADB_TOOBIG;
+        }
+        else
+        {
+            memcpy(key.data + key.size, visit->fields, visit->nfields);
+            key.size += visit->nfields;
+            key.data[key.size++] = (char)visit->nfields;
+        }
+    }
+    
+    if(rc)
+    {
+        SLOG_INDEX_WARN("indexVisitValue: value is not indexable [%s][%d]", visit->index->path, rc);
+        return rc;
+    }
+    
+    return visit->op ? visit->op(visit, &key) : SAKHADB_OK;
+}
+
+/**
+ * Applies 'op' to keys of all values of the document, only builds them if
+ * 'op' is 0.
+ */
+static int indexVisit(sakhadb_index_t index, const char* doc,
+                      int (*op)(struct IndexVisit* visit, const sakhadb_key_t* key), Pgno no,
+                      sakhadb_index_build_t build)
+{
+    struct IndexVisit visit;
+    visit.index = index;
+    visit.id = doc + sizeof(uint32_t);
+    visit.no = no;
+    visit.count = 0;
+    visit.op = op;
+    visit.build = build;
+    
+    int arrays;
+    int rc = indexVisitFields(&visit, doc);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    rc = sakhadb_key_find_all(doc, index->path, indexVisitValue, &visit, &arrays);
+    if(rc == SAKHADB_OK && visit.count == 0)
+    {
+        // Missing field is null
+        rc = indexVisitValue(&visit, 0x0A, doc);
+    }
+    
+    if(rc == SAKHADB_OK && arrays && op)
+    {
+        index->flags |= SAKHADB_INDEX_MULTIKEY;
+    }
+    
+    return rc;
+}
+
+/**
+ * Set of _id's returned by a cursor, open addressing.
+ */
+struct IndexSeen
+{
+    size_t      count;      /* Number of _id's */
+    size_t      capacity;   /* Number of slots, power of 2 */
+    char*       slots;      /* Used flag and ObjectId of each slot */
+};
+
+#define SAKHADB_INDEX_SEEN_SLOT     (1 + SAKHADB_BTREE_OID_SIZE)
+
+static char* indexSeenSlot(struct IndexSeen* seen, const char* id)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(int i = 0; i < SAKHADB_BTREE_OID_SIZE; ++i)
+    {
+        h = (h ^ (unsigned char)id[i]) * 1099511628211ULL;
+    }
+    
+    size_t i = (size_t)(h ^ (h >> 32)) & (seen->capacity - 1);
+    char* slot = seen->slots + i * SAKHADB_INDEX_SEEN_SLOT;
+    while(slot[0] && memcmp(slot + 1, id, SAKHADB_BTREE_OID_SIZE) != 0)
+    {
+        i = (i + 1) & (seen->capacity - 1);
+        slot = seen->slots + i * SAKHADB_INDEX_SEEN_SLOT;
+    }
+    return slot;
+}
+
+static int indexSeenGrow(struct IndexSeen* seen)
+{
+    size_t capacity = seen->capacity;
+    char* slots = seen->slots;
+    
+    seen->capacity = capacity ? capacity * 2 : 64;
+    seen->slots = cpl_allocator_allocate(cpl_allocator_get_default(), seen->capacity * SAKHADB_INDEX_SEEN_SLOT);
+    if(!seen->slots)
+    {
+        seen->capacity = capacity;
+        seen->slots = slots;
+        return SAKHADB_NOMEM;
+    }
+    
+    memset(seen->slots, 0, seen->capacity * SAKHADB_INDEX_SEEN_SLOT);
+    for(size_t i = 0; i < capacity; ++i)
+    {
+        const char* slot = slots + i * SAKHADB_INDEX_SEEN_SLOT;
+        if(slot[0])
+        {
+            memcpy(indexSeenSlot(seen, slot + 1), slot, SAKHADB_INDEX_SEEN_SLOT);
+        }
+    }
+    
+    cpl_allocator_free(cpl_allocator_get_default(), slots);
+    return SAKHADB_OK;
+}
+
+/**
+ * Index build. Keys of scanned documents are collected in a buffer; full
+ * buffer is sorted and written out as a run (a bulk-built tree), and runs are
+ * merged into the index tree at the end. Changes of the collection made
+ * during the build are logged and applied to the index tree after that.
+ */
+struct IndexBuild
+{
+    sakhadb_btree_ctx_t ctx;        /* B-tree context */
+    sakhadb_index_t     index;      /* Index being built, tree is open at the end */
+    char*               buffer;     /* Entries from the front, pointers to them from the back */
+    size_t              used;       /* Bytes used by entries */
+    size_t              count;      /* Number of entries */
+    Pgno*               runs;       /* Roots of runs written out */
+    size_t              nruns;      /* Number of runs */
+    char*               log;        /* Log of changes */
+    size_t              nlog;       /* Bytes of the log */
+    size_t              log_capacity; /* Bytes allocated for the log */
+};
+
+/**
+ * Entry of the buffer and the log.
+ */
+struct IndexBuildEntry
+{
+    char                op;         /* SAKHADB_INDEX_BUILD_INSERT or SAKHADB_INDEX_BUILD_DELETE */
+    uint16_t            nkey;       /* Size of the key */
+    Pgno                no;         /* Data page of the document */
+    char                key[SAKHADB_BTREE_MAX_KEY_SIZE];
+};
+
+#define SAKHADB_INDEX_BUILD_INSERT  0
+#define SAKHADB_INDEX_BUILD_DELETE  1
+
+static inline size_t indexBuildEntrySize(uint16_t nkey)
+{
+    // Entries are packed, fields are read by memcpy
+    return offsetof(struct IndexBuildEntry, key) + nkey;
+}
+
+static inline const char** indexBuildPointers(struct IndexBuild* build)
+{
+    return (const char**)(build->buffer + SAKHADB_INDEX_BUILD_BUFFER) - build->count;
+}
+
+static inline int indexBuildCompare(const char* a, const char* b)
+{
+    struct IndexBuildEntry x, y;
+    memcpy(&x, a, offsetof(struct IndexBuildEntry, key));
+    memcpy(&y, b, offsetof(struct IndexBuildEntry, key));
+    
+    const char* kx = a + offsetof(struct IndexBuildEntry, key);
+    const char* ky = b + offsetof(struct IndexBuildEntry, key);
+    int cmp = memcmp(kx, ky, (x.nkey < y.nkey) ? x.nkey : y.nkey);
+    return cmp ? cmp : (int)x.nkey - (int)y.nkey;
+}
+
+static int indexBuildPointerCompare(const void* a, const void* b)
+{
+    return indexBuildCompare(*(const char* const*)a, *(const char* const*)b);
+}
+
+/**
+ * Sorts the buffer and writes it out as a run.
+ */
+static int indexBuildSpill(struct IndexBuild* build)
+{
+    Pgno* runs = cpl_allocator_realloc(cpl_allocator_get_default(), build->runs, (build->nruns + 1) * sizeof(Pgno));
+    if(!runs)
+    {
+        return SAKHADB_NOMEM;
+    }
+    build->runs = runs;
+    
+    sakhadb_btree_builder_t builder;
+    int rc = sakhadb_btree_builder_create(build->ctx, 0, &builder);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    const char** ptrs = indexBuildPointers(build);
+    qsort(ptrs, build->count, sizeof(const char*), indexBuildPointerCompare);
+    
+    for(size_t i = 0; i < build->count && rc == SAKHADB_OK; ++i)
+    {
+        // Same value may be met twice in an array
+        if(i > 0 && indexBuildCompare(ptrs[i - 1], ptrs[i]) == 0)
+        {
+            continue;
+        }
+        
+        struct IndexBuildEntry e;
+        memcpy(&e, ptrs[i], offsetof(struct IndexBuildEntry, key));
+        rc = sakhadb_btree_builder_add(builder, ptrs[i] + offsetof(struct IndexBuildEntry, key), e.nkey, 0, 0, e.no);
+    }
+    
+    int frc = sakhadb_btree_builder_finish(builder, build->runs + build->nruns);
+    rc = rc ? rc : frc;
+    if(rc == SAKHADB_OK)
+    {
+        build->nruns += 1;
+        build->used = 0;
+        build->count = 0;
+    }
+    
+    return rc;
+}
+
+static int indexVisitCollect(struct IndexVisit* visit, const sakhadb_key_t* key)
+{
+    int rc = SAKHADB_OK;
+    struct IndexBuild* build = visit->build;
+    size_t sz = indexBuildEntrySize(key->size);
+    if(build->used + sz + (build->count + 1) * sizeof(const char*) > SAKHADB_INDEX_BUILD_BUFFER)
+    {
+        rc = indexBuildSpill(build);
+        if(rc)
+        {
+            return rc;
+        }
+    }
+    
+    struct IndexBuildEntry e;
+    e.op = SAKHADB_INDEX_BUILD_INSERT;
+    e.nkey = key->size;
+    e.no = visit->no;
+    memcpy(e.key, key->data, key->size);
+    
+    char* entry = build->buffer + build->used;
+    memcpy(entry, &e, sz);
+    build->used += sz;
+    build->count += 1;
+    indexBuildPointers(build)[0] = entry;
+    
+    return rc;
+}
+
+static int indexBuildLog(struct IndexVisit* visit, const sakhadb_key_t* key, char op)
+{
+    struct IndexBuild* build = visit->build;
+    size_t sz = indexBuildEntrySize(key->size);
+    if(build->nlog + sz > build->log_capacity)
+    {
+        size_t capacity = build->log_capacity ? build->log_capacity * 2 : 4096;
+        char* log = cpl_allocator_realloc(cpl_allocator_get_default(), build->log, capacity);
+        if(!log)
+        {
+            return SAKHADB_NOMEM;
+        }
+        
+        build->log = log;
+        build->log_capacity = capacity;
+    }
+    
+    struct IndexBuildEntry e;
+    e.op = op;
+    e.nkey = key->size;
+    e.no = visit->no;
+    memcpy(e.key, key->data, key->size);
+    memcpy(build->log + build->nlog, &e, sz);
+    build->nlog += sz;
+    return SAKHADB_OK;
+}
+
+static int indexVisitLogInsert(struct IndexVisit* visit, const sakhadb_key_t* key)
+{
+    return indexBuildLog(visit, key, SAKHADB_INDEX_BUILD_INSERT);
+}
+
+static int indexVisitLogDelete(struct IndexVisit* visit, const sakhadb_key_t* key)
+{
+    return indexBuildLog(visit, key, SAKHADB_INDEX_BUILD_DELETE);
+}
+
+/**
+ * Merges the runs into a new tree, returns its root in 'pNo'.
+ */
+static int indexBuildMerge(struct IndexBuild* build, Pgno* pNo)
+{
+    int rc = SAKHADB_OK;
+    cpl_allocator_ref allocator = cpl_allocator_get_default();
+    size_t n = build->nruns;
+    
+    sakhadb_btree_t* trees = cpl_allocator_allocate(allocator, n * (sizeof(sakhadb_btree_t) + sizeof(sakhadb_btree_cursor_t)));
+    if(!trees)
+    {
+        return SAKHADB_NOMEM;
+    }
+    
+    sakhadb_btree_cursor_t* cursors = (sakhadb_btree_cursor_t*)(trees + n);
+    memset(trees, 0, n * (sizeof(sakhadb_btree_t) + sizeof(sakhadb_btree_cursor_t)));
+    
+    sakhadb_btree_builder_t builder;
+    rc = sakhadb_btree_builder_create(build->ctx, 0, &builder);
+    if(rc)
+    {
+        goto Lfree;
+    }
+    
+    for(size_t i = 0; i < n && rc == SAKHADB_OK; ++i)
+    {
+        rc = sakhadb_btree_create(build->ctx, build->runs[i], &trees[i]);
+        rc = rc ? rc : sakhadb_btree_cursor_create(trees[i], &cursors[i]);
+        if(rc == SAKHADB_OK && sakhadb_btree_cursor_first(cursors[i]) != SAKHADB_OK)
+        {
+            // Run is empty
+            sakhadb_btree_cursor_destroy(cursors[i]);
+            cursors[i] = 0;
+        }
+    }
+    
+    // Runs are few, so the least key is searched linearly
+    char last[SAKHADB_BTREE_MAX_KEY_SIZE];
+    size_t nlast = 0;
+    while(rc == SAKHADB_OK)
+    {
+        size_t min = n;
+        const char* key = 0;
+        size_t nkey = 0;
+        for(size_t i = 0; i < n; ++i)
+        {
+            if(!cursors[i])
+            {
+                continue;
+            }
+            
+            size_t nk;
+            const char* k = sakhadb_btree_cursor_key(cursors[i], &nk);
+            int cmp = key ? memcmp(k, key, (nk < nkey) ? nk : nkey) : -1;
+            if(cmp < 0 || (cmp == 0 && nk < nkey))
+            {
+                min = i;
+                key = k;
+                nkey = nk;
+            }
+        }
+        
+        if(min == n)
+        {
+            break;
+        }
+        
+        if(nkey != nlast || memcmp(key, last, nkey) != 0)
+        {
+            rc = sakhadb_btree_builder_add(builder, key, nkey, 0, 0, sakhadb_btree_cursor_pgno(cursors[min]));
+            memcpy(last, key, nkey);
+            nlast = nkey;
+        }
+        
+        if(rc == SAKHADB_OK && sakhadb_btree_cursor_next(cursors[min]) != SAKHADB_OK)
+        {
+            sakhadb_btree_cursor_destroy(cursors[min]);
+            cursors[min] = 0;
+        }
+    }
+    
+    int frc = sakhadb_btree_builder_finish(builder, pNo);
+    rc = rc ? rc : frc;
+    
+Lfree:
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(cursors[i])
+        {
+            sakhadb_btree_cursor_destroy(cursors[i]);
+        }
+        
+        if(trees[i])
+        {
+            int drc = sakhadb_btree_drop(trees[i]);
+            rc = rc ? rc : drc;
+        }
+    }
+    
+    cpl_allocator_free(allocator, trees);
+    return rc;
+}
+
+/**
+ * Allocates index on 'path' with included fields 'include', its tree is not
+ * open.
+ */
+static sakhadb_index_t indexAllocate(const char* path, const char* include)
+{
+    size_t npath = strlen(path);
+    size_t ninclude = 0;
+    if(include)
+    {
+        while(include[ninclude])
+        {
+            ninclude += strlen(include + ninclude) + 1;
+        }
+        ninclude += 1;
+    }
+    
+    sakhadb_index_t index = cpl_allocator_allocate(cpl_allocator_get_default(),
+                                                   sizeof(struct Index) + npath + ninclude);
+    if(index)
+    {
+        index->tree = 0;
+        index->flags = 0;
+        index->next = 0;
+        memcpy(index->path, path, npath + 1);
+        index->include = include ? index->path + npath + 1 : 0;
+        if(include)
+        {
+            memcpy(index->include, include, ninclude);
+        }
+    }
+    return index;
+}
+
+/******************************************************************************/
+
+/***************************** Public Interface *******************************/
+int sakhadb_index_create(sakhadb_btree_ctx_t ctx, Pgno no, const char* path, const char* include,
+                         int flags, sakhadb_index_t* index)
+{
+    int rc = SAKHADB_OK;
+    sakhadb_index_t idx = indexAllocate(path, include);
+    if(!idx)
+    {
+        rc = SAKHADB_NOMEM;
+        goto Lexit;
+    }
+    
+    rc = sakhadb_btree_create(ctx, no, &idx->tree);
+    if(rc)
+    {
+        SLOG_INDEX_ERROR("sakhadb_index_create: failed to open tree [%d][%d]", no, rc);
+        cpl_allocator_free(cpl_allocator_get_default(), idx);
+        goto Lexit;
+    }
+    
+    idx->flags = flags;
+    *index = idx;
+    
+Lexit:
+    return rc;
+}
+
+void sakhadb_index_destroy(sakhadb_index_t index)
+{
+    sakhadb_btree_destroy(index->tree);
+    cpl_allocator_free(cpl_allocator_get_default(), index);
+}
+
+int sakhadb_index_drop(sakhadb_index_t index)
+{
+    int rc = sakhadb_btree_drop(index->tree);
+    cpl_allocator_free(cpl_allocator_get_default(), index);
+    return rc;
+}
+
+int sakhadb_index_check(sakhadb_index_t index, const void* doc)
+{
+    return indexVisit(index, doc, 0, 0, 0);
+}
+
+int sakhadb_index_insert(sakhadb_index_t index, const void* doc, Pgno no)
+{
+    return indexVisit(index, doc, indexVisitInsert, no, 0);
+}
+
+int sakhadb_index_delete(sakhadb_index_t index, const void* doc)
+{
+    return indexVisit(index, doc, indexVisitDelete, 0, 0);
+}
+
+const char* sakhadb_index_entry_id(sakhadb_index_t index, const void* key, size_t nkey)
+{
+    const char* end = (const char*)key + nkey;
+    if(index->include)
+    {
+        end -= 1 + (unsigned char)end[-1];
+    }
+    return end - SAKHADB_BTREE_OID_SIZE;
+}
+
+void sakhadb_index_entry_document(sakhadb_index_t index, const void* key, size_t nkey, char* doc)
+{
+    const char* id = sakhadb_index_entry_id(index, key, nkey);
+    size_t nfields = (unsigned char)((const char*)key)[nkey - 1];
+    
+    char* p = doc + sizeof(uint32_t);
+    *p++ = 0x07;
+    memcpy(p, "_id", 4);
+    p += 4;
+    memcpy(p, id, SAKHADB_BTREE_OID_SIZE);
+    p += SAKHADB_BTREE_OID_SIZE;
+    memcpy(p, id + SAKHADB_BTREE_OID_SIZE, nfields);
+    p += nfields;
+    *p++ = 0;
+    
+    uint32_t size = (uint32_t)(p - doc);
+    memcpy(doc, &size, sizeof(size));
+}
+
+int sakhadb_index_seen_create(sakhadb_index_seen_t* seen)
+{
+    sakhadb_index_seen_t s = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct IndexSeen));
+    if(!s)
+    {
+        return SAKHADB_NOMEM;
+    }
+    
+    s->count = 0;
+    s->capacity = 0;
+    s->slots = 0;
+    
+    int rc = indexSeenGrow(s);
+    if(rc)
+    {
+        cpl_allocator_free(cpl_allocator_get_default(), s);
+        return rc;
+    }
+    
+    *seen = s;
+    return SAKHADB_OK;
+}
+
+void sakhadb_index_seen_destroy(sakhadb_index_seen_t seen)
+{
+    cpl_allocator_free(cpl_allocator_get_default(), seen->slots);
+    cpl_allocator_free(cpl_allocator_get_default(), seen);
+}
+
+int sakhadb_index_seen_add(sakhadb_index_seen_t seen, const char* id, int* pSeen)
+{
+    char* slot = indexSeenSlot(seen, id);
+    *pSeen = slot[0];
+    if(slot[0])
+    {
+        return SAKHADB_OK;
+    }
+    
+    slot[0] = 1;
+    memcpy(slot + 1, id, SAKHADB_BTREE_OID_SIZE);
+    seen->count += 1;
+    
+    // Keep at most half of slots used
+    return (seen->count * 2 > seen->capacity) ? indexSeenGrow(seen) : SAKHADB_OK;
+}
+
+int sakhadb_index_build_create(sakhadb_btree_ctx_t ctx, const char* path, const char* include,
+                               int flags, sakhadb_index_build_t* build)
+{
+    cpl_allocator_ref allocator = cpl_allocator_get_default();
+    struct IndexBuild* b = cpl_allocator_allocate(allocator, sizeof(struct IndexBuild));
+    if(!b)
+    {
+        return SAKHADB_NOMEM;
+    }
+    
+    memset(b, 0, sizeof(struct IndexBuild));
+    b->ctx = ctx;
+    b->index = indexAllocate(path, include);
+    b->buffer = cpl_allocator_allocate(allocator, SAKHADB_INDEX_BUILD_BUFFER);
+    if(!b->index || !b->buffer)
+    {
+        sakhadb_index_build_destroy(b);
+        return SAKHADB_NOMEM;
+    }
+    
+    b->index->flags = flags;
+    
+    *build = b;
+    return SAKHADB_OK;
+}
+
+void sakhadb_index_build_destroy(sakhadb_index_build_t build)
+{
+    cpl_allocator_ref allocator = cpl_allocator_get_default();
+    for(size_t i = 0; i < build->nruns; ++i)
+    {
+        sakhadb_btree_t tree;
+        if(sakhadb_btree_create(build->ctx, build->runs[i], &tree) == SAKHADB_OK)
+        {
+            sakhadb_btree_drop(tree);
+        }
+    }
+    
+    if(build->index)
+    {
+        cpl_allocator_free(allocator, build->index);
+    }
+    if(build->buffer)
+    {
+        cpl_allocator_free(allocator, build->buffer);
+    }
+    if(build->runs)
+    {
+        cpl_allocator_free(allocator, build->runs);
+    }
+    if(build->log)
+    {
+        cpl_allocator_free(allocator, build->log);
+    }
+    cpl_allocator_free(allocator, build);
+}
+
+sakhadb_index_t sakhadb_index_build_index(sakhadb_index_build_t build)
+{
+    return build->index;
+}
+
+int sakhadb_index_build_add(sakhadb_index_build_t build, const void* doc, Pgno no)
+{
+    return indexVisit(build->index, doc, indexVisitCollect, no, build);
+}
+
+int sakhadb_index_build_log(sakhadb_index_build_t build, const void* doc, Pgno no, int remove)
+{
+    return indexVisit(build->index, doc, remove ? indexVisitLogDelete : indexVisitLogInsert, no, build);
+}
+
+int sakhadb_index_build_finish(sakhadb_index_build_t build, Pgno* pNo, sakhadb_index_t* index)
+{
+    int rc = SAKHADB_OK;
+    Pgno no;
+    if(build->count || build->nruns == 0)
+    {
+        rc = indexBuildSpill(build);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    if(build->nruns == 1)
+    {
+        no = build->runs[0];
+        build->nruns = 0;
+    }
+    else
+    {
+        rc = indexBuildMerge(build, &no);
+        build->nruns = 0;
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    sakhadb_index_t idx = build->index;
+    rc = sakhadb_btree_create(build->ctx, no, &idx->tree);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    // Changes made during the build, in order
+    for(size_t off = 0; off < build->nlog && rc == SAKHADB_OK; )
+    {
+        struct IndexBuildEntry e;
+        memcpy(&e, build->log + off, offsetof(struct IndexBuildEntry, key));
+        const char* key = build->log + off + offsetof(struct IndexBuildEntry, key);
+        if(e.op == SAKHADB_INDEX_BUILD_INSERT)
+        {
+            rc = sakhadb_btree_insert(idx->tree, key, e.nkey, e.no);
+        }
+        else
+        {
+            rc = sakhadb_btree_delete(idx->tree, key, e.nkey, 0);
+            rc = (rc == SAKHADB_NOTFOUND) ? SAKHADB_OK : rc;
+        }
+        off += indexBuildEntrySize(e.nkey);
+    }
+    
+    if(rc)
+    {
+        sakhadb_index_drop(idx);
+        build->index = 0;
+        goto Lexit;
+    }
+    
+    build->index = 0;
+    *pNo = no;
+    *index = idx;
+    
+Lexit:
+    sakhadb_index_build_destroy(build);
+    return rc;
+}
+
+int sakhadb_index_find(sakhadb_index_t index, const void* lower, const void* upper, int flags,
+                       sakhadb_btree_cursor_t* pCursor)
+{
+    int rc = SAKHADB_OK;
+    int lower_excl = flags & SAKHADB_RANGE_LOWER_EXCLUSIVE;
+    int upper_excl = flags & SAKHADB_RANGE_UPPER_EXCLUSIVE;
+    if(index->flags & SAKHADB_INDEX_DESCENDING)
+    {
+        // Greater values go first
+        const void* t = lower;
+        lower = upper;
+        upper = t;
+        
+        int e = lower_excl;
+        lower_excl = upper_excl;
+        upper_excl = e;
+    }
+    
+    // No entry is equal to a bound, so bounds are inclusive
+    sakhadb_key_t lo, hi;
+    if(lower)
+    {
+        rc = indexBound(index, lower, lower_excl, &lo);
+    }
+    
+    if(rc == SAKHADB_OK && upper)
+    {
+        rc = indexBound(index, upper, !upper_excl, &hi);
+    }
+    
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    sakhadb_btree_cursor_t cursor;
+    rc = sakhadb_btree_cursor_create(index->tree, &cursor);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    if(lower)
+    {
+        sakhadb_btree_cursor_set_lower(cursor, lo.data, lo.size, 0);
+    }
+    
+    if(upper)
+    {
+        sakhadb_btree_cursor_set_upper(cursor, hi.data, hi.size, 0);
+    }
+    
+    if(flags & SAKHADB_RANGE_REVERSE)
+    {
+        rc = upper ? sakhadb_btree_cursor_seek_last(cursor, hi.data, hi.size, 0)
+                   : sakhadb_btree_cursor_last(cursor);
+    }
+    else
+    {
+        rc = lower ? sakhadb_btree_cursor_seek(cursor, lo.data, lo.size, 0)
+                   : sakhadb_btree_cursor_first(cursor);
+    }
+    
+    if(rc)
+    {
+        sakhadb_btree_cursor_destroy(cursor);
+        goto Lexit;
+    }
+    
+    *pCursor = cursor;
+    
+Lexit:
+    return rc;
+}
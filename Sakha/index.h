@@ -0,0 +1,180 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/**
+ * Secondary indexes. An index is a B-tree keyed by the normalized value of a
+ * document field (see key.h) followed by the normalized _id of the document,
+ * so equal values are kept in _id order and every key is unique. Entry data
+ * page is the data page of the document, or SAKHADB_INDEX_BY_ID if the
+ * document is found through the _id tree. Arrays are indexed by element, one
+ * entry per distinct element.
+ *
+ * Covering index also stores included fields of the document in its keys, as
+ * BSON elements named by their paths placed after the _id and followed by
+ * their size byte, so queries reading those fields need no data pages.
+ */
+
+#ifndef _SAKHADB_INDEX_H_
+#define _SAKHADB_INDEX_H_
+
+#include "btree.h"
+#include "cursor.h"
+#include "key.h"
+
+/**
+ * Data page of entries whose document has no data page of its own (inline in
+ * the _id tree or in LSM runs). Page 1 holds the catalog, so it never is a
+ * document.
+ */
+#define SAKHADB_INDEX_BY_ID     1
+
+/**
+ * Index flag kept in the catalog along with SAKHADB_INDEX_* flags of
+ * sakhadb.h: some document has an array on the path, so there may be several
+ * entries per document.
+ */
+#define SAKHADB_INDEX_MULTIKEY  0x80
+
+/**
+ * Size of the buffer of keys collected by an index build. Full buffer is
+ * sorted and written out as a run; runs are merged into the index at the end.
+ */
+#ifndef SAKHADB_INDEX_BUILD_BUFFER
+#   define SAKHADB_INDEX_BUILD_BUFFER   1048576
+#endif
+
+/**
+ * Largest document built from an entry of a covering index: _id element and
+ * included fields.
+ */
+#define SAKHADB_INDEX_ENTRY_DOC_SIZE \
+    (sizeof(uint32_t) + 5 + SAKHADB_BTREE_OID_SIZE + SAKHADB_BTREE_MAX_KEY_SIZE + 1)
+
+typedef struct Index* sakhadb_index_t;
+typedef struct IndexSeen* sakhadb_index_seen_t;
+typedef struct IndexBuild* sakhadb_index_build_t;
+struct Index
+{
+    sakhadb_btree_t     tree;       /* Tree of value/_id keys */
+    int                 flags;      /* SAKHADB_INDEX_* flags */
+    sakhadb_index_t     next;       /* Next index of the collection */
+    char*               include;    /* Included field paths, each ending with 0, the list
+                                       ends with an empty one; 0 if index is not covering */
+    char                path[1];    /* Dotted path of the indexed field */
+};
+
+/**
+ * Opens index with root page 'no'. 'include' is the list of included field
+ * paths as in struct Index, or 0.
+ */
+int sakhadb_index_create(sakhadb_btree_ctx_t ctx, Pgno no, const char* path, const char* include,
+                         int flags, sakhadb_index_t* index);
+void sakhadb_index_destroy(sakhadb_index_t index);
+
+/**
+ * Returns pages of the index tree to the pager freelist and destroys the index.
+ */
+int sakhadb_index_drop(sakhadb_index_t index);
+
+/**
+ * Checks that keys of the document 'doc' (raw BSON with _id first) can be
+ * built. Returns SAKHADB_TOOBIG if some key does not fit.
+ */
+int sakhadb_index_check(sakhadb_index_t index, const void* doc);
+
+/**
+ * Adds the document stored at data page 'no' to the index. Missing field is
+ * indexed as null. Sets SAKHADB_INDEX_MULTIKEY if there is an array on the path.
+ */
+int sakhadb_index_insert(sakhadb_index_t index, const void* doc, Pgno no);
+
+/**
+ * Removes the document from the index.
+ */
+int sakhadb_index_delete(sakhadb_index_t index, const void* doc);
+
+/**
+ * Opens cursor at the first entry with value between 'lower' and 'upper'
+ * (raw BSON documents whose first element is the bound, either may be NULL).
+ * Takes SAKHADB_RANGE_* flags. Entries go in index order, which is descending
+ * by value for SAKHADB_INDEX_DESCENDING indexes. Returns SAKHADB_NOTFOUND if
+ * the range is empty.
+ */
+int sakhadb_index_find(sakhadb_index_t index, const void* lower, const void* upper, int flags,
+                       sakhadb_btree_cursor_t* pCursor);
+
+/**
+ * ObjectId of the document of index entry 'key'.
+ */
+const char* sakhadb_index_entry_id(sakhadb_index_t index, const void* key, size_t nkey);
+
+/**
+ * Builds document of _id and included fields of the document from entry 'key'
+ * of a covering index into 'doc' of SAKHADB_INDEX_ENTRY_DOC_SIZE bytes.
+ */
+void sakhadb_index_entry_document(sakhadb_index_t index, const void* key, size_t nkey, char* doc);
+
+/**
+ * Bulk build of a new index. Documents are added in any order and any number
+ * of steps; changes of the collection between the steps are logged and
+ * applied to the index tree after it is loaded.
+ */
+int sakhadb_index_build_create(sakhadb_btree_ctx_t ctx, const char* path, const char* include,
+                               int flags, sakhadb_index_build_t* build);
+
+/**
+ * Abandons the build, pages written so far go back to the freelist.
+ */
+void sakhadb_index_build_destroy(sakhadb_index_build_t build);
+
+/**
+ * Index being built, its tree is not open until the build finishes.
+ */
+sakhadb_index_t sakhadb_index_build_index(sakhadb_index_build_t build);
+
+/**
+ * Adds keys of the document stored at data page 'no'.
+ */
+int sakhadb_index_build_add(sakhadb_index_build_t build, const void* doc, Pgno no);
+
+/**
+ * Logs insertion of the document (removal, if 'remove' is set) made after
+ * the document could be added to the build.
+ */
+int sakhadb_index_build_log(sakhadb_index_build_t build, const void* doc, Pgno no, int remove);
+
+/**
+ * Loads the index tree and returns the index along with its root page.
+ * Destroys the build.
+ */
+int sakhadb_index_build_finish(sakhadb_index_build_t build, Pgno* pNo, sakhadb_index_t* index);
+
+/**
+ * Set of documents returned by a cursor over a multikey index.
+ */
+int sakhadb_index_seen_create(sakhadb_index_seen_t* seen);
+void sakhadb_index_seen_destroy(sakhadb_index_seen_t seen);
+
+/**
+ * Adds ObjectId 'id' to the set, 'pSeen' tells if it was there.
+ */
+int sakhadb_index_seen_add(sakhadb_index_seen_t seen, const char* id, int* pSeen);
+
+#endif // _SAKHADB_INDEX_H_
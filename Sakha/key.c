@@ -0,0 +1,440 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "key.h"
+
+#include <string.h>
+
+#include "sakhadb.h"
+
+/***************************** Private Interface ******************************/
+
+/**
+ * Tags of canonical types, in BSON comparison order. 0x00 ends objects and
+ * arrays, so it is below every tag.
+ */
+#define SAKHADB_KEY_MINKEY      0x01
+#define SAKHADB_KEY_UNDEFINED   0x02
+#define SAKHADB_KEY_NULL        0x07
+#define SAKHADB_KEY_NUMBER      0x0C
+#define SAKHADB_KEY_STRING      0x11
+#define SAKHADB_KEY_OBJECT      0x16
+#define SAKHADB_KEY_ARRAY       0x1B
+#define SAKHADB_KEY_BINARY      0x20
+#define SAKHADB_KEY_OID         0x25
+#define SAKHADB_KEY_BOOL        0x2A
+#define SAKHADB_KEY_DATE        0x2F
+#define SAKHADB_KEY_TIMESTAMP   0x31
+#define SAKHADB_KEY_REGEX       0x34
+#define SAKHADB_KEY_CODE        0x3E
+#define SAKHADB_KEY_MAXKEY      0x81
+
+#define SAKHADB_KEY_SIGN        0x8000000000000000ULL
+
+static inline uint32_t keyLoad32(const void* p)
+{
+    const unsigned char* b = p;
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static inline uint64_t keyLoad64(const void* p)
+{
+    return (uint64_t)keyLoad32(p) | ((uint64_t)keyLoad32((const char*)p + 4) << 32);
+}
+
+static inline int keyPut(sakhadb_key_t* key, const void* data, size_t n)
+{
+    if(key->size + n > SAKHADB_BTREE_MAX_KEY_SIZE)
+    {
+        return SAKHADB_TOOBIG;
+    }
+    
+    memcpy(key->data + key->size, data, n);
+    key->size += n;
+    return SAKHADB_OK;
+}
+
+static inline int keyPutByte(sakhadb_key_t* key, unsigned char b)
+{
+    return keyPut(key, &b, 1);
+}
+
+static inline int keyPut64(sakhadb_key_t* key, uint64_t v)
+{
+    unsigned char b[8];
+    for(int i = 7; i >= 0; --i, v >>= 8)
+    {
+        b[i] = (unsigned char)v;
+    }
+    return keyPut(key, b, sizeof(b));
+}
+
+/**
+ * Escaped bytes terminated with 0x00 0x01.
+ */
+static int keyPutString(sakhadb_key_t* key, const char* s, size_t n)
+{
+    static const unsigned char escape[2] = { 0x00, 0xFF };
+    static const unsigned char end[2] = { 0x00, 0x01 };
+    
+    int rc = SAKHADB_OK;
+    const char* zero;
+    while(rc == SAKHADB_OK && (zero = memchr(s, 0, n)))
+    {
+        rc = keyPut(key, s, zero - s);
+        rc = rc ? rc : keyPut(key, escape, sizeof(escape));
+        n -= zero - s + 1;
+        s = zero + 1;
+    }
+    
+    rc = rc ? rc : keyPut(key, s, n);
+    return rc ? rc : keyPut(key, end, sizeof(end));
+}
+
+/**
+ * Number is the double nearest to it and the integer part the double could
+ * not represent, zero for doubles.
+ */
+static int keyPutNumber(sakhadb_key_t* key, double d, int64_t rest)
+{
+    uint64_t bits = 0;      // NaN is less than any number
+    if(d == d)
+    {
+        d = (d == 0) ? 0 : d;
+        memcpy(&bits, &d, sizeof(bits));
+        bits = (bits & SAKHADB_KEY_SIGN) ? ~bits : (bits | SAKHADB_KEY_SIGN);
+    }
+    
+    int rc = keyPut64(key, bits);
+    return rc ? rc : keyPut64(key, (uint64_t)rest ^ SAKHADB_KEY_SIGN);
+}
+
+static int keyPutInt64(sakhadb_key_t* key, int64_t v)
+{
+    double d = (double)v;
+    if(d >= 9223372036854775808.0)
+    {
+        // Rounded up past INT64_MAX
+        return keyPutNumber(key, d, (int64_t)((uint64_t)v - SAKHADB_KEY_SIGN));
+    }
+    return keyPutNumber(key, d, v - (int64_t)d);
+}
+
+static int keyPutValue(sakhadb_key_t* key, char type, const char* value, const char* name);
+
+/**
+ * Elements of the object or array, array indexes are not encoded.
+ */
+static int keyPutElements(sakhadb_key_t* key, const char* doc, int is_array)
+{
+    int rc = SAKHADB_OK;
+    const char* end = doc + keyLoad32(doc) - 1;
+    const char* el = doc + sizeof(uint32_t);
+    while(rc == SAKHADB_OK && el < end)
+    {
+        char type = *el;
+        const char* name = el + 1;
+        const char* value = name + strlen(name) + 1;
+        rc = keyPutValue(key, type, value, is_array ? 0 : name);
+        el = value + sakhadb_key_value_size(type, value);
+    }
+    
+    return rc ? rc : keyPutByte(key, 0);
+}
+
+static int keyPutValue(
+    sakhadb_key_t* key,
+    char type,                          /* BSON type */
+    const char* value,                  /* BSON value */
+    const char* name                    /* Field name encoded after the tag, 0 if none */
+)
+{
+    int rc;
+    unsigned char tag;
+    switch((unsigned char)type)
+    {
+        case 0x01: case 0x10: case 0x12:
+            tag = SAKHADB_KEY_NUMBER; break;
+        case 0x02: case 0x0E:
+            tag = SAKHADB_KEY_STRING; break;
+        case 0x03:
+            tag = SAKHADB_KEY_OBJECT; break;
+        case 0x04:
+            tag = SAKHADB_KEY_ARRAY; break;
+        case 0x05:
+            tag = SAKHADB_KEY_BINARY; break;
+        case 0x06:
+            tag = SAKHADB_KEY_UNDEFINED; break;
+        case 0x07:
+            tag = SAKHADB_KEY_OID; break;
+        case 0x08:
+            tag = SAKHADB_KEY_BOOL; break;
+        case 0x09:
+            tag = SAKHADB_KEY_DATE; break;
+        case 0x0A:
+            tag = SAKHADB_KEY_NULL; break;
+        case 0x0B:
+            tag = SAKHADB_KEY_REGEX; break;
+        case 0x0D:
+            tag = SAKHADB_KEY_CODE; break;
+        case 0x11:
+            tag = SAKHADB_KEY_TIMESTAMP; break;
+        case 0xFF:
+            tag = SAKHADB_KEY_MINKEY; break;
+        case 0x7F:
+            tag = SAKHADB_KEY_MAXKEY; break;
+        default:
+            return SAKHADB_INVALID_ARG;
+    }
+    
+    rc = keyPutByte(key, tag);
+    if(rc == SAKHADB_OK && name)
+    {
+        rc = keyPutString(key, name, strlen(name));
+    }
+    
+    if(rc)
+    {
+        return rc;
+    }
+    
+    switch((unsigned char)type)
+    {
+        case 0x01:
+        {
+            uint64_t bits = keyLoad64(value);
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            rc = keyPutNumber(key, d, 0);
+            break;
+        }
+        case 0x10:
+            rc = keyPutNumber(key, (int32_t)keyLoad32(value), 0);
+            break;
+        case 0x12:
+            rc = keyPutInt64(key, (int64_t)keyLoad64(value));
+            break;
+        case 0x02: case 0x0E: case 0x0D:
+            rc = keyPutString(key, value + sizeof(uint32_t), keyLoad32(value) - 1);
+            break;
+        case 0x03: case 0x04:
+            rc = keyPutElements(key, value, type == 0x04);
+            break;
+        case 0x05:
+        {
+            // Length goes first, then subtype and bytes
+            uint32_t n = keyLoad32(value);
+            unsigned char len[4] = { n >> 24, n >> 16, n >> 8, n };
+            rc = keyPut(key, len, sizeof(len));
+            rc = rc ? rc : keyPut(key, value + sizeof(uint32_t), n + 1);
+            break;
+        }
+        case 0x07:
+            rc = keyPut(key, value, SAKHADB_BTREE_OID_SIZE);
+            break;
+        case 0x08:
+            rc = keyPutByte(key, *value != 0);
+            break;
+        case 0x09:
+            rc = keyPut64(key, keyLoad64(value) ^ SAKHADB_KEY_SIGN);
+            break;
+        case 0x11:
+            rc = keyPut64(key, keyLoad64(value));
+            break;
+        case 0x0B:
+        {
+            size_t npattern = strlen(value);
+            rc = keyPutString(key, value, npattern);
+            rc = rc ? rc : keyPutString(key, value + npattern + 1, strlen(value + npattern + 1));
+            break;
+        }
+        default:
+            rc = SAKHADB_OK;
+            break;
+    }
+    
+    return rc;
+}
+
+/**
+ * Element of the document named by 'n' bytes of 'name', 0 if there is none.
+ */
+static const char* keyFindElement(const char* doc, const char* name, size_t n)
+{
+    const char* end = doc + keyLoad32(doc) - 1;
+    const char* el = doc + sizeof(uint32_t);
+    while(el < end && (strncmp(el + 1, name, n) != 0 || el[1 + n] != 0))
+    {
+        const char* value = el + 1 + strlen(el + 1) + 1;
+        el = value + sakhadb_key_value_size(*el, value);
+    }
+    
+    return (el < end) ? el : 0;
+}
+
+static int keyFindAll(const char* doc, const char* path, sakhadb_key_visit_fn fn, void* arg, int* pArrays)
+{
+    const char* dot = strchr(path, '.');
+    size_t n = dot ? (size_t)(dot - path) : strlen(path);
+    const char* el = keyFindElement(doc, path, n);
+    if(!el)
+    {
+        return SAKHADB_OK;
+    }
+    
+    const char* value = el + 1 + n + 1;
+    if(*el == 0x03 && dot)
+    {
+        return keyFindAll(value, dot + 1, fn, arg, pArrays);
+    }
+    
+    if(*el != 0x04)
+    {
+        return dot ? SAKHADB_OK : fn(arg, *el, value);
+    }
+    
+    // Array is fanned out
+    *pArrays += 1;
+    
+    int rc = SAKHADB_OK;
+    const char* end = value + keyLoad32(value) - 1;
+    const char* e = value + sizeof(uint32_t);
+    if(e == end && !dot)
+    {
+        rc = fn(arg, 0x06, value);      // Empty array is undefined
+    }
+    
+    while(rc == SAKHADB_OK && e < end)
+    {
+        const char* v = e + 1 + strlen(e + 1) + 1;
+        if(!dot)
+        {
+            rc = fn(arg, *e, v);
+        }
+        else if(*e == 0x03)
+        {
+            rc = keyFindAll(v, dot + 1, fn, arg, pArrays);
+        }
+        e = v + sakhadb_key_value_size(*e, v);
+    }
+    
+    return rc;
+}
+
+/******************************************************************************/
+
+/***************************** Public Interface *******************************/
+void sakhadb_key_init(sakhadb_key_t* key)
+{
+    key->size = 0;
+}
+
+int sakhadb_key_append(sakhadb_key_t* key, char type, const void* value, int flags)
+{
+    uint16_t start = key->size;
+    int rc = keyPutValue(key, type, value, 0);
+    if(rc)
+    {
+        key->size = start;
+        return rc;
+    }
+    
+    if(flags & SAKHADB_KEY_DESCENDING)
+    {
+        for(uint16_t i = start; i < key->size; ++i)
+        {
+            key->data[i] = ~key->data[i];
+        }
+    }
+    
+    return SAKHADB_OK;
+}
+
+int sakhadb_key_find(const void* doc, const char* path, char* pType, const void** pValue)
+{
+    const char* d = doc;
+    for(;;)
+    {
+        const char* dot = strchr(path, '.');
+        size_t n = dot ? (size_t)(dot - path) : strlen(path);
+        
+        const char* el = keyFindElement(d, path, n);
+        if(!el)
+        {
+            return SAKHADB_NOTFOUND;
+        }
+        
+        const char* value = el + 1 + n + 1;
+        if(!dot)
+        {
+            *pType = *el;
+            *pValue = value;
+            return SAKHADB_OK;
+        }
+        
+        if(*el != 0x03 && *el != 0x04)
+        {
+            return SAKHADB_NOTFOUND;
+        }
+        
+        d = value;
+        path = dot + 1;
+    }
+}
+
+int sakhadb_key_find_all(const void* doc, const char* path, sakhadb_key_visit_fn fn, void* arg,
+                         int* pArrays)
+{
+    *pArrays = 0;
+    return keyFindAll(doc, path, fn, arg, pArrays);
+}
+
+size_t sakhadb_key_value_size(char type, const void* value)
+{
+    const char* v = value;
+    switch((unsigned char)type)
+    {
+        case 0x01: case 0x09: case 0x11: case 0x12:
+            return 8;
+        case 0x02: case 0x0D: case 0x0E:
+            return sizeof(uint32_t) + keyLoad32(v);
+        case 0x03: case 0x04: case 0x0F:
+            return keyLoad32(v);
+        case 0x05:
+            return sizeof(uint32_t) + 1 + keyLoad32(v);
+        case 0x07:
+            return SAKHADB_BTREE_OID_SIZE;
+        case 0x08:
+            return 1;
+        case 0x0B:
+        {
+            size_t npattern = strlen(v) + 1;
+            return npattern + strlen(v + npattern) + 1;
+        }
+        case 0x0C:
+            return sizeof(uint32_t) + keyLoad32(v) + SAKHADB_BTREE_OID_SIZE;
+        case 0x10:
+            return 4;
+        case 0x13:
+            return 16;
+        default:    // Undefined, Null, MinKey, MaxKey
+            return 0;
+    }
+}
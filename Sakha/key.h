@@ -0,0 +1,92 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/**
+ * Normalized keys. BSON values and tuples of them are encoded into byte
+ * strings that compare with memcmp() in the BSON comparison order, so B-tree
+ * compares keys of any type as bytes:
+ *
+ *  - every value starts with a tag of its canonical type (MinKey < Null <
+ *    numbers < strings < objects < arrays < binary < ObjectId < Boolean <
+ *    Date < Timestamp < Regex < Code < MaxKey);
+ *  - numbers of all types are encoded as a sign-flipped big-endian double
+ *    followed by the integer remainder the double could not represent, so
+ *    5, 5L and 5.0 get the same key;
+ *  - strings have 0x00 escaped as 0x00 0xFF and end with 0x00 0x01;
+ *  - objects and arrays are their elements in order followed by 0x00.
+ *
+ * No encoded value is a prefix of another one, so concatenation of encoded
+ * values orders as a tuple.
+ */
+
+#ifndef _SAKHADB_KEY_H_
+#define _SAKHADB_KEY_H_
+
+#include <stdint.h>
+
+#include "btree.h"
+
+/**
+ * Component flags
+ */
+#define SAKHADB_KEY_DESCENDING  0x1 /* Component sorts in descending order */
+
+typedef struct Key sakhadb_key_t;
+struct Key
+{
+    uint16_t    size;                               /* Size of the key */
+    char        data[SAKHADB_BTREE_MAX_KEY_SIZE];   /* Encoded key */
+};
+
+void sakhadb_key_init(sakhadb_key_t* key);
+
+/**
+ * Appends value of BSON element type 'type' stored at 'value' as the next
+ * component of the key. Returns SAKHADB_TOOBIG if the key gets larger than
+ * SAKHADB_BTREE_MAX_KEY_SIZE, SAKHADB_INVALID_ARG for types without defined
+ * order (Decimal128, DBPointer, CodeWScope).
+ */
+int sakhadb_key_append(sakhadb_key_t* key, char type, const void* value, int flags);
+
+/**
+ * Finds the value at dotted 'path' in BSON document 'doc', descending into
+ * embedded objects and arrays (by element index). Returns SAKHADB_NOTFOUND if
+ * there is no such field.
+ */
+int sakhadb_key_find(const void* doc, const char* path, char* pType, const void** pValue);
+
+typedef int (*sakhadb_key_visit_fn)(void* arg, char type, const void* value);
+
+/**
+ * Calls 'fn' for every value at dotted 'path' in BSON document 'doc', until it
+ * returns an error. Arrays on the path are fanned out: an array at the end of
+ * the path gives each of its elements (undefined if it is empty), the rest of
+ * the path is looked up in every embedded document of an array in the middle.
+ * Number of arrays fanned out is returned in 'pArrays'.
+ */
+int sakhadb_key_find_all(const void* doc, const char* path, sakhadb_key_visit_fn fn, void* arg,
+                         int* pArrays);
+
+/**
+ * Size of BSON value of the type stored at 'value'.
+ */
+size_t sakhadb_key_value_size(char type, const void* value);
+
+#endif // _SAKHADB_KEY_H_
@@ -0,0 +1,1302 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "lsm.h"
+
+#include <assert.h>
+#include <string.h>
+#include <cpl/cpl_allocator.h>
+
+#include "sakhadb.h"
+#include "logger.h"
+#include "cursor.h"
+#include "bloom.h"
+
+/**
+ * Turn on/off logging for LSM routines
+ */
+//#define SLOG_LSM_ENABLE    1
+
+#if SLOG_LSM_ENABLE
+#   define SLOG_LSM_INFO  SLOG_INFO
+#   define SLOG_LSM_WARN  SLOG_WARN
+#   define SLOG_LSM_ERROR SLOG_ERROR
+#   define SLOG_LSM_FATAL SLOG_FATAL
+#else // SLOG_LSM_ENABLE
+#   define SLOG_LSM_INFO(...)
+#   define SLOG_LSM_WARN(...)
+#   define SLOG_LSM_ERROR(...)
+#   define SLOG_LSM_FATAL(...)
+#endif // SLOG_LSM_ENABLE
+
+/***************************** Private Interface ******************************/
+
+/**
+ * "SLSM" at the start of the root page. First byte of a B-tree page is node
+ * flags, which never take this value.
+ */
+#define SAKHADB_LSM_MAGIC       0x4D534C53
+
+/**
+ * Levels above 0 hold a single run each, the last level is never merged.
+ */
+#define SAKHADB_LSM_MAX_LEVELS  12
+#define SAKHADB_LSM_MAX_RUNS    (SAKHADB_LSM_L0_RUNS + SAKHADB_LSM_MAX_LEVELS)
+
+/**
+ * Number of Bloom filter probes, optimal for SAKHADB_LSM_BLOOM_BITS.
+ */
+#define SAKHADB_LSM_BLOOM_PROBES SAKHADB_BLOOM_PROBES(SAKHADB_LSM_BLOOM_BITS)
+
+/**
+ * Deleted key. In runs it is an entry without payload and data page.
+ */
+#define SAKHADB_LSM_TOMBSTONE   0x1
+
+/**
+ * Cursor flag: cursor merges runs into a new one. Tombstones are returned
+ * and data pages of shadowed entries are freed.
+ */
+#define SAKHADB_LSM_CURSOR_MERGE 0x100
+
+#define lsmCompareKeys(a, b) memcmp((a), (b), SAKHADB_BTREE_OID_SIZE)
+
+/**
+ * Run as it is stored on the root page.
+ */
+struct LsmRunInfo
+{
+    Pgno                    root;       /* Root of the run tree */
+    Pgno                    bloom;      /* Data pages of Bloom filter */
+    uint32_t                nbits;      /* Size of Bloom filter in bits */
+    uint32_t                level;      /* Level of the run */
+};
+
+/**
+ * Root page. Runs are ordered from newest to oldest: level 0 runs first, then
+ * a run per level in ascending order of levels.
+ */
+struct LsmRoot
+{
+    uint32_t                magic;      /* SAKHADB_LSM_MAGIC */
+    uint32_t                nruns;      /* Number of runs */
+    struct LsmRunInfo       runs[SAKHADB_LSM_MAX_RUNS];
+};
+
+struct LsmRun
+{
+    sakhadb_btree_t         tree;       /* Run tree */
+    sakhadb_btree_cursor_t  cursor;     /* Cursor for point lookups */
+    uint64_t*               bloom;      /* Bloom filter */
+};
+
+struct LsmRecord
+{
+    Pgno                    no;         /* Data page, 0 for inline document */
+    uint16_t                npayload;   /* Size of inline document */
+    uint16_t                flags;      /* SAKHADB_LSM_TOMBSTONE */
+    char                    key[SAKHADB_BTREE_OID_SIZE];
+};
+
+#define lsmRecordSize(npayload) \
+    ((sizeof(struct LsmRecord) + (npayload) + sizeof(Pgno) - 1) & ~(sizeof(Pgno) - 1))
+#define lsmRecordPayload(r) ((const char*)(r) + sizeof(struct LsmRecord))
+
+/**
+ * Memtable keeps records in arrival order and their offsets in key order.
+ */
+struct LsmMemtable
+{
+    char*                   data;       /* Records */
+    uint32_t                used;       /* Bytes used in 'data' */
+    uint32_t*               index;      /* Offsets of records in key order */
+    uint32_t                count;      /* Number of records */
+    uint32_t                capacity;   /* Max number of records */
+};
+
+struct Lsm
+{
+    sakhadb_pager_t         pager;      /* Pager */
+    sakhadb_btree_ctx_t     ctx;        /* B-tree context of runs */
+    sakhadb_dbdata_t        dbdata;     /* Data pages of large documents */
+    sakhadb_page_t          page;       /* Root page */
+    struct LsmRoot*         root;       /* Content of the root page */
+    struct LsmRun           runs[SAKHADB_LSM_MAX_RUNS];
+    struct LsmMemtable      mem;        /* Memtable */
+    size_t                  max_inline; /* Largest document kept inline */
+#if SAKHADB_THREADSAFE
+    sakhadb_mutex_t         mutex;      /* Guards modifications */
+#endif
+};
+
+/**
+ * Position of the cursor in the memtable or in one of runs.
+ */
+struct LsmSource
+{
+    sakhadb_btree_cursor_t  cursor;     /* Cursor of the run, 0 for memtable */
+    uint32_t                pos;        /* Position in memtable */
+    int                     valid;      /* Source points to an entry */
+};
+
+struct LsmCursor
+{
+    struct Lsm*             lsm;
+    int                     flags;      /* SAKHADB_BTREE_CURSOR_* and SAKHADB_LSM_CURSOR_* flags */
+    int                     reverse;    /* Cursor moves backward */
+    int                     current;    /* Source of the current entry, -1 if none */
+    int                     nsources;   /* Number of sources, newest first */
+    char                    upper[SAKHADB_BTREE_OID_SIZE]; /* upper bound */
+    char                    lower[SAKHADB_BTREE_OID_SIZE]; /* lower bound */
+    struct LsmSource        sources[1];
+};
+
+#if SAKHADB_THREADSAFE
+#   define lsmEnter(lsm)    sakhadb_mutex_enter((lsm)->mutex)
+#   define lsmLeave(lsm)    sakhadb_mutex_leave((lsm)->mutex)
+#else // SAKHADB_THREADSAFE
+#   define lsmEnter(lsm)
+#   define lsmLeave(lsm)
+#endif // SAKHADB_THREADSAFE
+
+/******************************************************************************/
+
+/****************************** Bloom Section *********************************/
+
+static int lsmBloomLoad(struct Lsm* lsm, const struct LsmRunInfo* info, uint64_t** pBloom)
+{
+    int rc = SAKHADB_OK;
+    cpl_allocator_ref allocator = cpl_allocator_get_default();
+    size_t sz = info->nbits / 8;
+    uint64_t* bloom = cpl_allocator_allocate(allocator, sz);
+    if(!bloom)
+    {
+        rc = SAKHADB_NOMEM;
+        goto Lexit;
+    }
+    
+    cpl_region_t reg;
+    rc = cpl_region_init(allocator, &reg, sz + sakhadb_pager_page_size(lsm->pager, 0));
+    if(rc)
+    {
+        rc = SAKHADB_NOMEM;
+        goto Lfail;
+    }
+    
+    rc = sakhadb_dbdata_read(lsm->dbdata, info->bloom, &reg);
+    if(rc == SAKHADB_OK)
+    {
+        memcpy(bloom, reg.data, sz);
+    }
+    cpl_region_deinit(&reg);
+    
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    *pBloom = bloom;
+    
+Lexit:
+    return rc;
+    
+Lfail:
+    cpl_allocator_free(allocator, bloom);
+    goto Lexit;
+}
+
+/******************************************************************************/
+
+/****************************** Run Section ***********************************/
+
+static int lsmOpenRun(struct Lsm* lsm, int i)
+{
+    const struct LsmRunInfo* info = lsm->root->runs + i;
+    struct LsmRun* run = lsm->runs + i;
+    run->tree = 0;
+    run->cursor = 0;
+    run->bloom = 0;
+    
+    int rc = sakhadb_btree_create(lsm->ctx, info->root, &run->tree);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    rc = sakhadb_btree_cursor_create(run->tree, &run->cursor);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    rc = lsmBloomLoad(lsm, info, &run->bloom);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    return rc;
+    
+Lfail:
+    SLOG_LSM_ERROR("lsmOpenRun: failed to open run [%d][%d]", info->root, rc);
+    if(run->cursor)
+    {
+        sakhadb_btree_cursor_destroy(run->cursor);
+    }
+    if(run->tree)
+    {
+        sakhadb_btree_destroy(run->tree);
+    }
+    return rc;
+}
+
+static void lsmCloseRun(struct LsmRun* run)
+{
+    sakhadb_btree_cursor_destroy(run->cursor);
+    sakhadb_btree_destroy(run->tree);
+    cpl_allocator_free(cpl_allocator_get_default(), run->bloom);
+}
+
+/**
+ * Returns pages of the run and its filter to the freelist.
+ */
+static int lsmDropRun(struct Lsm* lsm, int i)
+{
+    struct LsmRun* run = lsm->runs + i;
+    sakhadb_btree_cursor_destroy(run->cursor);
+    cpl_allocator_free(cpl_allocator_get_default(), run->bloom);
+    int rc = sakhadb_btree_drop(run->tree);
+    if(rc == SAKHADB_OK)
+    {
+        rc = sakhadb_dbdata_free(lsm->dbdata, lsm->root->runs[i].bloom);
+    }
+    return rc;
+}
+
+/**
+ * Replaces runs [from, to) with a new run. Run tree and filter are written
+ * already.
+ */
+static int lsmReplaceRuns(struct Lsm* lsm, int from, int to, const struct LsmRunInfo* info)
+{
+    int rc = SAKHADB_OK;
+    struct LsmRoot* root = lsm->root;
+    for(int i = from; i < to && rc == SAKHADB_OK; ++i)
+    {
+        rc = lsmDropRun(lsm, i);
+    }
+    
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    int tail = root->nruns - to;
+    memmove(root->runs + from + 1, root->runs + to, tail * sizeof(struct LsmRunInfo));
+    memmove(lsm->runs + from + 1, lsm->runs + to, tail * sizeof(struct LsmRun));
+    root->nruns = from + 1 + tail;
+    root->runs[from] = *info;
+    
+    rc = lsmOpenRun(lsm, from);
+    if(rc)
+    {
+        // Run is lost for this session, keep the rest usable
+        memmove(root->runs + from, root->runs + from + 1, tail * sizeof(struct LsmRunInfo));
+        memmove(lsm->runs + from, lsm->runs + from + 1, tail * sizeof(struct LsmRun));
+        root->nruns -= 1;
+    }
+    
+    sakhadb_pager_save_page(lsm->pager, lsm->page);
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Writes the filter and completes the run description.
+ */
+static int lsmWriteBloom(struct Lsm* lsm, uint64_t* bloom, uint32_t nbits, struct LsmRunInfo* info)
+{
+    info->nbits = nbits;
+    int rc = sakhadb_dbdata_write(lsm->dbdata, bloom, nbits / 8, &info->bloom);
+    cpl_allocator_free(cpl_allocator_get_default(), bloom);
+    return rc;
+}
+
+/******************************************************************************/
+
+/**************************** Memtable Section ********************************/
+
+static int lsmMemCreate(struct LsmMemtable* mem)
+{
+    uint32_t capacity = SAKHADB_LSM_MEMTABLE_SIZE / sizeof(struct LsmRecord);
+    char* ptr = cpl_allocator_allocate(cpl_allocator_get_default(),
+                                       SAKHADB_LSM_MEMTABLE_SIZE + capacity * sizeof(uint32_t));
+    if(!ptr)
+    {
+        return SAKHADB_NOMEM;
+    }
+    
+    mem->data = ptr;
+    mem->index = (uint32_t*)(ptr + SAKHADB_LSM_MEMTABLE_SIZE);
+    mem->used = 0;
+    mem->count = 0;
+    mem->capacity = capacity;
+    return SAKHADB_OK;
+}
+
+static inline struct LsmRecord* lsmMemRecord(struct LsmMemtable* mem, uint32_t i)
+{
+    return (struct LsmRecord*)(mem->data + mem->index[i]);
+}
+
+/**
+ * Returns index of the first record not less than the key, 'pFound' is set
+ * if the key is there.
+ */
+static uint32_t lsmMemFind(struct LsmMemtable* mem, const char* key, int* pFound)
+{
+    uint32_t lo = 0;
+    uint32_t hi = mem->count;
+    while(lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if(lsmCompareKeys(lsmMemRecord(mem, mid)->key, key) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    
+    *pFound = lo < mem->count && lsmCompareKeys(lsmMemRecord(mem, lo)->key, key) == 0;
+    return lo;
+}
+
+static int lsmFlush(struct Lsm* lsm);
+
+/**
+ * Puts the record into memtable, replacing the record of the same key.
+ */
+static int lsmMemPut(
+    struct Lsm* lsm,
+    const char* key,
+    const void* payload, uint16_t npayload,
+    Pgno no,
+    uint16_t flags
+)
+{
+    int rc = SAKHADB_OK;
+    struct LsmMemtable* mem = &lsm->mem;
+    uint32_t sz = lsmRecordSize(npayload);
+    if(mem->used + sz > SAKHADB_LSM_MEMTABLE_SIZE || mem->count == mem->capacity)
+    {
+        rc = lsmFlush(lsm);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    struct LsmRecord* rec = (struct LsmRecord*)(mem->data + mem->used);
+    rec->no = no;
+    rec->npayload = npayload;
+    rec->flags = flags;
+    memcpy(rec->key, key, SAKHADB_BTREE_OID_SIZE);
+    if(npayload)
+    {
+        memcpy((char*)lsmRecordPayload(rec), payload, npayload);
+    }
+    
+    int found;
+    uint32_t i = lsmMemFind(mem, key, &found);
+    if(!found)
+    {
+        memmove(mem->index + i + 1, mem->index + i, (mem->count - i) * sizeof(uint32_t));
+        mem->count += 1;
+    }
+    mem->index[i] = mem->used;
+    mem->used += sz;
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Writes out the memtable as a new level 0 run.
+ */
+static int lsmMemWrite(struct Lsm* lsm, struct LsmRunInfo* info)
+{
+    struct LsmMemtable* mem = &lsm->mem;
+    sakhadb_btree_builder_t builder;
+    int rc = sakhadb_btree_builder_create(lsm->ctx, SAKHADB_BTREE_INLINE, &builder);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    uint32_t nbits;
+    uint64_t* bloom = sakhadb_bloom_create(mem->count, SAKHADB_LSM_BLOOM_BITS, &nbits);
+    if(!bloom)
+    {
+        rc = SAKHADB_NOMEM;
+        sakhadb_btree_builder_finish(builder, &info->root);
+        goto Lexit;
+    }
+    
+    for(uint32_t i = 0; i < mem->count && rc == SAKHADB_OK; ++i)
+    {
+        const struct LsmRecord* rec = lsmMemRecord(mem, i);
+        sakhadb_bloom_add(bloom, nbits, SAKHADB_LSM_BLOOM_PROBES, rec->key);
+        rc = sakhadb_btree_builder_add(builder, rec->key, SAKHADB_BTREE_OID_SIZE,
+                                       lsmRecordPayload(rec), rec->npayload, rec->no);
+    }
+    
+    int frc = sakhadb_btree_builder_finish(builder, &info->root);
+    rc = rc ? rc : frc;
+    if(rc)
+    {
+        cpl_allocator_free(cpl_allocator_get_default(), bloom);
+        goto Lexit;
+    }
+    
+    info->level = 0;
+    rc = lsmWriteBloom(lsm, bloom, nbits, info);
+    
+Lexit:
+    return rc;
+}
+
+/******************************************************************************/
+
+/****************************** Cursor Section ********************************/
+
+static int lsmCreateCursor(
+    struct Lsm* lsm,
+    int from, int to,                   /* Runs to merge */
+    int flags,                          /* SAKHADB_LSM_CURSOR_MERGE, if memtable is not merged */
+    struct LsmCursor** pCursor
+)
+{
+    int memtable = (flags & SAKHADB_LSM_CURSOR_MERGE) == 0;
+    int nsources = memtable + to - from;
+    struct LsmCursor* cursor = cpl_allocator_allocate(cpl_allocator_get_default(),
+                                                      sizeof(struct LsmCursor) +
+                                                      nsources * sizeof(struct LsmSource));
+    if(!cursor)
+    {
+        return SAKHADB_NOMEM;
+    }
+    
+    cursor->lsm = lsm;
+    cursor->flags = flags;
+    cursor->reverse = 0;
+    cursor->current = -1;
+    cursor->nsources = 0;
+    
+    int rc = SAKHADB_OK;
+    if(memtable)
+    {
+        struct LsmSource* s = cursor->sources + cursor->nsources++;
+        s->cursor = 0;
+        s->valid = 0;
+    }
+    
+    for(int i = from; i < to; ++i)
+    {
+        struct LsmSource* s = cursor->sources + cursor->nsources;
+        rc = sakhadb_btree_cursor_create(lsm->runs[i].tree, &s->cursor);
+        if(rc)
+        {
+            sakhadb_lsm_cursor_destroy(cursor);
+            return rc;
+        }
+        s->valid = 0;
+        cursor->nsources += 1;
+    }
+    
+    *pCursor = cursor;
+    return rc;
+}
+
+static inline const char* lsmSourceKey(struct LsmCursor* cursor, struct LsmSource* s)
+{
+    if(s->cursor)
+    {
+        size_t nkey;
+        return sakhadb_btree_cursor_key(s->cursor, &nkey);
+    }
+    return lsmMemRecord(&cursor->lsm->mem, s->pos)->key;
+}
+
+/**
+ * Entry under the source: inline payload or data page, tombstone has neither.
+ */
+static inline const void* lsmSourceEntry(
+    struct LsmCursor* cursor,
+    struct LsmSource* s,
+    size_t* pNpayload,
+    Pgno* pNo
+)
+{
+    if(s->cursor)
+    {
+        const void* payload = sakhadb_btree_cursor_payload(s->cursor, pNpayload);
+        *pNo = payload ? 0 : sakhadb_btree_cursor_pgno(s->cursor);
+        if(!payload)
+        {
+            *pNpayload = 0;
+        }
+        return payload;
+    }
+    
+    const struct LsmRecord* rec = lsmMemRecord(&cursor->lsm->mem, s->pos);
+    *pNpayload = rec->npayload;
+    *pNo = rec->no;
+    return lsmRecordPayload(rec);
+}
+
+static inline int lsmSourceIsTombstone(struct LsmCursor* cursor, struct LsmSource* s)
+{
+    size_t npayload;
+    Pgno no;
+    lsmSourceEntry(cursor, s, &npayload, &no);
+    return npayload == 0 && no == 0;
+}
+
+/**
+ * Checks memtable position against the bounds of the cursor.
+ */
+static inline int lsmMemWithinBounds(struct LsmCursor* cursor, struct LsmSource* s)
+{
+    struct LsmMemtable* mem = &cursor->lsm->mem;
+    if(s->pos >= mem->count)
+    {
+        return 0;
+    }
+    
+    const char* key = lsmMemRecord(mem, s->pos)->key;
+    if(cursor->flags & SAKHADB_BTREE_CURSOR_UPPER)
+    {
+        int cmp = lsmCompareKeys(key, cursor->upper);
+        if(cmp > 0 || (cmp == 0 && (cursor->flags & SAKHADB_BTREE_CURSOR_UPPER_EXCL)))
+        {
+            return 0;
+        }
+    }
+    
+    if(cursor->flags & SAKHADB_BTREE_CURSOR_LOWER)
+    {
+        int cmp = lsmCompareKeys(key, cursor->lower);
+        if(cmp < 0 || (cmp == 0 && (cursor->flags & SAKHADB_BTREE_CURSOR_LOWER_EXCL)))
+        {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+static inline int lsmSourceResult(struct LsmSource* s, int rc)
+{
+    s->valid = (rc == SAKHADB_OK);
+    return (rc == SAKHADB_NOTFOUND) ? SAKHADB_OK : rc;
+}
+
+static int lsmSourceStart(struct LsmCursor* cursor, struct LsmSource* s)
+{
+    int lower = cursor->flags & SAKHADB_BTREE_CURSOR_LOWER;
+    int upper = cursor->flags & SAKHADB_BTREE_CURSOR_UPPER;
+    if(s->cursor)
+    {
+        int rc;
+        if(cursor->reverse)
+        {
+            rc = upper ? sakhadb_btree_cursor_seek_last(s->cursor, cursor->upper, SAKHADB_BTREE_OID_SIZE,
+                                                        cursor->flags & SAKHADB_BTREE_CURSOR_UPPER_EXCL)
+                       : sakhadb_btree_cursor_last(s->cursor);
+        }
+        else
+        {
+            rc = lower ? sakhadb_btree_cursor_seek(s->cursor, cursor->lower, SAKHADB_BTREE_OID_SIZE,
+                                                   cursor->flags & SAKHADB_BTREE_CURSOR_LOWER_EXCL)
+                       : sakhadb_btree_cursor_first(s->cursor);
+        }
+        return lsmSourceResult(s, rc);
+    }
+    
+    struct LsmMemtable* mem = &cursor->lsm->mem;
+    int found;
+    if(cursor->reverse)
+    {
+        if(!upper)
+        {
+            s->pos = mem->count - 1;
+        }
+        else
+        {
+            uint32_t i = lsmMemFind(mem, cursor->upper, &found);
+            s->pos = (found && !(cursor->flags & SAKHADB_BTREE_CURSOR_UPPER_EXCL)) ? i : i - 1;
+        }
+    }
+    else if(lower)
+    {
+        uint32_t i = lsmMemFind(mem, cursor->lower, &found);
+        s->pos = (found && (cursor->flags & SAKHADB_BTREE_CURSOR_LOWER_EXCL)) ? i + 1 : i;
+    }
+    else
+    {
+        s->pos = 0;
+    }
+    
+    // Position before the first record wraps around and fails the bounds check
+    s->valid = lsmMemWithinBounds(cursor, s);
+    return SAKHADB_OK;
+}
+
+static int lsmSourceMove(struct LsmCursor* cursor, struct LsmSource* s)
+{
+    if(s->cursor)
+    {
+        int rc = cursor->reverse ? sakhadb_btree_cursor_prev(s->cursor)
+                                 : sakhadb_btree_cursor_next(s->cursor);
+        return lsmSourceResult(s, rc);
+    }
+    
+    s->pos += cursor->reverse ? -1 : 1;
+    s->valid = lsmMemWithinBounds(cursor, s);
+    return SAKHADB_OK;
+}
+
+/**
+ * Moves all sources past the current key. Newer sources shadow entries of the
+ * same key in older ones.
+ */
+static int lsmCursorStep(struct LsmCursor* cursor)
+{
+    int rc = SAKHADB_OK;
+    char key[SAKHADB_BTREE_OID_SIZE];
+    memcpy(key, lsmSourceKey(cursor, cursor->sources + cursor->current), SAKHADB_BTREE_OID_SIZE);
+    
+    for(int i = 0; i < cursor->nsources && rc == SAKHADB_OK; ++i)
+    {
+        struct LsmSource* s = cursor->sources + i;
+        if(!s->valid || lsmCompareKeys(lsmSourceKey(cursor, s), key) != 0)
+        {
+            continue;
+        }
+        
+        if(i != cursor->current && (cursor->flags & SAKHADB_LSM_CURSOR_MERGE))
+        {
+            // Shadowed entry goes away with the merged runs
+            size_t npayload;
+            Pgno no;
+            lsmSourceEntry(cursor, s, &npayload, &no);
+            if(no)
+            {
+                rc = sakhadb_dbdata_free(cursor->lsm->dbdata, no);
+                if(rc)
+                {
+                    break;
+                }
+            }
+        }
+        
+        rc = lsmSourceMove(cursor, s);
+    }
+    
+    return rc;
+}
+
+/**
+ * Picks the source with the least (greatest, if reverse) key as current one,
+ * skipping deleted keys.
+ */
+static int lsmCursorSettle(struct LsmCursor* cursor)
+{
+    int rc = SAKHADB_OK;
+    for(;;)
+    {
+        int best = -1;
+        const char* best_key = 0;
+        for(int i = 0; i < cursor->nsources; ++i)
+        {
+            struct LsmSource* s = cursor->sources + i;
+            if(!s->valid)
+            {
+                continue;
+            }
+            
+            const char* key = lsmSourceKey(cursor, s);
+            int cmp = best_key ? lsmCompareKeys(key, best_key) : -1;
+            if(best == -1 || (cursor->reverse ? cmp > 0 : cmp < 0))
+            {
+                best = i;
+                best_key = key;
+            }
+        }
+        
+        cursor->current = best;
+        if(best == -1)
+        {
+            rc = SAKHADB_NOTFOUND;
+            break;
+        }
+        
+        if((cursor->flags & SAKHADB_LSM_CURSOR_MERGE) ||
+           !lsmSourceIsTombstone(cursor, cursor->sources + best))
+        {
+            break;
+        }
+        
+        rc = lsmCursorStep(cursor);
+        if(rc)
+        {
+            break;
+        }
+    }
+    
+    return rc;
+}
+
+static int lsmCursorStart(struct LsmCursor* cursor, int reverse)
+{
+    int rc = SAKHADB_OK;
+    cursor->reverse = reverse;
+    for(int i = 0; i < cursor->nsources && rc == SAKHADB_OK; ++i)
+    {
+        rc = lsmSourceStart(cursor, cursor->sources + i);
+    }
+    
+    return rc ? rc : lsmCursorSettle(cursor);
+}
+
+static int lsmCursorNext(struct LsmCursor* cursor)
+{
+    if(cursor->current == -1)
+    {
+        return SAKHADB_NOTFOUND;
+    }
+    
+    int rc = lsmCursorStep(cursor);
+    return rc ? rc : lsmCursorSettle(cursor);
+}
+
+/******************************************************************************/
+
+/****************************** Compaction Section ****************************/
+
+/**
+ * Merges runs [from, to) into a new run of the level. Tombstones are dropped
+ * when nothing older is left below the new run.
+ */
+static int lsmMerge(struct Lsm* lsm, int from, int to, uint32_t level)
+{
+    SLOG_LSM_INFO("lsmMerge: merge runs [%d][%d][%d]", from, to, level);
+    struct LsmRoot* root = lsm->root;
+    int bottom = (to == root->nruns);
+    uint64_t count = 0;
+    for(int i = from; i < to; ++i)
+    {
+        count += sakhadb_btree_count(lsm->runs[i].tree);
+    }
+    
+    struct LsmCursor* cursor;
+    int rc = lsmCreateCursor(lsm, from, to, SAKHADB_LSM_CURSOR_MERGE, &cursor);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    sakhadb_btree_builder_t builder;
+    rc = sakhadb_btree_builder_create(lsm->ctx, SAKHADB_BTREE_INLINE, &builder);
+    if(rc)
+    {
+        goto Lcursor;
+    }
+    
+    struct LsmRunInfo info;
+    uint32_t nbits;
+    uint64_t* bloom = sakhadb_bloom_create(count, SAKHADB_LSM_BLOOM_BITS, &nbits);
+    if(!bloom)
+    {
+        rc = SAKHADB_NOMEM;
+        sakhadb_btree_builder_finish(builder, &info.root);
+        goto Lcursor;
+    }
+    
+    for(rc = lsmCursorStart(cursor, 0); rc == SAKHADB_OK; rc = lsmCursorNext(cursor))
+    {
+        struct LsmSource* s = cursor->sources + cursor->current;
+        size_t npayload;
+        Pgno no;
+        const void* payload = lsmSourceEntry(cursor, s, &npayload, &no);
+        if(bottom && npayload == 0 && no == 0)
+        {
+            continue;
+        }
+        
+        const char* key = lsmSourceKey(cursor, s);
+        sakhadb_bloom_add(bloom, nbits, SAKHADB_LSM_BLOOM_PROBES, key);
+        rc = sakhadb_btree_builder_add(builder, key, SAKHADB_BTREE_OID_SIZE, payload, npayload, no);
+        if(rc)
+        {
+            break;
+        }
+    }
+    
+    rc = (rc == SAKHADB_NOTFOUND) ? SAKHADB_OK : rc;
+    int frc = sakhadb_btree_builder_finish(builder, &info.root);
+    rc = rc ? rc : frc;
+    if(rc)
+    {
+        cpl_allocator_free(cpl_allocator_get_default(), bloom);
+        goto Lcursor;
+    }
+    
+    info.level = level;
+    rc = lsmWriteBloom(lsm, bloom, nbits, &info);
+    if(rc)
+    {
+        goto Lcursor;
+    }
+    
+    sakhadb_lsm_cursor_destroy(cursor);
+    rc = lsmReplaceRuns(lsm, from, to, &info);
+    goto Lexit;
+    
+Lcursor:
+    sakhadb_lsm_cursor_destroy(cursor);
+    
+Lexit:
+    return rc;
+}
+
+static inline uint64_t lsmLevelLimit(uint32_t level)
+{
+    uint64_t limit = SAKHADB_LSM_L1_ENTRIES;
+    while(--level > 0)
+    {
+        limit *= SAKHADB_LSM_FANOUT;
+    }
+    return limit;
+}
+
+/**
+ * Merges level 0 into level 1 when it has too many runs, then every level
+ * over its limit into the next one.
+ */
+static int lsmCompact(struct Lsm* lsm)
+{
+    int rc = SAKHADB_OK;
+    struct LsmRoot* root = lsm->root;
+    int n0 = 0;
+    while(n0 < root->nruns && root->runs[n0].level == 0)
+    {
+        n0 += 1;
+    }
+    
+    if(n0 >= SAKHADB_LSM_L0_RUNS)
+    {
+        int to = (n0 < root->nruns && root->runs[n0].level == 1) ? n0 + 1 : n0;
+        rc = lsmMerge(lsm, 0, to, 1);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    for(int i = 0; i < root->nruns; ++i)
+    {
+        uint32_t level = root->runs[i].level;
+        if(level == 0 || level + 1 >= SAKHADB_LSM_MAX_LEVELS ||
+           sakhadb_btree_count(lsm->runs[i].tree) <= lsmLevelLimit(level))
+        {
+            continue;
+        }
+        
+        int to = (i + 1 < root->nruns && root->runs[i + 1].level == level + 1) ? i + 2 : i + 1;
+        rc = lsmMerge(lsm, i, to, level + 1);
+        if(rc)
+        {
+            goto Lexit;
+        }
+        
+        // Merged run may be over the limit of its level as well
+        --i;
+    }
+    
+Lexit:
+    return rc;
+}
+
+static int lsmFlush(struct Lsm* lsm)
+{
+    int rc = SAKHADB_OK;
+    if(lsm->mem.count == 0)
+    {
+        goto Lexit;
+    }
+    
+    SLOG_LSM_INFO("lsmFlush: write memtable [%d][%d]", lsm->page->no, lsm->mem.count);
+    struct LsmRunInfo info;
+    rc = lsmMemWrite(lsm, &info);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    lsm->mem.count = 0;
+    lsm->mem.used = 0;
+    
+    // New run goes first, compaction keeps room for it
+    assert(lsm->root->nruns < SAKHADB_LSM_MAX_RUNS);
+    rc = lsmReplaceRuns(lsm, 0, 0, &info);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    rc = lsmCompact(lsm);
+    
+Lexit:
+    return rc;
+}
+
+/******************************************************************************/
+
+/****************************** Lookup Section ********************************/
+
+/**
+ * Finds the newest entry of the key. Returns SAKHADB_NOTFOUND if there is no
+ * such key or it is deleted. 'pPos' is set to the memtable position of the
+ * entry, or to -1 if the entry is in a run.
+ */
+static int lsmLookup(struct Lsm* lsm, const char* key, int64_t* pPos)
+{
+    int found;
+    uint32_t pos = lsmMemFind(&lsm->mem, key, &found);
+    if(found)
+    {
+        *pPos = pos;
+        return (lsmMemRecord(&lsm->mem, pos)->flags & SAKHADB_LSM_TOMBSTONE) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+    }
+    
+    *pPos = -1;
+    struct LsmRoot* root = lsm->root;
+    for(int i = 0; i < root->nruns; ++i)
+    {
+        struct LsmRun* run = lsm->runs + i;
+        if(!sakhadb_bloom_may_contain(run->bloom, root->runs[i].nbits, SAKHADB_LSM_BLOOM_PROBES, key))
+        {
+            continue;
+        }
+        
+        if(sakhadb_btree_cursor_find(run->cursor, key, SAKHADB_BTREE_OID_SIZE) != 0)
+        {
+            continue;
+        }
+        
+        size_t npayload;
+        const void* payload = sakhadb_btree_cursor_payload(run->cursor, &npayload);
+        return (payload && npayload == 0) ? SAKHADB_NOTFOUND : SAKHADB_OK;
+    }
+    
+    return SAKHADB_NOTFOUND;
+}
+
+/******************************************************************************/
+
+/***************************** Public Interface *******************************/
+int sakhadb_lsm_is_root(sakhadb_page_t page)
+{
+    return ((struct LsmRoot*)page->data)->magic == SAKHADB_LSM_MAGIC;
+}
+
+void sakhadb_lsm_init_new_root(sakhadb_pager_t pager, sakhadb_page_t page)
+{
+    assert(page->no > 1);
+    assert(sizeof(struct LsmRoot) <= sakhadb_pager_page_size(pager, 0));
+    struct LsmRoot* root = page->data;
+    root->magic = SAKHADB_LSM_MAGIC;
+    root->nruns = 0;
+    sakhadb_pager_save_page(pager, page);
+}
+
+int sakhadb_lsm_create(sakhadb_pager_t pager, sakhadb_btree_ctx_t ctx, sakhadb_dbdata_t dbdata,
+                       Pgno no, sakhadb_lsm_t* pLsm)
+{
+    SLOG_LSM_INFO("sakhadb_lsm_create: open LSM storage [%d]", no);
+    cpl_allocator_ref allocator = cpl_allocator_get_default();
+    struct Lsm* lsm = cpl_allocator_allocate(allocator, sizeof(struct Lsm));
+    if(!lsm)
+    {
+        SLOG_LSM_FATAL("sakhadb_lsm_create: failed to allocate memory for Lsm");
+        return SAKHADB_NOMEM;
+    }
+    
+    lsm->pager = pager;
+    lsm->ctx = ctx;
+    lsm->dbdata = dbdata;
+    lsm->max_inline = sakhadb_btree_builder_max_payload(ctx);
+    
+    int nopen = 0;
+    int rc = sakhadb_pager_request_page(pager, no, &lsm->page);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    lsm->root = lsm->page->data;
+    assert(lsm->root->magic == SAKHADB_LSM_MAGIC);
+    
+    rc = lsmMemCreate(&lsm->mem);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    for(; nopen < lsm->root->nruns; ++nopen)
+    {
+        rc = lsmOpenRun(lsm, nopen);
+        if(rc)
+        {
+            goto Lmem;
+        }
+    }
+    
+#if SAKHADB_THREADSAFE
+    rc = sakhadb_mutex_create(&lsm->mutex);
+    if(rc)
+    {
+        goto Lmem;
+    }
+#endif // SAKHADB_THREADSAFE
+    
+    *pLsm = lsm;
+    return rc;
+    
+Lmem:
+    while(nopen-- > 0)
+    {
+        lsmCloseRun(lsm->runs + nopen);
+    }
+    cpl_allocator_free(allocator, lsm->mem.data);
+    
+Lfail:
+    SLOG_LSM_ERROR("sakhadb_lsm_create: failed to open LSM storage [%d][%d]", no, rc);
+    cpl_allocator_free(allocator, lsm);
+    return rc;
+}
+
+void sakhadb_lsm_destroy(sakhadb_lsm_t lsm)
+{
+    int rc = lsmFlush(lsm);
+    if(rc)
+    {
+        SLOG_LSM_ERROR("sakhadb_lsm_destroy: failed to write memtable [%d][%d]", lsm->page->no, rc);
+    }
+    
+    for(int i = 0; i < lsm->root->nruns; ++i)
+    {
+        lsmCloseRun(lsm->runs + i);
+    }
+    
+#if SAKHADB_THREADSAFE
+    sakhadb_mutex_destroy(lsm->mutex);
+#endif
+    cpl_allocator_free(cpl_allocator_get_default(), lsm->mem.data);
+    cpl_allocator_free(cpl_allocator_get_default(), lsm);
+}
+
+int sakhadb_lsm_flush(sakhadb_lsm_t lsm)
+{
+    lsmEnter(lsm);
+    int rc = lsmFlush(lsm);
+    lsmLeave(lsm);
+    return rc;
+}
+
+int sakhadb_lsm_insert(sakhadb_lsm_t lsm, const void* key, size_t nkey, const void* doc, size_t ndoc)
+{
+    assert(lsm && key && doc && ndoc);
+    SLOG_LSM_INFO("sakhadb_lsm_insert: insert document [%d][%d]", lsm->page->no, ndoc);
+    if(nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        SLOG_LSM_ERROR("sakhadb_lsm_insert: key is not an ObjectId [%d]", nkey);
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    lsmEnter(lsm);
+    
+    int64_t pos;
+    int rc = lsmLookup(lsm, key, &pos);
+    if(rc == SAKHADB_OK)
+    {
+        SLOG_LSM_WARN("sakhadb_lsm_insert: keys duplicated");
+        goto Lexit;
+    }
+    
+    if(ndoc <= lsm->max_inline)
+    {
+        rc = lsmMemPut(lsm, key, doc, ndoc, 0, 0);
+        goto Lexit;
+    }
+    
+    Pgno no;
+    rc = sakhadb_dbdata_write(lsm->dbdata, doc, ndoc, &no);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    rc = lsmMemPut(lsm, key, 0, 0, no, 0);
+    
+Lexit:
+    lsmLeave(lsm);
+    return rc;
+}
+
+int sakhadb_lsm_delete(sakhadb_lsm_t lsm, const void* key, size_t nkey)
+{
+    assert(lsm && key);
+    SLOG_LSM_INFO("sakhadb_lsm_delete: delete key [%d]", lsm->page->no);
+    if(nkey != SAKHADB_BTREE_OID_SIZE)
+    {
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    lsmEnter(lsm);
+    
+    int64_t pos;
+    int rc = lsmLookup(lsm, key, &pos);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    if(pos == -1)
+    {
+        rc = lsmMemPut(lsm, key, 0, 0, 0, SAKHADB_LSM_TOMBSTONE);
+        goto Lexit;
+    }
+    
+    // Record in memtable turns into tombstone, runs may still have the key
+    struct LsmRecord* rec = lsmMemRecord(&lsm->mem, (uint32_t)pos);
+    if(rec->no)
+    {
+        rc = sakhadb_dbdata_free(lsm->dbdata, rec->no);
+    }
+    rec->no = 0;
+    rec->npayload = 0;
+    rec->flags = SAKHADB_LSM_TOMBSTONE;
+    
+Lexit:
+    lsmLeave(lsm);
+    return rc;
+}
+
+int sakhadb_lsm_cursor_create(sakhadb_lsm_t lsm, sakhadb_lsm_cursor_t* cursor)
+{
+    return lsmCreateCursor(lsm, 0, lsm->root->nruns, 0, cursor);
+}
+
+void sakhadb_lsm_cursor_destroy(sakhadb_lsm_cursor_t cursor)
+{
+    for(int i = 0; i < cursor->nsources; ++i)
+    {
+        if(cursor->sources[i].cursor)
+        {
+            sakhadb_btree_cursor_destroy(cursor->sources[i].cursor);
+        }
+    }
+    cpl_allocator_free(cpl_allocator_get_default(), cursor);
+}
+
+void sakhadb_lsm_cursor_set_lower(sakhadb_lsm_cursor_t cursor, const void* key, size_t nkey, int exclusive)
+{
+    assert(nkey == SAKHADB_BTREE_OID_SIZE);
+    memcpy(cursor->lower, key, SAKHADB_BTREE_OID_SIZE);
+    cursor->flags |= SAKHADB_BTREE_CURSOR_LOWER;
+    cursor->flags = exclusive ? (cursor->flags | SAKHADB_BTREE_CURSOR_LOWER_EXCL)
+                              : (cursor->flags & ~SAKHADB_BTREE_CURSOR_LOWER_EXCL);
+    
+    for(int i = 0; i < cursor->nsources; ++i)
+    {
+        if(cursor->sources[i].cursor)
+        {
+            sakhadb_btree_cursor_set_lower(cursor->sources[i].cursor, key, nkey, exclusive);
+        }
+    }
+}
+
+void sakhadb_lsm_cursor_set_upper(sakhadb_lsm_cursor_t cursor, const void* key, size_t nkey, int exclusive)
+{
+    assert(nkey == SAKHADB_BTREE_OID_SIZE);
+    memcpy(cursor->upper, key, SAKHADB_BTREE_OID_SIZE);
+    cursor->flags |= SAKHADB_BTREE_CURSOR_UPPER;
+    cursor->flags = exclusive ? (cursor->flags | SAKHADB_BTREE_CURSOR_UPPER_EXCL)
+                              : (cursor->flags & ~SAKHADB_BTREE_CURSOR_UPPER_EXCL);
+    
+    for(int i = 0; i < cursor->nsources; ++i)
+    {
+        if(cursor->sources[i].cursor)
+        {
+            sakhadb_btree_cursor_set_upper(cursor->sources[i].cursor, key, nkey, exclusive);
+        }
+    }
+}
+
+int sakhadb_lsm_cursor_first(sakhadb_lsm_cursor_t cursor)
+{
+    return lsmCursorStart(cursor, 0);
+}
+
+int sakhadb_lsm_cursor_last(sakhadb_lsm_cursor_t cursor)
+{
+    return lsmCursorStart(cursor, 1);
+}
+
+int sakhadb_lsm_cursor_next(sakhadb_lsm_cursor_t cursor)
+{
+    return lsmCursorNext(cursor);
+}
+
+const void* sakhadb_lsm_cursor_key(sakhadb_lsm_cursor_t cursor)
+{
+    return lsmSourceKey(cursor, cursor->sources + cursor->current);
+}
+
+const void* sakhadb_lsm_cursor_payload(sakhadb_lsm_cursor_t cursor, size_t* npayload)
+{
+    Pgno no;
+    const void* payload = lsmSourceEntry(cursor, cursor->sources + cursor->current, npayload, &no);
+    return no ? 0 : payload;
+}
+
+Pgno sakhadb_lsm_cursor_pgno(sakhadb_lsm_cursor_t cursor)
+{
+    size_t npayload;
+    Pgno no;
+    lsmSourceEntry(cursor, cursor->sources + cursor->current, &npayload, &no);
+    return no;
+}
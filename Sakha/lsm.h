@@ -0,0 +1,134 @@
+// Copyright (c) 2013-2014. Alex Komnin. All rights Reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/**
+ * Log-structured storage of a collection. Documents go to the in-memory
+ * memtable, a full memtable is written out as an immutable sorted run (a
+ * B-tree built bottom-up with documents inline) and runs are merged level by
+ * level as they pile up. Every run has a Bloom filter on keys, so point
+ * lookups skip runs that cannot have the key.
+ */
+
+#ifndef _SAKHADB_LSM_H_
+#define _SAKHADB_LSM_H_
+
+#include "btree.h"
+#include "dbdata.h"
+
+/**
+ * Size of the memtable. Memtable is written out as a new level 0 run when it
+ * fills up and when the collection is released.
+ */
+#ifndef SAKHADB_LSM_MEMTABLE_SIZE
+#   define SAKHADB_LSM_MEMTABLE_SIZE    262144
+#endif
+
+/**
+ * Number of level 0 runs that are merged together into level 1.
+ */
+#ifndef SAKHADB_LSM_L0_RUNS
+#   define SAKHADB_LSM_L0_RUNS          4
+#endif
+
+/**
+ * Entries allowed in level 1, each next level holds SAKHADB_LSM_FANOUT
+ * times more. Level over its limit is merged into the next one.
+ */
+#ifndef SAKHADB_LSM_L1_ENTRIES
+#   define SAKHADB_LSM_L1_ENTRIES       65536
+#endif
+
+#ifndef SAKHADB_LSM_FANOUT
+#   define SAKHADB_LSM_FANOUT           10
+#endif
+
+/**
+ * Bloom filter bits per key of a run.
+ */
+#ifndef SAKHADB_LSM_BLOOM_BITS
+#   define SAKHADB_LSM_BLOOM_BITS       10
+#endif
+
+typedef struct Lsm* sakhadb_lsm_t;
+typedef struct LsmCursor* sakhadb_lsm_cursor_t;
+
+/**
+ * Checks whether the page is the root page of LSM storage.
+ */
+int sakhadb_lsm_is_root(sakhadb_page_t page);
+void sakhadb_lsm_init_new_root(sakhadb_pager_t pager, sakhadb_page_t page);
+
+int sakhadb_lsm_create(sakhadb_pager_t pager, sakhadb_btree_ctx_t ctx, sakhadb_dbdata_t dbdata,
+                       Pgno no, sakhadb_lsm_t* pLsm);
+
+/**
+ * Writes out the memtable and destroys the storage.
+ */
+void sakhadb_lsm_destroy(sakhadb_lsm_t lsm);
+
+/**
+ * Writes out the memtable as a new run.
+ */
+int sakhadb_lsm_flush(sakhadb_lsm_t lsm);
+
+/**
+ * Inserts the document with ObjectId key. Insert of an existing key is
+ * ignored, as it is with B-tree. With SAKHADB_THREADSAFE inserts and deletes
+ * may run from several threads at once.
+ */
+int sakhadb_lsm_insert(sakhadb_lsm_t lsm, const void* key, size_t nkey, const void* doc, size_t ndoc);
+
+/**
+ * Deletes the key. Returns SAKHADB_NOTFOUND if there is no such key.
+ */
+int sakhadb_lsm_delete(sakhadb_lsm_t lsm, const void* key, size_t nkey);
+
+/**
+ * Cursor merges the memtable and all runs. It moves in one direction only and
+ * is invalidated by any modification of the storage.
+ */
+int sakhadb_lsm_cursor_create(sakhadb_lsm_t lsm, sakhadb_lsm_cursor_t* cursor);
+void sakhadb_lsm_cursor_destroy(sakhadb_lsm_cursor_t cursor);
+
+void sakhadb_lsm_cursor_set_lower(sakhadb_lsm_cursor_t cursor, const void* key, size_t nkey, int exclusive);
+void sakhadb_lsm_cursor_set_upper(sakhadb_lsm_cursor_t cursor, const void* key, size_t nkey, int exclusive);
+
+/**
+ * Positions cursor at the first key within the bounds, cursor moves forward.
+ */
+int sakhadb_lsm_cursor_first(sakhadb_lsm_cursor_t cursor);
+
+/**
+ * Positions cursor at the last key within the bounds, cursor moves backward.
+ */
+int sakhadb_lsm_cursor_last(sakhadb_lsm_cursor_t cursor);
+
+int sakhadb_lsm_cursor_next(sakhadb_lsm_cursor_t cursor);
+
+const void* sakhadb_lsm_cursor_key(sakhadb_lsm_cursor_t cursor);
+
+/**
+ * Returns inline document of the current entry, or NULL if the document is
+ * stored in data pages starting at sakhadb_lsm_cursor_pgno().
+ */
+const void* sakhadb_lsm_cursor_payload(sakhadb_lsm_cursor_t cursor, size_t* npayload);
+Pgno sakhadb_lsm_cursor_pgno(sakhadb_lsm_cursor_t cursor);
+
+#endif // _SAKHADB_LSM_H_
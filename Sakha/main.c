@@ -28,12 +28,18 @@
 #include <bson/iterator.h>
 
 #include <sys/mman.h>
+#include <sys/time.h>
+#if SAKHADB_THREADSAFE
+#   include <pthread.h>
+#endif
 
 #include "logger.h"
 #include "sakhadb.h"
 #include "os.h"
 #include "btree.h"
 #include "dbdata.h"
+#include "key.h"
+#include "cursor.h"
 #include <bson/jsonparser.h>
 
 int test_db()
@@ -47,7 +53,7 @@ int test_db()
     }
     
     sakhadb_btree_ctx_t env = *(sakhadb_btree_ctx_t*)((char*)db + sizeof(sakhadb_file_t) + sizeof(sakhadb_pager_t));
-    sakhadb_dbdata_t dbdata = *(sakhadb_dbdata_t*)((char*)db + sizeof(sakhadb_file_t) + sizeof(sakhadb_pager_t) + sizeof(sakhadb_btree_ctx_t));
+    sakhadb_dbdata_t dbdata = sakhadb_dbdata_of(db);
     
     sakhadb_btree_t meta;
     sakhadb_btree_create(env, 1, &meta);
@@ -307,6 +313,2675 @@ int test_db3()
     return 0;
 }
 
+int test_range()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_range", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    struct bson_oid lower, upper;
+    for(int i = 0; i < 100; ++i)
+    {
+        bson_document_ref doc = test_create_doc();
+        bson_element_ref el = bson_document_get_first(doc);
+        if(i == 10)
+        {
+            memcpy(lower.data, bson_element_value(el), sizeof(lower.data));
+        }
+        else if(i == 19)
+        {
+            memcpy(upper.data, bson_element_value(el), sizeof(upper.data));
+        }
+        
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find_range(collection, &lower, &upper, SAKHADB_RANGE_UPPER_EXCLUSIVE, &cur);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    int count = 1;
+    while(sakhadb_cursor_next(cur) == SAKHADB_OK)
+    {
+        ++count;
+    }
+    sakhadb_cursor_destroy(cur);
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    
+    return count == 9 ? 0 : 1;
+}
+
+int test_delete()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_delete", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    struct bson_oid oids[1000];
+    for(int i = 0; i < 1000; ++i)
+    {
+        bson_document_ref doc = test_create_doc();
+        bson_element_ref el = bson_document_get_first(doc);
+        memcpy(oids[i].data, bson_element_value(el), sizeof(oids[i].data));
+        
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    for(int i = 0; i < 1000; i += 2)
+    {
+        rc = sakhadb_collection_delete(collection, &oids[i]);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    if(sakhadb_collection_delete(collection, &oids[0]) != SAKHADB_NOTFOUND)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find_range(collection, &oids[0], &oids[999], 0, &cur);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    int count = 1;
+    while(sakhadb_cursor_next(cur) == SAKHADB_OK)
+    {
+        ++count;
+    }
+    sakhadb_cursor_destroy(cur);
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    
+    return count == 500 ? 0 : 1;
+}
+
+struct test_tree
+{
+    sakhadb_file_t      h;
+    sakhadb_pager_t     pager;
+    sakhadb_btree_ctx_t ctx;
+    sakhadb_btree_t     tree;
+};
+
+/**
+ * Opens a file with a pager and B-tree context of its own and creates an
+ * empty tree with the given node flags in it.
+ */
+int test_tree_open(const char* filename, int flags, struct test_tree* t)
+{
+    memset(t, 0, sizeof(*t));
+    int rc = sakhadb_file_open(filename, SAKHADB_OPEN_READWRITE | SAKHADB_OPEN_CREATE, &t->h);
+    if(rc == SAKHADB_OK)
+    {
+        rc = sakhadb_pager_create(t->h, &t->pager);
+    }
+    if(rc == SAKHADB_OK)
+    {
+        rc = sakhadb_btree_ctx_create(t->pager, &t->ctx);
+    }
+    
+    sakhadb_page_t page;
+    if(rc == SAKHADB_OK)
+    {
+        rc = sakhadb_pager_request_free_page(t->pager, &page);
+    }
+    if(rc == SAKHADB_OK)
+    {
+        sakhadb_btree_init_new_root(t->ctx, page, flags);
+        rc = sakhadb_btree_create(t->ctx, page->no, &t->tree);
+    }
+    return rc;
+}
+
+void test_tree_close(struct test_tree* t)
+{
+    sakhadb_btree_destroy(t->tree);
+    sakhadb_btree_ctx_destroy(t->ctx);
+    sakhadb_pager_destroy(t->pager);
+    sakhadb_file_close(t->h);
+}
+
+/**
+ * Big-endian key, so keys sort as the numbers do.
+ */
+void test_tree_key(uint32_t i, char key[4])
+{
+    key[0] = (char)(i >> 24);
+    key[1] = (char)(i >> 16);
+    key[2] = (char)(i >> 8);
+    key[3] = (char)i;
+}
+
+uint32_t test_tree_key_value(sakhadb_btree_cursor_t cursor)
+{
+    size_t nkey;
+    const unsigned char* key = sakhadb_btree_cursor_key(cursor, &nkey);
+    return ((uint32_t)key[0] << 24) | ((uint32_t)key[1] << 16) | ((uint32_t)key[2] << 8) | key[3];
+}
+
+int test_reverse()
+{
+    struct test_tree t;
+    if(test_tree_open("test_reverse.db", 0, &t) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Shuffled inserts give a tree several levels deep
+    const uint32_t count = 5000;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        char key[4];
+        uint32_t v = (i * 7919) % count;
+        test_tree_key(v, key);
+        if(sakhadb_btree_insert(t.tree, key, sizeof(key), v + 1) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    // Full reverse scan visits every key once, in descending order
+    sakhadb_btree_cursor_t cursor;
+    if(sakhadb_btree_cursor_create(t.tree, &cursor) != SAKHADB_OK ||
+       sakhadb_btree_cursor_last(cursor) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    uint32_t expected = count;
+    do
+    {
+        --expected;
+        if(test_tree_key_value(cursor) != expected || sakhadb_btree_cursor_pgno(cursor) != expected + 1)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    while(sakhadb_btree_cursor_prev(cursor) == SAKHADB_OK);
+    
+    if(expected != 0)
+    {
+        assert(0);
+        return 1;
+    }
+    sakhadb_btree_cursor_destroy(cursor);
+    
+    // Bounded reverse scan over [1000, 2000)
+    char lower[4], upper[4];
+    test_tree_key(1000, lower);
+    test_tree_key(2000, upper);
+    if(sakhadb_btree_cursor_create(t.tree, &cursor) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    sakhadb_btree_cursor_set_lower(cursor, lower, sizeof(lower), 0);
+    if(sakhadb_btree_cursor_seek_last(cursor, upper, sizeof(upper), 1) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    expected = 2000;
+    do
+    {
+        if(test_tree_key_value(cursor) != --expected)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    while(sakhadb_btree_cursor_prev(cursor) == SAKHADB_OK);
+    sakhadb_btree_cursor_destroy(cursor);
+    
+    test_tree_close(&t);
+    return expected == 1000 ? 0 : 1;
+}
+
+int test_insert_sorted()
+{
+    struct test_tree t;
+    if(test_tree_open("test_insert_sorted.db", 0, &t) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Even keys go in sorted batches, odd keys in a second pass between them
+    enum { count = 6000, batch = 500 };
+    static char keys[count][4];
+    static const void* pkeys[count];
+    static size_t nkeys[count];
+    static Pgno nos[count];
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        int n = 0;
+        for(uint32_t v = pass; v < count; v += 2, ++n)
+        {
+            test_tree_key(v, keys[n]);
+            pkeys[n] = keys[n];
+            nkeys[n] = sizeof(keys[n]);
+            nos[n] = v + 1;
+        }
+        
+        for(int i = 0; i < n; i += batch)
+        {
+            size_t size = (n - i < batch) ? (size_t)(n - i) : batch;
+            if(sakhadb_btree_insert_sorted(t.tree, size, pkeys + i, nkeys + i, nos + i) != SAKHADB_OK)
+            {
+                assert(0);
+                return 1;
+            }
+        }
+    }
+    
+    // Out-of-order key in a batch
+    char unordered[2][4];
+    test_tree_key(count + 1, unordered[0]);
+    test_tree_key(count, unordered[1]);
+    const void* punordered[2] = { unordered[0], unordered[1] };
+    size_t nunordered[2] = { 4, 4 };
+    Pgno nounordered[2] = { count + 2, count + 1 };
+    if(sakhadb_btree_insert_sorted(t.tree, 2, punordered, nunordered, nounordered) != SAKHADB_OK ||
+       sakhadb_btree_count(t.tree) != count + 2)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    for(uint32_t v = 0; v < count + 2; ++v)
+    {
+        char key[4];
+        Pgno no;
+        test_tree_key(v, key);
+        if(sakhadb_btree_lookup(t.tree, key, sizeof(key), &no) != SAKHADB_OK || no != v + 1)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_btree_cursor_t cursor;
+    if(sakhadb_btree_cursor_create(t.tree, &cursor) != SAKHADB_OK ||
+       sakhadb_btree_cursor_first(cursor) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    uint32_t expected = 0;
+    do
+    {
+        if(test_tree_key_value(cursor) != expected++)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    while(sakhadb_btree_cursor_next(cursor) == SAKHADB_OK);
+    sakhadb_btree_cursor_destroy(cursor);
+    
+    test_tree_close(&t);
+    return expected == count + 2 ? 0 : 1;
+}
+
+/**
+ * 16-byte key, so a node fills up after a few dozen keys.
+ */
+void test_defragment_key(uint32_t i, char key[16])
+{
+    memset(key, 'k', 16);
+    test_tree_key(i, key);
+}
+
+int test_defragment()
+{
+    struct test_tree t;
+    if(test_tree_open("test_defragment.db", 0, &t) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Root leaf splits once it is full
+    struct BtreeStats stats;
+    uint32_t capacity = 0;
+    do
+    {
+        char key[16];
+        test_defragment_key(capacity++, key);
+        if(sakhadb_btree_insert(t.tree, key, sizeof(key), capacity) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+        sakhadb_btree_ctx_stats(t.ctx, &stats);
+    }
+    while(stats.splits == 0);
+    
+    if(stats.avoided_splits != 0 || sakhadb_btree_count(t.tree) != capacity)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // A full leaf of a new tree loses every other key, new keys then fit
+    // into the space of deleted ones without a split
+    sakhadb_btree_destroy(t.tree);
+    sakhadb_page_t page;
+    sakhadb_pager_request_free_page(t.pager, &page);
+    sakhadb_btree_init_new_root(t.ctx, page, 0);
+    sakhadb_btree_create(t.ctx, page->no, &t.tree);
+    
+    const uint32_t count = capacity - 1;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        char key[16];
+        test_defragment_key(2 * i, key);
+        if(sakhadb_btree_insert(t.tree, key, sizeof(key), 2 * i + 1) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    for(uint32_t i = 0; i < count; i += 2)
+    {
+        char key[16];
+        Pgno no;
+        test_defragment_key(2 * i, key);
+        if(sakhadb_btree_delete(t.tree, key, sizeof(key), &no) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    for(uint32_t i = 0; i < count; i += 2)
+    {
+        char key[16];
+        test_defragment_key(2 * i + 1, key);
+        if(sakhadb_btree_insert(t.tree, key, sizeof(key), 2 * i + 2) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    struct BtreeStats after;
+    sakhadb_btree_ctx_stats(t.ctx, &after);
+    if(after.splits != stats.splits || after.avoided_splits == 0)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Compacted node still finds every key and none of the deleted ones
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        char key[16];
+        Pgno no;
+        uint32_t v = (i % 2) ? 2 * i : 2 * i + 1;
+        test_defragment_key(v, key);
+        if(sakhadb_btree_lookup(t.tree, key, sizeof(key), &no) != SAKHADB_OK || no != v + 1)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        test_defragment_key(v ^ 1, key);
+        if(sakhadb_btree_lookup(t.tree, key, sizeof(key), &no) != SAKHADB_NOTFOUND)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    test_tree_close(&t);
+    return 0;
+}
+
+void test_inline_key(uint32_t i, char key[12])
+{
+    memset(key, 0, 12);
+    test_tree_key(i, key);
+}
+
+/**
+ * Payload of the i-th key, or 0 if the key refers to a data page.
+ */
+size_t test_inline_payload(uint32_t i, char* payload)
+{
+    if(i % 10 == 0)
+    {
+        return 0;
+    }
+    size_t size = 10 + i % 50;
+    memset(payload, (char)i, size);
+    return size;
+}
+
+int test_inline_check(sakhadb_btree_t tree, uint32_t count, int deleted)
+{
+    sakhadb_btree_cursor_t cursor;
+    if(sakhadb_btree_cursor_create(tree, &cursor) != SAKHADB_OK ||
+       sakhadb_btree_cursor_first(cursor) != SAKHADB_OK)
+    {
+        return 1;
+    }
+    
+    uint32_t expected = 0;
+    do
+    {
+        while(deleted && expected % 3 == 0)
+        {
+            ++expected;
+        }
+        
+        char payload[64];
+        size_t npayload = 0;
+        size_t size = test_inline_payload(expected, payload);
+        const void* data = sakhadb_btree_cursor_payload(cursor, &npayload);
+        if(test_tree_key_value(cursor) != expected ||
+           (size ? (!data || npayload != size || memcmp(data, payload, size) != 0)
+                 : (data || sakhadb_btree_cursor_pgno(cursor) != expected + 1)))
+        {
+            return 1;
+        }
+        ++expected;
+    }
+    while(sakhadb_btree_cursor_next(cursor) == SAKHADB_OK);
+    sakhadb_btree_cursor_destroy(cursor);
+    
+    return expected != count;
+}
+
+int test_inline()
+{
+    struct test_tree t;
+    if(test_tree_open("test_inline.db", SAKHADB_BTREE_INLINE, &t) != SAKHADB_OK ||
+       sakhadb_btree_max_payload(t.tree) < 64)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Every tenth key refers to a data page, the others keep payloads in leaves
+    const uint32_t count = 2000;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        char key[12], payload[64];
+        size_t size = test_inline_payload(i, payload);
+        test_inline_key(i, key);
+        int rc = size ? sakhadb_btree_insert_payload(t.tree, key, sizeof(key), payload, size)
+                      : sakhadb_btree_insert(t.tree, key, sizeof(key), i + 1);
+        if(rc != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    struct BtreeStats stats;
+    sakhadb_btree_ctx_stats(t.ctx, &stats);
+    if(stats.splits == 0 || test_inline_check(t.tree, count, 0))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        char key[12];
+        Pgno no;
+        test_inline_key(i, key);
+        if(sakhadb_btree_lookup(t.tree, key, sizeof(key), &no) != SAKHADB_OK ||
+           no != ((i % 10 == 0) ? i + 1 : 0))
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    // Payloads go with deleted keys, the rest stay in place
+    for(uint32_t i = 0; i < count; i += 3)
+    {
+        char key[12];
+        Pgno no;
+        test_inline_key(i, key);
+        if(sakhadb_btree_delete(t.tree, key, sizeof(key), &no) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    if(test_inline_check(t.tree, count, 1))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Payload too large for a leaf is refused
+    char key[12], large[1024];
+    test_inline_key(count, key);
+    memset(large, 0, sizeof(large));
+    if(sakhadb_btree_insert_payload(t.tree, key, sizeof(key), large,
+                                    sakhadb_btree_max_payload(t.tree) + 1) != SAKHADB_INVALID_ARG)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    test_tree_close(&t);
+    return 0;
+}
+
+/**
+ * Keys of a group of 64 share the first 16 bytes, the prefix the node cache
+ * compares, so searches in cached nodes have to settle ties on the page.
+ */
+size_t test_cache_key(int flags, uint32_t i, char key[20])
+{
+    if(flags & SAKHADB_BTREE_OIDKEYS)
+    {
+        memset(key, 0, 12);
+        test_tree_key(i, key);
+        return 12;
+    }
+    memset(key, 'p', 20);
+    test_tree_key(i / 64, key);
+    test_tree_key(i, key + 16);
+    return 20;
+}
+
+int test_cache_check(sakhadb_btree_t tree, int flags, uint32_t count, uint32_t deleted)
+{
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        char key[20];
+        Pgno no;
+        size_t nkey = test_cache_key(flags, i, key);
+        int rc = sakhadb_btree_lookup(tree, key, nkey, &no);
+        if(i < deleted ? rc != SAKHADB_NOTFOUND : (rc != SAKHADB_OK || no != i + 1))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int test_cache()
+{
+    int formats[2] = { 0, SAKHADB_BTREE_OIDKEYS };
+    for(int f = 0; f < 2; ++f)
+    {
+        int flags = formats[f];
+        struct test_tree t;
+        if(test_tree_open("test_cache.db", flags, &t) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        // Lookups between inserts keep upper nodes cached while they split
+        const uint32_t count = 20000;
+        for(uint32_t i = 0; i < count; ++i)
+        {
+            char key[20];
+            size_t nkey = test_cache_key(flags, (i * 7919) % count, key);
+            if(sakhadb_btree_insert(t.tree, key, nkey, (i * 7919) % count + 1) != SAKHADB_OK)
+            {
+                assert(0);
+                return 1;
+            }
+            
+            if(i % 1000 == 999)
+            {
+                for(uint32_t j = 0; j <= i; ++j)
+                {
+                    Pgno no;
+                    nkey = test_cache_key(flags, (j * 7919) % count, key);
+                    if(sakhadb_btree_lookup(t.tree, key, nkey, &no) != SAKHADB_OK ||
+                       no != (j * 7919) % count + 1)
+                    {
+                        assert(0);
+                        return 1;
+                    }
+                }
+            }
+        }
+        
+        struct BtreeStats stats;
+        sakhadb_btree_ctx_stats(t.ctx, &stats);
+        if(stats.splits < 100 || test_cache_check(t.tree, flags, count, 0))
+        {
+            assert(0);
+            return 1;
+        }
+        
+        // Deletes merge nodes and collapse the root under cached entries
+        for(uint32_t i = 0; i < count; ++i)
+        {
+            char key[20];
+            Pgno no;
+            size_t nkey = test_cache_key(flags, i, key);
+            if(sakhadb_btree_delete(t.tree, key, nkey, &no) != SAKHADB_OK || no != i + 1)
+            {
+                assert(0);
+                return 1;
+            }
+            
+            if(i % 2000 == 1999 && test_cache_check(t.tree, flags, count, i + 1))
+            {
+                assert(0);
+                return 1;
+            }
+        }
+        
+        test_tree_close(&t);
+    }
+    return 0;
+}
+
+int test_buffered()
+{
+    int formats[2] = { SAKHADB_BTREE_BUFFERED, SAKHADB_BTREE_OIDKEYS | SAKHADB_BTREE_BUFFERED };
+    for(int f = 0; f < 2; ++f)
+    {
+        int flags = formats[f];
+        struct test_tree t;
+        if(test_tree_open("test_buffered.db", flags, &t) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        // Lookups find keys waiting in buffers of any level, but no others
+        const uint32_t count = 30000;
+        for(uint32_t i = 0; i < count; ++i)
+        {
+            char key[20];
+            size_t nkey = test_cache_key(flags, (i * 7919) % count, key);
+            if(sakhadb_btree_insert(t.tree, key, nkey, (i * 7919) % count + 1) != SAKHADB_OK)
+            {
+                assert(0);
+                return 1;
+            }
+            
+            if(i % 5000 == 4999)
+            {
+                for(uint32_t j = 0; j <= i; ++j)
+                {
+                    Pgno no;
+                    nkey = test_cache_key(flags, (j * 7919) % count, key);
+                    if(sakhadb_btree_lookup(t.tree, key, nkey, &no) != SAKHADB_OK ||
+                       no != (j * 7919) % count + 1)
+                    {
+                        assert(0);
+                        return 1;
+                    }
+                    
+                    nkey = test_cache_key(flags, count + j, key);
+                    if(sakhadb_btree_lookup(t.tree, key, nkey, &no) != SAKHADB_NOTFOUND)
+                    {
+                        assert(0);
+                        return 1;
+                    }
+                }
+            }
+        }
+        
+        // Duplicates wait in buffers too, the first entry of a key stays
+        for(uint32_t i = 0; i < count; i += 3)
+        {
+            char key[20];
+            size_t nkey = test_cache_key(flags, i, key);
+            if(sakhadb_btree_insert(t.tree, key, nkey, count + i + 1) != SAKHADB_OK)
+            {
+                assert(0);
+                return 1;
+            }
+        }
+        
+        struct BtreeStats stats;
+        sakhadb_btree_ctx_stats(t.ctx, &stats);
+        // Trees shared by threads are not buffered
+        if((!SAKHADB_THREADSAFE && stats.flushes < 10) || test_cache_check(t.tree, flags, count, 0) ||
+           sakhadb_btree_count(t.tree) != count)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        // Count applied the buffers, cursor sees every key once
+        sakhadb_btree_cursor_t cursor;
+        if(sakhadb_btree_cursor_create(t.tree, &cursor) != SAKHADB_OK ||
+           sakhadb_btree_cursor_first(cursor) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        uint32_t n = 0;
+        do
+        {
+            char key[20];
+            size_t nkey;
+            size_t size = test_cache_key(flags, n, key);
+            const void* k = sakhadb_btree_cursor_key(cursor, &nkey);
+            if(nkey != size || memcmp(k, key, size) != 0 || sakhadb_btree_cursor_pgno(cursor) != n + 1)
+            {
+                assert(0);
+                return 1;
+            }
+            ++n;
+        }
+        while(sakhadb_btree_cursor_next(cursor) == SAKHADB_OK);
+        sakhadb_btree_cursor_destroy(cursor);
+        
+        if(n != count)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        // Deletes apply the buffers, then the keys go to buffers again
+        for(uint32_t i = 0; i < count / 2; ++i)
+        {
+            char key[20];
+            Pgno no;
+            size_t nkey = test_cache_key(flags, i, key);
+            if(sakhadb_btree_delete(t.tree, key, nkey, &no) != SAKHADB_OK || no != i + 1)
+            {
+                assert(0);
+                return 1;
+            }
+        }
+        
+        if(test_cache_check(t.tree, flags, count, count / 2))
+        {
+            assert(0);
+            return 1;
+        }
+        
+        for(uint32_t i = 0; i < count / 2; ++i)
+        {
+            char key[20];
+            size_t nkey = test_cache_key(flags, i, key);
+            if(sakhadb_btree_insert(t.tree, key, nkey, i + 1) != SAKHADB_OK)
+            {
+                assert(0);
+                return 1;
+            }
+        }
+        
+        if(sakhadb_btree_ctx_commit(t.ctx) != SAKHADB_OK || test_cache_check(t.tree, flags, count, 0) ||
+           sakhadb_btree_count(t.tree) != count)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        test_tree_close(&t);
+    }
+    
+    // Inline payloads pass through buffers with their keys
+    struct test_tree t;
+    if(test_tree_open("test_buffered.db", SAKHADB_BTREE_INLINE | SAKHADB_BTREE_BUFFERED, &t) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    const uint32_t count = 5000;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t k = (i * 7919) % count;
+        char key[12], payload[64];
+        size_t size = test_inline_payload(k, payload);
+        test_inline_key(k, key);
+        int rc = size ? sakhadb_btree_insert_payload(t.tree, key, sizeof(key), payload, size)
+                      : sakhadb_btree_insert(t.tree, key, sizeof(key), k + 1);
+        if(rc != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    if(test_inline_check(t.tree, count, 0))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    test_tree_close(&t);
+    return 0;
+}
+
+/**
+ * Random inserts committed in batches, as a log of events keyed by hash comes
+ * in. Plain tree writes a leaf per insert, buffered one a leaf per batch of
+ * entries flushed to it.
+ */
+int test_buffered_ingest()
+{
+    const uint32_t count = 200000;
+    const uint32_t batch = 1000;
+    double rates[2];
+    for(int f = 0; f < 2; ++f)
+    {
+        int flags = SAKHADB_BTREE_OIDKEYS | (f ? SAKHADB_BTREE_BUFFERED : 0);
+        struct test_tree t;
+        remove("test_buffered_ingest.db");
+        if(test_tree_open("test_buffered_ingest.db", flags, &t) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        for(uint32_t i = 0; i < count; ++i)
+        {
+            char key[12];
+            test_cache_key(flags, (i * 7919) % count, key);
+            if(sakhadb_btree_insert(t.tree, key, sizeof(key), i + 1) != SAKHADB_OK ||
+               (i % batch == batch - 1 && sakhadb_btree_ctx_commit(t.ctx) != SAKHADB_OK))
+            {
+                assert(0);
+                return 1;
+            }
+        }
+        gettimeofday(&end, 0);
+        
+        double sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) * 1e-6;
+        rates[f] = count / sec;
+        
+        if(sakhadb_btree_count(t.tree) != count)
+        {
+            assert(0);
+            return 1;
+        }
+        test_tree_close(&t);
+    }
+    
+    printf("ingest: plain %.0f inserts/s, buffered %.0f inserts/s\n", rates[0], rates[1]);
+    return 0;
+}
+
+int test_count()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_count", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    struct bson_oid lower, upper;
+    for(int i = 0; i < 1000; ++i)
+    {
+        bson_document_ref doc = test_create_doc();
+        bson_element_ref el = bson_document_get_first(doc);
+        if(i == 100)
+        {
+            memcpy(lower.data, bson_element_value(el), sizeof(lower.data));
+        }
+        else if(i == 899)
+        {
+            memcpy(upper.data, bson_element_value(el), sizeof(upper.data));
+        }
+        
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    uint64_t count;
+    rc = sakhadb_collection_count(collection, &lower, &upper, SAKHADB_RANGE_UPPER_EXCLUSIVE, &count);
+    if(rc || count != 799)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find_range(collection, &lower, &upper, SAKHADB_RANGE_UPPER_EXCLUSIVE, &cur);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Page 40 of 20 documents
+    int left = 0;
+    if(sakhadb_cursor_skip(cur, 780) == SAKHADB_OK)
+    {
+        left = 1;
+        while(sakhadb_cursor_next(cur) == SAKHADB_OK)
+        {
+            ++left;
+        }
+    }
+    sakhadb_cursor_destroy(cur);
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    
+    return left == 19 ? 0 : 1;
+}
+
+int test_lsm()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load_ex(db, "test_lsm", SAKHADB_COLLECTION_CREATE_LSM, &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Deletes go into runs written out and merged after them
+    static struct bson_oid oids[30000];
+    for(int i = 0; i < 30000; ++i)
+    {
+        bson_document_ref doc = test_create_doc();
+        bson_element_ref el = bson_document_get_first(doc);
+        memcpy(oids[i].data, bson_element_value(el), sizeof(oids[i].data));
+        
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc == SAKHADB_OK && i == 20000)
+        {
+            for(int j = 0; j < 20000 && rc == SAKHADB_OK; j += 3)
+            {
+                rc = sakhadb_collection_delete(collection, &oids[j]);
+            }
+        }
+        
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    for(int i = 0; i < 30000; ++i)
+    {
+        sakhadb_cursor* cur;
+        rc = sakhadb_collection_find(collection, &oids[i], &cur);
+        if(rc == SAKHADB_OK)
+        {
+            sakhadb_cursor_destroy(cur);
+        }
+        
+        if(rc != ((i < 20000 && i % 3 == 0) ? SAKHADB_NOTFOUND : SAKHADB_OK))
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find(collection, 0, &cur);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    int count = 1;
+    while(sakhadb_cursor_next(cur) == SAKHADB_OK)
+    {
+        ++count;
+    }
+    sakhadb_cursor_destroy(cur);
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    
+    return count == 30000 - 6667 ? 0 : 1;
+}
+
+bson_document_ref test_create_int_doc(struct bson_oid* oid, const char* name, int value)
+{
+    bson_document_builder_ref builder = bson_document_builder_create();
+    bson_oid_init(oid);
+    
+    bson_document_builder_append_oid(builder, "_id", oid);
+    bson_document_builder_append_i(builder, name, value);
+    
+    return bson_document_builder_finalize(builder);
+}
+
+bson_document_ref test_create_bound(const char* name, int value)
+{
+    bson_document_builder_ref builder = bson_document_builder_create();
+    bson_document_builder_append_i(builder, name, value);
+    return bson_document_builder_finalize(builder);
+}
+
+int test_int_field(bson_document_ref doc, const char* path)
+{
+    char type;
+    const void* value;
+    int32_t v;
+    if(sakhadb_key_find(doc->data, path, &type, &value) || type != 0x10)
+    {
+        return -1;
+    }
+    
+    memcpy(&v, value, sizeof(v));
+    return v;
+}
+
+int test_index()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_index", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Half of the documents is loaded by the index build, half by inserts
+    struct bson_oid oids[1000];
+    for(int i = 0; i < 1000; ++i)
+    {
+        if(i == 500)
+        {
+            rc = sakhadb_collection_create_index(collection, "age", 0);
+        }
+        
+        bson_document_ref doc = test_create_int_doc(&oids[i], "age", i % 100);
+        rc = rc ? rc : sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    for(int i = 0; i < 1000; i += 10)
+    {
+        rc = sakhadb_collection_delete(collection, &oids[i]);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    bson_document_ref lower = test_create_bound("age", 10);
+    bson_document_ref upper = test_create_bound("age", 20);
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find_index(collection, "age", lower, upper, SAKHADB_RANGE_UPPER_EXCLUSIVE, &cur);
+    bson_document_destroy(lower);
+    bson_document_destroy(upper);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Ages 10 to 19, age 10 is deleted
+    int count = 0;
+    int last = 11;
+    while(rc == SAKHADB_OK)
+    {
+        bson_document_ref doc;
+        rc = sakhadb_cursor_data(db, cur, &doc);
+        int age = rc ? -1 : test_int_field(doc, "age");
+        if(age < last || age >= 20)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        last = age;
+        ++count;
+        rc = sakhadb_cursor_next(cur);
+    }
+    sakhadb_cursor_destroy(cur);
+    
+    if(sakhadb_collection_find_index(collection, "name", 0, 0, 0, &cur) != SAKHADB_INVALID_ARG)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    
+    return (rc == SAKHADB_NOTFOUND && count == 90) ? 0 : 1;
+}
+
+int test_index_multikey()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_index_multikey", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Every document has three consecutive values in "tags.v"
+    for(int i = 0; i < 200; ++i)
+    {
+        if(i == 100)
+        {
+            rc = sakhadb_collection_create_index(collection, "tags.v", 0);
+        }
+        
+        struct bson_oid oid;
+        bson_array_builder_ref tags = bson_array_builder_create();
+        for(int j = 0; j < 3; ++j)
+        {
+            bson_document_ref tag = test_create_bound("v", i % 20 + j);
+            bson_array_builder_append_doc(tags, tag);
+            bson_document_destroy(tag);
+        }
+        
+        bson_array_ref arr = bson_array_builder_finalize(tags);
+        bson_document_builder_ref builder = bson_document_builder_create();
+        bson_oid_init(&oid);
+        bson_document_builder_append_oid(builder, "_id", &oid);
+        bson_document_builder_append_arr(builder, "tags", arr);
+        bson_array_destroy(arr);
+        bson_document_ref doc = bson_document_builder_finalize(builder);
+        
+        rc = rc ? rc : sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    // Values 5 to 8 match documents starting at 3 to 8, most of them more than once
+    bson_document_ref lower = test_create_bound("v", 5);
+    bson_document_ref upper = test_create_bound("v", 8);
+    for(int reverse = 0; reverse < 2; ++reverse)
+    {
+        sakhadb_cursor* cur;
+        rc = sakhadb_collection_find_index(collection, "tags.v", lower, upper,
+                                           reverse ? SAKHADB_RANGE_REVERSE : 0, &cur);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        struct bson_oid seen[200];
+        int count = 0;
+        while(rc == SAKHADB_OK && count < 200)
+        {
+            bson_document_ref doc;
+            rc = sakhadb_cursor_data(db, cur, &doc);
+            if(rc)
+            {
+                break;
+            }
+            
+            memcpy(seen[count].data, bson_element_value(bson_document_get_first(doc)), sizeof(seen[count].data));
+            for(int k = 0; k < count; ++k)
+            {
+                if(memcmp(seen[k].data, seen[count].data, sizeof(seen[k].data)) == 0)
+                {
+                    assert(0);
+                    return 1;
+                }
+            }
+            
+            ++count;
+            rc = sakhadb_cursor_next(cur);
+        }
+        sakhadb_cursor_destroy(cur);
+        
+        if(rc != SAKHADB_NOTFOUND || count != 60)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    bson_document_destroy(lower);
+    bson_document_destroy(upper);
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return 0;
+}
+
+int test_index_background()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_index_background", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    struct bson_oid oids[2000];
+    int next = 0;
+    for(; next < 1000; ++next)
+    {
+        bson_document_ref doc = test_create_int_doc(&oids[next], "age", next % 100);
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    rc = sakhadb_collection_create_index(collection, "age", SAKHADB_INDEX_BACKGROUND);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Oldest documents are deleted behind the scan position, new ones are
+    // inserted ahead of it
+    size_t pending = 1;
+    int deleted = 0;
+    while(pending)
+    {
+        sakhadb_cursor* cur;
+        if(next + 50 > 2000 || sakhadb_collection_find_index(collection, "age", 0, 0, 0, &cur) != SAKHADB_INVALID_ARG)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        rc = sakhadb_collection_build_index(collection, 200, &pending);
+        for(int i = 0; i < 50 && rc == SAKHADB_OK; ++i, ++next)
+        {
+            bson_document_ref doc = test_create_int_doc(&oids[next], "age", next % 100);
+            rc = sakhadb_collection_insert(collection, doc);
+            bson_document_destroy(doc);
+        }
+        
+        for(int i = 0; i < 20 && rc == SAKHADB_OK; ++i, ++deleted)
+        {
+            rc = sakhadb_collection_delete(collection, &oids[deleted]);
+        }
+        
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    // Every live document is in the index once
+    bson_document_ref lower = test_create_bound("age", 50);
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find_index(collection, "age", lower, lower, 0, &cur);
+    bson_document_destroy(lower);
+    
+    int count = 0;
+    while(rc == SAKHADB_OK)
+    {
+        bson_document_ref doc;
+        rc = sakhadb_cursor_data(db, cur, &doc);
+        if(rc || test_int_field(doc, "age") != 50)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        ++count;
+        rc = sakhadb_cursor_next(cur);
+    }
+    sakhadb_cursor_destroy(cur);
+    
+    int expected = 0;
+    for(int i = 50; i < next; i += 100)
+    {
+        expected += (i >= deleted) ? 1 : 0;
+    }
+    
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return (rc == SAKHADB_NOTFOUND && count == expected) ? 0 : 1;
+}
+
+int test_index_covering()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_index_covering", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Documents span several pages, names and ages fit in index entries
+    static char text[3000];
+    memset(text, 'a', sizeof(text) - 1);
+    struct bson_oid oids[100];
+    for(int i = 0; i < 100; ++i)
+    {
+        if(i == 50)
+        {
+            const char* include[] = { "name" };
+            rc = sakhadb_collection_create_covering_index(collection, "age", include, 1, 0);
+        }
+        
+        char name[16];
+        snprintf(name, sizeof(name), "name%d", i);
+        bson_document_builder_ref builder = bson_document_builder_create();
+        bson_oid_init(&oids[i]);
+        bson_document_builder_append_oid(builder, "_id", &oids[i]);
+        bson_document_builder_append_i(builder, "age", i % 10);
+        bson_document_builder_append_str(builder, "name", name);
+        bson_document_builder_append_str(builder, "text", text);
+        bson_document_ref doc = bson_document_builder_finalize(builder);
+        
+        rc = rc ? rc : sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    bson_document_ref lower = test_create_bound("age", 3);
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find_index(collection, "age", lower, lower, 0, &cur);
+    bson_document_destroy(lower);
+    
+    // Projection holds _id and name of the document and nothing else
+    int count = 0;
+    while(rc == SAKHADB_OK)
+    {
+        bson_document_ref doc;
+        rc = sakhadb_cursor_index_data(cur, &doc);
+        if(rc)
+        {
+            break;
+        }
+        
+        int i = count * 10 + 3;
+        char name[16];
+        char type;
+        const void* value;
+        snprintf(name, sizeof(name), "name%d", i);
+        if(memcmp(bson_element_value(bson_document_get_first(doc)), oids[i].data, sizeof(oids[i].data)) != 0 ||
+           sakhadb_key_find(doc->data, "name", &type, &value) != SAKHADB_OK || type != 0x02 ||
+           strcmp((const char*)value + 4, name) != 0 ||
+           sakhadb_key_find(doc->data, "text", &type, &value) != SAKHADB_NOTFOUND)
+        {
+            assert(0);
+            return 1;
+        }
+        
+        ++count;
+        rc = sakhadb_cursor_next(cur);
+    }
+    
+    struct sakhadb_cursor_stats stats;
+    sakhadb_cursor_stats(cur, &stats);
+    sakhadb_cursor_destroy(cur);
+    if(rc != SAKHADB_NOTFOUND || count != 10 || stats.documents != 0)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Index without included fields has no projection
+    rc = sakhadb_collection_create_index(collection, "name", 0);
+    rc = rc ? rc : sakhadb_collection_find_index(collection, "name", 0, 0, 0, &cur);
+    if(rc || sakhadb_cursor_index_data(cur, &lower) != SAKHADB_INVALID_ARG)
+    {
+        assert(0);
+        return 1;
+    }
+    sakhadb_cursor_destroy(cur);
+    
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return 0;
+}
+
+int test_hash_find(sakhadb* db, sakhadb_collection* collection, struct bson_oid* oids, int count, int deleted)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        sakhadb_cursor* cur;
+        int rc = sakhadb_collection_find(collection, &oids[i], &cur);
+        if(i < deleted)
+        {
+            if(rc != SAKHADB_NOTFOUND)
+            {
+                return 1;
+            }
+            continue;
+        }
+        
+        bson_document_ref doc;
+        rc = rc ? rc : sakhadb_cursor_data(db, cur, &doc);
+        if(rc || test_int_field(doc, "n") != i)
+        {
+            return 1;
+        }
+        sakhadb_cursor_destroy(cur);
+    }
+    return 0;
+}
+
+int test_hash()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load_ex(db, "test_hash", SAKHADB_COLLECTION_CREATE_HASH, &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Bucket of default page holds 63 entries: it is split before the 100th
+    // document, the directory doubles seven times by the 5000th
+    static struct bson_oid oids[5000];
+    for(int i = 0; i < 5000; ++i)
+    {
+        bson_document_ref doc = test_create_int_doc(&oids[i], "n", i);
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc || ((i == 100 || i == 1000) && test_hash_find(db, collection, oids, i + 1, 0)))
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    for(int i = 0; i < 500; ++i)
+    {
+        rc = sakhadb_collection_delete(collection, &oids[i]);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    if(test_hash_find(db, collection, oids, 5000, 500))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Directory is read back from its pages
+    sakhadb_collection_release(collection);
+    rc = sakhadb_collection_load_ex(db, "test_hash", 0, &collection);
+    if(rc || test_hash_find(db, collection, oids, 5000, 500))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return 0;
+}
+
+/**
+ * Looks up 'count' _id's that were never inserted. Returns the number of the
+ * lookups that passed the filter and searched the tree, -1 if some lookup
+ * found a document.
+ */
+int test_bloom_misses(sakhadb_collection* collection, int count)
+{
+    struct sakhadb_collection_stats before, after;
+    sakhadb_collection_stats(collection, &before);
+    for(int i = 0; i < count; ++i)
+    {
+        struct bson_oid oid;
+        sakhadb_cursor* cur;
+        bson_oid_init(&oid);
+        if(sakhadb_collection_find(collection, &oid, &cur) != SAKHADB_NOTFOUND)
+        {
+            return -1;
+        }
+    }
+    
+    sakhadb_collection_stats(collection, &after);
+    uint64_t searches = after.searches - before.searches;
+    if(after.filtered - before.filtered + searches != (uint64_t)count)
+    {
+        return -1;
+    }
+    return (int)searches;
+}
+
+/**
+ * Finds documents as test_hash_find() does. Fails if the filter turned any
+ * of the lookups away, deleted _id's stay in the filter until it is rebuilt.
+ */
+int test_bloom_find(sakhadb* db, sakhadb_collection* collection, struct bson_oid* oids, int count, int deleted)
+{
+    struct sakhadb_collection_stats before, after;
+    sakhadb_collection_stats(collection, &before);
+    if(test_hash_find(db, collection, oids, count, deleted))
+    {
+        return 1;
+    }
+    sakhadb_collection_stats(collection, &after);
+    return after.filtered != before.filtered;
+}
+
+int test_bloom()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load_ex(db, "test_bloom", 0, &collection);
+    static struct bson_oid oids[5000];
+    for(int i = 0; i < 5000 && rc == SAKHADB_OK; ++i)
+    {
+        bson_document_ref doc = test_create_int_doc(&oids[i], "n", i);
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+    }
+    
+    // Filter got full long before, it still has every key
+    if(rc || test_bloom_find(db, collection, oids, 5000, 0))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Filter rebuilt at commit turns misses away
+    rc = sakhadb_commit(db);
+    int searches = test_bloom_misses(collection, 5000);
+    if(rc || searches < 0 || searches > 50)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Deleted documents stay in the filter, lookups of them go to the tree
+    for(int i = 0; i < 1000 && rc == SAKHADB_OK; ++i)
+    {
+        rc = sakhadb_collection_delete(collection, &oids[i]);
+    }
+    if(rc || test_bloom_find(db, collection, oids, 5000, 1000))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Filter is read back from its pages
+    rc = sakhadb_commit(db);
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    rc = rc ? rc : sakhadb_open("test.db", 0, &db);
+    rc = rc ? rc : sakhadb_collection_load_ex(db, "test_bloom", 0, &collection);
+    searches = rc ? -1 : test_bloom_misses(collection, 5000);
+    if(searches < 0 || searches > 50 || test_bloom_find(db, collection, oids, 5000, 1000))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return 0;
+}
+
+int test_bloom_rate()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Filter rebuilt at commit has room for as many keys again, so the
+    // second half fills it up to SAKHADB_COLLECTION_BLOOM_BITS per key
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load_ex(db, "test_bloom_rate", 0, &collection);
+    static struct bson_oid oids[20000];
+    for(int i = 0; i < 20000 && rc == SAKHADB_OK; ++i)
+    {
+        bson_document_ref doc = test_create_int_doc(&oids[i], "n", i);
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc == SAKHADB_OK && i == 9999)
+        {
+            rc = sakhadb_commit(db);
+        }
+    }
+    
+    if(rc || test_bloom_find(db, collection, oids, 20000, 0))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    int searches = test_bloom_misses(collection, 100000);
+    printf("bloom: %d bits per key, %d keys, %.2f%% false positives\n",
+           SAKHADB_COLLECTION_BLOOM_BITS, 20000, searches * 100.0 / 100000);
+    if(searches < 0 || searches > 3000)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return 0;
+}
+
+struct test_scan_arg
+{
+    uint64_t    count;
+    uint64_t    sum;
+    uint64_t    stop;   /* Scan is stopped at this document, 0 if never */
+};
+
+static int test_scan_visit(void* p, bson_document_ref doc)
+{
+    struct test_scan_arg* arg = p;
+    uint64_t count = __atomic_add_fetch(&arg->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&arg->sum, (uint64_t)test_int_field(doc, "n"), __ATOMIC_RELAXED);
+    return (count == arg->stop) ? SAKHADB_NOTAVAIL : 0;
+}
+
+int test_scan()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_scan", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    for(int i = 0; i < 5000; ++i)
+    {
+        struct bson_oid oid;
+        bson_document_ref doc = test_create_int_doc(&oid, "n", i);
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    uint64_t count;
+    rc = sakhadb_collection_count(collection, 0, 0, 0, &count);
+    if(rc || count != 5000)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Every document is visited once whatever the number of threads
+    int nthreads[] = { 1, 4, 64 };
+    for(int i = 0; i < 3; ++i)
+    {
+        struct test_scan_arg arg = { 0, 0, 0 };
+        rc = sakhadb_collection_scan(collection, nthreads[i], test_scan_visit, &arg);
+        if(rc || arg.count != count || arg.sum != 5000 * 4999 / 2)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    struct test_scan_arg arg = { 0, 0, 10 };
+    rc = sakhadb_collection_scan(collection, 4, test_scan_visit, &arg);
+    
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return (rc == SAKHADB_NOTAVAIL && arg.count < count) ? 0 : 1;
+}
+
+#if SAKHADB_THREADSAFE
+struct test_concurrent_arg
+{
+    sakhadb_btree_t tree;
+    int             id;
+    int             nthreads;
+    int             count;
+};
+
+static void test_concurrent_key(int i, int id, int nthreads, struct bson_oid* oid)
+{
+    uint32_t v = (uint32_t)(i * nthreads + id) * 2654435761u;
+    memset(oid->data, 0, sizeof(oid->data));
+    memcpy(oid->data, &v, sizeof(v));
+}
+
+static void* test_concurrent_worker(void* p)
+{
+    struct test_concurrent_arg* arg = p;
+    struct bson_oid oid;
+    for(int i = 0; i < arg->count; ++i)
+    {
+        test_concurrent_key(i, arg->id, arg->nthreads, &oid);
+        if(sakhadb_btree_insert(arg->tree, oid.data, sizeof(oid.data), i + 1) != SAKHADB_OK)
+        {
+            return (void*)1;
+        }
+        
+        // Look up a key inserted before
+        Pgno no;
+        test_concurrent_key(i / 2, arg->id, arg->nthreads, &oid);
+        if(sakhadb_btree_lookup(arg->tree, oid.data, sizeof(oid.data), &no) != SAKHADB_OK)
+        {
+            return (void*)1;
+        }
+    }
+    return 0;
+}
+
+int test_concurrent()
+{
+    sakhadb_file_t h = 0;
+    sakhadb_pager_t pager = 0;
+    sakhadb_btree_ctx_t env = 0;
+    int rc = sakhadb_file_open("test_concurrent.db", SAKHADB_OPEN_READWRITE | SAKHADB_OPEN_CREATE, &h);
+    if(rc == SAKHADB_OK)
+    {
+        rc = sakhadb_pager_create(h, &pager);
+    }
+    if(rc == SAKHADB_OK)
+    {
+        rc = sakhadb_btree_ctx_create(pager, &env);
+    }
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    const int total = 400000;
+    for(int nthreads = 1; nthreads <= 8; nthreads *= 2)
+    {
+        sakhadb_page_t page;
+        sakhadb_pager_request_free_page(pager, &page);
+        sakhadb_btree_init_new_root(env, page, SAKHADB_BTREE_OIDKEYS);
+        
+        sakhadb_btree_t tree;
+        sakhadb_btree_create(env, page->no, &tree);
+        
+        pthread_t threads[8];
+        struct test_concurrent_arg args[8];
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        for(int i = 0; i < nthreads; ++i)
+        {
+            args[i].tree = tree;
+            args[i].id = i;
+            args[i].nthreads = nthreads;
+            args[i].count = total / nthreads;
+            pthread_create(&threads[i], 0, test_concurrent_worker, &args[i]);
+        }
+        
+        int failed = 0;
+        for(int i = 0; i < nthreads; ++i)
+        {
+            void* res;
+            pthread_join(threads[i], &res);
+            failed |= (res != 0);
+        }
+        gettimeofday(&end, 0);
+        
+        double sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) * 1e-6;
+        printf("threads %d: %d inserts + %d lookups in %.3f s\n", nthreads, total, total, sec);
+        
+        // Every key of every thread must be in the tree exactly once
+        failed |= (sakhadb_btree_count(tree) != (uint64_t)total);
+        for(int id = 0; id < nthreads && !failed; ++id)
+        {
+            for(int i = 0; i < total / nthreads; ++i)
+            {
+                struct bson_oid oid;
+                Pgno no;
+                test_concurrent_key(i, id, nthreads, &oid);
+                if(sakhadb_btree_lookup(tree, oid.data, sizeof(oid.data), &no) != SAKHADB_OK || no != (Pgno)(i + 1))
+                {
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+        
+        sakhadb_btree_destroy(tree);
+        if(failed)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_btree_ctx_destroy(env);
+    sakhadb_pager_destroy(pager);
+    sakhadb_file_close(h);
+    return 0;
+}
+#endif // SAKHADB_THREADSAFE
+
+int test_key()
+{
+    // -1 < 2.5 < 5 == 5.0 < "a"
+    const char minus_one[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+    const char five[4] = { 5, 0, 0, 0 };
+    double two_and_half = 2.5, five_dbl = 5.0;
+    const char str_a[6] = { 2, 0, 0, 0, 'a', 0 };
+    
+    sakhadb_key_t keys[5];
+    for(int i = 0; i < 5; ++i)
+    {
+        sakhadb_key_init(keys + i);
+    }
+    
+    if(sakhadb_key_append(keys + 0, 0x10, minus_one, 0) ||
+       sakhadb_key_append(keys + 1, 0x01, &two_and_half, 0) ||
+       sakhadb_key_append(keys + 2, 0x10, five, 0) ||
+       sakhadb_key_append(keys + 3, 0x01, &five_dbl, 0) ||
+       sakhadb_key_append(keys + 4, 0x02, str_a, 0))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    if(keys[2].size != keys[3].size || memcmp(keys[2].data, keys[3].data, keys[2].size) != 0)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    int order[4] = { 0, 1, 2, 4 };
+    for(int i = 1; i < 4; ++i)
+    {
+        sakhadb_key_t* a = keys + order[i - 1];
+        sakhadb_key_t* b = keys + order[i];
+        if(memcmp(a->data, b->data, a->size < b->size ? a->size : b->size) >= 0)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+int test_pager_open(sakhadb_file_t* h, sakhadb_pager_t* pager)
+{
+    int rc = sakhadb_file_open("test_pager.db", SAKHADB_OPEN_READWRITE | SAKHADB_OPEN_CREATE, h);
+    if(rc == SAKHADB_OK)
+    {
+        rc = sakhadb_pager_create(*h, pager);
+    }
+    return rc;
+}
+
+int test_pager()
+{
+    sakhadb_file_t h = 0;
+    sakhadb_pager_t pager = 0;
+    if(test_pager_open(&h, &pager) != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Enough pages for every bucket of the page table to hold several
+    enum { count = 3000 };
+    static Pgno nos[count];
+    for(int i = 0; i < count; ++i)
+    {
+        sakhadb_page_t page;
+        if(sakhadb_pager_request_free_page(pager, &page) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+        nos[i] = page->no;
+        *(Pgno*)page->data = page->no;
+        sakhadb_pager_save_page(pager, page);
+    }
+    
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        for(int i = 0; i < count; ++i)
+        {
+            sakhadb_page_t page;
+            if(sakhadb_pager_request_page(pager, nos[i], &page) != SAKHADB_OK ||
+               page->no != nos[i] || *(Pgno*)page->data != nos[i])
+            {
+                assert(0);
+                return 1;
+            }
+        }
+        
+        // Second pass reads the pages back from the file
+        sakhadb_pager_sync(pager);
+        sakhadb_pager_destroy(pager);
+        sakhadb_file_close(h);
+        if(test_pager_open(&h, &pager) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_pager_destroy(pager);
+    sakhadb_file_close(h);
+    return 0;
+}
+
+int test_dbdata()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_dbdata_t dbdata = sakhadb_dbdata_of(db);
+    
+    // Small documents share pages
+    Pgno nos[100];
+    for(int i = 0; i < 100; ++i)
+    {
+        bson_document_ref doc = test_create_doc();
+        rc = sakhadb_dbdata_write(dbdata, doc->data, bson_document_size(doc), &nos[i]);
+        bson_document_destroy(doc);
+        if(rc || sakhadb_dbdata_rid_slot(nos[i]) == 0)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    if(sakhadb_dbdata_rid_page(nos[0]) != sakhadb_dbdata_rid_page(nos[1]))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    for(int i = 0; i < 100; i += 2)
+    {
+        rc = sakhadb_dbdata_free(dbdata, nos[i]);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    // Records left keep their ids
+    for(int i = 1; i < 100; i += 2)
+    {
+        void* data;
+        rc = sakhadb_dbdata_preload(dbdata, nos[i], &data);
+        if(rc || bson_document_size((bson_document_ref)data) < 5)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_close(db);
+    return 0;
+}
+
+/**
+ * Writes a record of 'size' bytes of a pattern of 'seed' and checks it reads
+ * back, whole and in a range around 'boundary'. Returns 0 on success.
+ */
+int test_extents_write(sakhadb_dbdata_t dbdata, size_t size, int seed, size_t boundary, Pgno* pNo)
+{
+    unsigned char* data = cpl_allocator_allocate(cpl_allocator_get_default(), size);
+    unsigned char* copy = cpl_allocator_allocate(cpl_allocator_get_default(), size);
+    for(size_t i = 0; i < size; ++i)
+    {
+        data[i] = (unsigned char)((i + seed) % 251);
+    }
+    
+    int failed = sakhadb_dbdata_write(dbdata, data, size, pNo) != SAKHADB_OK ||
+                 sakhadb_dbdata_rid_slot(*pNo) != 0 ||
+                 sakhadb_dbdata_read_range(dbdata, *pNo, 0, copy, size) != SAKHADB_OK ||
+                 memcmp(data, copy, size) != 0;
+    
+    if(!failed && boundary && boundary + 100 < size)
+    {
+        failed = sakhadb_dbdata_read_range(dbdata, *pNo, boundary - 100, copy, 200) != SAKHADB_OK ||
+                 memcmp(data + boundary - 100, copy, 200) != 0;
+    }
+    
+    cpl_allocator_free(cpl_allocator_get_default(), copy);
+    cpl_allocator_free(cpl_allocator_get_default(), data);
+    return failed;
+}
+
+int test_dbdata_extents()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_dbdata_t dbdata = sakhadb_dbdata_of(db);
+    
+    // Header of a single extent record takes 16 bytes of its first page
+    const size_t page = 1024, extent = 1024 * page;
+    Pgno a, b, c, d, e;
+    if(test_extents_write(dbdata, 5 * page - 16, 1, 0, &a))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Record grows past one extent
+    if(test_extents_write(dbdata, 5 * extent / 2, 2, extent, &b) ||
+       sakhadb_dbdata_rid_page(b) <= sakhadb_dbdata_rid_page(a))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Freed extent is taken by a record of the same size
+    if(sakhadb_dbdata_free(dbdata, a) != SAKHADB_OK ||
+       test_extents_write(dbdata, 5 * page - 16, 3, 0, &c) ||
+       sakhadb_dbdata_rid_page(c) != sakhadb_dbdata_rid_page(a))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // And by smaller records, one after another
+    if(sakhadb_dbdata_free(dbdata, b) != SAKHADB_OK ||
+       test_extents_write(dbdata, 100 * page - 16, 4, 0, &d) ||
+       sakhadb_dbdata_rid_page(d) != sakhadb_dbdata_rid_page(b) ||
+       test_extents_write(dbdata, 3 * extent / 2, 5, extent, &e) ||
+       sakhadb_dbdata_rid_page(e) != sakhadb_dbdata_rid_page(b) + 100)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Record in reused pages stays intact after its neighbours are freed
+    unsigned char head[4] = { 0 };
+    const unsigned char expected[4] = { 3, 4, 5, 6 };
+    rc = sakhadb_dbdata_free(dbdata, d);
+    if(rc == SAKHADB_OK)
+    {
+        rc = sakhadb_dbdata_read_range(dbdata, c, 0, head, sizeof(head));
+    }
+    if(rc || memcmp(head, expected, sizeof(head)) != 0 ||
+       sakhadb_dbdata_free(dbdata, c) || sakhadb_dbdata_free(dbdata, e))
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_close(db);
+    return 0;
+}
+
+int test_rollback()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Committed state has a page of freed records in the freelist
+    sakhadb_dbdata_t dbdata = sakhadb_dbdata_of(db);
+    char record[100];
+    Pgno nos[200];
+    for(int i = 0; i < 10 && rc == SAKHADB_OK; ++i)
+    {
+        memset(record, i, sizeof(record));
+        rc = sakhadb_dbdata_write(dbdata, record, sizeof(record), nos + i);
+    }
+    for(int i = 0; i < 10 && rc == SAKHADB_OK; ++i)
+    {
+        rc = sakhadb_dbdata_free(dbdata, nos[i]);
+    }
+    rc = rc ? rc : sakhadb_commit(db);
+    
+    // Record goes to the page taken from the freelist, which the rollback
+    // puts back
+    Pgno before;
+    memset(record, 0xAA, sizeof(record));
+    rc = rc ? rc : sakhadb_dbdata_write(dbdata, record, sizeof(record), &before);
+    rc = rc ? rc : sakhadb_rollback(db);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Records written after the rollback go to pages taken anew; filling
+    // several pages must not hand out the page of the first of them again
+    for(int i = 0; i < 200; ++i)
+    {
+        memset(record, i, sizeof(record));
+        if(sakhadb_dbdata_write(dbdata, record, sizeof(record), nos + i) != SAKHADB_OK)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    for(int i = 0; i < 200; ++i)
+    {
+        char data[sizeof(record)];
+        memset(record, i, sizeof(record));
+        if(sakhadb_dbdata_read_range(dbdata, nos[i], 0, data, sizeof(data)) != SAKHADB_OK ||
+           memcmp(data, record, sizeof(record)) != 0)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_close(db);
+    return 0;
+}
+
+int test_dbdata_blob()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_dbdata_t dbdata = sakhadb_dbdata_of(db);
+    
+    // Record is appended in chunks not aligned to pages or extents
+    size_t size = 5 * 1024 * 1024 / 2;
+    size_t nchunk = 3000;
+    unsigned char chunk[3002];
+    sakhadb_dbdata_blob_t blob;
+    rc = sakhadb_dbdata_blob_create(dbdata, size, &blob);
+    for(size_t off = 0; off < size && rc == SAKHADB_OK; off += nchunk)
+    {
+        size_t n = (size - off < nchunk) ? size - off : nchunk;
+        for(size_t i = 0; i < n; ++i)
+        {
+            chunk[i] = (unsigned char)((off + i) % 251);
+        }
+        rc = sakhadb_dbdata_blob_append(blob, chunk, n);
+    }
+    
+    Pgno no = sakhadb_dbdata_blob_rid(blob);
+    sakhadb_dbdata_blob_close(blob);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Ranges around both extent boundaries
+    rc = sakhadb_dbdata_blob_open(dbdata, no, &blob);
+    for(size_t k = 1; k <= 2 && rc == SAKHADB_OK; ++k)
+    {
+        size_t offset = k * 1024 * 1024 - nchunk / 2;
+        rc = sakhadb_dbdata_blob_read(blob, offset, chunk, nchunk);
+        for(size_t i = 0; i < nchunk && rc == SAKHADB_OK; ++i)
+        {
+            if(chunk[i] != (unsigned char)((offset + i) % 251))
+            {
+                assert(0);
+                return 1;
+            }
+        }
+        
+        memset(chunk, 0xFF, nchunk);
+        rc = rc ? rc : sakhadb_dbdata_blob_write(blob, offset, chunk, nchunk);
+    }
+    
+    if(rc || sakhadb_dbdata_blob_write(blob, size - 1, chunk, 2) != SAKHADB_INVALID_ARG)
+    {
+        assert(0);
+        return 1;
+    }
+    sakhadb_dbdata_blob_close(blob);
+    
+    // Written ranges are seen by ranged reads of the record
+    for(size_t k = 1; k <= 2; ++k)
+    {
+        size_t offset = k * 1024 * 1024 - nchunk / 2;
+        rc = sakhadb_dbdata_read_range(dbdata, no, offset - 1, chunk, nchunk + 2);
+        if(rc || chunk[0] != (unsigned char)((offset - 1) % 251) || chunk[1] != 0xFF ||
+           chunk[nchunk] != 0xFF || chunk[nchunk + 1] != (unsigned char)((offset + nchunk) % 251))
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_close(db);
+    return 0;
+}
+
+int test_blob()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_blob", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Document runs through several extents
+    size_t ntext = 3 * 1024 * 1024;
+    char* text = cpl_allocator_allocate(cpl_allocator_get_default(), ntext + 1);
+    memset(text, 'a', ntext);
+    text[ntext] = 0;
+    
+    struct bson_oid oid;
+    bson_document_builder_ref builder = bson_document_builder_create();
+    bson_oid_init(&oid);
+    bson_document_builder_append_oid(builder, "_id", &oid);
+    bson_document_builder_append_str(builder, "text", text);
+    bson_document_ref doc = bson_document_builder_finalize(builder);
+    size_t size = bson_document_size(doc);
+    rc = sakhadb_collection_insert(collection, doc);
+    bson_document_destroy(doc);
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_blob* blob;
+    rc = sakhadb_collection_open_blob(collection, &oid, &blob);
+    if(rc || sakhadb_blob_size(blob) != size)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Range across the end of the first extent
+    size_t offset = size - 2 - ntext + 1024 * 1024 - 5000;
+    size_t n = 10000;
+    memset(text, 'b', n);
+    rc = sakhadb_blob_write(blob, offset, text, n);
+    rc = rc ? rc : sakhadb_blob_read(blob, offset - 1, text, n + 2);
+    if(rc || text[0] != 'a' || text[1] != 'b' || text[n] != 'b' || text[n + 1] != 'a')
+    {
+        assert(0);
+        return 1;
+    }
+    
+    if(sakhadb_blob_read(blob, size - 1, text, 2) != SAKHADB_INVALID_ARG)
+    {
+        assert(0);
+        return 1;
+    }
+    sakhadb_blob_close(blob);
+    
+    // Document read through a cursor has the change
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find(collection, &oid, &cur);
+    rc = rc ? rc : sakhadb_cursor_read(db, cur, offset + n - 1, text, 2);
+    if(rc || text[0] != 'b' || text[1] != 'a')
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_cursor_destroy(cur);
+    cpl_allocator_free(cpl_allocator_get_default(), text);
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return 0;
+}
+
+bson_document_ref test_create_text_doc(struct bson_oid* oid, char c, size_t length)
+{
+    static char text[4000];
+    assert(length < sizeof(text));
+    memset(text, c, length);
+    text[length] = 0;
+    
+    bson_document_builder_ref builder = bson_document_builder_create();
+    bson_oid_init(oid);
+    bson_document_builder_append_oid(builder, "_id", oid);
+    bson_document_builder_append_str(builder, "text", text);
+    return bson_document_builder_finalize(builder);
+}
+
+/**
+ * Returns in 'c' the first character of the "text" field of the document.
+ */
+int test_text_char(bson_document_ref doc, char* c)
+{
+    char type;
+    const void* value;
+    if(sakhadb_key_find(doc->data, "text", &type, &value) || type != 0x02)
+    {
+        return 1;
+    }
+    *c = ((const char*)value)[4];
+    return 0;
+}
+
+int test_cursor_view()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Small documents share a data page in the order of inserts, large ones
+    // span several pages
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load_ex(db, "test_cursor_view", 0, &collection);
+    struct bson_oid small[3], large[3];
+    for(int i = 0; i < 6 && rc == SAKHADB_OK; ++i)
+    {
+        bson_document_ref doc = (i < 3) ? test_create_text_doc(small + i, 'a' + i, 20)
+                                        : test_create_text_doc(large + i - 3, 'x' + i - 3, 3000);
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+    }
+    if(rc)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Document stays the same while other cursors read and the collection
+    // is not modified
+    sakhadb_cursor* cur;
+    bson_document_ref view, again;
+    char copy[64];
+    rc = sakhadb_collection_find(collection, small + 1, &cur);
+    rc = rc ? rc : sakhadb_cursor_data(db, cur, &view);
+    if(rc || bson_document_size(view) > sizeof(copy))
+    {
+        assert(0);
+        return 1;
+    }
+    size_t size = bson_document_size(view);
+    memcpy(copy, view, size);
+    
+    sakhadb_cursor* other;
+    rc = sakhadb_collection_find(collection, 0, &other);
+    while(rc == SAKHADB_OK)
+    {
+        bson_document_ref doc;
+        rc = sakhadb_cursor_data(db, other, &doc);
+        rc = rc ? rc : sakhadb_cursor_next(other);
+    }
+    sakhadb_cursor_destroy(other);
+    
+    if(rc != SAKHADB_NOTFOUND || sakhadb_cursor_data(db, cur, &again) != SAKHADB_OK ||
+       again != view || memcmp(view, copy, size) != 0)
+    {
+        assert(0);
+        return 1;
+    }
+    
+#if !SAKHADB_COLLECTION_CLUSTERED
+    // Freeing the record stored before it moves the document within its page
+    if(sakhadb_collection_delete(collection, small) != SAKHADB_OK ||
+       memcmp(view, copy, size) == 0)
+    {
+        assert(0);
+        return 1;
+    }
+#endif
+    sakhadb_cursor_destroy(cur);
+    
+    // Large documents are read into the buffer of the cursor, the next one
+    // overwrites it
+    char first;
+    rc = sakhadb_collection_find(collection, large, &cur);
+    rc = rc ? rc : sakhadb_cursor_data(db, cur, &view);
+    if(rc || test_text_char(view, &first) || first != 'x')
+    {
+        assert(0);
+        return 1;
+    }
+    
+    char next;
+    rc = sakhadb_cursor_next(cur);
+    rc = rc ? rc : sakhadb_cursor_data(db, cur, &again);
+    if(rc || again != view || test_text_char(view, &next) || next != 'y')
+    {
+        assert(0);
+        return 1;
+    }
+    sakhadb_cursor_destroy(cur);
+    
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    return 0;
+}
+
+int test_scan_allocs()
+{
+    sakhadb* db = 0;
+    int rc = sakhadb_open("test.db", 0, &db);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    sakhadb_collection* collection;
+    rc = sakhadb_collection_load(db, "test_scan_allocs", &collection);
+    if(rc != SAKHADB_OK)
+    {
+        assert(0);
+        return 1;
+    }
+    
+    // Every tenth document takes several pages
+    static char text[20000];
+    memset(text, 'a', sizeof(text) - 1);
+    for(int i = 0; i < 1000; ++i)
+    {
+        struct bson_oid oid;
+        bson_document_builder_ref builder = bson_document_builder_create();
+        bson_oid_init(&oid);
+        bson_document_builder_append_oid(builder, "_id", &oid);
+        bson_document_builder_append_str(builder, "text", text + ((i % 10) ? sizeof(text) - 100 : i));
+        bson_document_ref doc = bson_document_builder_finalize(builder);
+        
+        rc = sakhadb_collection_insert(collection, doc);
+        bson_document_destroy(doc);
+        if(rc)
+        {
+            assert(0);
+            return 1;
+        }
+    }
+    
+    sakhadb_cursor* cur;
+    rc = sakhadb_collection_find(collection, 0, &cur);
+    while(rc == SAKHADB_OK)
+    {
+        bson_document_ref doc;
+        rc = sakhadb_cursor_data(db, cur, &doc);
+        rc = rc ? rc : sakhadb_cursor_next(cur);
+    }
+    
+    struct sakhadb_cursor_stats stats;
+    sakhadb_cursor_stats(cur, &stats);
+    sakhadb_cursor_destroy(cur);
+    sakhadb_collection_release(collection);
+    sakhadb_close(db);
+    
+    printf("scan: %llu documents, %llu copies, %.4f allocations per document\n",
+           (unsigned long long)stats.documents, (unsigned long long)stats.copies,
+           stats.documents ? (double)stats.allocations / stats.documents : 0.0);
+    return (rc == SAKHADB_NOTFOUND && stats.documents == 1000 && stats.allocations == 1) ? 0 : 1;
+}
+
 int test_allocator()
 {
     cpl_allocator_ref allocator = cpl_allocator_create_dl(0x1000000);
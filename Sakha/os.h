@@ -50,4 +50,44 @@ int sakhadb_file_write(sakhadb_file_t, const void*, int, int64_t);
 int sakhadb_file_size(sakhadb_file_t, int64_t*);
 const char* sakhadb_file_filename(sakhadb_file_t);
 
+/**
+ * When this option is on, B-trees of one database may be searched and
+ * inserted into from several threads at once.
+ */
+#ifndef SAKHADB_THREADSAFE
+#   define SAKHADB_THREADSAFE 0
+#endif
+
+#if SAKHADB_THREADSAFE
+/**
+ * Mutex handler
+ */
+typedef struct sakhadb_mutex* sakhadb_mutex_t;
+
+/**
+ * Routines for working with mutexes
+ */
+int sakhadb_mutex_create(sakhadb_mutex_t*);
+void sakhadb_mutex_destroy(sakhadb_mutex_t);
+
+void sakhadb_mutex_enter(sakhadb_mutex_t);
+void sakhadb_mutex_leave(sakhadb_mutex_t);
+
+/**
+ * Gives up the processor while spinning on a latch
+ */
+void sakhadb_yield(void);
+
+/**
+ * Thread handler
+ */
+typedef struct sakhadb_thread* sakhadb_thread_t;
+
+/**
+ * Starts thread running 'fn' with 'arg'. Thread is destroyed when it is joined.
+ */
+int sakhadb_thread_create(void* (*fn)(void*), void* arg, sakhadb_thread_t*);
+void* sakhadb_thread_join(sakhadb_thread_t);
+#endif // SAKHADB_THREADSAFE
+
 #endif // _SAKHADB_OS_H_
@@ -30,6 +30,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#if SAKHADB_THREADSAFE
+#   include <pthread.h>
+#   include <sched.h>
+#endif
 
 #include "logger.h"
 #include "sakhadb.h"
@@ -355,3 +359,83 @@ const char* sakhadb_file_filename(sakhadb_file_t fd)
     return ((posixFile *)fd)->pszFilename;
 }
 
+#if SAKHADB_THREADSAFE
+struct sakhadb_mutex
+{
+    pthread_mutex_t mutex;          /* The mutex itself */
+};
+
+int sakhadb_mutex_create(sakhadb_mutex_t* pMutex)
+{
+    struct sakhadb_mutex* p = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct sakhadb_mutex));
+    if(!p)
+    {
+        SLOG_OS_FATAL("sakhadb_mutex_create: failed to allocate memory for mutex");
+        return SAKHADB_NOMEM;
+    }
+    
+    if(pthread_mutex_init(&p->mutex, 0))
+    {
+        SLOG_OS_ERROR("sakhadb_mutex_create: failed to init mutex");
+        cpl_allocator_free(cpl_allocator_get_default(), p);
+        return SAKHADB_NOMEM;
+    }
+    
+    *pMutex = p;
+    return SAKHADB_OK;
+}
+
+void sakhadb_mutex_destroy(sakhadb_mutex_t mutex)
+{
+    pthread_mutex_destroy(&mutex->mutex);
+    cpl_allocator_free(cpl_allocator_get_default(), mutex);
+}
+
+void sakhadb_mutex_enter(sakhadb_mutex_t mutex)
+{
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+void sakhadb_mutex_leave(sakhadb_mutex_t mutex)
+{
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+void sakhadb_yield(void)
+{
+    sched_yield();
+}
+
+struct sakhadb_thread
+{
+    pthread_t       thread;         /* The thread itself */
+};
+
+int sakhadb_thread_create(void* (*fn)(void*), void* arg, sakhadb_thread_t* pThread)
+{
+    struct sakhadb_thread* p = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct sakhadb_thread));
+    if(!p)
+    {
+        SLOG_OS_FATAL("sakhadb_thread_create: failed to allocate memory for thread");
+        return SAKHADB_NOMEM;
+    }
+    
+    if(pthread_create(&p->thread, 0, fn, arg))
+    {
+        SLOG_OS_ERROR("sakhadb_thread_create: failed to create thread");
+        cpl_allocator_free(cpl_allocator_get_default(), p);
+        return SAKHADB_NOMEM;
+    }
+    
+    *pThread = p;
+    return SAKHADB_OK;
+}
+
+void* sakhadb_thread_join(sakhadb_thread_t thread)
+{
+    void* res = 0;
+    pthread_join(thread->thread, &res);
+    cpl_allocator_free(cpl_allocator_get_default(), thread);
+    return res;
+}
+#endif // SAKHADB_THREADSAFE
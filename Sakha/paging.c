@@ -47,6 +47,23 @@
 #   define SLOG_PAGING_FATAL(...)
 #endif // SLOG_PAGING_ENABLE
 
+/**
+ * Pages are never removed from the hash table while the pager is open, so
+ * lookups go without the mutex. New pages are published with release
+ * semantics after their content is loaded.
+ */
+#if SAKHADB_THREADSAFE
+#   define pagerEnter(p)        sakhadb_mutex_enter((p)->mutex)
+#   define pagerLeave(p)        sakhadb_mutex_leave((p)->mutex)
+#   define pagerLoad(x)         __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#   define pagerPublish(x, v)   __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else // SAKHADB_THREADSAFE
+#   define pagerEnter(p)
+#   define pagerLeave(p)
+#   define pagerLoad(x)         (x)
+#   define pagerPublish(x, v)   ((x) = (v))
+#endif // SAKHADB_THREADSAFE
+
 struct InternalPage
 {
     Pgno        pageNumber;         /* Number of the page */
@@ -57,6 +74,9 @@ struct InternalPage
     int         isDirty;            /* Should be synced */
     struct InternalPage *next;              /* Linked list of pages */
     struct InternalPage *dnext;             /* Dirty next. Useful when page marked as dirty. */
+#if SAKHADB_THREADSAFE
+    uint64_t    latch;              /* Version latch of B-tree node */
+#endif
 };
 
 struct PagesHashTable
@@ -72,12 +92,16 @@ struct Pager
     sakhadb_file_t      fd;             /* File handle */
     Pgno                dbSize;         /* Number of pages in database */
     Pgno                fileSize;       /* Size of the file in pages */
+    Pgno                syncSize;       /* Number of pages at last sync */
     struct Header       *dbHeader;      /* Header of the DB file */
     struct InternalPage *page1;         /* Pointer to the first page in file. */
     uint16_t            pageSize;       /* Page size for current database */
     
     struct PagesHashTable table;    /* Hash table to store pages */
     struct InternalPage *dirty;         /* List of pages to sync */
+#if SAKHADB_THREADSAFE
+    sakhadb_mutex_t     mutex;          /* Guards page creation, freelist and dirty list */
+#endif
 };
 
 /**
@@ -90,7 +114,8 @@ struct Header
     char            reserved1[2];
     uint32_t        dbVersion;      /* Version of Database */
     Pgno            freelist;       /* Freelist */
-    char            reserved2[36];  /* Reserved for future */
+    uint32_t        formatVersion;  /* Version of the page format */
+    char            reserved2[32];  /* Reserved for future */
 };
 
 
@@ -100,9 +125,9 @@ struct Header
 static void addPageToTable(struct Pager* pager, struct InternalPage* page)
 {
     assert(page);
-    int hash = page->pageNumber % sizeof(pager->table._ht);
+    int hash = page->pageNumber % (sizeof(pager->table._ht) / sizeof(pager->table._ht[0]));
     page->next = pager->table._ht[hash];
-    pager->table._ht[hash] = page;
+    pagerPublish(pager->table._ht[hash], page);
 }
 
 /**
@@ -111,7 +136,7 @@ static void addPageToTable(struct Pager* pager, struct InternalPage* page)
 static void removePageFromTable(struct Pager* pager, struct InternalPage* page)
 {
     assert(page);
-    int hash = page->pageNumber % sizeof(pager->table._ht);
+    int hash = page->pageNumber % (sizeof(pager->table._ht) / sizeof(pager->table._ht[0]));
     struct InternalPage* pPage = pager->table._ht[hash];
     if(pPage == page)
     {
@@ -144,8 +169,8 @@ static void markAsDirty(struct InternalPage* pPage)
 static struct InternalPage* lookupPageInTable(struct Pager* pager, Pgno no)
 {
     assert(no > 0);
-    int hash = no % sizeof(pager->table._ht);
-    struct InternalPage* pPage = pager->table._ht[hash];
+    int hash = no % (sizeof(pager->table._ht) / sizeof(pager->table._ht[0]));
+    struct InternalPage* pPage = pagerLoad(pager->table._ht[hash]);
     while (pPage && pPage->pageNumber != no) pPage = pPage->next;
     return pPage;
 }
@@ -171,8 +196,9 @@ static int createPage(
     pPage->pData = 0;
     pPage->isDirty = 0;
     pPage->dnext = 0;
-    
-    addPageToTable(pPager, pPage);
+#if SAKHADB_THREADSAFE
+    pPage->latch = 0;
+#endif
     
     *ppPage = pPage;
     return SAKHADB_OK;
@@ -248,6 +274,8 @@ static int preloadPages(
             break;
         }
         
+        addPageToTable(pPager, pPage);
+        
         rc = fetchPageContent(pPage);
         if(rc != SAKHADB_OK)
         {
@@ -279,6 +307,7 @@ static int acquireHeader(
         header->reserved1[0] = header->reserved1[1] = 0;
         header->dbVersion = SAKHADB_VERSION_NUMBER;
         header->freelist = 0;
+        header->formatVersion = SAKHADB_FORMAT_VERSION;
         memset(header->reserved2, 0, sizeof(header->reserved2));
         
         markAsDirty(page1);
@@ -298,6 +327,12 @@ static int acquireHeader(
             return SAKHADB_CANTOPEN;
         }
         
+        if(header->formatVersion != SAKHADB_FORMAT_VERSION)
+        {
+            SLOG_PAGING_FATAL("acquireHeader: page format do not match [%d]", header->formatVersion);
+            return SAKHADB_NOTADB;
+        }
+        
         uint16_t pageSize = header->pageSize;
         if(pageSize != pager->pageSize)
         {
@@ -341,7 +376,9 @@ int sakhadb_pager_create(const sakhadb_file_t fd,
     
     pager->fileSize = (Pgno)(fileSize/pager->pageSize);
     pager->dbSize = pager->fileSize?pager->fileSize:1;
+    pager->syncSize = pager->dbSize;
     memset(pager->table._ht, 0, sizeof(pager->table._ht));
+    pager->dirty = 0;
     
     pager->pageAllocator = cpl_allocator_create_pool(sizeof(struct InternalPage), 1024);
     if(!pager->pageAllocator)
@@ -366,6 +403,8 @@ int sakhadb_pager_create(const sakhadb_file_t fd,
         goto content_allocator_failed;
     }
     
+    addPageToTable(pager, pager->page1);
+    
     SLOG_PAGING_INFO("sakhadb_pager_create: created page1");
     
     rc = fetchPageContent(pager->page1);
@@ -391,11 +430,21 @@ int sakhadb_pager_create(const sakhadb_file_t fd,
         goto preload_failed;
     }
     
+#if SAKHADB_THREADSAFE
+    rc = sakhadb_mutex_create(&pager->mutex);
+    if(rc != SAKHADB_OK)
+    {
+        SLOG_PAGING_FATAL("sakhadb_pager_create: failed to create mutex.");
+        goto preload_failed;
+    }
+#endif
+    
     *pPager = pager;
     return SAKHADB_OK;
     
 preload_failed:
     // TODO: free peloaded pages
+    pager->page1->pData -= sizeof(struct Header);
     
 fetch_failed:
     destroyPage(pager->page1);
@@ -414,9 +463,14 @@ cleanup:
 int sakhadb_pager_destroy(sakhadb_pager_t pager)
 {
     SLOG_PAGING_INFO("sakhadb_pager_destroy: destroying pager.");
+    // Page 1 data starts past the header, free the whole buffer
+    pager->page1->pData -= sizeof(struct Header);
     destroyPage(pager->page1);
     cpl_allocator_destroy_pool(pager->contentAllocator);
     cpl_allocator_destroy_pool(pager->pageAllocator);
+#if SAKHADB_THREADSAFE
+    sakhadb_mutex_destroy(pager->mutex);
+#endif
     cpl_allocator_free(pager->allocator, pager);
     return SAKHADB_OK;
 }
@@ -436,8 +490,13 @@ int sakhadb_pager_sync(sakhadb_pager_t pager)
             SLOG_PAGING_ERROR("sakhadb_pager_sync: failed to sync page.");
             return rc;
         }
+        if(pager->dirty->pageNumber > pager->fileSize)
+        {
+            pager->fileSize = pager->dirty->pageNumber;
+        }
         pager->dirty = pager->dirty->dnext;
     }
+    pager->syncSize = pager->dbSize;
     return SAKHADB_OK;
 }
 
@@ -446,8 +505,13 @@ int sakhadb_pager_update(sakhadb_pager_t pager)
     SLOG_PAGING_INFO("sakhadb_pager_update: updating pager.");
     while (pager->dirty)
     {
-        int rc = fetchPageContent(pager->dirty);
-        pager->dirty->isDirty = 0;
+        // Page 1 data starts after the file header, read the page as a whole
+        struct InternalPage* pPage = pager->dirty;
+        size_t header = (pPage->pageNumber == 1)?sizeof(struct Header):0;
+        pPage->pData -= header;
+        int rc = fetchPageContent(pPage);
+        pPage->pData += header;
+        pPage->isDirty = 0;
         if(rc != SAKHADB_OK)
         {
             SLOG_PAGING_ERROR("sakhadb_pager_update: failed to update page.");
@@ -456,78 +520,244 @@ int sakhadb_pager_update(sakhadb_pager_t pager)
         pager->dirty = pager->dirty->dnext;
     }
     
+    // Pages appended since the last sync are handed out again
+    pager->dbSize = pager->syncSize;
     return SAKHADB_OK;
 }
 
-int sakhadb_pager_request_page(sakhadb_pager_t pager, Pgno no, sakhadb_page_t* pPage)
+/**
+ * Creates the page if it is not loaded yet. Must be called under pager mutex.
+ */
+static int requestPage(struct Pager* pager, Pgno no, struct InternalPage** ppPage)
 {
-    SLOG_PAGING_INFO("sakhadb_pager_request_page: requesting page [%d]", no);
-    if(no == 1)
-    {
-        *pPage = (sakhadb_page_t)pager->page1;
-        return SAKHADB_OK;
-    }
-    
-    SLOG_PAGING_INFO("sakhadb_pager_request_page: looking for page in table.");
     struct InternalPage* pInternalPage = lookupPageInTable(pager, no);
     if(!pInternalPage)
     {
-        SLOG_PAGING_INFO("sakhadb_pager_request_page: page not found. create new.");
+        SLOG_PAGING_INFO("requestPage: page not found. create new.");
         int rc = createPage(pager, no, &pInternalPage);
         if(rc != SAKHADB_OK)
         {
-            SLOG_PAGING_ERROR("sakhadb_pager_request_page: failed to create page [%d]", no);
+            SLOG_PAGING_ERROR("requestPage: failed to create page [%d]", no);
             return rc;
         }
         
-        SLOG_PAGING_INFO("sakhadb_pager_request_page: fetch page content");
+        SLOG_PAGING_INFO("requestPage: fetch page content");
         rc = fetchPageContent(pInternalPage);
         if(rc != SAKHADB_OK)
         {
-            SLOG_PAGING_ERROR("sakhadb_pager_request_page: failed to fetch page content. [%d]", no);
+            SLOG_PAGING_ERROR("requestPage: failed to fetch page content. [%d]", no);
+            cpl_allocator_free(pager->contentAllocator, pInternalPage->pData);
+            cpl_allocator_free(pager->pageAllocator, pInternalPage);
             return rc;
         }
+        
+        addPageToTable(pager, pInternalPage);
     }
     
-    *pPage = (sakhadb_page_t)pInternalPage;
-    
+    *ppPage = pInternalPage;
     return SAKHADB_OK;
 }
 
+int sakhadb_pager_request_page(sakhadb_pager_t pager, Pgno no, sakhadb_page_t* pPage)
+{
+    SLOG_PAGING_INFO("sakhadb_pager_request_page: requesting page [%d]", no);
+    if(no == 1)
+    {
+        *pPage = (sakhadb_page_t)pager->page1;
+        return SAKHADB_OK;
+    }
+    
+    SLOG_PAGING_INFO("sakhadb_pager_request_page: looking for page in table.");
+    struct InternalPage* pInternalPage = lookupPageInTable(pager, no);
+    if(pInternalPage)
+    {
+        *pPage = (sakhadb_page_t)pInternalPage;
+        return SAKHADB_OK;
+    }
+    
+    pagerEnter(pager);
+    int rc = requestPage(pager, no, &pInternalPage);
+    pagerLeave(pager);
+    
+    if(rc == SAKHADB_OK)
+    {
+        *pPage = (sakhadb_page_t)pInternalPage;
+    }
+    
+    return rc;
+}
+
 void sakhadb_pager_save_page(sakhadb_pager_t pager, sakhadb_page_t page)
 {
+    // Page is already in the dirty list
+    if(pagerLoad(((struct InternalPage*)page)->isDirty))
+    {
+        return;
+    }
+    
+    pagerEnter(pager);
     markAsDirty((struct InternalPage*)page);
+    pagerLeave(pager);
 }
 
 int sakhadb_pager_request_free_page(sakhadb_pager_t pager, sakhadb_page_t* pPage)
 {
     struct Header* h = pager->dbHeader;
+    struct InternalPage* pInternalPage;
+    int res;
+    
+    pagerEnter(pager);
     if(h->freelist == 0)
     {
-        return sakhadb_pager_request_page(pager, ++pager->dbSize, pPage);
+        res = requestPage(pager, ++pager->dbSize, &pInternalPage);
+    }
+    else
+    {
+        res = requestPage(pager, h->freelist, &pInternalPage);
+        if(res == SAKHADB_OK)
+        {
+            h->freelist = *(Pgno*)(pInternalPage->pData);
+            markAsDirty(pager->page1);
+        }
     }
+    pagerLeave(pager);
     
-    int res = sakhadb_pager_request_page(pager, h->freelist, pPage);
     if(res == SAKHADB_OK)
     {
-        h->freelist = *(Pgno*)((*pPage)->data);
-        markAsDirty(pager->page1);
+        *pPage = (sakhadb_page_t)pInternalPage;
     }
     return res;
 }
 
+int sakhadb_pager_request_extent(sakhadb_pager_t pager, Pgno count, Pgno* pNo)
+{
+    assert(count > 0);
+    SLOG_PAGING_INFO("sakhadb_pager_request_extent: requesting extent [%d]", count);
+    struct Header* h = pager->dbHeader;
+    int rc = SAKHADB_OK;
+    pagerEnter(pager);
+    
+    // Freed extent heads the freelist with its pages in ascending order
+    Pgno no = h->freelist;
+    Pgno next = no;
+    Pgno n = 0;
+    while(no && n < count && next == no + n)
+    {
+        struct InternalPage* pInternalPage;
+        rc = requestPage(pager, next, &pInternalPage);
+        if(rc)
+        {
+            break;
+        }
+        next = *(Pgno*)(pInternalPage->pData);
+        ++n;
+    }
+    
+    if(rc == SAKHADB_OK && no && n == count)
+    {
+        SLOG_PAGING_INFO("sakhadb_pager_request_extent: reuse free pages [%d][%d]", no, count);
+        h->freelist = next;
+        markAsDirty(pager->page1);
+        *pNo = no;
+    }
+    else if(rc == SAKHADB_OK)
+    {
+        *pNo = pager->dbSize + 1;
+        pager->dbSize += count;
+    }
+    pagerLeave(pager);
+    return rc;
+}
+
+/**
+ * Reads run of pages missing in the table with one read. Must be called under
+ * pager mutex.
+ */
+static int readPages(struct Pager* pager, Pgno no, Pgno count)
+{
+    size_t size = (size_t)count * pager->pageSize;
+    char* buffer = cpl_allocator_allocate(pager->allocator, size);
+    if(!buffer)
+    {
+        SLOG_PAGING_FATAL("readPages: failed to allocate buffer for pages.");
+        return SAKHADB_NOMEM;
+    }
+    
+    int rc = sakhadb_file_read(pager->fd, buffer, (int)size, (int64_t)(no - 1) * pager->pageSize);
+    for(Pgno i = 0; i < count && rc == SAKHADB_OK; ++i)
+    {
+        struct InternalPage* pPage;
+        rc = createPage(pager, no + i, &pPage);
+        if(rc)
+        {
+            break;
+        }
+        
+        pPage->pData = cpl_allocator_allocate(pager->contentAllocator, pager->pageSize);
+        if(!pPage->pData)
+        {
+            cpl_allocator_free(pager->pageAllocator, pPage);
+            rc = SAKHADB_NOMEM;
+            break;
+        }
+        
+        memcpy(pPage->pData, buffer + (size_t)i * pager->pageSize, pager->pageSize);
+        addPageToTable(pager, pPage);
+    }
+    
+    cpl_allocator_free(pager->allocator, buffer);
+    return rc;
+}
+
+int sakhadb_pager_load_pages(sakhadb_pager_t pager, Pgno no, Pgno count)
+{
+    SLOG_PAGING_INFO("sakhadb_pager_load_pages: loading pages [%d][%d]", no, count);
+    int rc = SAKHADB_OK;
+    
+    pagerEnter(pager);
+    Pgno end = no + count;
+    while(no < end && rc == SAKHADB_OK)
+    {
+        if(no == 1 || no > pager->fileSize || lookupPageInTable(pager, no))
+        {
+            ++no;
+            continue;
+        }
+        
+        Pgno first = no;
+        while(no < end && no <= pager->fileSize && !lookupPageInTable(pager, no))
+        {
+            ++no;
+        }
+        rc = readPages(pager, first, no - first);
+    }
+    pagerLeave(pager);
+    
+    return rc;
+}
+
 void sakhadb_pager_add_freelist(sakhadb_pager_t pager, sakhadb_page_t page)
 {
     SLOG_PAGING_INFO("sakhadb_pager_add_freelist: freeing page [%d]", page->no);
+    pagerEnter(pager);
     Pgno* pNo = (Pgno *)page->data;
     struct Header* h = pager->dbHeader;
     *pNo = h->freelist;
     h->freelist = page->no;
     
+    markAsDirty((struct InternalPage*)page);
     markAsDirty(pager->page1);
+    pagerLeave(pager);
 }
 
 size_t sakhadb_pager_page_size(sakhadb_pager_t pager, int page1)
 {
     return pager->pageSize - page1 * sizeof(struct Header);
 }
+
+#if SAKHADB_THREADSAFE
+uint64_t* sakhadb_pager_page_latch(sakhadb_page_t page)
+{
+    return &((struct InternalPage*)page)->latch;
+}
+#endif
@@ -86,6 +86,20 @@ void sakhadb_pager_save_page(sakhadb_pager_t pager, sakhadb_page_t page);
  */
 int sakhadb_pager_request_free_page(sakhadb_pager_t pager, sakhadb_page_t* pPage);
 
+/**
+ * Allocates 'count' consecutive pages and returns the first of them in 'pNo'.
+ * Pages heading the freelist are reused if they are consecutive, as pages of
+ * a freed extent are, otherwise the extent goes at the end of the file.
+ * Pages are requested with sakhadb_pager_request_page().
+ */
+int sakhadb_pager_request_extent(sakhadb_pager_t pager, Pgno count, Pgno* pNo);
+
+/**
+ * Loads 'count' pages starting from 'no'. Each run of pages that are not
+ * loaded yet is read from file at once.
+ */
+int sakhadb_pager_load_pages(sakhadb_pager_t pager, Pgno no, Pgno count);
+
 /**
  * Marke the page as free and add it to freelist.
  */
@@ -96,5 +110,13 @@ void sakhadb_pager_add_freelist(sakhadb_pager_t pager, sakhadb_page_t page);
  */
 size_t sakhadb_pager_page_size(sakhadb_pager_t pager, int page1);
 
+#if SAKHADB_THREADSAFE
+/**
+ * Get version latch of the page. The latch is zero for new page and is
+ * managed by the B-tree.
+ */
+uint64_t* sakhadb_pager_page_latch(sakhadb_page_t page);
+#endif
+
 
 #endif // _SAKHADB_PAGING_H_
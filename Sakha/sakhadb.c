@@ -29,6 +29,10 @@
 #include "btree.h"
 #include "dbdata.h"
 #include "cursor.h"
+#include "lsm.h"
+#include "index.h"
+#include "hash.h"
+#include "bloom.h"
 
 struct sakhadb
 {
@@ -36,21 +40,344 @@ struct sakhadb
     sakhadb_pager_t     pager;      /* Pager */
     sakhadb_btree_ctx_t ctx;        /* B-tree environment */
     sakhadb_dbdata_t    dbdata;     /* DbData */
+    sakhadb_collection* collections; /* Loaded collections */
 };
 
 struct sakhadb_collection
 {
     sakhadb_btree_t     tree;
+    sakhadb_lsm_t       lsm;        /* Log-structured storage, 0 for B-tree collection */
+    sakhadb_hash_t      hash;       /* Hash of _id's to data pages, if any */
+    sakhadb_page_t      bloom;      /* Header page of the filter of _id's, 0 if there is none */
+    struct sakhadb_collection_stats stats;
+    sakhadb_index_t     indexes;    /* Secondary indexes */
+    struct CollectionBuild* builds; /* Indexes being built */
     sakhadb*            db;
+    sakhadb_collection* next;       /* Next loaded collection of the database */
+    char                name[1];    /* Name of the collection in the catalog */
+};
+
+/**
+ * Index being built in steps. Documents are scanned in _id order, so changes
+ * of documents past the last scanned one need not be logged.
+ */
+struct CollectionBuild
+{
+    sakhadb_index_build_t   build;
+    struct CollectionBuild* next;
+    int                     scanned;    /* Some documents were scanned */
+    char                    id[SAKHADB_BTREE_OID_SIZE]; /* _id of the last scanned document */
 };
 
 struct sakhadb_cursor
 {
     struct BtreeCursorStack*    cur;
-    cpl_region_ref              reg;
+    sakhadb_lsm_cursor_t        lsm;        /* Cursor of LSM collection, 'cur' is 0 then */
+    sakhadb_btree_t             tree;       /* _id tree of document found through hash, 'cur' is 0
+                                               until the cursor moves */
+    Pgno                        no;         /* Data page of document found through hash */
+    char                        id[SAKHADB_BTREE_OID_SIZE]; /* _id of document found through hash */
+    cpl_region_t                buffer;     /* Document read from several pages, kept for next ones */
+    size_t                      nbuffer;    /* Capacity of 'buffer', 0 until it is allocated */
+    struct sakhadb_cursor_stats stats;
+    int                         reverse;    /* Cursor moves backward */
+    sakhadb_collection*         coll;       /* Collection of index cursor, 0 for _id cursor */
+    sakhadb_index_t             index;      /* Index of index cursor */
+    sakhadb_cursor*             doc;        /* Document of index entry found by _id */
+    sakhadb_index_seen_t        seen;       /* Documents returned from multikey index */
+    char                        entry[SAKHADB_INDEX_ENTRY_DOC_SIZE]; /* Document of covering index entry */
+};
+
+struct sakhadb_blob
+{
+    sakhadb_dbdata_blob_t       data;       /* Record of the document */
+    sakhadb_collection*         coll;
+};
+
+/**
+ * Loads the filter and indexes of the collection. Catalog entry of the filter
+ * is "<collection>\0", entries of indexes are
+ * "<collection>\0<path>\0<included path>\0...<flags>", so they follow the
+ * collection entry.
+ */
+static int collectionLoadIndexes(sakhadb_collection* coll, sakhadb_btree_cursor_t cursor, size_t length)
+{
+    sakhadb_index_t* tail = &coll->indexes;
+    int rc = sakhadb_btree_cursor_seek(cursor, coll->name, length, 1);
+    while(rc == SAKHADB_OK)
+    {
+        size_t nkey;
+        const char* key = sakhadb_btree_cursor_key(cursor, &nkey);
+        if(nkey == length + 1 && memcmp(key, coll->name, length + 1) == 0)
+        {
+            rc = sakhadb_pager_request_page(coll->db->pager, sakhadb_btree_cursor_pgno(cursor), &coll->bloom);
+            rc = rc ? rc : sakhadb_btree_cursor_next(cursor);
+            continue;
+        }
+        
+        if(nkey <= length + 1 || memcmp(key, coll->name, length + 1) != 0)
+        {
+            break;
+        }
+        
+        const char* path = key + length + 1;
+        size_t ninclude = nkey - 1 - (length + 1 + strlen(path) + 1);
+        char include[SAKHADB_BTREE_MAX_KEY_SIZE];
+        memcpy(include, key + nkey - 1 - ninclude, ninclude);
+        include[ninclude] = 0;
+        
+        rc = sakhadb_index_create(coll->db->ctx, sakhadb_btree_cursor_pgno(cursor), path,
+                                  ninclude ? include : 0, (unsigned char)key[nkey - 1], tail);
+        if(rc)
+        {
+            goto Lexit;
+        }
+        
+        tail = &(*tail)->next;
+        rc = sakhadb_btree_cursor_next(cursor);
+    }
+    
+    rc = SAKHADB_OK;
+    
+Lexit:
+    return rc;
+}
+
+#define SAKHADB_COLLECTION_BLOOM_PROBES SAKHADB_BLOOM_PROBES(SAKHADB_COLLECTION_BLOOM_BITS)
+
+/**
+ * Header page of the filter of _id's. The filter takes an extent of pages,
+ * each page is a block of the blocked filter, so a lookup reads one page.
+ */
+struct CollectionBloom
+{
+    Pgno        no;                 /* First page of the filter */
+    uint32_t    npages;             /* Pages of the filter */
+    uint64_t    nadded;             /* Keys added to the filter */
 };
 
-static int collectionCreate(sakhadb* db, const char* name, size_t length, struct sakhadb_collection** ppColl)
+static inline uint32_t collectionBloomPageBits(sakhadb_pager_t pager)
+{
+    return (uint32_t)(sakhadb_pager_page_size(pager, 0) * 8) & ~63U;
+}
+
+/**
+ * Allocates zeroed pages for the filter of 'count' keys.
+ */
+static int collectionBloomAllocate(sakhadb_pager_t pager, uint64_t count, Pgno* pNo, uint32_t* pNpages)
+{
+    uint64_t nbits = (count ? count : 1) * SAKHADB_COLLECTION_BLOOM_BITS;
+    uint32_t npages = (uint32_t)((nbits + collectionBloomPageBits(pager) - 1) / collectionBloomPageBits(pager));
+    int rc = sakhadb_pager_request_extent(pager, npages, pNo);
+    for(uint32_t i = 0; i < npages && rc == SAKHADB_OK; ++i)
+    {
+        sakhadb_page_t page;
+        rc = sakhadb_pager_request_page(pager, *pNo + i, &page);
+        if(rc == SAKHADB_OK)
+        {
+            memset(page->data, 0, sakhadb_pager_page_size(pager, 0));
+            sakhadb_pager_save_page(pager, page);
+        }
+    }
+    *pNpages = npages;
+    return rc;
+}
+
+static int collectionBloomSet(sakhadb_pager_t pager, const struct CollectionBloom* bloom, const void* key)
+{
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_page(pager, bloom->no + sakhadb_bloom_block(bloom->npages, key), &page);
+    if(rc == SAKHADB_OK)
+    {
+        sakhadb_bloom_add(page->data, collectionBloomPageBits(pager), SAKHADB_COLLECTION_BLOOM_PROBES, key);
+        sakhadb_pager_save_page(pager, page);
+    }
+    return rc;
+}
+
+/**
+ * Creates the filter of new collection and its catalog entry.
+ */
+static int collectionBloomCreate(sakhadb* db, sakhadb_btree_t meta, const char* name, size_t length)
+{
+    sakhadb_page_t page;
+    int rc = sakhadb_pager_request_free_page(db->pager, &page);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    struct CollectionBloom* bloom = page->data;
+    rc = collectionBloomAllocate(db->pager, 0, &bloom->no, &bloom->npages);
+    if(rc)
+    {
+        return rc;
+    }
+    bloom->nadded = 0;
+    sakhadb_pager_save_page(db->pager, page);
+    
+    return sakhadb_btree_insert(meta, name, length + 1, page->no);
+}
+
+/**
+ * Rebuilds the filter from the _id tree if it got full, with room for as many
+ * keys again. Pages of the old filter are freed.
+ */
+static int collectionBloomRebuild(sakhadb_collection* coll)
+{
+    sakhadb_pager_t pager = coll->db->pager;
+    struct CollectionBloom* bloom = coll->bloom->data;
+    if(bloom->nadded * SAKHADB_COLLECTION_BLOOM_BITS <= (uint64_t)bloom->npages * collectionBloomPageBits(pager))
+    {
+        return SAKHADB_OK;
+    }
+    
+    struct CollectionBloom rebuilt;
+    rebuilt.nadded = sakhadb_btree_count(coll->tree);
+    int rc = collectionBloomAllocate(pager, 2 * rebuilt.nadded, &rebuilt.no, &rebuilt.npages);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    sakhadb_btree_cursor_t cursor;
+    rc = sakhadb_btree_cursor_create(coll->tree, &cursor);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    for(rc = sakhadb_btree_cursor_first(cursor); rc == SAKHADB_OK; rc = sakhadb_btree_cursor_next(cursor))
+    {
+        size_t nkey;
+        rc = collectionBloomSet(pager, &rebuilt, sakhadb_btree_cursor_key(cursor, &nkey));
+        if(rc)
+        {
+            break;
+        }
+    }
+    sakhadb_btree_cursor_destroy(cursor);
+    if(rc != SAKHADB_NOTFOUND)
+    {
+        return rc;
+    }
+    
+    // Freelist takes the pages back in ascending order
+    for(uint32_t i = bloom->npages; i > 0; --i)
+    {
+        sakhadb_page_t page;
+        rc = sakhadb_pager_request_page(pager, bloom->no + i - 1, &page);
+        if(rc)
+        {
+            return rc;
+        }
+        sakhadb_pager_add_freelist(pager, page);
+    }
+    
+    *bloom = rebuilt;
+    sakhadb_pager_save_page(pager, coll->bloom);
+    return SAKHADB_OK;
+}
+
+/**
+ * Adds the key to the filter. A full filter takes keys until it is rebuilt at
+ * commit, letting more lookups through meanwhile.
+ */
+static int collectionBloomAdd(sakhadb_collection* coll, const void* key)
+{
+    if(!coll->bloom)
+    {
+        return SAKHADB_OK;
+    }
+    
+    struct CollectionBloom* bloom = coll->bloom->data;
+    int rc = collectionBloomSet(coll->db->pager, bloom, key);
+    if(rc == SAKHADB_OK)
+    {
+        bloom->nadded += 1;
+        sakhadb_pager_save_page(coll->db->pager, coll->bloom);
+    }
+    return rc;
+}
+
+/**
+ * Tells if the collection may have the _id, false positives aside.
+ */
+static inline int collectionBloomMayContain(sakhadb_collection* coll, const void* key)
+{
+    sakhadb_page_t page;
+    const struct CollectionBloom* bloom = coll->bloom ? coll->bloom->data : 0;
+    if(bloom && sakhadb_pager_request_page(coll->db->pager, bloom->no + sakhadb_bloom_block(bloom->npages, key),
+                                           &page) == SAKHADB_OK &&
+       !sakhadb_bloom_may_contain(page->data, collectionBloomPageBits(coll->db->pager),
+                                  SAKHADB_COLLECTION_BLOOM_PROBES, key))
+    {
+        coll->stats.filtered += 1;
+        return 0;
+    }
+    
+    coll->stats.searches += 1;
+    return 1;
+}
+
+/**
+ * Abandons the build.
+ */
+static void collectionBuildDestroy(sakhadb_collection* collection, struct CollectionBuild* build)
+{
+    struct CollectionBuild** link = &collection->builds;
+    while(*link != build)
+    {
+        link = &(*link)->next;
+    }
+    *link = build->next;
+    
+    sakhadb_index_build_destroy(build->build);
+    cpl_allocator_free(cpl_allocator_get_default(), build);
+}
+
+static inline void collectionDestroy(sakhadb_collection* coll)
+{
+    for(sakhadb_collection** link = &coll->db->collections; *link; link = &(*link)->next)
+    {
+        if(*link == coll)
+        {
+            *link = coll->next;
+            break;
+        }
+    }
+    
+    while(coll->builds)
+    {
+        collectionBuildDestroy(coll, coll->builds);
+    }
+    
+    while(coll->indexes)
+    {
+        sakhadb_index_t index = coll->indexes;
+        coll->indexes = index->next;
+        sakhadb_index_destroy(index);
+    }
+    
+    if(coll->lsm)
+    {
+        sakhadb_lsm_destroy(coll->lsm);
+    }
+    else if(coll->tree)
+    {
+        sakhadb_btree_destroy(coll->tree);
+    }
+    
+    if(coll->hash)
+    {
+        sakhadb_hash_destroy(coll->hash);
+    }
+    
+    cpl_allocator_free(cpl_allocator_get_default(), coll);
+}
+
+static int collectionCreate(sakhadb* db, const char* name, size_t length, int flags,
+                            struct sakhadb_collection** ppColl)
 {
     int rc = SAKHADB_OK;
     sakhadb_btree_cursor_t cursor = 0;
@@ -58,7 +385,8 @@ static int collectionCreate(sakhadb* db, const char* name, size_t length, struct
     sakhadb_btree_ctx_t ctx = db->ctx;
     sakhadb_btree_t meta = 0;
     
-    struct sakhadb_collection* coll = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct sakhadb_collection));
+    struct sakhadb_collection* coll = cpl_allocator_allocate(cpl_allocator_get_default(),
+                                                             sizeof(struct sakhadb_collection) + length);
     if(!coll)
     {
         rc = SAKHADB_NOMEM;
@@ -94,17 +422,103 @@ static int collectionCreate(sakhadb* db, const char* name, size_t length, struct
             goto Lfail;
         }
         
-        sakhadb_btree_init_new_root(ctx, page);
         no = page->no;
+        if(flags & SAKHADB_COLLECTION_CREATE_LSM)
+        {
+            sakhadb_lsm_init_new_root(pager, page);
+            goto Lopen;
+        }
+        
+        int tree_flags = SAKHADB_COLLECTION_CLUSTERED ? SAKHADB_BTREE_INLINE :
+                         SAKHADB_COLLECTION_OID_NODES ? SAKHADB_BTREE_OIDKEYS : 0;
+        if(flags & SAKHADB_COLLECTION_CREATE_BUFFERED)
+        {
+            tree_flags |= SAKHADB_BTREE_BUFFERED;
+        }
+        if((flags & SAKHADB_COLLECTION_CREATE_HASH) && !SAKHADB_COLLECTION_CLUSTERED)
+        {
+            // Catalog refers to the hash, the hash to the tree
+            sakhadb_page_t tree;
+            rc = sakhadb_pager_request_free_page(pager, &tree);
+            if(rc)
+            {
+                goto Lfail;
+            }
+            
+            sakhadb_hash_init_new_root(pager, page, tree->no);
+            page = tree;
+        }
+        sakhadb_btree_init_new_root(ctx, page, tree_flags);
+        
+        if(SAKHADB_COLLECTION_BLOOM_BITS)
+        {
+            rc = collectionBloomCreate(db, meta, name, length);
+            if(rc)
+            {
+                goto Lfail;
+            }
+        }
     }
     else
     {
         no = sakhadb_btree_cursor_pgno(cursor);
     }
     
-    rc = sakhadb_btree_create(ctx, no, &coll->tree);
+Lopen:
+    coll->tree = 0;
+    coll->lsm = 0;
+    coll->hash = 0;
+    coll->bloom = 0;
+    memset(&coll->stats, 0, sizeof(coll->stats));
+    coll->indexes = 0;
+    coll->builds = 0;
     coll->db = db;
+    coll->next = 0;
+    memcpy(coll->name, name, length);
+    coll->name[length] = 0;
+    
+    sakhadb_page_t root;
+    rc = sakhadb_pager_request_page(pager, no, &root);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    if(sakhadb_lsm_is_root(root))
+    {
+        rc = sakhadb_lsm_create(pager, ctx, db->dbdata, no, &coll->lsm);
+    }
+    else if(sakhadb_hash_is_root(root))
+    {
+        rc = sakhadb_hash_create(pager, no, &coll->hash);
+        if(rc == SAKHADB_OK)
+        {
+            rc = sakhadb_btree_create(ctx, sakhadb_hash_tree(coll->hash), &coll->tree);
+            if(rc)
+            {
+                sakhadb_hash_destroy(coll->hash);
+            }
+        }
+    }
+    else
+    {
+        rc = sakhadb_btree_create(ctx, no, &coll->tree);
+    }
+    
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    rc = collectionLoadIndexes(coll, cursor, length);
+    if(rc)
+    {
+        collectionDestroy(coll);
+        goto Lexit;
+    }
     
+    coll->next = db->collections;
+    db->collections = coll;
     *ppColl = coll;
     
     goto Lexit;
@@ -118,12 +532,6 @@ Lexit:
     return rc;
 }
 
-static inline void collectionDestroy(sakhadb_collection* coll)
-{
-    sakhadb_btree_destroy(coll->tree);
-    cpl_allocator_free(cpl_allocator_get_default(), coll);
-}
-
 
 /******************* Public API routines  ********************/
 
@@ -185,6 +593,11 @@ file_open_failed:
     return rc;
 }
 
+sakhadb_dbdata_t sakhadb_dbdata_of(sakhadb* db)
+{
+    return db->dbdata;
+}
+
 int sakhadb_close(sakhadb* db)
 {
     SLOG_INFO("sakhadb_close: closing database");
@@ -208,10 +621,43 @@ int sakhadb_close(sakhadb* db)
     return rc;
 }
 
+int sakhadb_commit(sakhadb* db)
+{
+    SLOG_INFO("sakhadb_commit: commit changes");
+    
+    for(sakhadb_collection* coll = db->collections; coll; coll = coll->next)
+    {
+        int rc = coll->bloom ? collectionBloomRebuild(coll) : SAKHADB_OK;
+        if(rc)
+        {
+            SLOG_ERROR("sakhadb_commit: failed to rebuild filter of _id's [%d][%s]", rc, coll->name);
+            return rc;
+        }
+    }
+    return sakhadb_btree_ctx_commit(db->ctx);
+}
+
+int sakhadb_rollback(sakhadb* db)
+{
+    SLOG_INFO("sakhadb_rollback: rollback changes");
+    
+    // Slotted page of new records may be gone with the changes
+    sakhadb_dbdata_rollback(db->dbdata);
+    return sakhadb_btree_ctx_rollback(db->ctx);
+}
+
 int sakhadb_collection_load(sakhadb *db, const char *name, sakhadb_collection **ppColl)
+{
+    int flags = (SAKHADB_COLLECTION_LSM ? SAKHADB_COLLECTION_CREATE_LSM : 0) |
+                (SAKHADB_COLLECTION_HASH ? SAKHADB_COLLECTION_CREATE_HASH : 0) |
+                (SAKHADB_COLLECTION_BUFFERED ? SAKHADB_COLLECTION_CREATE_BUFFERED : 0);
+    return sakhadb_collection_load_ex(db, name, flags, ppColl);
+}
+
+int sakhadb_collection_load_ex(sakhadb *db, const char *name, int flags, sakhadb_collection **ppColl)
 {
     size_t length = strlen(name);
-    return collectionCreate(db, name, length, ppColl);
+    return collectionCreate(db, name, length, flags, ppColl);
 }
 
 void sakhadb_collection_release(sakhadb_collection* coll)
@@ -219,83 +665,1266 @@ void sakhadb_collection_release(sakhadb_collection* coll)
     collectionDestroy(coll);
 }
 
-int sakhadb_collection_insert(sakhadb_collection* collection, bson_document_ref doc)
+void sakhadb_collection_stats(sakhadb_collection* coll, struct sakhadb_collection_stats* stats)
 {
-    int rc = SAKHADB_OK;
-    bson_element_ref el = bson_document_get_first(doc);
-    if(strcmp(bson_element_fieldname(el), "_id") != 0)
+    *stats = coll->stats;
+}
+
+/**
+ * Opens merged cursor of LSM collection over the range, see
+ * sakhadb_collection_find_range().
+ */
+static int collectionLsmFind(sakhadb_collection* collection,
+                             bson_oid_ref lower, bson_oid_ref upper, int flags,
+                             sakhadb_lsm_cursor_t* pCursor)
+{
+    sakhadb_lsm_cursor_t cursor;
+    int rc = sakhadb_lsm_cursor_create(collection->lsm, &cursor);
+    if(rc)
     {
-        rc = SAKHADB_INVALID_ARG;
         goto Lexit;
     }
     
-    const void* key = bson_element_value(el);
-    size_t nkey = bson_element_value_size(el);
+    if(lower)
+    {
+        sakhadb_lsm_cursor_set_lower(cursor, lower->data, sizeof(lower->data),
+                                     flags & SAKHADB_RANGE_LOWER_EXCLUSIVE);
+    }
     
-    Pgno no;
-    rc = sakhadb_dbdata_write(collection->db->dbdata, doc->data, bson_document_size(doc), &no);
+    if(upper)
+    {
+        sakhadb_lsm_cursor_set_upper(cursor, upper->data, sizeof(upper->data),
+                                     flags & SAKHADB_RANGE_UPPER_EXCLUSIVE);
+    }
+    
+    rc = (flags & SAKHADB_RANGE_REVERSE) ? sakhadb_lsm_cursor_last(cursor)
+                                         : sakhadb_lsm_cursor_first(cursor);
     if(rc)
     {
+        sakhadb_lsm_cursor_destroy(cursor);
         goto Lexit;
     }
     
-    rc = sakhadb_btree_insert(collection->tree, key, nkey, no);
+    *pCursor = cursor;
     
 Lexit:
     return rc;
 }
 
-int sakhadb_collection_find(sakhadb_collection* collection, bson_oid_ref oid,
-                            sakhadb_cursor **pCur)
+/**
+ * Checks if there is a document with the _id.
+ */
+static int collectionContains(sakhadb_collection* collection, const void* key, size_t nkey)
 {
-    int rc = SAKHADB_OK;
-
-    sakhadb_btree_cursor_t cursor;
-    rc = sakhadb_btree_cursor_create(collection->tree, &cursor);
-    if(rc)
+    if(collection->lsm)
     {
-        goto Lexit;
+        struct bson_oid oid;
+        sakhadb_lsm_cursor_t lsm;
+        memcpy(oid.data, key, sizeof(oid.data));
+        if(collectionLsmFind(collection, &oid, 0, 0, &lsm))
+        {
+            return 0;
+        }
+        
+        int found = memcmp(sakhadb_lsm_cursor_key(lsm), oid.data, sizeof(oid.data)) == 0;
+        sakhadb_lsm_cursor_destroy(lsm);
+        return found;
     }
     
-    if(oid)
+    Pgno no;
+    if(!collectionBloomMayContain(collection, key))
     {
-        rc = sakhadb_btree_cursor_find(cursor, oid->data, sizeof(oid->data));
+        return 0;
     }
-    else
+    
+    if(collection->hash)
     {
-        rc = sakhadb_btree_cursor_first(cursor);
+        return sakhadb_hash_lookup(collection->hash, key, &no) == SAKHADB_OK;
+    }
+    return sakhadb_btree_lookup(collection->tree, key, nkey, &no) == SAKHADB_OK;
+}
+
+/**
+ * Catalog entry of index: "<collection>\0<path>\0<included path>\0...<flags>".
+ * Returns its size, 0 if it does not fit in a key.
+ */
+static size_t collectionIndexEntry(sakhadb_collection* collection, const char* path, const char* include,
+                                   int flags, char name[SAKHADB_BTREE_MAX_KEY_SIZE])
+{
+    size_t length = strlen(collection->name);
+    size_t npath = strlen(path);
+    size_t ninclude = 0;
+    while(include && include[ninclude])
+    {
+        ninclude += strlen(include + ninclude) + 1;
     }
     
-    if(rc)
+    size_t nname = length + 1 + npath + 1 + ninclude + 1;
+    if(nname > SAKHADB_BTREE_MAX_KEY_SIZE)
     {
-        goto Lfail;
+        return 0;
     }
     
-    sakhadb_cursor* pCursor = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(sakhadb_cursor));
-    if(!pCursor)
+    memcpy(name, collection->name, length + 1);
+    memcpy(name + length + 1, path, npath + 1);
+    if(ninclude)
     {
-        goto Lfail;
+        memcpy(name + length + 1 + npath + 1, include, ninclude);
+    }
+    name[nname - 1] = (char)flags;
+    return nname;
+}
+
+/**
+ * Rewrites catalog entry of the index after its flags changed from 'flags'.
+ */
+static int collectionIndexUpdate(sakhadb_collection* collection, sakhadb_index_t index, int flags)
+{
+    char name[SAKHADB_BTREE_MAX_KEY_SIZE];
+    sakhadb_btree_t meta;
+    int rc = sakhadb_btree_create(collection->db->ctx, 1, &meta);
+    if(rc)
+    {
+        goto Lexit;
     }
     
-    pCursor->cur = cursor;
-    pCursor->reg = 0;
+    Pgno no;
+    size_t nname = collectionIndexEntry(collection, index->path, index->include, flags, name);
+    rc = sakhadb_btree_delete(meta, name, nname, &no);
+    if(rc == SAKHADB_OK)
+    {
+        nname = collectionIndexEntry(collection, index->path, index->include, index->flags, name);
+        rc = sakhadb_btree_insert(meta, name, nname, no);
+    }
     
-    *pCur = pCursor;
+    sakhadb_btree_destroy(meta);
     
 Lexit:
     return rc;
-    
-Lfail:
-    sakhadb_btree_cursor_destroy(cursor);
-    goto Lexit;
+}
+
+/**
+ * Removes the document from all indexes of the collection, including ones
+ * being built.
+ */
+static int collectionIndexDelete(sakhadb_collection* collection, bson_oid_ref oid)
+{
+    sakhadb_cursor* cur;
+    int rc = sakhadb_collection_find(collection, oid, &cur);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    bson_document_ref doc;
+    rc = sakhadb_cursor_data(collection->db, cur, &doc);
+    for(sakhadb_index_t index = collection->indexes; index && rc == SAKHADB_OK; index = index->next)
+    {
+        rc = sakhadb_index_delete(index, doc->data);
+    }
+    
+    for(struct CollectionBuild* b = collection->builds; b && rc == SAKHADB_OK; b = b->next)
+    {
+        if(b->scanned && memcmp(oid->data, b->id, sizeof(b->id)) <= 0)
+        {
+            rc = sakhadb_index_build_log(b->build, doc->data, 0, 1);
+        }
+    }
+    
+    sakhadb_cursor_destroy(cur);
+    
+Lexit:
+    return rc;
+}
+
+int sakhadb_collection_insert(sakhadb_collection* collection, bson_document_ref doc)
+{
+    int rc = SAKHADB_OK;
+    bson_element_ref el = bson_document_get_first(doc);
+    if(strcmp(bson_element_fieldname(el), "_id") != 0)
+    {
+        rc = SAKHADB_INVALID_ARG;
+        goto Lexit;
+    }
+    
+    const void* key = bson_element_value(el);
+    size_t nkey = bson_element_value_size(el);
+    size_t sz = bson_document_size(doc);
+    
+    if(collection->indexes || collection->builds || collection->hash)
+    {
+        // Document must get into every index, or not be inserted at all
+        if(collectionContains(collection, key, nkey))
+        {
+            SLOG_WARN("sakhadb_collection_insert: keys duplicated");
+            goto Lexit;
+        }
+        
+        for(sakhadb_index_t index = collection->indexes; index && rc == SAKHADB_OK; index = index->next)
+        {
+            rc = sakhadb_index_check(index, doc->data);
+        }
+        
+        for(struct CollectionBuild* b = collection->builds; b && rc == SAKHADB_OK; b = b->next)
+        {
+            rc = sakhadb_index_check(sakhadb_index_build_index(b->build), doc->data);
+        }
+        
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    Pgno no = SAKHADB_INDEX_BY_ID;
+    if(collection->lsm)
+    {
+        rc = sakhadb_lsm_insert(collection->lsm, key, nkey, doc->data, sz);
+    }
+    else if(sz <= sakhadb_btree_max_payload(collection->tree))
+    {
+        rc = sakhadb_btree_insert_payload(collection->tree, key, nkey, doc->data, sz);
+        rc = rc ? rc : collectionBloomAdd(collection, key);
+    }
+    else
+    {
+        rc = sakhadb_dbdata_write(collection->db->dbdata, doc->data, sz, &no);
+        if(rc)
+        {
+            goto Lexit;
+        }
+        
+        rc = sakhadb_btree_insert(collection->tree, key, nkey, no);
+        if(rc == SAKHADB_OK && collection->hash)
+        {
+            rc = sakhadb_hash_insert(collection->hash, key, no);
+        }
+        rc = rc ? rc : collectionBloomAdd(collection, key);
+    }
+    
+    for(sakhadb_index_t index = collection->indexes; index && rc == SAKHADB_OK; index = index->next)
+    {
+        int flags = index->flags;
+        rc = sakhadb_index_insert(index, doc->data, no);
+        if(rc == SAKHADB_OK && flags != index->flags)
+        {
+            rc = collectionIndexUpdate(collection, index, flags);
+        }
+    }
+    
+    for(struct CollectionBuild* b = collection->builds; b && rc == SAKHADB_OK; b = b->next)
+    {
+        if(b->scanned && memcmp(key, b->id, sizeof(b->id)) <= 0)
+        {
+            rc = sakhadb_index_build_log(b->build, doc->data, no, 0);
+        }
+    }
+    
+Lexit:
+    return rc;
+}
+
+static int cursorCreate(sakhadb_btree_cursor_t cursor, sakhadb_lsm_cursor_t lsm, int reverse,
+                        sakhadb_cursor **pCur)
+{
+    sakhadb_cursor* pCursor = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(sakhadb_cursor));
+    if(!pCursor)
+    {
+        return SAKHADB_NOMEM;
+    }
+    
+    pCursor->cur = cursor;
+    pCursor->lsm = lsm;
+    pCursor->nbuffer = 0;
+    memset(&pCursor->stats, 0, sizeof(pCursor->stats));
+    pCursor->reverse = reverse;
+    pCursor->tree = 0;
+    pCursor->no = 0;
+    pCursor->coll = 0;
+    pCursor->index = 0;
+    pCursor->doc = 0;
+    pCursor->seen = 0;
+    
+    *pCur = pCursor;
+    return SAKHADB_OK;
+}
+
+struct BatchEntry
+{
+    const void*         key;        /* _id value */
+    size_t              nkey;       /* size of _id value */
+    bson_document_ref   doc;        /* document to insert */
+};
+
+static int batchEntryCompare(const void* a, const void* b)
+{
+    const struct BatchEntry* x = a;
+    const struct BatchEntry* y = b;
+    int cmp = memcmp(x->key, y->key, (x->nkey < y->nkey) ? x->nkey : y->nkey);
+    return cmp ? cmp : (int)x->nkey - (int)y->nkey;
+}
+
+int sakhadb_collection_insert_batch(sakhadb_collection* collection, bson_document_ref* docs, size_t count)
+{
+    int rc = SAKHADB_OK;
+    cpl_allocator_ref allocator = cpl_allocator_get_default();
+    size_t entry_sz = sizeof(struct BatchEntry) + sizeof(const void*) + sizeof(size_t) + sizeof(Pgno);
+    if(count == 0)
+    {
+        goto Lexit;
+    }
+    
+    struct BatchEntry* entries = cpl_allocator_allocate(allocator, count * entry_sz);
+    if(!entries)
+    {
+        rc = SAKHADB_NOMEM;
+        goto Lexit;
+    }
+    
+    const void** keys = (const void**)(entries + count);
+    size_t* nkeys = (size_t*)(keys + count);
+    Pgno* nos = (Pgno*)(nkeys + count);
+    
+    for(size_t i = 0; i < count; ++i)
+    {
+        bson_element_ref el = bson_document_get_first(docs[i]);
+        if(strcmp(bson_element_fieldname(el), "_id") != 0)
+        {
+            rc = SAKHADB_INVALID_ARG;
+            goto Lfree;
+        }
+        
+        entries[i].key = bson_element_value(el);
+        entries[i].nkey = bson_element_value_size(el);
+        entries[i].doc = docs[i];
+    }
+    
+    qsort(entries, count, sizeof(struct BatchEntry), batchEntryCompare);
+    
+    if(collection->lsm || collection->indexes || collection->builds ||
+       sakhadb_btree_max_payload(collection->tree))
+    {
+        // Clustered, LSM or indexed collection: documents go one by one, still in key order
+        for(size_t i = 0; i < count && rc == SAKHADB_OK; ++i)
+        {
+            rc = sakhadb_collection_insert(collection, entries[i].doc);
+        }
+        goto Lfree;
+    }
+    
+    size_t n = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(collection->hash)
+        {
+            // Hash keeps the first document of a key, as the tree does
+            Pgno no;
+            if(sakhadb_hash_lookup(collection->hash, entries[i].key, &no) == SAKHADB_OK)
+            {
+                continue;
+            }
+        }
+        
+        bson_document_ref doc = entries[i].doc;
+        rc = sakhadb_dbdata_write(collection->db->dbdata, doc->data, bson_document_size(doc), &nos[n]);
+        if(rc == SAKHADB_OK && collection->hash)
+        {
+            rc = sakhadb_hash_insert(collection->hash, entries[i].key, nos[n]);
+        }
+        
+        if(rc)
+        {
+            goto Lfree;
+        }
+        
+        keys[n] = entries[i].key;
+        nkeys[n] = entries[i].nkey;
+        n += 1;
+    }
+    
+    rc = sakhadb_btree_insert_sorted(collection->tree, n, keys, nkeys, nos);
+    for(size_t i = 0; i < n && rc == SAKHADB_OK; ++i)
+    {
+        rc = collectionBloomAdd(collection, keys[i]);
+    }
+    
+Lfree:
+    cpl_allocator_free(allocator, entries);
+    
+Lexit:
+    return rc;
+}
+
+int sakhadb_collection_delete(sakhadb_collection* collection, bson_oid_ref oid)
+{
+    int rc = SAKHADB_OK;
+    if(!collectionBloomMayContain(collection, oid->data))
+    {
+        rc = SAKHADB_NOTFOUND;
+        goto Lexit;
+    }
+    
+    if(collection->indexes || collection->builds)
+    {
+        rc = collectionIndexDelete(collection, oid);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    if(collection->lsm)
+    {
+        rc = sakhadb_lsm_delete(collection->lsm, oid->data, sizeof(oid->data));
+        goto Lexit;
+    }
+    
+    Pgno no;
+    if(collection->hash)
+    {
+        rc = sakhadb_hash_delete(collection->hash, oid->data, 0);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    rc = sakhadb_btree_delete(collection->tree, oid->data, sizeof(oid->data), &no);
+    if(rc || no == 0)
+    {
+        // Inline document went away with its entry
+        goto Lexit;
+    }
+    
+    rc = sakhadb_dbdata_free(collection->db->dbdata, no);
+    
+Lexit:
+    return rc;
+}
+
+int sakhadb_collection_find(sakhadb_collection* collection, bson_oid_ref oid,
+                            sakhadb_cursor **pCur)
+{
+    int rc = SAKHADB_OK;
+    
+    if(collection->lsm)
+    {
+        sakhadb_lsm_cursor_t lsm;
+        rc = collectionLsmFind(collection, oid, 0, 0, &lsm);
+        if(rc == SAKHADB_OK && oid && memcmp(sakhadb_lsm_cursor_key(lsm), oid->data, sizeof(oid->data)) != 0)
+        {
+            sakhadb_lsm_cursor_destroy(lsm);
+            rc = SAKHADB_NOTFOUND;
+        }
+        
+        if(rc == SAKHADB_OK)
+        {
+            rc = cursorCreate(0, lsm, 0, pCur);
+            if(rc)
+            {
+                sakhadb_lsm_cursor_destroy(lsm);
+            }
+        }
+        return rc;
+    }
+    
+    if(oid && !collectionBloomMayContain(collection, oid->data))
+    {
+        return SAKHADB_NOTFOUND;
+    }
+    
+    if(collection->hash && oid)
+    {
+        // Tree cursor is positioned only if the cursor moves
+        Pgno no;
+        rc = sakhadb_hash_lookup(collection->hash, oid->data, &no);
+        rc = rc ? rc : cursorCreate(0, 0, 0, pCur);
+        if(rc == SAKHADB_OK)
+        {
+            (*pCur)->tree = collection->tree;
+            (*pCur)->no = no;
+            memcpy((*pCur)->id, oid->data, sizeof(oid->data));
+        }
+        return rc;
+    }
+
+    sakhadb_btree_cursor_t cursor;
+    rc = sakhadb_btree_cursor_create(collection->tree, &cursor);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    if(oid)
+    {
+        rc = sakhadb_btree_cursor_find(cursor, oid->data, sizeof(oid->data));
+        if(rc)
+        {
+            rc = SAKHADB_NOTFOUND;
+        }
+    }
+    else
+    {
+        rc = sakhadb_btree_cursor_first(cursor);
+    }
+    
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    rc = cursorCreate(cursor, 0, 0, pCur);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+Lexit:
+    return rc;
+    
+Lfail:
+    sakhadb_btree_cursor_destroy(cursor);
+    goto Lexit;
+}
+
+int sakhadb_collection_find_range(sakhadb_collection* collection,
+                                  bson_oid_ref lower, bson_oid_ref upper, int flags,
+                                  sakhadb_cursor **pCur)
+{
+    int rc = SAKHADB_OK;
+    int reverse = (flags & SAKHADB_RANGE_REVERSE) != 0;
+    
+    if(collection->lsm)
+    {
+        sakhadb_lsm_cursor_t lsm;
+        rc = collectionLsmFind(collection, lower, upper, flags, &lsm);
+        if(rc == SAKHADB_OK)
+        {
+            rc = cursorCreate(0, lsm, reverse, pCur);
+            if(rc)
+            {
+                sakhadb_lsm_cursor_destroy(lsm);
+            }
+        }
+        return rc;
+    }
+    
+    sakhadb_btree_cursor_t cursor;
+    rc = sakhadb_btree_cursor_create(collection->tree, &cursor);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    if(lower)
+    {
+        sakhadb_btree_cursor_set_lower(cursor, lower->data, sizeof(lower->data),
+                                       flags & SAKHADB_RANGE_LOWER_EXCLUSIVE);
+    }
+    
+    if(upper)
+    {
+        sakhadb_btree_cursor_set_upper(cursor, upper->data, sizeof(upper->data),
+                                       flags & SAKHADB_RANGE_UPPER_EXCLUSIVE);
+    }
+    
+    if(reverse)
+    {
+        rc = upper ? sakhadb_btree_cursor_seek_last(cursor, upper->data, sizeof(upper->data),
+                                                    flags & SAKHADB_RANGE_UPPER_EXCLUSIVE)
+                   : sakhadb_btree_cursor_last(cursor);
+    }
+    else
+    {
+        rc = lower ? sakhadb_btree_cursor_seek(cursor, lower->data, sizeof(lower->data),
+                                               flags & SAKHADB_RANGE_LOWER_EXCLUSIVE)
+                   : sakhadb_btree_cursor_first(cursor);
+    }
+    
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+    rc = cursorCreate(cursor, 0, reverse, pCur);
+    if(rc)
+    {
+        goto Lfail;
+    }
+    
+Lexit:
+    return rc;
+    
+Lfail:
+    sakhadb_btree_cursor_destroy(cursor);
+    goto Lexit;
+}
+
+int sakhadb_collection_count(sakhadb_collection* collection,
+                             bson_oid_ref lower, bson_oid_ref upper, int flags,
+                             uint64_t* pCount)
+{
+    int rc = SAKHADB_OK;
+    uint64_t from = 0;
+    uint64_t to = 0;
+    
+    if(collection->lsm)
+    {
+        // Runs may overlap, so the range is merged and counted
+        sakhadb_lsm_cursor_t lsm;
+        rc = collectionLsmFind(collection, lower, upper, flags & ~SAKHADB_RANGE_REVERSE, &lsm);
+        if(rc == SAKHADB_OK)
+        {
+            do
+            {
+                to += 1;
+            } while((rc = sakhadb_lsm_cursor_next(lsm)) == SAKHADB_OK);
+            sakhadb_lsm_cursor_destroy(lsm);
+        }
+        
+        if(rc == SAKHADB_NOTFOUND)
+        {
+            *pCount = to;
+            rc = SAKHADB_OK;
+        }
+        goto Lexit;
+    }
+    
+    to = sakhadb_btree_count(collection->tree);
+    
+    if(lower)
+    {
+        rc = sakhadb_btree_rank(collection->tree, lower->data, sizeof(lower->data),
+                                flags & SAKHADB_RANGE_LOWER_EXCLUSIVE, &from);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    if(upper)
+    {
+        rc = sakhadb_btree_rank(collection->tree, upper->data, sizeof(upper->data),
+                                !(flags & SAKHADB_RANGE_UPPER_EXCLUSIVE), &to);
+        if(rc)
+        {
+            goto Lexit;
+        }
+    }
+    
+    *pCount = (to > from) ? to - from : 0;
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Scans up to 'count' documents following the last scanned one into the
+ * build. 'pDone' is set when the scan reaches the end of collection.
+ */
+static int collectionBuildStep(sakhadb_collection* collection, struct CollectionBuild* build,
+                               size_t count, int* pDone)
+{
+    struct bson_oid lower;
+    memcpy(lower.data, build->id, sizeof(lower.data));
+    
+    *pDone = 0;
+    sakhadb_cursor* cur;
+    int rc = sakhadb_collection_find_range(collection, build->scanned ? &lower : 0, 0,
+                                           SAKHADB_RANGE_LOWER_EXCLUSIVE, &cur);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    for(; rc == SAKHADB_OK && count > 0; --count)
+    {
+        bson_document_ref doc;
+        rc = sakhadb_cursor_data(collection->db, cur, &doc);
+        if(rc)
+        {
+            break;
+        }
+        
+        // Only documents of _id tree read from data pages stay there
+        Pgno no = cur->cur ? sakhadb_btree_cursor_pgno(cur->cur) : 0;
+        no = no ? no : SAKHADB_INDEX_BY_ID;
+        rc = sakhadb_index_build_add(build->build, doc->data, no);
+        if(rc)
+        {
+            break;
+        }
+        
+        memcpy(build->id, bson_element_value(bson_document_get_first(doc)), sizeof(build->id));
+        build->scanned = 1;
+        
+        rc = sakhadb_cursor_next(cur);
+    }
+    
+    sakhadb_cursor_destroy(cur);
+    
+Lexit:
+    if(rc == SAKHADB_NOTFOUND)
+    {
+        *pDone = 1;
+        rc = SAKHADB_OK;
+    }
+    return rc;
+}
+
+/**
+ * Loads the index of the build and registers it in the catalog. Unlinks and
+ * destroys the build.
+ */
+static int collectionBuildFinish(sakhadb_collection* collection, struct CollectionBuild* build)
+{
+    struct CollectionBuild** link = &collection->builds;
+    while(*link != build)
+    {
+        link = &(*link)->next;
+    }
+    *link = build->next;
+    
+    Pgno no;
+    sakhadb_index_t index;
+    sakhadb_btree_t meta = 0;
+    int rc = sakhadb_index_build_finish(build->build, &no, &index);
+    cpl_allocator_free(cpl_allocator_get_default(), build);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    char name[SAKHADB_BTREE_MAX_KEY_SIZE];
+    size_t nname = collectionIndexEntry(collection, index->path, index->include, index->flags, name);
+    rc = sakhadb_btree_create(collection->db->ctx, 1, &meta);
+    rc = rc ? rc : sakhadb_btree_insert(meta, name, nname, no);
+    if(rc)
+    {
+        sakhadb_index_drop(index);
+        goto Lexit;
+    }
+    
+    index->next = collection->indexes;
+    collection->indexes = index;
+    
+Lexit:
+    if(meta)
+    {
+        sakhadb_btree_destroy(meta);
+    }
+    return rc;
+}
+
+int sakhadb_collection_create_index(sakhadb_collection* collection, const char* path, int flags)
+{
+    return sakhadb_collection_create_covering_index(collection, path, 0, 0, flags);
+}
+
+int sakhadb_collection_create_covering_index(sakhadb_collection* collection, const char* path,
+                                             const char* const* include, size_t count, int flags)
+{
+    int rc = SAKHADB_OK;
+    for(sakhadb_index_t i = collection->indexes; i; i = i->next)
+    {
+        if(strcmp(i->path, path) == 0)
+        {
+            goto Lexit;
+        }
+    }
+    
+    for(struct CollectionBuild* b = collection->builds; b; b = b->next)
+    {
+        if(strcmp(sakhadb_index_build_index(b->build)->path, path) == 0)
+        {
+            goto Lexit;
+        }
+    }
+    
+    char name[SAKHADB_BTREE_MAX_KEY_SIZE];
+    if(*path == 0 || (flags & SAKHADB_INDEX_MULTIKEY))
+    {
+        rc = SAKHADB_INVALID_ARG;
+        goto Lexit;
+    }
+    
+    // Included paths as the list of struct Index
+    char list[SAKHADB_BTREE_MAX_KEY_SIZE + 1];
+    size_t nlist = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        size_t n = strlen(include[i]) + 1;
+        if(n == 1)
+        {
+            rc = SAKHADB_INVALID_ARG;
+            goto Lexit;
+        }
+        
+        if(nlist + n > SAKHADB_BTREE_MAX_KEY_SIZE)
+        {
+            rc = SAKHADB_TOOBIG;
+            goto Lexit;
+        }
+        
+        memcpy(list + nlist, include[i], n);
+        nlist += n;
+    }
+    list[nlist] = 0;
+    
+    if(!collectionIndexEntry(collection, path, list, flags, name))
+    {
+        rc = SAKHADB_TOOBIG;
+        goto Lexit;
+    }
+    
+    struct CollectionBuild* build = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct CollectionBuild));
+    if(!build)
+    {
+        rc = SAKHADB_NOMEM;
+        goto Lexit;
+    }
+    
+    rc = sakhadb_index_build_create(collection->db->ctx, path, count ? list : 0,
+                                    flags & ~SAKHADB_INDEX_BACKGROUND, &build->build);
+    if(rc)
+    {
+        cpl_allocator_free(cpl_allocator_get_default(), build);
+        goto Lexit;
+    }
+    
+    build->scanned = 0;
+    build->next = collection->builds;
+    collection->builds = build;
+    
+    if(flags & SAKHADB_INDEX_BACKGROUND)
+    {
+        goto Lexit;
+    }
+    
+    int done;
+    rc = collectionBuildStep(collection, build, SIZE_MAX, &done);
+    if(rc)
+    {
+        collectionBuildDestroy(collection, build);
+        goto Lexit;
+    }
+    
+    rc = collectionBuildFinish(collection, build);
+    
+Lexit:
+    return rc;
+}
+
+int sakhadb_collection_build_index(sakhadb_collection* collection, size_t count, size_t* pPending)
+{
+    int rc = SAKHADB_OK;
+    struct CollectionBuild* build = collection->builds;
+    while(build && rc == SAKHADB_OK)
+    {
+        struct CollectionBuild* next = build->next;
+        
+        int done;
+        rc = collectionBuildStep(collection, build, count, &done);
+        if(rc)
+        {
+            collectionBuildDestroy(collection, build);
+        }
+        else if(done)
+        {
+            rc = collectionBuildFinish(collection, build);
+        }
+        
+        build = next;
+    }
+    
+    *pPending = 0;
+    for(build = collection->builds; build; build = build->next)
+    {
+        *pPending += 1;
+    }
+    
+    return rc;
+}
+
+int sakhadb_collection_find_index(sakhadb_collection* collection, const char* path,
+                                  bson_document_ref lower, bson_document_ref upper, int flags,
+                                  sakhadb_cursor **pCur)
+{
+    int rc = SAKHADB_OK;
+    sakhadb_index_t index = collection->indexes;
+    while(index && strcmp(index->path, path) != 0)
+    {
+        index = index->next;
+    }
+    
+    if(!index)
+    {
+        rc = SAKHADB_INVALID_ARG;
+        goto Lexit;
+    }
+    
+    sakhadb_btree_cursor_t cursor;
+    rc = sakhadb_index_find(index, lower ? lower->data : 0, upper ? upper->data : 0, flags, &cursor);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    rc = cursorCreate(cursor, 0, (flags & SAKHADB_RANGE_REVERSE) != 0, pCur);
+    if(rc)
+    {
+        sakhadb_btree_cursor_destroy(cursor);
+        goto Lexit;
+    }
+    
+    (*pCur)->coll = collection;
+    (*pCur)->index = index;
+    
+    if(index->flags & SAKHADB_INDEX_MULTIKEY)
+    {
+        size_t nkey;
+        int seen;
+        const void* key = sakhadb_btree_cursor_key(cursor, &nkey);
+        rc = sakhadb_index_seen_create(&(*pCur)->seen);
+        rc = rc ? rc : sakhadb_index_seen_add((*pCur)->seen, sakhadb_index_entry_id(index, key, nkey), &seen);
+        if(rc)
+        {
+            sakhadb_cursor_destroy(*pCur);
+        }
+    }
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Ranges per thread a parallel scan splits the collection into, and the least
+ * number of documents in a range.
+ */
+#ifndef SAKHADB_SCAN_RANGES
+#   define SAKHADB_SCAN_RANGES      16
+#endif
+
+#ifndef SAKHADB_SCAN_MIN_RANGE
+#   define SAKHADB_SCAN_MIN_RANGE   256
+#endif
+
+#define SAKHADB_SCAN_MAX_THREADS    64
+
+/**
+ * Worker of a parallel scan. Ranges are numbered in _id order; a worker
+ * takes its ranges from the head, idle workers steal from the tail.
+ */
+struct ScanWorker
+{
+    struct Scan*        scan;
+    size_t              head;       /* Next range of the worker */
+    size_t              tail;       /* End of ranges of the worker */
+#if SAKHADB_THREADSAFE
+    sakhadb_mutex_t     mutex;      /* Guards 'head' and 'tail' */
+    sakhadb_thread_t    thread;     /* Thread of the worker, 0 for the caller's */
+#endif
+};
+
+struct Scan
+{
+    sakhadb_collection* coll;
+    sakhadb_scan_fn     fn;
+    void*               arg;
+    uint64_t            count;      /* Number of documents */
+    size_t              nranges;    /* Number of ranges, equal by number of documents */
+    int                 nworkers;   /* Number of workers */
+    int                 rc;         /* First failure, stops the scan */
+    struct ScanWorker   workers[SAKHADB_SCAN_MAX_THREADS];
+};
+
+#if SAKHADB_THREADSAFE
+#   define scanEnter(w)     sakhadb_mutex_enter((w)->mutex)
+#   define scanLeave(w)     sakhadb_mutex_leave((w)->mutex)
+#   define scanFailed(s)    __atomic_load_n(&(s)->rc, __ATOMIC_RELAXED)
+#else // SAKHADB_THREADSAFE
+#   define scanEnter(w)
+#   define scanLeave(w)
+#   define scanFailed(s)    ((s)->rc)
+#endif // SAKHADB_THREADSAFE
+
+static inline void scanFail(struct Scan* scan, int rc)
+{
+#if SAKHADB_THREADSAFE
+    int ok = SAKHADB_OK;
+    __atomic_compare_exchange_n(&scan->rc, &ok, rc, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#else
+    scan->rc = scan->rc ? scan->rc : rc;
+#endif
+}
+
+/**
+ * Passes documents of the range to the callback.
+ */
+static int scanRange(struct Scan* scan, size_t i)
+{
+    uint64_t first = scan->count * i / scan->nranges;
+    uint64_t last = scan->count * (i + 1) / scan->nranges;
+    
+    sakhadb_btree_cursor_t cursor;
+    sakhadb_cursor* cur;
+    int rc = sakhadb_btree_cursor_create(scan->coll->tree, &cursor);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    rc = cursorCreate(cursor, 0, 0, &cur);
+    if(rc)
+    {
+        sakhadb_btree_cursor_destroy(cursor);
+        return rc;
+    }
+    
+    rc = sakhadb_btree_cursor_nth(cursor, first);
+    for(uint64_t n = first; n < last && rc == SAKHADB_OK && !scanFailed(scan); ++n)
+    {
+        bson_document_ref doc;
+        rc = sakhadb_cursor_data(scan->coll->db, cur, &doc);
+        rc = rc ? rc : scan->fn(scan->arg, doc);
+        if(rc == SAKHADB_OK && n + 1 < last)
+        {
+            rc = sakhadb_cursor_next(cur);
+        }
+    }
+    
+    sakhadb_cursor_destroy(cur);
+    return rc;
+}
+
+static int scanTake(struct ScanWorker* w, size_t* pRange)
+{
+    scanEnter(w);
+    int taken = w->head < w->tail;
+    if(taken)
+    {
+        *pRange = w->head++;
+    }
+    scanLeave(w);
+    return taken;
+}
+
+/**
+ * Moves the later half of ranges of some other worker to 'w'.
+ */
+static int scanSteal(struct ScanWorker* w)
+{
+    struct Scan* scan = w->scan;
+    int self = (int)(w - scan->workers);
+    for(int k = 1; k < scan->nworkers; ++k)
+    {
+        struct ScanWorker* victim = scan->workers + (self + k) % scan->nworkers;
+        scanEnter(victim);
+        size_t head = victim->tail - (victim->tail - victim->head + 1) / 2;
+        size_t tail = victim->tail;
+        victim->tail = head;
+        scanLeave(victim);
+        
+        if(head < tail)
+        {
+            scanEnter(w);
+            w->head = head;
+            w->tail = tail;
+            scanLeave(w);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void* scanWorker(void* p)
+{
+    struct ScanWorker* w = p;
+    struct Scan* scan = w->scan;
+    size_t i;
+    while(!scanFailed(scan) && (scanTake(w, &i) || (scanSteal(w) && scanTake(w, &i))))
+    {
+        int rc = scanRange(scan, i);
+        if(rc)
+        {
+            scanFail(scan, rc);
+        }
+    }
+    return 0;
+}
+
+int sakhadb_collection_scan(sakhadb_collection* collection, int nthreads, sakhadb_scan_fn fn, void* arg)
+{
+    int rc = SAKHADB_OK;
+    sakhadb_cursor* cur = 0;
+    if(collection->lsm)
+    {
+        // No ranks to split LSM storage by, documents go in one pass
+        rc = sakhadb_collection_find(collection, 0, &cur);
+        while(rc == SAKHADB_OK)
+        {
+            bson_document_ref doc;
+            rc = sakhadb_cursor_data(collection->db, cur, &doc);
+            rc = rc ? rc : fn(arg, doc);
+            rc = rc ? rc : sakhadb_cursor_next(cur);
+        }
+        
+        if(cur)
+        {
+            sakhadb_cursor_destroy(cur);
+        }
+        goto Ldone;
+    }
+    
+    // Buffered keys are applied before the tree is counted
+    rc = sakhadb_collection_find(collection, 0, &cur);
+    if(rc)
+    {
+        goto Ldone;
+    }
+    sakhadb_cursor_destroy(cur);
+    
+    struct Scan* scan = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(struct Scan));
+    if(!scan)
+    {
+        rc = SAKHADB_NOMEM;
+        goto Lexit;
+    }
+    
+    scan->coll = collection;
+    scan->fn = fn;
+    scan->arg = arg;
+    scan->rc = SAKHADB_OK;
+    scan->count = sakhadb_btree_count(collection->tree);
+    scan->nworkers = SAKHADB_THREADSAFE ? nthreads : 1;
+    scan->nworkers = (scan->nworkers < 1) ? 1 :
+                     (scan->nworkers > SAKHADB_SCAN_MAX_THREADS) ? SAKHADB_SCAN_MAX_THREADS : scan->nworkers;
+    
+    uint64_t nranges = scan->count / SAKHADB_SCAN_MIN_RANGE;
+    nranges = (nranges > (uint64_t)scan->nworkers * SAKHADB_SCAN_RANGES) ? (uint64_t)scan->nworkers * SAKHADB_SCAN_RANGES : nranges;
+    scan->nranges = nranges ? (size_t)nranges : 1;
+    
+    int nready = 0;
+    for(; nready < scan->nworkers; ++nready)
+    {
+        struct ScanWorker* w = scan->workers + nready;
+        w->scan = scan;
+        w->head = scan->nranges * nready / scan->nworkers;
+        w->tail = scan->nranges * (nready + 1) / scan->nworkers;
+#if SAKHADB_THREADSAFE
+        w->thread = 0;
+        rc = sakhadb_mutex_create(&w->mutex);
+        if(rc)
+        {
+            goto Lfree;
+        }
+#endif
+    }
+    
+#if SAKHADB_THREADSAFE
+    // Ranges of workers that fail to start are stolen by the rest
+    for(int i = 1; i < scan->nworkers; ++i)
+    {
+        if(sakhadb_thread_create(scanWorker, scan->workers + i, &scan->workers[i].thread))
+        {
+            SLOG_WARN("sakhadb_collection_scan: failed to start worker [%d]", i);
+        }
+    }
+#endif
+    
+    scanWorker(scan->workers);
+    
+#if SAKHADB_THREADSAFE
+    for(int i = 1; i < scan->nworkers; ++i)
+    {
+        if(scan->workers[i].thread)
+        {
+            sakhadb_thread_join(scan->workers[i].thread);
+        }
+    }
+#endif
+    
+    rc = scan->rc;
+    
+#if SAKHADB_THREADSAFE
+Lfree:
+    while(nready-- > 0)
+    {
+        sakhadb_mutex_destroy(scan->workers[nready].mutex);
+    }
+#endif
+    cpl_allocator_free(cpl_allocator_get_default(), scan);
+    goto Lexit;
+    
+Ldone:
+    rc = (rc == SAKHADB_NOTFOUND) ? SAKHADB_OK : rc;
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Releases data of the current document.
+ */
+static void cursorRelease(sakhadb_cursor* cur)
+{
+    if(cur->nbuffer)
+    {
+        cur->buffer.offset = 0;
+    }
+    
+    if(cur->doc)
+    {
+        cur->stats.copies += cur->doc->stats.copies;
+        cur->stats.allocations += cur->doc->stats.allocations;
+        sakhadb_cursor_destroy(cur->doc);
+        cur->doc = 0;
+    }
+}
+
+/**
+ * Positions tree cursor of the document found through hash.
+ */
+static int cursorPosition(sakhadb_cursor* cur)
+{
+    if(cur->cur || cur->lsm)
+    {
+        return SAKHADB_OK;
+    }
+    
+    int rc = sakhadb_btree_cursor_create(cur->tree, &cur->cur);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    if(sakhadb_btree_cursor_find(cur->cur, cur->id, sizeof(cur->id)) != 0)
+    {
+        sakhadb_btree_cursor_destroy(cur->cur);
+        cur->cur = 0;
+        return SAKHADB_NOTFOUND;
+    }
+    return SAKHADB_OK;
 }
 
 void sakhadb_cursor_destroy(sakhadb_cursor* cur)
 {
-    sakhadb_btree_cursor_destroy(cur->cur);
-    if(cur->reg)
+    if(cur->lsm)
     {
-        cpl_allocator_destroy_dl(cur->reg->allocator);
+        sakhadb_lsm_cursor_destroy(cur->lsm);
+    }
+    else if(cur->cur)
+    {
+        sakhadb_btree_cursor_destroy(cur->cur);
+    }
+    cursorRelease(cur);
+    if(cur->nbuffer)
+    {
+        cpl_region_deinit(&cur->buffer);
+    }
+    if(cur->seen)
+    {
+        sakhadb_index_seen_destroy(cur->seen);
     }
     // TODO: add cache list for cursors
     cpl_allocator_free(cpl_allocator_get_default(), cur);
@@ -303,50 +1932,295 @@ void sakhadb_cursor_destroy(sakhadb_cursor* cur)
 
 int sakhadb_cursor_next(sakhadb_cursor *cur)
 {
-    return sakhadb_btree_cursor_next(cur->cur);
+    // Data of the previous document
+    cursorRelease(cur);
+    
+    if(cur->lsm)
+    {
+        return sakhadb_lsm_cursor_next(cur->lsm);
+    }
+    
+    int rc = cursorPosition(cur);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    int seen = 0;
+    do
+    {
+        rc = cur->reverse ? sakhadb_btree_cursor_prev(cur->cur) : sakhadb_btree_cursor_next(cur->cur);
+        if(rc == SAKHADB_OK && cur->seen)
+        {
+            // Document of multikey index comes once per distinct value
+            size_t nkey;
+            const void* key = sakhadb_btree_cursor_key(cur->cur, &nkey);
+            rc = sakhadb_index_seen_add(cur->seen, sakhadb_index_entry_id(cur->index, key, nkey), &seen);
+        }
+    } while(rc == SAKHADB_OK && seen);
+    
+    return rc;
+}
+
+int sakhadb_cursor_skip(sakhadb_cursor *cur, uint64_t n)
+{
+    if(cur->lsm || cur->seen)
+    {
+        int rc = SAKHADB_OK;
+        while(n-- > 0 && rc == SAKHADB_OK)
+        {
+            rc = sakhadb_cursor_next(cur);
+        }
+        return rc;
+    }
+    
+    uint64_t rank;
+    int rc = cursorPosition(cur);
+    rc = rc ? rc : sakhadb_btree_cursor_rank(cur->cur, &rank);
+    if(rc)
+    {
+        goto Lexit;
+    }
+    
+    if(cur->reverse && n > rank)
+    {
+        rc = SAKHADB_NOTFOUND;
+        goto Lexit;
+    }
+    
+    // Data of the previous document
+    cursorRelease(cur);
+    
+    rc = sakhadb_btree_cursor_nth(cur->cur, cur->reverse ? rank - n : rank + n);
+    
+Lexit:
+    return rc;
+}
+
+/**
+ * Finds the document of the current entry of index cursor, the entry holds
+ * its ObjectId.
+ */
+static int cursorFindDoc(sakhadb_cursor* cur)
+{
+    if(cur->doc)
+    {
+        return SAKHADB_OK;
+    }
+    
+    size_t nkey;
+    const char* key = sakhadb_btree_cursor_key(cur->cur, &nkey);
+    struct bson_oid oid;
+    memcpy(oid.data, sakhadb_index_entry_id(cur->index, key, nkey), sizeof(oid.data));
+    return sakhadb_collection_find(cur->coll, &oid, &cur->doc);
 }
 
 int sakhadb_cursor_data(sakhadb* db, sakhadb_cursor *cur, bson_document_ref* doc)
 {
     int rc = SAKHADB_OK;
-    cpl_allocator_ref allocator = 0;
     
-    if(!cur->reg)
+    size_t npayload;
+    const void* payload = cur->lsm ? sakhadb_lsm_cursor_payload(cur->lsm, &npayload) :
+                          cur->cur ? sakhadb_btree_cursor_payload(cur->cur, &npayload) : 0;
+    if(payload)
+    {
+        // Document of clustered collection is read in place
+        *doc = (bson_document_ref)payload;
+        goto Lexit;
+    }
+    
+    if(cur->coll && sakhadb_btree_cursor_pgno(cur->cur) == SAKHADB_INDEX_BY_ID)
+    {
+        rc = cursorFindDoc(cur);
+        rc = rc ? rc : sakhadb_cursor_data(db, cur->doc, doc);
+        goto Lexit;
+    }
+    
+    if(!cur->nbuffer || !cur->buffer.offset)
     {
-        bson_document_ref d;
-        rc = sakhadb_dbdata_preload(db->dbdata, sakhadb_btree_cursor_pgno(cur->cur), (void**)&d);
+        Pgno no = cur->lsm ? sakhadb_lsm_cursor_pgno(cur->lsm) :
+                  cur->cur ? sakhadb_btree_cursor_pgno(cur->cur) : cur->no;
+        const void* d;
+        size_t sz;
+        rc = sakhadb_dbdata_view(db->dbdata, no, &d, &sz);
         if(rc)
         {
             goto Lexit;
         }
         
-        size_t sz = bson_document_size(d);
-        
-        allocator = cpl_allocator_create_dl(sz + sizeof(cpl_region_t));
-        if(!allocator)
+        if(d)
         {
+            // Document in one page is borrowed from it
+            *doc = (bson_document_ref)d;
             goto Lexit;
         }
         
-        cpl_region_ref reg = cpl_region_create(allocator, sz);
+        // Buffer grows to the largest document and is reused for next ones
+        if(sz > cur->nbuffer)
+        {
+            if(cur->nbuffer)
+            {
+                cpl_region_deinit(&cur->buffer);
+                cur->nbuffer = 0;
+            }
+            
+            rc = cpl_region_init(cpl_allocator_get_default(), &cur->buffer, sz);
+            if(rc)
+            {
+                rc = SAKHADB_NOMEM;
+                goto Lexit;
+            }
+            cur->nbuffer = sz;
+            cur->stats.allocations += 1;
+        }
         
-        // print info
-        rc = sakhadb_dbdata_read(db->dbdata, sakhadb_btree_cursor_pgno(cur->cur), reg);
+        cur->buffer.offset = 0;
+        rc = sakhadb_dbdata_read(db->dbdata, no, &cur->buffer);
         if(rc)
         {
-            goto Lfail;
+            cur->buffer.offset = 0;
+            goto Lexit;
+        }
+        cur->stats.copies += 1;
+    }
+    
+    *doc = (bson_document_ref)cur->buffer.data;
+    
+Lexit:
+    if(rc == SAKHADB_OK)
+    {
+        cur->stats.documents += 1;
+    }
+    return rc;
+}
+
+int sakhadb_cursor_read(sakhadb* db, sakhadb_cursor *cur, size_t offset, void* data, size_t ndata)
+{
+    size_t npayload;
+    const char* payload = cur->lsm ? sakhadb_lsm_cursor_payload(cur->lsm, &npayload) :
+                          cur->cur ? sakhadb_btree_cursor_payload(cur->cur, &npayload) : 0;
+    if(!payload && cur->nbuffer && cur->buffer.offset)
+    {
+        payload = cur->buffer.data;
+        npayload = cur->buffer.offset;
+    }
+    
+    if(payload)
+    {
+        if(offset > npayload || ndata > npayload - offset)
+        {
+            return SAKHADB_INVALID_ARG;
         }
         
-        cur->reg = reg;
+        memcpy(data, payload + offset, ndata);
+        return SAKHADB_OK;
     }
     
-    *doc = (bson_document_ref)cur->reg->data;
-    goto Lexit;
+    if(cur->coll && sakhadb_btree_cursor_pgno(cur->cur) == SAKHADB_INDEX_BY_ID)
+    {
+        int rc = cursorFindDoc(cur);
+        return rc ? rc : sakhadb_cursor_read(db, cur->doc, offset, data, ndata);
+    }
     
-Lfail:
-    cpl_allocator_destroy_dl(allocator);
+    Pgno no = cur->lsm ? sakhadb_lsm_cursor_pgno(cur->lsm) :
+              cur->cur ? sakhadb_btree_cursor_pgno(cur->cur) : cur->no;
+    return sakhadb_dbdata_read_range(db->dbdata, no, offset, data, ndata);
+}
+
+int sakhadb_collection_open_blob(sakhadb_collection* collection, bson_oid_ref oid, sakhadb_blob** ppBlob)
+{
+    if(!oid)
+    {
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    sakhadb_cursor* cur;
+    int rc = sakhadb_collection_find(collection, oid, &cur);
+    if(rc)
+    {
+        return rc;
+    }
+    
+    size_t npayload;
+    const void* payload = cur->lsm ? sakhadb_lsm_cursor_payload(cur->lsm, &npayload) :
+                          cur->cur ? sakhadb_btree_cursor_payload(cur->cur, &npayload) : 0;
+    if(payload)
+    {
+        SLOG_WARN("sakhadb_collection_open_blob: document is inline");
+        rc = SAKHADB_INVALID_ARG;
+        goto Lexit;
+    }
+    
+    sakhadb_blob* blob = cpl_allocator_allocate(cpl_allocator_get_default(), sizeof(sakhadb_blob));
+    if(!blob)
+    {
+        rc = SAKHADB_NOMEM;
+        goto Lexit;
+    }
+    
+    Pgno no = cur->lsm ? sakhadb_lsm_cursor_pgno(cur->lsm) :
+              cur->cur ? sakhadb_btree_cursor_pgno(cur->cur) : cur->no;
+    rc = sakhadb_dbdata_blob_open(collection->db->dbdata, no, &blob->data);
+    if(rc)
+    {
+        cpl_allocator_free(cpl_allocator_get_default(), blob);
+        goto Lexit;
+    }
+    
+    blob->coll = collection;
+    *ppBlob = blob;
     
 Lexit:
+    sakhadb_cursor_destroy(cur);
     return rc;
 }
 
+void sakhadb_blob_close(sakhadb_blob* blob)
+{
+    sakhadb_dbdata_blob_close(blob->data);
+    cpl_allocator_free(cpl_allocator_get_default(), blob);
+}
+
+size_t sakhadb_blob_size(sakhadb_blob* blob)
+{
+    return sakhadb_dbdata_blob_size(blob->data);
+}
+
+int sakhadb_blob_read(sakhadb_blob* blob, size_t offset, void* data, size_t ndata)
+{
+    return sakhadb_dbdata_blob_read(blob->data, offset, data, ndata);
+}
+
+int sakhadb_blob_write(sakhadb_blob* blob, size_t offset, const void* data, size_t ndata)
+{
+    if(blob->coll->indexes || blob->coll->builds)
+    {
+        SLOG_WARN("sakhadb_blob_write: collection has secondary indexes");
+        return SAKHADB_INVALID_ARG;
+    }
+    return sakhadb_dbdata_blob_write(blob->data, offset, data, ndata);
+}
+
+void sakhadb_cursor_stats(sakhadb_cursor *cur, struct sakhadb_cursor_stats* stats)
+{
+    *stats = cur->stats;
+    if(cur->doc)
+    {
+        stats->copies += cur->doc->stats.copies;
+        stats->allocations += cur->doc->stats.allocations;
+    }
+}
+
+int sakhadb_cursor_index_data(sakhadb_cursor *cur, bson_document_ref* doc)
+{
+    if(!cur->index || !cur->index->include)
+    {
+        return SAKHADB_INVALID_ARG;
+    }
+    
+    size_t nkey;
+    const void* key = sakhadb_btree_cursor_key(cur->cur, &nkey);
+    sakhadb_index_entry_document(cur->index, key, nkey, cur->entry);
+    *doc = (bson_document_ref)cur->entry;
+    return SAKHADB_OK;
+}
@@ -21,6 +21,7 @@
 #ifndef _SAKHADB_H_
 #define _SAKHADB_H_
 
+#include <stdint.h>
 #include <bson/document.h>
 #include <bson/oid.h>
 #include <cpl/cpl_region.h>
@@ -40,6 +41,14 @@
 #   define SAKHADB_VERSION_NUMBER 000002
 #endif
 
+/**
+ * This is a version of the page format. Files written in another format
+ * are not opened.
+ */
+#ifndef SAKHADB_FORMAT_VERSION
+#   define SAKHADB_FORMAT_VERSION 3
+#endif
+
 /**
  * This is a limit restrictions for SakhaDB
  */
@@ -47,6 +56,63 @@
 #   define SAKHADB_MAX_DOCUMENT_SIZE 16711680
 #endif
 
+/**
+ * Collection trees are keyed by 12-byte ObjectId. When this option is on
+ * new collections are created with fixed-width B-tree nodes, which hold more
+ * entries per page and are searched faster than generic slotted nodes.
+ */
+#ifndef SAKHADB_COLLECTION_OID_NODES
+#   define SAKHADB_COLLECTION_OID_NODES 1
+#endif
+
+/**
+ * Clustered collections. When this option is on new collections keep small
+ * documents inline in B-tree leaves next to their _id, so a point read or a
+ * scan does not go to separate data pages. Larger documents are still stored
+ * in data pages. Overrides SAKHADB_COLLECTION_OID_NODES.
+ */
+#ifndef SAKHADB_COLLECTION_CLUSTERED
+#   define SAKHADB_COLLECTION_CLUSTERED 0
+#endif
+
+/**
+ * Log-structured collections for append-heavy loads. When this option is on
+ * sakhadb_collection_load() creates collections with
+ * SAKHADB_COLLECTION_CREATE_LSM. Overrides the options above.
+ */
+#ifndef SAKHADB_COLLECTION_LSM
+#   define SAKHADB_COLLECTION_LSM 0
+#endif
+
+/**
+ * Hashed collections for point access. When this option is on
+ * sakhadb_collection_load() creates collections with
+ * SAKHADB_COLLECTION_CREATE_HASH.
+ */
+#ifndef SAKHADB_COLLECTION_HASH
+#   define SAKHADB_COLLECTION_HASH 0
+#endif
+
+/**
+ * Write-optimized collections for random _id's. When this option is on
+ * sakhadb_collection_load() creates collections with
+ * SAKHADB_COLLECTION_CREATE_BUFFERED.
+ */
+#ifndef SAKHADB_COLLECTION_BUFFERED
+#   define SAKHADB_COLLECTION_BUFFERED 0
+#endif
+
+/**
+ * Bits per _id of the Bloom filter of a B-tree collection, 0 turns it off.
+ * The filter is kept in pages of the collection, so finding, deleting or
+ * checking for duplicates an _id that is not in the collection mostly reads
+ * one page. A filter that got full is rebuilt from the _id tree by
+ * sakhadb_commit(), until then it lets more lookups through.
+ */
+#ifndef SAKHADB_COLLECTION_BLOOM_BITS
+#   define SAKHADB_COLLECTION_BLOOM_BITS 10
+#endif
+
 /**
  * Database connection handle.
  *
@@ -74,6 +140,13 @@ typedef struct sakhadb_cursor sakhadb_cursor;
  */
 typedef struct sakhadb_pred sakhadb_pred;
 
+/**
+ * Blob handle
+ *
+ * Document opened for reads and writes of its parts.
+ */
+typedef struct sakhadb_blob sakhadb_blob;
+
 /**
  * Opening a new database connection.
  */
@@ -85,28 +158,237 @@ int sakhadb_open(const char *filename, int flags, sakhadb **ppDb);
 int sakhadb_close(sakhadb* db);
 
 /**
- * Loads collection.
+ * Writes changes made since the last commit to the file.
+ */
+int sakhadb_commit(sakhadb* db);
+
+/**
+ * Discards changes made since the last commit. Collections loaded before
+ * have to be released and loaded again.
+ */
+int sakhadb_rollback(sakhadb* db);
+
+/**
+ * Loads collection. A missing collection is created with the flags given by
+ * the SAKHADB_COLLECTION_* options.
  */
 int sakhadb_collection_load(sakhadb *db, const char *name, sakhadb_collection **ppColl);
 
+/**
+ * Flags of a new collection. Collection found in the database keeps the
+ * storage it was created with, whatever the flags are.
+ *
+ * SAKHADB_COLLECTION_CREATE_LSM keeps documents in a memtable that is written
+ * out as sorted runs and merged in the background of inserts, instead of
+ * updating the _id tree and a data page per document in place. Counting such
+ * collection scans it.
+ *
+ * SAKHADB_COLLECTION_CREATE_HASH also keeps an extendible hash of _id's to data
+ * pages, so finding, deleting or checking a document by _id reads a single hash
+ * bucket instead of walking the _id tree. Ranges and scans still go through the
+ * tree. Documents must be stored in data pages, so the flag is ignored for
+ * clustered and log-structured collections.
+ *
+ * SAKHADB_COLLECTION_CREATE_BUFFERED gives the _id tree insert buffers in its
+ * internal nodes (SAKHADB_BTREE_BUFFERED), so inserts of random _id's write
+ * leaves in batches. Scans and deletes apply the buffers first.
+ */
+#define SAKHADB_COLLECTION_CREATE_LSM       0x1
+#define SAKHADB_COLLECTION_CREATE_HASH      0x2
+#define SAKHADB_COLLECTION_CREATE_BUFFERED  0x4
+
+/**
+ * Loads collection, a missing one is created with 'flags'.
+ */
+int sakhadb_collection_load_ex(sakhadb *db, const char *name, int flags, sakhadb_collection **ppColl);
+
 /**
  * Releases collection.
  */
 void sakhadb_collection_release(sakhadb_collection* coll);
 
+/**
+ * Counters of lookups of _id's in a B-tree collection.
+ */
+struct sakhadb_collection_stats
+{
+    uint64_t    filtered;           /* Lookups turned away by the Bloom filter */
+    uint64_t    searches;           /* Lookups that searched the tree */
+};
+
+void sakhadb_collection_stats(sakhadb_collection* coll, struct sakhadb_collection_stats* stats);
+
 /**
  * Insert new item in collection.
  */
 int sakhadb_collection_insert(sakhadb_collection* collection, bson_document_ref doc);
 
+/**
+ * Insert a batch of documents. Documents are ordered by _id before insertion,
+ * so the B-tree path is reused between consecutive documents.
+ */
+int sakhadb_collection_insert_batch(sakhadb_collection* collection, bson_document_ref* docs, size_t count);
+
+/**
+ * Removes the document with the given _id from collection.
+ * Returns SAKHADB_NOTFOUND if there is no such document.
+ */
+int sakhadb_collection_delete(sakhadb_collection* collection, bson_oid_ref oid);
+
 /**
  * Selects documents in a collection and returns a cursor to the selected documents.
  */
 int sakhadb_collection_find(sakhadb_collection* collection, bson_oid_ref oid,
                             sakhadb_cursor **pCur);
 
+/**
+ * Selects documents with _id between 'lower' and 'upper' in ascending order
+ * (descending with SAKHADB_RANGE_REVERSE). Either bound may be NULL. Bounds are
+ * inclusive unless SAKHADB_RANGE_*_EXCLUSIVE flags are given.
+ * Returns SAKHADB_NOTFOUND if the range is empty.
+ */
+int sakhadb_collection_find_range(sakhadb_collection* collection,
+                                  bson_oid_ref lower, bson_oid_ref upper, int flags,
+                                  sakhadb_cursor **pCur);
+
+/**
+ * Counts documents with _id between 'lower' and 'upper' (either may be NULL)
+ * without scanning them. Takes the same SAKHADB_RANGE_* flags as
+ * sakhadb_collection_find_range().
+ */
+int sakhadb_collection_count(sakhadb_collection* collection,
+                             bson_oid_ref lower, bson_oid_ref upper, int flags,
+                             uint64_t* pCount);
+
+/**
+ * Range flags
+ */
+#define SAKHADB_RANGE_LOWER_EXCLUSIVE   0x1
+#define SAKHADB_RANGE_UPPER_EXCLUSIVE   0x2
+#define SAKHADB_RANGE_REVERSE           0x4 /* Iterate from upper bound down */
+
+/**
+ * Creates index on the field at dotted 'path' (e.g. "address.city") and fills
+ * it from documents of the collection: keys are sorted in runs and loaded into
+ * the index in bulk. Inserts and deletes keep it up to date.
+ * Arrays on the path are indexed by element. Does nothing if the field is
+ * indexed already.
+ */
+int sakhadb_collection_create_index(sakhadb_collection* collection, const char* path, int flags);
+
+/**
+ * Creates index on the field at 'path' that also stores 'count' fields at
+ * dotted paths 'include' of every document, for sakhadb_cursor_index_data().
+ * Returns SAKHADB_TOOBIG on insert of a document whose included fields do not
+ * fit in an index key.
+ */
+int sakhadb_collection_create_covering_index(sakhadb_collection* collection, const char* path,
+                                             const char* const* include, size_t count, int flags);
+
+/**
+ * Advances indexes created with SAKHADB_INDEX_BACKGROUND by scanning up to
+ * 'count' documents for each of them; inserts and deletes may go on between
+ * the calls. Index becomes available for queries once its scan is complete.
+ * Number of indexes still being built is returned in 'pPending'.
+ */
+int sakhadb_collection_build_index(sakhadb_collection* collection, size_t count, size_t* pPending);
+
+/**
+ * Selects documents whose field at 'path' is between values of the first
+ * elements of 'lower' and 'upper' documents (either may be NULL) through the
+ * index on the field. Takes SAKHADB_RANGE_* flags, documents with equal values
+ * go in _id order. A document with several matching array elements is
+ * returned once, at its first match. Returns SAKHADB_INVALID_ARG if the field is not indexed,
+ * SAKHADB_NOTFOUND if the range is empty.
+ */
+int sakhadb_collection_find_index(sakhadb_collection* collection, const char* path,
+                                  bson_document_ref lower, bson_document_ref upper, int flags,
+                                  sakhadb_cursor **pCur);
+
+/**
+ * Index flags
+ */
+#define SAKHADB_INDEX_DESCENDING        0x1 /* Index is ordered by value descending */
+#define SAKHADB_INDEX_BACKGROUND        0x2 /* Index is built by sakhadb_collection_build_index() */
+
+/**
+ * Callback of sakhadb_collection_scan(). The document is valid until the
+ * callback returns; a non-zero result stops the scan.
+ */
+typedef int (*sakhadb_scan_fn)(void* arg, bson_document_ref doc);
+
+/**
+ * Passes every document of the collection to 'fn' from up to 'nthreads'
+ * threads (one without SAKHADB_THREADSAFE), in no particular order. The
+ * collection is split into ranges of equal number of documents; a thread
+ * that runs out of ranges takes over half of the ranges left to another.
+ * Returns the first non-zero result of 'fn' or failure. The collection must
+ * not be modified during the scan.
+ */
+int sakhadb_collection_scan(sakhadb_collection* collection, int nthreads, sakhadb_scan_fn fn, void* arg);
+
+/**
+ * Opens the document with _id 'oid' for reads and writes of its parts, so a
+ * large document is changed without reading and writing all of it. Returns
+ * SAKHADB_INVALID_ARG if the document is stored inline, in a clustered or
+ * log-structured collection.
+ */
+int sakhadb_collection_open_blob(sakhadb_collection* collection, bson_oid_ref oid, sakhadb_blob** ppBlob);
+void sakhadb_blob_close(sakhadb_blob* blob);
+size_t sakhadb_blob_size(sakhadb_blob* blob);
+
+/**
+ * Reads or writes 'ndata' bytes at 'offset' of the document. Returns
+ * SAKHADB_INVALID_ARG if the range is out of the document. Size of the
+ * document stays the same and its _id must not change; writes to collection
+ * with secondary indexes are refused with SAKHADB_INVALID_ARG, as the indexes
+ * would not follow them.
+ */
+int sakhadb_blob_read(sakhadb_blob* blob, size_t offset, void* data, size_t ndata);
+int sakhadb_blob_write(sakhadb_blob* blob, size_t offset, const void* data, size_t ndata);
+
 int sakhadb_cursor_next(sakhadb_cursor *cur);
+
+/**
+ * Moves the cursor 'n' documents forward in its direction at the cost of a
+ * single descent. Returns SAKHADB_NOTFOUND if the cursor runs out of range.
+ */
+int sakhadb_cursor_skip(sakhadb_cursor *cur, uint64_t n);
+
+/**
+ * Returns the current document of the cursor. Documents stored inline or in
+ * a single page are returned in place, larger ones are read into a buffer the
+ * cursor keeps for all its positions. The document is valid until the cursor
+ * moves or the collection is modified.
+ */
 int sakhadb_cursor_data(sakhadb* db, sakhadb_cursor *cur, bson_document_ref* doc);
+
+/**
+ * Reads 'ndata' bytes at 'offset' of the current document of the cursor
+ * without reading the rest of it. Returns SAKHADB_INVALID_ARG if the range
+ * is out of the document.
+ */
+int sakhadb_cursor_read(sakhadb* db, sakhadb_cursor *cur, size_t offset, void* data, size_t ndata);
+
+/**
+ * Counters of documents returned by sakhadb_cursor_data().
+ */
+struct sakhadb_cursor_stats
+{
+    uint64_t    documents;          /* Documents returned */
+    uint64_t    copies;             /* Documents read into the buffer of the cursor */
+    uint64_t    allocations;        /* Allocations of the buffer */
+};
+
+void sakhadb_cursor_stats(sakhadb_cursor *cur, struct sakhadb_cursor_stats* stats);
+
+/**
+ * Returns document of _id and included fields (named by their paths) of the
+ * current document of a cursor over a covering index, read from the index
+ * entry alone. The document is valid until the cursor moves. Returns
+ * SAKHADB_INVALID_ARG if the index is not covering.
+ */
+int sakhadb_cursor_index_data(sakhadb_cursor *cur, bson_document_ref* doc);
 void sakhadb_cursor_destroy(sakhadb_cursor* cur);
 
 /**
@@ -128,6 +410,7 @@ void sakhadb_cursor_destroy(sakhadb_cursor* cur);
 #define SAKHADB_NOTADB             10 /* File is not a valid DB */
 #define SAKHADB_NOTFOUND           11 /* Not found */
 #define SAKHADB_CANTOPEN           12 /* Unable to open the DB file */
+#define SAKHADB_TOOBIG             13 /* Key does not fit in the limit */
 
 
 #endif // _SAKHADB_H_